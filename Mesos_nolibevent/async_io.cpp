@@ -2,15 +2,73 @@
 #include "io.hpp"
 #include "async_io.hpp"
 #include "eventloop.hpp"
+#include "eventloop_iocp.hpp"
+#include "pool.hpp"
 
+#ifdef _WIN32
 namespace async {
-  LPFN_CONNECTEX ConnectEx = NULL;
+  // Looked up the first time they are needed, see `extension`.
+  std::atomic<LPFN_CONNECTEX> ConnectEx{NULL};
+  std::atomic<LPFN_DISCONNECTEX> DisconnectEx{NULL};
+
+  // Lets a token cancel an overlapped request with CancelIoEx, after which
+  // the request completes with ERROR_OPERATION_ABORTED. It can't be a base
+  // of the structs below, the OVERLAPPED has to come first.
+  struct OverlappedCancellation : internal::Cancellable {
+    HANDLE handle = NULL;
+    OVERLAPPED* overlapped = nullptr;
+
+    bool cancel() override
+    {
+      CancelIoEx(handle, overlapped);
+      return false;
+    }
+  };
 
-  struct Overlapped {
+  // The structs come from the operation pool. PooledOperation is empty,
+  // so the OVERLAPPED still comes first.
+  //
+  // A read or write hands its result to a callback, or, if it returns a
+  // future, to the state of the future, which is kept in the struct so
+  // that the operation and its future take a single allocation.
+  struct Overlapped : internal::PooledOperation {
     OVERLAPPED o;
-    std::promise<SSIZE_T> promise;
+    OverlappedCancellation cancellation;
+    bool future;
+
+    // The buffers of a gather write, copied into one (see
+    // `PipeHandle::writevAsync`).
+    std::unique_ptr<char[]> gathered;
   };
 
+  struct Overlapped_CALLBACK : Overlapped {
+    Callback callback;
+  };
+
+  struct Overlapped_FUTURE : Overlapped {
+    internal::EmbeddedState<SSIZE_T, Overlapped_FUTURE> state{this};
+  };
+
+  // Hands the result on, after which the struct is gone, or only kept
+  // for the future.
+  static void deliver(Overlapped* overlapped, SSIZE_T result)
+  {
+    if (result == CANCELLED && overlapped->cancellation.timed_out) {
+      result = TIMED_OUT;
+    }
+
+    overlapped->gathered.reset();
+    if (overlapped->future) {
+      Overlapped_FUTURE* o = static_cast<Overlapped_FUTURE*>(overlapped);
+      o->state.set(std::move(result));
+      o->state.release();
+    } else {
+      Overlapped_CALLBACK* o = static_cast<Overlapped_CALLBACK*>(overlapped);
+      o->callback(result);
+      delete o;
+    }
+  }
+
   static void CALLBACK ioCallback(
     PTP_CALLBACK_INSTANCE Instance,
     PVOID Context,
@@ -20,41 +78,167 @@ namespace async {
     PTP_IO Io)
   {
     Overlapped* overlapped = reinterpret_cast<Overlapped*>(o);
+    overlapped->cancellation.delist();
     if (IoResult == NO_ERROR) {
-      overlapped->promise.set_value(static_cast<SSIZE_T>(NumberOfBytesTransferred));
+      deliver(overlapped, static_cast<SSIZE_T>(NumberOfBytesTransferred));
+    } else if (overlapped->cancellation.cancelled) {
+      deliver(overlapped, CANCELLED);
     } else {
-      overlapped->promise.set_value(-1);
+      deliver(overlapped, -1);
       std::cout << "ERROR in callback: " << IoResult << std::endl;
     }
-    delete overlapped;
   }
 
   enum class WSAOverlappedType {
     SIZE_T,
+    FUTURE,
+    SLICE,
     SOCKET,
+    ACCEPT,
+    ACCEPT_READ,
+    DISCONNECT,
     NONE
   };
 
-  struct WSAOverlappedBase {
+  struct WSAOverlappedBase : internal::PooledOperation {
     WSAOVERLAPPED o;
     WSAOverlappedType ot;
-    WSABUF buf;
+    OverlappedCancellation cancellation;
   };
 
+  // Like Overlapped, the structs that return a future hold its state.
   struct WSAOverlapped_SIZET : WSAOverlappedBase {
-    std::promise<SSIZE_T> promise;
+    Callback callback;
+
+    // Keeps the data of a slice write alive.
+    Slice slice;
+  };
+
+  struct WSAOverlapped_FUTURE : WSAOverlappedBase {
+    internal::EmbeddedState<SSIZE_T, WSAOverlapped_FUTURE> state{this};
   };
 
+  struct WSAOverlapped_SLICE : WSAOverlappedBase {
+    Slice slice;
+    SliceCallback callback;
+  };
+
+  // AcceptEx writes the addresses to `output`, which must live until it
+  // completes.
   struct WSAOverlapped_SOCKET : WSAOverlappedBase {
     SocketHandle* result;
-    std::promise<SocketHandle*> promise;
+    char output[2 * (sizeof(sockaddr_in) + 16)];
+    internal::EmbeddedState<SocketHandle*, WSAOverlapped_SOCKET> state{this};
+  };
+
+  // An accept that reads the first bytes of the connection as well.
+  // AcceptEx reads into the front of `slice` and writes the addresses to
+  // its end.
+  struct WSAOverlapped_ACCEPT_READ : WSAOverlappedBase {
+    SOCKET listener;
+    SOCKET socket;
+    SocketHandle* result;
+    Slice slice;
+    AcceptReadCallback callback;
   };
 
   struct WSAOverlapped_DWORD : WSAOverlappedBase {
     DWORD errorCode;
-    std::promise<DWORD> promise;
+    internal::EmbeddedState<DWORD, WSAOverlapped_DWORD> state{this};
+  };
+
+  namespace internal {
+    // Shared by an Acceptor and its pending accepts and disconnects, each
+    // of which holds a reference. `pending` counts the accepts; it only
+    // drops to 0 once the acceptor has stopped, since an accept starts the
+    // next one before it is done.
+    struct AcceptorState {
+      SOCKET listener;
+      loop::Descriptor* descriptor;
+      AcceptCallback callback;
+      CancellationToken token = CancellationToken::create();
+      std::atomic<size_t> pending{0};
+      std::atomic<bool> stopped{false};
+      std::atomic<int> references{1};
+
+      // Disconnected sockets for the next accepts to take.
+      std::mutex mutex;
+      std::vector<std::pair<SOCKET, SocketHandle*>> recycled;
+
+      ~AcceptorState()
+      {
+        for (auto& socket : recycled) {
+          socket.second->close();
+          delete socket.second;
+        }
+      }
+
+      void acquire()
+      {
+        references.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release()
+      {
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete this;
+        }
+      }
+    };
+  }
+
+  // An accept of an Acceptor. AcceptEx writes the addresses to `output`,
+  // which must live until it completes.
+  struct WSAOverlapped_ACCEPT : WSAOverlappedBase {
+    internal::AcceptorState* acceptor;
+    SOCKET socket;
+    SocketHandle* result;
+    char output[2 * (sizeof(sockaddr_in) + 16)];
+  };
+
+  // Disconnects a recycled socket so that an accept can take it again.
+  struct WSAOverlapped_DISCONNECT : WSAOverlappedBase {
+    internal::AcceptorState* acceptor;
+    SOCKET socket;
+    SocketHandle* result;
   };
 
+  static void accepted(WSAOverlapped_ACCEPT* o, ULONG error);
+
+  static void accepted(WSAOverlapped_ACCEPT_READ* o, ULONG error, size_t read);
+
+  static void disconnected(WSAOverlapped_DISCONNECT* o, ULONG error);
+
+  // Hands the result of a read, write or sendfile on, after which the
+  // struct is gone, or only kept for the future.
+  static void deliver(WSAOverlappedBase* base, SSIZE_T result)
+  {
+    if (result == CANCELLED && base->cancellation.timed_out) {
+      result = TIMED_OUT;
+    }
+
+    if (base->ot == WSAOverlappedType::SIZE_T) {
+      WSAOverlapped_SIZET* o = reinterpret_cast<WSAOverlapped_SIZET*>(base);
+      o->slice = Slice();
+      o->callback(result);
+      delete o;
+    }
+    else if (base->ot == WSAOverlappedType::FUTURE) {
+      WSAOverlapped_FUTURE* o = reinterpret_cast<WSAOverlapped_FUTURE*>(base);
+      o->state.set(std::move(result));
+      o->state.release();
+    }
+    else {
+      WSAOverlapped_SLICE* o = reinterpret_cast<WSAOverlapped_SLICE*>(base);
+
+      // The callback gets the only reference to the buffer.
+      Slice data = result > 0 ? o->slice.slice(0, static_cast<size_t>(result)) : Slice();
+      o->slice = Slice();
+      o->callback(result, std::move(data));
+      delete o;
+    }
+  }
+
   static void CALLBACK socketCallback(
     PTP_CALLBACK_INSTANCE Instance,
     PVOID Context,
@@ -64,44 +248,286 @@ namespace async {
     PTP_IO Io)
   {
     WSAOverlappedBase* base = reinterpret_cast<WSAOverlappedBase*>(Overlapped);
-    if (base->ot == WSAOverlappedType::SIZE_T) {
-      WSAOverlapped_SIZET* wsa_socket = reinterpret_cast<WSAOverlapped_SIZET*>(base);
+    base->cancellation.delist();
+    bool cancelled = base->cancellation.cancelled;
+
+    if (base->ot == WSAOverlappedType::SIZE_T ||
+        base->ot == WSAOverlappedType::FUTURE ||
+        base->ot == WSAOverlappedType::SLICE) {
       if (IoResult == NO_ERROR) {
-        wsa_socket->promise.set_value(static_cast<SSIZE_T>(NumberOfBytesTransferred));
+        deliver(base, static_cast<SSIZE_T>(NumberOfBytesTransferred));
       } else {
-        wsa_socket->promise.set_value(static_cast<SSIZE_T>(-1));
+        deliver(base, cancelled ? CANCELLED : static_cast<SSIZE_T>(-1));
       }
-      delete wsa_socket;
     }
     else if (base->ot == WSAOverlappedType::SOCKET) {
       WSAOverlapped_SOCKET* wsa_socket = reinterpret_cast<WSAOverlapped_SOCKET*>(base);
       if (IoResult == NO_ERROR) {
-        wsa_socket->promise.set_value(wsa_socket->result);
+        wsa_socket->state.set(std::move(wsa_socket->result));
       } else {
         wsa_socket->result->close();
         delete wsa_socket->result;
-        wsa_socket->promise.set_value(nullptr);
+        wsa_socket->state.set(nullptr);
       }
-      delete wsa_socket;
+      wsa_socket->state.release();
+    }
+    else if (base->ot == WSAOverlappedType::ACCEPT) {
+      accepted(reinterpret_cast<WSAOverlapped_ACCEPT*>(base), IoResult);
+    }
+    else if (base->ot == WSAOverlappedType::ACCEPT_READ) {
+      accepted(
+        reinterpret_cast<WSAOverlapped_ACCEPT_READ*>(base),
+        IoResult,
+        static_cast<size_t>(NumberOfBytesTransferred));
+    }
+    else if (base->ot == WSAOverlappedType::DISCONNECT) {
+      disconnected(reinterpret_cast<WSAOverlapped_DISCONNECT*>(base), IoResult);
     }
     else {
       WSAOverlapped_DWORD* wsa_socket = reinterpret_cast<WSAOverlapped_DWORD*>(base);
-      wsa_socket->promise.set_value(IoResult);
-      delete wsa_socket;
+      wsa_socket->state.set(static_cast<DWORD>(IoResult));
+      wsa_socket->state.release();
     }
 
-    if (IoResult != NO_ERROR) {
+    if (IoResult != NO_ERROR && !cancelled) {
       std::cout << "ERROR in callback: " << IoResult << std::endl;
     }
   }
 
 
+  // Issues an overlapped request by running `start`, which returns false
+  // if the request failed right away, with the request enlisted with
+  // `token`. Returns 0 if the request is pending, in which case the
+  // callback owns it, -1 if it failed, or CANCELLED if the token was
+  // cancelled before it could be issued.
+  template <typename F>
+  static SSIZE_T issue(
+    OverlappedCancellation& cancellation,
+    HANDLE handle,
+    OVERLAPPED* overlapped,
+    const CancellationToken& token,
+    F start)
+  {
+    cancellation.handle = handle;
+    cancellation.overlapped = overlapped;
+
+    bool failed = false;
+    bool enlisted = cancellation.enlist(token, [&]() {
+      failed = !start();
+      return !failed;
+    });
+
+    if (!enlisted) {
+      return CANCELLED;
+    }
+    return failed ? -1 : 0;
+  }
+
+
+  template <typename T>
+  static Future<T> ready(T value)
+  {
+    Promise<T> promise;
+    Future<T> future = promise.get_future();
+    promise.set_value(value);
+    return future;
+  }
+
+  // Issues a WSARecv or WSASend into or from `count` buffers with
+  // `overlapped`, whose type is set already, and hand the result on if the
+  // request fails right away. Winsock captures the WSABUFs before the call
+  // returns, so they don't have to outlive it.
+  static void receive(
+    SOCKET socket,
+    loop::Descriptor* descriptor,
+    WSAOverlappedBase* overlapped,
+    WSABUF* buffers,
+    DWORD count,
+    const CancellationToken& token)
+  {
+    loop::iocp::start(descriptor);
+
+    overlapped->o = { 0 };
+
+    SSIZE_T status = issue(
+      overlapped->cancellation,
+      reinterpret_cast<HANDLE>(socket),
+      reinterpret_cast<OVERLAPPED*>(overlapped),
+      token,
+      [&]() {
+        DWORD lpflags = 0;
+        int result = WSARecv(
+          socket,
+          buffers,
+          count,
+          NULL,
+          &lpflags,
+          reinterpret_cast<OVERLAPPED*>(overlapped),
+          NULL);
+        return result != SOCKET_ERROR || WSAGetLastError() == WSA_IO_PENDING;
+      });
+
+    if (status != 0) {
+      loop::iocp::cancel(descriptor);
+      deliver(overlapped, status);
+    }
+  }
+
+  static void send(
+    SOCKET socket,
+    loop::Descriptor* descriptor,
+    WSAOverlappedBase* overlapped,
+    WSABUF* buffers,
+    DWORD count,
+    const CancellationToken& token)
+  {
+    loop::iocp::start(descriptor);
+
+    overlapped->o = { 0 };
+
+    SSIZE_T status = issue(
+      overlapped->cancellation,
+      reinterpret_cast<HANDLE>(socket),
+      reinterpret_cast<OVERLAPPED*>(overlapped),
+      token,
+      [&]() {
+        DWORD lpflags = 0;
+        int result = WSASend(
+          socket,
+          buffers,
+          count,
+          NULL,
+          lpflags,
+          reinterpret_cast<OVERLAPPED*>(overlapped),
+          NULL);
+        return result != SOCKET_ERROR || WSAGetLastError() == WSA_IO_PENDING;
+      });
+
+    if (status != 0) {
+      loop::iocp::cancel(descriptor);
+      deliver(overlapped, status);
+    }
+  }
+
+  // The same with `size` bytes at `data`.
+  static void receive(
+    SOCKET socket,
+    loop::Descriptor* descriptor,
+    WSAOverlappedBase* overlapped,
+    void* data,
+    size_t size,
+    const CancellationToken& token)
+  {
+    WSABUF buffer = { static_cast<u_long>(size), static_cast<char*>(data) };
+    receive(socket, descriptor, overlapped, &buffer, 1, token);
+  }
+
+  static void send(
+    SOCKET socket,
+    loop::Descriptor* descriptor,
+    WSAOverlappedBase* overlapped,
+    const void* data,
+    size_t size,
+    const CancellationToken& token)
+  {
+    WSABUF buffer = {
+      static_cast<u_long>(size),
+      const_cast<char*>(static_cast<const char*>(data))
+    };
+    send(socket, descriptor, overlapped, &buffer, 1, token);
+  }
+
+  static void vectorize(WSABUF* vectors, const IoBuffer* buffers, size_t count)
+  {
+    for (size_t i = 0; i < count; i++) {
+      vectors[i].buf = static_cast<char*>(buffers[i].data);
+      vectors[i].len = static_cast<u_long>(buffers[i].size);
+    }
+  }
+
+  // The same with ReadFile and WriteFile, for pipes.
+  static void readFile(
+    HANDLE handle,
+    loop::Descriptor* descriptor,
+    Overlapped* overlapped,
+    void* data,
+    size_t size,
+    const CancellationToken& token)
+  {
+    loop::iocp::start(descriptor);
+
+    overlapped->o = { 0 };
+
+    SSIZE_T status = issue(
+      overlapped->cancellation,
+      handle,
+      reinterpret_cast<OVERLAPPED*>(overlapped),
+      token,
+      [&]() {
+        BOOL success = ReadFile(
+          handle,
+          data,
+          (DWORD)size,
+          NULL,
+          reinterpret_cast<OVERLAPPED*>(overlapped));
+        return success || GetLastError() == ERROR_IO_PENDING;
+      });
+
+    if (status != 0) {
+      loop::iocp::cancel(descriptor);
+      deliver(overlapped, status);
+    }
+  }
+
+  static void writeFile(
+    HANDLE handle,
+    loop::Descriptor* descriptor,
+    Overlapped* overlapped,
+    const void* data,
+    size_t size,
+    const CancellationToken& token)
+  {
+    loop::iocp::start(descriptor);
+
+    overlapped->o = { 0 };
+
+    SSIZE_T status = issue(
+      overlapped->cancellation,
+      handle,
+      reinterpret_cast<OVERLAPPED*>(overlapped),
+      token,
+      [&]() {
+        BOOL success = WriteFile(
+          handle,
+          data,
+          (DWORD)size,
+          NULL,
+          reinterpret_cast<OVERLAPPED*>(overlapped));
+        return success || GetLastError() == ERROR_IO_PENDING;
+      });
+
+    if (status != 0) {
+      loop::iocp::cancel(descriptor);
+      deliver(overlapped, status);
+    }
+  }
+
+
   FileHandle::FileHandle(HANDLE h) : m_handle(h) {}
 
-  std::future<SSIZE_T> FileHandle::readAsync(void* data, size_t size) const
+  Future<SSIZE_T> FileHandle::readAsync(
+    void* data,
+    size_t size,
+    const CancellationToken& token) const
   {
-    std::promise<SSIZE_T> promise;
-    std::future<SSIZE_T> future = promise.get_future();
+    Promise<SSIZE_T> promise;
+    Future<SSIZE_T> future = promise.get_future();
+
+    // A blocking call, so there is nothing to cancel once it started.
+    if (token.cancelled()) {
+      promise.set_value(CANCELLED);
+      return future;
+    }
 
     DWORD bytesRead;
     if (ReadFile(m_handle, data, (DWORD)size, &bytesRead, NULL) == FALSE)
@@ -114,10 +540,18 @@ namespace async {
     return future;
   }
 
-  std::future<SSIZE_T> FileHandle::writeAsync(const void* data, size_t size) const
+  Future<SSIZE_T> FileHandle::writeAsync(
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
   {
-    std::promise<SSIZE_T> promise;
-    std::future<SSIZE_T> future = promise.get_future();
+    Promise<SSIZE_T> promise;
+    Future<SSIZE_T> future = promise.get_future();
+
+    if (token.cancelled()) {
+      promise.set_value(CANCELLED);
+      return future;
+    }
 
     DWORD bytesRead;
     if (WriteFile(m_handle, data, (DWORD)size, &bytesRead, NULL) == FALSE)
@@ -135,12 +569,10 @@ namespace async {
     CloseHandle(m_handle);
   }
 
-  static BOOL loadConnect()
+  // Looks an extension function of Winsock up, through a socket of its
+  // own since the sockets that need it may not exist yet.
+  static BOOL loadExtension(GUID guid, void* function, DWORD size)
   {
-    if (ConnectEx != NULL) {
-      return TRUE;
-    }
-
     SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
     if (s == INVALID_SOCKET)
     {
@@ -148,21 +580,21 @@ namespace async {
       return FALSE;
     }
 
-    GUID connectex = WSAID_CONNECTEX;
     DWORD bytes;
     int res = WSAIoctl(
       s,
       SIO_GET_EXTENSION_FUNCTION_POINTER,
-      &connectex,
-      sizeof(connectex),
-      &ConnectEx,
-      sizeof(ConnectEx),
+      &guid,
+      sizeof(guid),
+      function,
+      size,
       &bytes,
       NULL,
       NULL);
 
     if (res != 0) {
       std::cout << "loadfunctions::ioctl error " << WSAGetLastError();
+      closesocket(s);
       return FALSE;
     }
 
@@ -170,143 +602,298 @@ namespace async {
     return TRUE;
   }
 
-  SocketHandle::SocketHandle(SOCKET s) : m_socket(s)
+  // The extension function `function` keeps, looked up on first use. The
+  // lookup takes a socket and an ioctl of its own, so every later connect
+  // or disconnect just loads the pointer. A lookup that fails is tried
+  // again next time, and NULL returned meanwhile.
+  template <typename F>
+  static F extension(std::atomic<F>& function, GUID guid)
+  {
+    F f = function.load(std::memory_order_acquire);
+    if (f == NULL && loadExtension(guid, &f, sizeof(f))) {
+      function.store(f, std::memory_order_release);
+    }
+    return f;
+  }
+
+  // ConnectEx needs a bound socket. Binds one that isn't bound yet to the
+  // wildcard address of `family`. A socket that is bound already, say by
+  // the application or since it was recycled, fails with WSAEINVAL and is
+  // left as it is.
+  static bool bindAny(SOCKET s, int family)
   {
-    m_iocp = CreateThreadpoolIo(
+    sockaddr_storage local = { 0 };
+    local.ss_family = static_cast<ADDRESS_FAMILY>(family);
+    int size = family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+    return bind(s, reinterpret_cast<sockaddr*>(&local), size) == 0 ||
+      WSAGetLastError() == WSAEINVAL;
+  }
+
+  SocketHandle::SocketHandle(SOCKET s) : SocketHandle(s, loop::EventLoop::current())
+  {
+  }
+
+  SocketHandle::SocketHandle(SOCKET s, size_t loop) : m_socket(s)
+  {
+    m_descriptor = loop::iocp::attach(
       reinterpret_cast<HANDLE>(m_socket),
       &socketCallback,
-      NULL,
-      &loop::environment);
+      loop);
   }
 
-  std::future<SSIZE_T> SocketHandle::readAsync(void* data, size_t size) const
+  Future<SSIZE_T> SocketHandle::readAsync(
+    void* data,
+    size_t size,
+    const CancellationToken& token) const
   {
-    if (m_iocp == NULL || m_socket == INVALID_SOCKET) {
-      std::promise<SSIZE_T> promise;
-      std::future<SSIZE_T> future = promise.get_future();
-      promise.set_value(-1);
-      return future;
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      return ready<SSIZE_T>(-1);
     }
 
-    StartThreadpoolIo(m_iocp);
+    WSAOverlapped_FUTURE* overlapped = new WSAOverlapped_FUTURE();
+    overlapped->ot = WSAOverlappedType::FUTURE;
+    Future<SSIZE_T> future = overlapped->state.get_future();
+
+    receive(m_socket, m_descriptor, overlapped, data, size, token);
+    return future;
+  }
+
+  void SocketHandle::readAsync(
+    void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1);
+      return;
+    }
 
     WSAOverlapped_SIZET* overlapped = new WSAOverlapped_SIZET();
-    overlapped->o = { 0 };
     overlapped->ot = WSAOverlappedType::SIZE_T;
-    overlapped->buf.buf = static_cast<char*>(data);
-    overlapped->buf.len = static_cast<u_long>(size);
-
-    std::future<SSIZE_T> future = overlapped->promise.get_future();
+    overlapped->callback = std::move(callback);
 
-    DWORD lpflags = 0;
-    int result = WSARecv(
-      m_socket,
-      &overlapped->buf,
-      1,
-      NULL,
-      &lpflags,
-      reinterpret_cast<OVERLAPPED*>(overlapped),
-      NULL);
+    receive(m_socket, m_descriptor, overlapped, data, size, token);
+  }
 
-    if (result == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING) {
-      CancelThreadpoolIo(m_iocp);
-      delete overlapped;
-      overlapped->promise.set_value(-1);
-      return future;
+  Future<SSIZE_T> SocketHandle::writeAsync(
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      return ready<SSIZE_T>(-1);
     }
 
+    WSAOverlapped_FUTURE* overlapped = new WSAOverlapped_FUTURE();
+    overlapped->ot = WSAOverlappedType::FUTURE;
+    Future<SSIZE_T> future = overlapped->state.get_future();
+
+    send(m_socket, m_descriptor, overlapped, data, size, token);
     return future;
   }
 
-  std::future<SSIZE_T> SocketHandle::writeAsync(const void* data, size_t size) const
+  void SocketHandle::writeAsync(
+    const void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
   {
-    if (m_iocp == NULL || m_socket == INVALID_SOCKET) {
-      std::promise<SSIZE_T> promise;
-      std::future<SSIZE_T> future = promise.get_future();
-      promise.set_value(-1);
-      return future;
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1);
+      return;
     }
 
-    StartThreadpoolIo(m_iocp);
-
     WSAOverlapped_SIZET* overlapped = new WSAOverlapped_SIZET();
-    overlapped->o = { 0 };
     overlapped->ot = WSAOverlappedType::SIZE_T;
-    overlapped->buf.buf = const_cast<char*>(static_cast<const char*>(data));
-    overlapped->buf.len = static_cast<u_long>(size);
+    overlapped->callback = std::move(callback);
+
+    send(m_socket, m_descriptor, overlapped, data, size, token);
+  }
 
-    std::future<SSIZE_T> future = overlapped->promise.get_future();
+  // The buffer is held from the start, like any other overlapped read.
+  void SocketHandle::readAsync(
+    BufferPool& pool,
+    SliceCallback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1, Slice());
+      return;
+    }
 
-    DWORD lpflags = 0;
-    int result = WSASend(
+    WSAOverlapped_SLICE* overlapped = new WSAOverlapped_SLICE();
+    overlapped->ot = WSAOverlappedType::SLICE;
+    overlapped->slice = pool.acquire();
+    overlapped->callback = std::move(callback);
+
+    receive(
       m_socket,
-      &overlapped->buf,
-      1,
-      NULL,
-      lpflags,
-      reinterpret_cast<OVERLAPPED*>(overlapped),
-      NULL);
+      m_descriptor,
+      overlapped,
+      overlapped->slice.data(),
+      overlapped->slice.size(),
+      token);
+  }
 
-    if (result == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING) {
-      CancelThreadpoolIo(m_iocp);
-      overlapped->promise.set_value(-1);
-      delete overlapped;
-      return future;
+  void SocketHandle::writeAsync(
+    Slice slice,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1);
+      return;
+    }
+
+    WSAOverlapped_SIZET* overlapped = new WSAOverlapped_SIZET();
+    overlapped->ot = WSAOverlappedType::SIZE_T;
+    overlapped->callback = std::move(callback);
+    overlapped->slice = std::move(slice);
+
+    send(
+      m_socket,
+      m_descriptor,
+      overlapped,
+      overlapped->slice.data(),
+      overlapped->slice.size(),
+      token);
+  }
+
+  Future<SSIZE_T> SocketHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET ||
+        count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
     }
 
+    WSAOverlapped_FUTURE* overlapped = new WSAOverlapped_FUTURE();
+    overlapped->ot = WSAOverlappedType::FUTURE;
+    Future<SSIZE_T> future = overlapped->state.get_future();
+
+    WSABUF vectors[MAX_IO_BUFFERS];
+    vectorize(vectors, buffers, count);
+    receive(m_socket, m_descriptor, overlapped, vectors, static_cast<DWORD>(count), token);
     return future;
   }
 
-  std::future<SSIZE_T> SocketHandle::sendfile(io::Handle* fd, off_t offset, size_t size) const
+  void SocketHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
   {
-    if (m_iocp == NULL || m_socket == INVALID_SOCKET) {
-      std::promise<SSIZE_T> promise;
-      std::future<SSIZE_T> future = promise.get_future();
-      promise.set_value(-1);
-      return future;
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET ||
+        count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
     }
 
-    WSAOverlapped_SIZET* o = new WSAOverlapped_SIZET();
-    std::future<SSIZE_T> future = o->promise.get_future();
+    WSAOverlapped_SIZET* overlapped = new WSAOverlapped_SIZET();
+    overlapped->ot = WSAOverlappedType::SIZE_T;
+    overlapped->callback = std::move(callback);
 
-    if (offset < 0) {
-      o->promise.set_value(-1);
-      delete o;
-      return future;
+    WSABUF vectors[MAX_IO_BUFFERS];
+    vectorize(vectors, buffers, count);
+    receive(m_socket, m_descriptor, overlapped, vectors, static_cast<DWORD>(count), token);
+  }
+
+  Future<SSIZE_T> SocketHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET ||
+        count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
     }
 
-    StartThreadpoolIo(m_iocp);
+    WSAOverlapped_FUTURE* overlapped = new WSAOverlapped_FUTURE();
+    overlapped->ot = WSAOverlappedType::FUTURE;
+    Future<SSIZE_T> future = overlapped->state.get_future();
+
+    WSABUF vectors[MAX_IO_BUFFERS];
+    vectorize(vectors, buffers, count);
+    send(m_socket, m_descriptor, overlapped, vectors, static_cast<DWORD>(count), token);
+    return future;
+  }
+
+  void SocketHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET ||
+        count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    WSAOverlapped_SIZET* overlapped = new WSAOverlapped_SIZET();
+    overlapped->ot = WSAOverlappedType::SIZE_T;
+    overlapped->callback = std::move(callback);
+
+    WSABUF vectors[MAX_IO_BUFFERS];
+    vectorize(vectors, buffers, count);
+    send(m_socket, m_descriptor, overlapped, vectors, static_cast<DWORD>(count), token);
+  }
+
+  Future<SSIZE_T> SocketHandle::sendfile(
+    io::Handle* fd,
+    off_t offset,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || offset < 0) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WSAOverlapped_FUTURE* o = new WSAOverlapped_FUTURE();
+    Future<SSIZE_T> future = o->state.get_future();
+
+    loop::iocp::start(m_descriptor);
 
     // Set offset values for sendfile
     o->o = { 0 };
     o->o.Offset = static_cast<DWORD>(offset);
     o->o.OffsetHigh = 0;
-    o->ot = WSAOverlappedType::SIZE_T;
+    o->ot = WSAOverlappedType::FUTURE;
 
-    BOOL success = TransmitFile(
-      m_socket,
-      fd->get(),
-      static_cast<DWORD>(size),
-      0,
+    SSIZE_T status = issue(
+      o->cancellation,
+      reinterpret_cast<HANDLE>(m_socket),
       reinterpret_cast<OVERLAPPED*>(o),
-      NULL,
-      0);
-
-    if (!success && WSAGetLastError() != WSA_IO_PENDING) {
-      CancelThreadpoolIo(m_iocp);
-      o->promise.set_value(-1);
-      delete o;
+      token,
+      [&]() {
+        BOOL success = TransmitFile(
+          m_socket,
+          fd->get(),
+          static_cast<DWORD>(size),
+          0,
+          reinterpret_cast<OVERLAPPED*>(o),
+          NULL,
+          0);
+        return success || WSAGetLastError() == WSA_IO_PENDING;
+      });
+
+    if (status != 0) {
+      loop::iocp::cancel(m_descriptor);
+      deliver(o, status);
       return future;
     }
 
     return future;
   }
 
-  std::future<SocketHandle*> SocketHandle::accept() const
+  Future<SocketHandle*> SocketHandle::accept(const CancellationToken& token) const
   {
-    if (m_iocp == NULL || m_socket == INVALID_SOCKET) {
-      std::promise<SocketHandle*> promise;
-      std::future<SocketHandle*> future = promise.get_future();
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      Promise<SocketHandle*> promise;
+      Future<SocketHandle*> future = promise.get_future();
       promise.set_value(nullptr);
       return future;
     }
@@ -314,89 +901,221 @@ namespace async {
     WSAOverlapped_SOCKET* o = new WSAOverlapped_SOCKET();
     o->o = { 0 };
     o->ot = WSAOverlappedType::SOCKET;
-    std::future<SocketHandle*> future = o->promise.get_future();
+    Future<SocketHandle*> future = o->state.get_future();
 
     // Create an accepting socket
     SOCKET acceptSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (acceptSocket == INVALID_SOCKET) {
-      o->promise.set_value(nullptr);
-      delete o;
+      o->state.set(nullptr);
+      o->state.release();
       return future;
     }
-    o->result = new SocketHandle(acceptSocket);
+    o->result = new SocketHandle(acceptSocket, loop::EventLoop::next());
 
-    char lpOutputBuf[2 * (sizeof(sockaddr_in) + 16)];
-    int outBufLen = sizeof(lpOutputBuf);
     DWORD dwBytes;
     
-    StartThreadpoolIo(m_iocp);
-    BOOL result = AcceptEx(
-      m_socket,
-      acceptSocket,
-      lpOutputBuf,
-      0,
-      sizeof(sockaddr_in) + 16,
-      sizeof(sockaddr_in) + 16,
-      &dwBytes,
-      (OVERLAPPED*)o);
-  
-    if (!result && WSAGetLastError() != ERROR_IO_PENDING) {
-      CancelThreadpoolIo(m_iocp);
+    loop::iocp::start(m_descriptor);
+    SSIZE_T status = issue(
+      o->cancellation,
+      reinterpret_cast<HANDLE>(m_socket),
+      (OVERLAPPED*)o,
+      token,
+      [&]() {
+        BOOL result = AcceptEx(
+          m_socket,
+          acceptSocket,
+          o->output,
+          0,
+          sizeof(sockaddr_in) + 16,
+          sizeof(sockaddr_in) + 16,
+          &dwBytes,
+          (OVERLAPPED*)o);
+        return result || WSAGetLastError() == ERROR_IO_PENDING;
+      });
+
+    if (status != 0) {
+      loop::iocp::cancel(m_descriptor);
       o->result->close();
       delete o->result;
-      o->promise.set_value(nullptr);
-      delete o;
+      o->state.set(nullptr);
+      o->state.release();
       return future;
     }
 
     return future;
   }
 
-  std::future<DWORD> SocketHandle::connect(const sockaddr* addr, size_t addr_size) const
+  void SocketHandle::accept(
+    BufferPool& pool,
+    AcceptReadCallback callback,
+    const CancellationToken& token) const
   {
-    if (m_iocp == NULL || m_socket == INVALID_SOCKET) {
-      std::promise<DWORD> promise;
-      std::future<DWORD> future = promise.get_future();
-      promise.set_value(~0);
-      return future;
+    const DWORD address = sizeof(sockaddr_in) + 16;
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(nullptr, -1, Slice());
+      return;
     }
 
-    WSAOverlapped_DWORD* o = new WSAOverlapped_DWORD();
+    // The addresses take up the end of the buffer, and there has to be
+    // room left for the data in front of them.
+    Slice slice = pool.acquire();
+    if (slice.size() <= 2 * address) {
+      callback(nullptr, -1, Slice());
+      return;
+    }
+
+    WSAOverlapped_ACCEPT_READ* o = new WSAOverlapped_ACCEPT_READ();
     o->o = { 0 };
-    o->ot = WSAOverlappedType::NONE;
-    std::future<DWORD> future = o->promise.get_future();
-
-    // ConnectEx needs to bind first. Figure out how to do this
-    // in a family independent way.
-    struct sockaddr_in local_addr = { 0 };
-    local_addr.sin_family = AF_INET;
-    local_addr.sin_addr.s_addr = INADDR_ANY;
-    local_addr.sin_port = 0;
-
-    int result = bind(m_socket, (struct sockaddr*) &local_addr, sizeof(local_addr));
-    if (result == SOCKET_ERROR) {
-      o->promise.set_value(~0);
+    o->ot = WSAOverlappedType::ACCEPT_READ;
+    o->listener = m_socket;
+    o->callback = std::move(callback);
+
+    o->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (o->socket == INVALID_SOCKET) {
+      o->callback(nullptr, -1, Slice());
       delete o;
-      return future;
+      return;
     }
+    o->result = new SocketHandle(o->socket, loop::EventLoop::next());
+    o->slice = std::move(slice);
 
-    loadConnect();
-
-    StartThreadpoolIo(m_iocp);
-    BOOL success = ConnectEx(m_socket, addr, (int)addr_size, NULL, 0, NULL, (OVERLAPPED*) o);
-    if (!success && WSAGetLastError() != ERROR_IO_PENDING) {
-      CancelThreadpoolIo(m_iocp);
-      o->promise.set_value(~0);
+    DWORD dwBytes;
+    loop::iocp::start(m_descriptor);
+    SSIZE_T status = issue(
+      o->cancellation,
+      reinterpret_cast<HANDLE>(m_socket),
+      (OVERLAPPED*)o,
+      token,
+      [&]() {
+        BOOL result = AcceptEx(
+          m_socket,
+          o->socket,
+          o->slice.data(),
+          static_cast<DWORD>(o->slice.size()) - 2 * address,
+          address,
+          address,
+          &dwBytes,
+          (OVERLAPPED*)o);
+        return result || WSAGetLastError() == ERROR_IO_PENDING;
+      });
+
+    if (status != 0) {
+      loop::iocp::cancel(m_descriptor);
+      o->result->close();
+      delete o->result;
+      o->slice = Slice();
+      o->callback(nullptr, status, Slice());
       delete o;
+    }
+  }
+
+  static void accepted(WSAOverlapped_ACCEPT_READ* o, ULONG error, size_t read)
+  {
+    if (error == NO_ERROR) {
+      // Lets getpeername, shutdown and the like work on the socket.
+      setsockopt(
+        o->socket,
+        SOL_SOCKET,
+        SO_UPDATE_ACCEPT_CONTEXT,
+        reinterpret_cast<char*>(&o->listener),
+        sizeof(o->listener));
+
+      // The callback gets the only reference to the buffer.
+      Slice data = read > 0 ? o->slice.slice(0, read) : Slice();
+      o->slice = Slice();
+      o->callback(o->result, static_cast<SSIZE_T>(read), std::move(data));
+    } else {
+      o->result->close();
+      delete o->result;
+      o->slice = Slice();
+      o->callback(nullptr, o->cancellation.cancelled ? CANCELLED : -1, Slice());
+    }
+    delete o;
+  }
+
+  // Issues a ConnectEx that sends `size` bytes at `data` once connected,
+  // or none if `data` is NULL.
+  static Future<DWORD> connect(
+    SOCKET socket,
+    loop::Descriptor* descriptor,
+    const sockaddr* addr,
+    size_t addr_size,
+    const void* data,
+    size_t size,
+    const CancellationToken& token)
+  {
+    LPFN_CONNECTEX connectEx = extension(ConnectEx, WSAID_CONNECTEX);
+    if (descriptor == nullptr ||
+        socket == INVALID_SOCKET ||
+        connectEx == NULL ||
+        !bindAny(socket, addr->sa_family)) {
+      return ready<DWORD>(~0);
+    }
+
+    WSAOverlapped_DWORD* o = new WSAOverlapped_DWORD();
+    o->o = { 0 };
+    o->ot = WSAOverlappedType::NONE;
+    Future<DWORD> future = o->state.get_future();
+
+    loop::iocp::start(descriptor);
+    SSIZE_T status = issue(
+      o->cancellation,
+      reinterpret_cast<HANDLE>(socket),
+      (OVERLAPPED*)o,
+      token,
+      [&]() {
+        BOOL success = connectEx(
+          socket,
+          addr,
+          (int)addr_size,
+          const_cast<void*>(data),
+          static_cast<DWORD>(size),
+          NULL,
+          (OVERLAPPED*)o);
+        return success || WSAGetLastError() == ERROR_IO_PENDING;
+      });
+
+    if (status != 0) {
+      loop::iocp::cancel(descriptor);
+      o->state.set(status == CANCELLED ? CANCELLED_ERROR : ~0);
+      o->state.release();
       return future;
     }
 
     return future;
   }
 
+  Future<DWORD> SocketHandle::connect(
+    const sockaddr* addr,
+    size_t addr_size,
+    const CancellationToken& token) const
+  {
+    return async::connect(m_socket, m_descriptor, addr, addr_size, NULL, 0, token);
+  }
+
+  // TCP Fast Open has to be asked for before the connect. Without it,
+  // or with a server that doesn't do it, ConnectEx sends the data right
+  // after the handshake.
+  Future<DWORD> SocketHandle::connect(
+    const sockaddr* addr,
+    size_t addr_size,
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    DWORD enable = 1;
+    setsockopt(
+      m_socket,
+      IPPROTO_TCP,
+      TCP_FASTOPEN,
+      reinterpret_cast<char*>(&enable),
+      sizeof(enable));
+    return async::connect(m_socket, m_descriptor, addr, addr_size, data, size, token);
+  }
+
   int SocketHandle::listen(int connections) const
   {
-    int iResult = ::listen(m_socket, 1);
+    int iResult = ::listen(m_socket, connections);
     if (iResult != 0) {
       return WSAGetLastError();
     }
@@ -405,132 +1124,455 @@ namespace async {
 
   void SocketHandle::close() const
   {
-    if (m_iocp != NULL) {
-      CloseThreadpoolIo(m_iocp);
+    if (m_descriptor != nullptr) {
+      loop::iocp::detach(m_descriptor);
     }
     closesocket(m_socket);
   }
 
 
-  PipeHandle::PipeHandle(HANDLE h) : m_handle(h)
+  static void stop_acceptor(internal::AcceptorState* acceptor)
+  {
+    acceptor->stopped.store(true, std::memory_order_release);
+    acceptor->token.cancel();
+  }
+
+  // Called when an accept is done. The last one hands nullptr on.
+  static void done(internal::AcceptorState* acceptor)
+  {
+    if (acceptor->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      acceptor->callback(nullptr);
+    }
+    acceptor->release();
+  }
+
+  // Starts one more accept, with a recycled socket if there is one.
+  // Returns false if it couldn't.
+  static bool post(internal::AcceptorState* acceptor)
   {
-    m_iocp = CreateThreadpoolIo(
+    WSAOverlapped_ACCEPT* o = new WSAOverlapped_ACCEPT();
+    o->o = { 0 };
+    o->ot = WSAOverlappedType::ACCEPT;
+    o->acceptor = acceptor;
+    o->result = nullptr;
+
+    {
+      std::lock_guard<std::mutex> lock(acceptor->mutex);
+      if (!acceptor->recycled.empty()) {
+        o->socket = acceptor->recycled.back().first;
+        o->result = acceptor->recycled.back().second;
+        acceptor->recycled.pop_back();
+      }
+    }
+
+    if (o->result == nullptr) {
+      o->socket = socket(AF_INET, SOCK_STREAM, 0);
+      if (o->socket == INVALID_SOCKET) {
+        delete o;
+        return false;
+      }
+      o->result = new SocketHandle(o->socket, loop::EventLoop::next());
+    }
+
+    acceptor->acquire();
+    acceptor->pending.fetch_add(1, std::memory_order_relaxed);
+
+    DWORD dwBytes;
+    loop::iocp::start(acceptor->descriptor);
+    SSIZE_T status = issue(
+      o->cancellation,
+      reinterpret_cast<HANDLE>(acceptor->listener),
+      (OVERLAPPED*)o,
+      acceptor->token,
+      [&]() {
+        BOOL result = AcceptEx(
+          acceptor->listener,
+          o->socket,
+          o->output,
+          0,
+          sizeof(sockaddr_in) + 16,
+          sizeof(sockaddr_in) + 16,
+          &dwBytes,
+          (OVERLAPPED*)o);
+        return result || WSAGetLastError() == ERROR_IO_PENDING;
+      });
+
+    if (status != 0) {
+      loop::iocp::cancel(acceptor->descriptor);
+      o->result->close();
+      delete o->result;
+      delete o;
+
+      // The caller still counts as pending, so this is never the last.
+      acceptor->pending.fetch_sub(1, std::memory_order_relaxed);
+      acceptor->release();
+      return false;
+    }
+    return true;
+  }
+
+  // A connection reset before it was accepted. Anything else stops the
+  // acceptor rather than fail over and over (a closed listener).
+  static bool transient(ULONG error)
+  {
+    return error == ERROR_NETNAME_DELETED || error == WSAECONNRESET;
+  }
+
+  static void accepted(WSAOverlapped_ACCEPT* o, ULONG error)
+  {
+    internal::AcceptorState* acceptor = o->acceptor;
+    bool stopped = acceptor->stopped.load(std::memory_order_acquire);
+
+    if (error == NO_ERROR && !stopped) {
+      // Lets getpeername, shutdown and the like work on the socket.
+      setsockopt(
+        o->socket,
+        SOL_SOCKET,
+        SO_UPDATE_ACCEPT_CONTEXT,
+        reinterpret_cast<char*>(&acceptor->listener),
+        sizeof(acceptor->listener));
+
+      if (!post(acceptor)) {
+        stop_acceptor(acceptor);
+      }
+      acceptor->callback(o->result);
+    } else {
+      o->result->close();
+      delete o->result;
+      if (stopped || o->cancellation.cancelled || !transient(error) || !post(acceptor)) {
+        stop_acceptor(acceptor);
+      }
+    }
+
+    delete o;
+    done(acceptor);
+  }
+
+  static void disconnected(WSAOverlapped_DISCONNECT* o, ULONG error)
+  {
+    internal::AcceptorState* acceptor = o->acceptor;
+    if (error == NO_ERROR && !acceptor->stopped.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lock(acceptor->mutex);
+      acceptor->recycled.emplace_back(o->socket, o->result);
+    } else {
+      o->result->close();
+      delete o->result;
+    }
+
+    delete o;
+    acceptor->release();
+  }
+
+  Acceptor::Acceptor(const SocketHandle& listener, size_t depth, AcceptCallback callback)
+    : m_state(new internal::AcceptorState())
+  {
+    m_state->listener = listener.m_socket;
+    m_state->descriptor = listener.m_descriptor;
+    m_state->callback = std::move(callback);
+
+    // Counts as an accept until all of them are started, so that the
+    // callback can't get nullptr in between.
+    m_state->acquire();
+    m_state->pending.store(1, std::memory_order_relaxed);
+
+    if (m_state->descriptor == nullptr || depth == 0) {
+      stop_acceptor(m_state);
+    }
+    for (size_t i = 0; i < depth && !m_state->stopped.load(std::memory_order_acquire); i++) {
+      if (!post(m_state)) {
+        stop_acceptor(m_state);
+      }
+    }
+    done(m_state);
+  }
+
+  Acceptor::~Acceptor()
+  {
+    stop_acceptor(m_state);
+    m_state->release();
+  }
+
+  void Acceptor::stop()
+  {
+    stop_acceptor(m_state);
+  }
+
+  void Acceptor::recycle(SocketHandle* socket)
+  {
+    if (m_state->stopped.load(std::memory_order_acquire) ||
+        socket->m_descriptor == nullptr ||
+        extension(DisconnectEx, WSAID_DISCONNECTEX) == NULL) {
+      socket->close();
+      delete socket;
+      return;
+    }
+
+    WSAOverlapped_DISCONNECT* o = new WSAOverlapped_DISCONNECT();
+    o->o = { 0 };
+    o->ot = WSAOverlappedType::DISCONNECT;
+    o->acceptor = m_state;
+    o->socket = socket->m_socket;
+    o->result = socket;
+    m_state->acquire();
+
+    loop::iocp::start(socket->m_descriptor);
+    BOOL success = DisconnectEx.load()(socket->m_socket, (OVERLAPPED*)o, TF_REUSE_SOCKET, 0);
+    int error = success ? NO_ERROR : WSAGetLastError();
+    if (error != NO_ERROR && error != ERROR_IO_PENDING) {
+      loop::iocp::cancel(socket->m_descriptor);
+      disconnected(o, error);
+    }
+  }
+
+
+  PipeHandle::PipeHandle(HANDLE h) : PipeHandle(h, loop::EventLoop::current())
+  {
+  }
+
+  PipeHandle::PipeHandle(HANDLE h, size_t loop) : m_handle(h)
+  {
+    m_descriptor = loop::iocp::attach(
       reinterpret_cast<HANDLE>(m_handle),
       &ioCallback,
-      NULL,
-      &loop::environment);
+      loop);
   }
 
-  std::future<SSIZE_T> PipeHandle::readAsync(void* data, size_t size) const
+  Future<SSIZE_T> PipeHandle::readAsync(
+    void* data,
+    size_t size,
+    const CancellationToken& token) const
   {
-    if (m_iocp == NULL) {
-      std::promise<SSIZE_T> promise;
-      std::future<SSIZE_T> future = promise.get_future();
-      promise.set_value(-1);
-      return future;
+    if (m_descriptor == nullptr) {
+      return ready<SSIZE_T>(-1);
     }
 
-    StartThreadpoolIo(m_iocp);
+    Overlapped_FUTURE* overlapped = new Overlapped_FUTURE();
+    overlapped->future = true;
+    Future<SSIZE_T> future = overlapped->state.get_future();
 
-    Overlapped* overlapped = new Overlapped();
-    overlapped->o = { 0 };
-    std::future<SSIZE_T> future = overlapped->promise.get_future();
+    readFile(m_handle, m_descriptor, overlapped, data, size, token);
+    return future;
+  }
 
-    BOOL success = ReadFile(
-      m_handle,
-      data,
-      (DWORD)size,
-      NULL,
-      reinterpret_cast<OVERLAPPED*>(overlapped));
+  void PipeHandle::readAsync(
+    void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr) {
+      callback(-1);
+      return;
+    }
 
-    if (!success && GetLastError() != ERROR_IO_PENDING) {
-      CancelThreadpoolIo(m_iocp);
-      overlapped->promise.set_value(-1);
-      delete overlapped;
-      return future;
+    Overlapped_CALLBACK* overlapped = new Overlapped_CALLBACK();
+    overlapped->future = false;
+    overlapped->callback = std::move(callback);
+
+    readFile(m_handle, m_descriptor, overlapped, data, size, token);
+  }
+
+  Future<SSIZE_T> PipeHandle::writeAsync(
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr) {
+      return ready<SSIZE_T>(-1);
     }
 
+    Overlapped_FUTURE* overlapped = new Overlapped_FUTURE();
+    overlapped->future = true;
+    Future<SSIZE_T> future = overlapped->state.get_future();
+
+    writeFile(m_handle, m_descriptor, overlapped, data, size, token);
     return future;
   }
 
-  std::future<SSIZE_T> PipeHandle::writeAsync(const void* data, size_t size) const
+  void PipeHandle::writeAsync(
+    const void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
   {
-    if (m_iocp == NULL) {
-      std::promise<SSIZE_T> promise;
-      std::future<SSIZE_T> future = promise.get_future();
-      promise.set_value(-1);
-      return future;
+    if (m_descriptor == nullptr) {
+      callback(-1);
+      return;
     }
 
-    StartThreadpoolIo(m_iocp);
+    Overlapped_CALLBACK* overlapped = new Overlapped_CALLBACK();
+    overlapped->future = false;
+    overlapped->callback = std::move(callback);
 
-    Overlapped* overlapped = new Overlapped();
-    overlapped->o = { 0 };
-    std::future<SSIZE_T> future = overlapped->promise.get_future();
+    writeFile(m_handle, m_descriptor, overlapped, data, size, token);
+  }
 
-    BOOL success = WriteFile(
-      m_handle,
-      data,
-      (DWORD)size,
-      NULL,
-      reinterpret_cast<OVERLAPPED*>(overlapped));
+  // Pipes have no scatter/gather: a read goes into the first buffer that
+  // isn't empty, which is as much as a short read would fill anyway.
+  static const IoBuffer& first(const IoBuffer* buffers, size_t count)
+  {
+    for (size_t i = 0; i < count; i++) {
+      if (buffers[i].size != 0) {
+        return buffers[i];
+      }
+    }
+    return buffers[0];
+  }
 
-    if (!success && GetLastError() != ERROR_IO_PENDING) {
-      CancelThreadpoolIo(m_iocp);
-      overlapped->promise.set_value(-1);
-      delete overlapped;
-      return future;
+  // And a write of more than one buffer copies them into `overlapped`
+  // first, so that it is still one WriteFile.
+  static void gather(
+    HANDLE handle,
+    loop::Descriptor* descriptor,
+    Overlapped* overlapped,
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token)
+  {
+    if (count == 1) {
+      writeFile(handle, descriptor, overlapped, buffers[0].data, buffers[0].size, token);
+      return;
+    }
+
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+      size += buffers[i].size;
+    }
+    overlapped->gathered.reset(new char[size]);
+    char* data = overlapped->gathered.get();
+    for (size_t i = 0; i < count; i++) {
+      memcpy(data, buffers[i].data, buffers[i].size);
+      data += buffers[i].size;
+    }
+    writeFile(handle, descriptor, overlapped, overlapped->gathered.get(), size, token);
+  }
+
+  Future<SSIZE_T> PipeHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
     }
 
+    const IoBuffer& buffer = first(buffers, count);
+    return readAsync(buffer.data, buffer.size, token);
+  }
+
+  void PipeHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    const IoBuffer& buffer = first(buffers, count);
+    readAsync(buffer.data, buffer.size, std::move(callback), token);
+  }
+
+  Future<SSIZE_T> PipeHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    Overlapped_FUTURE* overlapped = new Overlapped_FUTURE();
+    overlapped->future = true;
+    Future<SSIZE_T> future = overlapped->state.get_future();
+
+    gather(m_handle, m_descriptor, overlapped, buffers, count, token);
     return future;
   }
 
+  void PipeHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    Overlapped_CALLBACK* overlapped = new Overlapped_CALLBACK();
+    overlapped->future = false;
+    overlapped->callback = std::move(callback);
+
+    gather(m_handle, m_descriptor, overlapped, buffers, count, token);
+  }
+
   void PipeHandle::close() const
   {
-    if (m_iocp != NULL) {
-      CloseThreadpoolIo(m_iocp);
+    if (m_descriptor != nullptr) {
+      loop::iocp::detach(m_descriptor);
     }
     CloseHandle(m_handle);
   }
 
 
+  template <typename T, typename H>
+  static Handle* make(internal::HandleStorage* storage, H h)
+  {
+    if (storage == nullptr) {
+      return new T(h);
+    }
+    return new (storage) T(h);
+  }
+
   Handle* createAsyncHandle(io::Handle* fd)
+  {
+    return createAsyncHandle(fd, nullptr);
+  }
+
+  Handle* createAsyncHandle(io::Handle* fd, internal::HandleStorage* storage)
   {
     struct vistor {
       Handle* operator()(HANDLE h)
       {
         if (isOverlapped) {
-          return new PipeHandle(h);
+          return make<PipeHandle>(storage, h);
         }
-        return new FileHandle(h);
+        return make<FileHandle>(storage, h);
       }
 
       Handle* operator()(SOCKET s)
       {
-        return new SocketHandle(s);
+        return make<SocketHandle>(storage, s);
       }
       bool isOverlapped;
+      internal::HandleStorage* storage;
     };
 
     std::variant<HANDLE, SOCKET> var = fd->dup();
-    vistor v = { fd->isOverlapped() };
+    vistor v = { fd->isOverlapped(), storage };
     return std::visit(v, var);
   }
 
-  std::future<SSIZE_T> readAsync(
+  Future<SSIZE_T> readAsync(
     Handle* fd,
     void* data,
-    size_t size)
+    size_t size,
+    const CancellationToken& token)
   {
-    return fd->readAsync(data, size);
+    return fd->readAsync(data, size, token);
   }
 
-  std::future<SSIZE_T> writeAsync(
+  Future<SSIZE_T> writeAsync(
     Handle* fd,
     const void* data,
-    size_t size)
+    size_t size,
+    const CancellationToken& token)
   {
-    return fd->writeAsync(data, size);
+    return fd->writeAsync(data, size, token);
   }
 
   void close(Handle* fd)
@@ -538,3 +1580,4 @@ namespace async {
     fd->close();
   }
 }
+#endif // _WIN32
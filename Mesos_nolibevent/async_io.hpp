@@ -1,20 +1,78 @@
 #pragma once
 
 #include "stdafx.h"
+#include "buffers.hpp"
+#include "cancellation.hpp"
+#include "future.hpp"
 #include "io.hpp"
 
+namespace loop {
+  struct Descriptor;
+}
+
 namespace async {
+  // Receives the result of a read or write: the number of bytes, -1,
+  // CANCELLED or TIMED_OUT.
+  typedef loop::Function<void(SSIZE_T)> Callback;
+
+  // Receives the result of a read into a pool buffer, and the data as a
+  // slice of the buffer, empty unless the result is positive.
+  typedef loop::Function<void(SSIZE_T, Slice)> SliceCallback;
+
+  // One buffer of a scatter/gather read or write (see
+  // `SocketHandle::readvAsync`).
+  struct IoBuffer {
+    void* data;
+    size_t size;
+  };
+
+  // The most buffers a scatter/gather read or write takes. It fails with
+  // -1 given more, or none.
+  const size_t MAX_IO_BUFFERS = 8;
+
+  class SocketHandle;
+
+  // Receives a connection accepted together with its first read (see
+  // `SocketHandle::accept(BufferPool&)`): the socket, or nullptr, and the
+  // result and data of the read, like a SliceCallback.
+  typedef loop::Function<void(SocketHandle*, SSIZE_T, Slice)> AcceptReadCallback;
+
+  // The result of a read, write or sendfile cancelled through its
+  // CancellationToken. Every other failure is -1.
+  const SSIZE_T CANCELLED = -2;
+
+  // The error code of a connect cancelled through its CancellationToken.
+#ifdef _WIN32
+  const DWORD CANCELLED_ERROR = ERROR_OPERATION_ABORTED;
+#else
+  const DWORD CANCELLED_ERROR = ECANCELED;
+#endif
+
+  // The result of a read or write that didn't complete by its deadline.
+  const SSIZE_T TIMED_OUT = -3;
+
+  // The error code of a connect that didn't complete by its deadline.
+#ifdef _WIN32
+  const DWORD TIMED_OUT_ERROR = WSAETIMEDOUT;
+#else
+  const DWORD TIMED_OUT_ERROR = ETIMEDOUT;
+#endif
+
   class Handle {
   public:
-    ~Handle() {}
+    virtual ~Handle() {}
 
-    virtual std::future<SSIZE_T> readAsync(
+    // Every operation takes an optional token to cancel it with (see
+    // CancellationToken).
+    virtual Future<SSIZE_T> readAsync(
       void* data,
-      size_t size) const = 0;
+      size_t size,
+      const CancellationToken& token = CancellationToken()) const = 0;
 
-    virtual std::future<SSIZE_T> writeAsync(
+    virtual Future<SSIZE_T> writeAsync(
       const void* data,
-      size_t size) const = 0;
+      size_t size,
+      const CancellationToken& token = CancellationToken()) const = 0;
 
     virtual void close() const = 0;
   };
@@ -24,9 +82,15 @@ namespace async {
   public:
     FileHandle(HANDLE h);
 
-    std::future<SSIZE_T> readAsync(void* data, size_t size) const override;
+    Future<SSIZE_T> readAsync(
+      void* data,
+      size_t size,
+      const CancellationToken& token = CancellationToken()) const override;
 
-    std::future<SSIZE_T> writeAsync(const void* data, size_t size) const override;
+    Future<SSIZE_T> writeAsync(
+      const void* data,
+      size_t size,
+      const CancellationToken& token = CancellationToken()) const override;
 
     void close() const override;
 
@@ -40,51 +104,356 @@ namespace async {
 
     SocketHandle(SOCKET s);
 
-    std::future<SSIZE_T> readAsync(void* data, size_t size) const override;
+    // Binds the socket to event loop `loop` (see `EventLoop::initialize`).
+    SocketHandle(SOCKET s, size_t loop);
+
+    Future<SSIZE_T> readAsync(
+      void* data,
+      size_t size,
+      const CancellationToken& token = CancellationToken()) const override;
+
+    Future<SSIZE_T> writeAsync(
+      const void* data,
+      size_t size,
+      const CancellationToken& token = CancellationToken()) const override;
+
+    // Like the reads and writes above, but the result goes to `callback`
+    // instead of a future, so there is no future state to allocate. The
+    // callback is kept in the operation itself and runs on the loop thread
+    // the socket is bound to, or on the calling thread before the call
+    // returns if the operation fails (or, on epoll, completes) right away.
+    void readAsync(
+      void* data,
+      size_t size,
+      Callback callback,
+      const CancellationToken& token = CancellationToken()) const;
+
+    void writeAsync(
+      const void* data,
+      size_t size,
+      Callback callback,
+      const CancellationToken& token = CancellationToken()) const;
+
+    // Reads into a buffer of `pool` rather than one of the caller's, and
+    // passes what was read on as a slice of it, which the callback can
+    // keep, or hand on, for as long as it likes (see BufferPool). Runs
+    // like the callback reads above.
+    void readAsync(
+      BufferPool& pool,
+      SliceCallback callback,
+      const CancellationToken& token = CancellationToken()) const;
+
+    // Writes all of `slice`, which is kept alive until the write is done.
+    void writeAsync(
+      Slice slice,
+      Callback callback,
+      const CancellationToken& token = CancellationToken()) const;
+
+    // Scatter/gather reads and writes, over `count` buffers in order, in
+    // a single request (WSARecv and WSASend with as many WSABUFs, readv
+    // and sendmsg on Linux): a header and a body go out together without
+    // being copied into one buffer first. A read may fill only some of
+    // the buffers, a write completes once all of them are sent. The array
+    // is copied, but the memory of the buffers must stay alive until the
+    // operation completes.
+    Future<SSIZE_T> readvAsync(
+      const IoBuffer* buffers,
+      size_t count,
+      const CancellationToken& token = CancellationToken()) const;
+
+    Future<SSIZE_T> writevAsync(
+      const IoBuffer* buffers,
+      size_t count,
+      const CancellationToken& token = CancellationToken()) const;
+
+    void readvAsync(
+      const IoBuffer* buffers,
+      size_t count,
+      Callback callback,
+      const CancellationToken& token = CancellationToken()) const;
+
+    void writevAsync(
+      const IoBuffer* buffers,
+      size_t count,
+      Callback callback,
+      const CancellationToken& token = CancellationToken()) const;
+
+    Future<SocketHandle*> accept(
+      const CancellationToken& token = CancellationToken()) const;
+
+    // Accepts a connection and reads its first bytes into a buffer of
+    // `pool` in the same operation (AcceptEx with a receive buffer on
+    // Windows), so that a client that sends its request right away costs
+    // one completion instead of an accept and then a read. The callback
+    // owns the socket it gets. A connection that closes before it sends
+    // anything reads 0; if the accept or the read fails, the connection
+    // is closed and the callback gets nullptr and -1 or CANCELLED.
+    //
+    // The operation only completes once the client has sent something, so
+    // one that connects and waits holds it: bound it with a deadline. On
+    // Windows the end of the buffer holds the addresses, so the read gets
+    // 64 bytes less.
+    void accept(
+      BufferPool& pool,
+      AcceptReadCallback callback,
+      const CancellationToken& token = CancellationToken()) const;
+
+    Future<DWORD> connect(
+      const sockaddr* addr,
+      size_t addr_size,
+      const CancellationToken& token = CancellationToken()) const;
+
+    // Connects and sends the `size` bytes at `data` as part of it, so that
+    // the first request needs no write of its own: ConnectEx sends them on
+    // Windows, and on Linux they go out in the SYN with TCP Fast Open once
+    // the server has handed out a cookie (net.ipv4.tcp_fastopen has to
+    // allow it on both ends), or right after the handshake otherwise.
+    // Completes like connect, once the connection is up and all of the
+    // data is sent; `data` must stay alive until then.
+    Future<DWORD> connect(
+      const sockaddr* addr,
+      size_t addr_size,
+      const void* data,
+      size_t size,
+      const CancellationToken& token = CancellationToken()) const;
+
+    Future<SSIZE_T> sendfile(
+      io::Handle* fd,
+      off_t offset,
+      size_t size,
+      const CancellationToken& token = CancellationToken()) const;
+
+    // The same operations with a deadline: one that is still pending at
+    // `deadline` is cancelled, and completes with TIMED_OUT (a connect
+    // with TIMED_OUT_ERROR, an accept with nullptr). Each operation gets a
+    // token of its own (see `CancellationToken::create(Deadline)`), whose
+    // timer is disarmed as soon as the operation completes.
+    Future<SSIZE_T> readAsync(
+      void* data,
+      size_t size,
+      Deadline deadline) const;
+
+    Future<SSIZE_T> writeAsync(
+      const void* data,
+      size_t size,
+      Deadline deadline) const;
+
+    void readAsync(
+      void* data,
+      size_t size,
+      Callback callback,
+      Deadline deadline) const;
 
-    std::future<SSIZE_T> writeAsync(const void* data, size_t size) const override;
+    void writeAsync(
+      const void* data,
+      size_t size,
+      Callback callback,
+      Deadline deadline) const;
 
-    std::future<SocketHandle*> accept() const;
+    Future<SocketHandle*> accept(Deadline deadline) const;
 
-    std::future<DWORD> connect(const sockaddr* addr, size_t addr_size) const;
+    void accept(
+      BufferPool& pool,
+      AcceptReadCallback callback,
+      Deadline deadline) const;
 
-    std::future<SSIZE_T> sendfile(io::Handle* fd, off_t offset, size_t size) const;
+    Future<DWORD> connect(
+      const sockaddr* addr,
+      size_t addr_size,
+      Deadline deadline) const;
+
+    Future<DWORD> connect(
+      const sockaddr* addr,
+      size_t addr_size,
+      const void* data,
+      size_t size,
+      Deadline deadline) const;
 
+    // `connections` is the backlog of the listening socket.
     int listen(int connections) const;
 
     void close() const override;
 
   protected:
+    friend class Acceptor;
+    friend class WriteQueue;
+
     SOCKET m_socket;
-    PTP_IO m_iocp;
+    loop::Descriptor* m_descriptor;
   };
 
   class PipeHandle : public Handle {
   public:
     PipeHandle(HANDLE h);
 
-    std::future<SSIZE_T> readAsync(void* data, size_t size) const override;
+    PipeHandle(HANDLE h, size_t loop);
 
-    std::future<SSIZE_T> writeAsync(const void* data, size_t size) const override;
+    Future<SSIZE_T> readAsync(
+      void* data,
+      size_t size,
+      const CancellationToken& token = CancellationToken()) const override;
+
+    Future<SSIZE_T> writeAsync(
+      const void* data,
+      size_t size,
+      const CancellationToken& token = CancellationToken()) const override;
+
+    // See `SocketHandle::readAsync`.
+    void readAsync(
+      void* data,
+      size_t size,
+      Callback callback,
+      const CancellationToken& token = CancellationToken()) const;
+
+    void writeAsync(
+      const void* data,
+      size_t size,
+      Callback callback,
+      const CancellationToken& token = CancellationToken()) const;
+
+    // See `SocketHandle::readvAsync`. Windows has no scatter/gather for
+    // pipes: a read there only fills the first buffer that isn't empty,
+    // and a write of more than one buffer copies them into one.
+    Future<SSIZE_T> readvAsync(
+      const IoBuffer* buffers,
+      size_t count,
+      const CancellationToken& token = CancellationToken()) const;
+
+    Future<SSIZE_T> writevAsync(
+      const IoBuffer* buffers,
+      size_t count,
+      const CancellationToken& token = CancellationToken()) const;
+
+    void readvAsync(
+      const IoBuffer* buffers,
+      size_t count,
+      Callback callback,
+      const CancellationToken& token = CancellationToken()) const;
+
+    void writevAsync(
+      const IoBuffer* buffers,
+      size_t count,
+      Callback callback,
+      const CancellationToken& token = CancellationToken()) const;
 
     void close() const override;
 
   protected:
     HANDLE m_handle;
-    PTP_IO m_iocp;
+    loop::Descriptor* m_descriptor;
   };
   
+  // Receives the connections of an Acceptor, and nullptr once, when it
+  // has stopped.
+  typedef loop::Function<void(SocketHandle*)> AcceptCallback;
+
+  namespace internal {
+    struct AcceptorState;
+  }
+
+  // Keeps `depth` accepts pending on a listening socket at all times, so
+  // that a burst of connections doesn't wait on the application to start
+  // the next accept after every one: each accept that completes starts the
+  // next one, from the completion, before its connection is handed on. The
+  // listener's backlog should be at least `depth` (see `listen`).
+  //
+  // The connections go to the callback, on the loop thread the listener is
+  // bound to (on Windows, on a thread of the pool in the THREAD_POOL mode,
+  // where several may run at once). An accept that fails because the
+  // connection was reset before it got to it is started again; any other
+  // failure, closing the listener, or `stop` stops the acceptor, and the
+  // callback gets nullptr once every pending accept is done. A connection
+  // accepted by then is closed.
+  //
+  // On Windows a connection the application is done with can be handed
+  // back with `recycle` instead of being closed and deleted: the socket is
+  // disconnected with DisconnectEx (TF_REUSE_SOCKET) and a later accept
+  // takes it rather than a new socket. On Linux there is nothing an accept
+  // can reuse, so `recycle` closes and deletes the socket.
+  class Acceptor {
+  public:
+    Acceptor(const SocketHandle& listener, size_t depth, AcceptCallback callback);
+
+    // Stops the acceptor. The callback may still run until it gets nullptr.
+    ~Acceptor();
+
+    Acceptor(const Acceptor&) = delete;
+    Acceptor& operator=(const Acceptor&) = delete;
+
+    // Cancels the pending accepts and starts no new ones.
+    void stop();
+
+    // Takes a connection of this acceptor back once nothing is pending on
+    // it any longer. Can be called from any thread.
+    void recycle(SocketHandle* socket);
+
+  private:
+    internal::AcceptorState* m_state;
+  };
+
+  namespace internal {
+    struct WriteQueueState;
+  }
+
+  // Coalesces small writes to a socket ("corking"): a write made while an
+  // earlier one is still being sent waits, and once that send completes
+  // every write that queued up behind it goes out together, as one gather
+  // send (see `SocketHandle::writevAsync`) of up to MAX_IO_BUFFERS writes.
+  // Each write still gets its own callback with its own size, in the order
+  // of the writes, on the loop thread the socket is bound to (or on the
+  // calling thread, like the callbacks of the socket's own writes). A write
+  // made while nothing is being sent goes out right away, so a socket with
+  // little traffic sees no delay. On epoll, where a send is performed on
+  // the spot, a write made then off the socket's loop thread is handed to
+  // the loop, and the writes made before it gets to it go out with it.
+  //
+  // The memory of a write must stay alive until its callback runs. Once a
+  // send fails, every write still queued and every later one fails with
+  // the same result. The writes already queued still go out after the
+  // queue is destroyed. Can be used from any thread.
+  class WriteQueue {
+  public:
+    explicit WriteQueue(const SocketHandle& socket);
+
+    ~WriteQueue();
+
+    WriteQueue(const WriteQueue&) = delete;
+    WriteQueue& operator=(const WriteQueue&) = delete;
+
+    Future<SSIZE_T> writeAsync(const void* data, size_t size);
+
+    void writeAsync(const void* data, size_t size, Callback callback);
+
+  private:
+    internal::WriteQueueState* m_state;
+  };
+
+  namespace internal {
+    // Room for a handle of any of the types above (see HandleTable).
+    union HandleStorage {
+      alignas(FileHandle) char file[sizeof(FileHandle)];
+      alignas(SocketHandle) char socket[sizeof(SocketHandle)];
+      alignas(PipeHandle) char pipe[sizeof(PipeHandle)];
+    };
+  }
+
   Handle* createAsyncHandle(io::Handle* fd);
+
+  // Makes the handle in `storage` rather than on the heap; it is destroyed
+  // with `~Handle`, not deleted.
+  Handle* createAsyncHandle(io::Handle* fd, internal::HandleStorage* storage);
   
-  std::future<SSIZE_T> readAsync(
+  Future<SSIZE_T> readAsync(
     Handle* fd,
     void* data,
-    size_t size);
+    size_t size,
+    const CancellationToken& token = CancellationToken());
 
-  std::future<SSIZE_T> writeAsync(
+  Future<SSIZE_T> writeAsync(
     Handle* fd,
     const void* data,
-    size_t size);
+    size_t size,
+    const CancellationToken& token = CancellationToken());
 
   void close(Handle* fd);
 }
\ No newline at end of file
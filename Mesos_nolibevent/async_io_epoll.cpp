@@ -0,0 +1,1312 @@
+#include "stdafx.h"
+#include "io.hpp"
+#include "async_io.hpp"
+#include "eventloop.hpp"
+#include "eventloop_epoll.hpp"
+#include "pool.hpp"
+
+#if defined(__linux__) && !defined(USE_IO_URING)
+namespace async {
+  // The operations mirror the WSAOverlapped_* structs of the Windows
+  // implementation, except that they carry enough state to be retried
+  // whenever the descriptor becomes ready again.
+  //
+  // A token cancels an operation by taking it off its descriptor's queue
+  // and aborting it. One that the token gets to while it is still being
+  // submitted, before it is queued, finds `cancelled` set when it is
+  // performed.
+  struct CancellableOperation :
+    loop::Operation,
+    internal::Cancellable,
+    internal::PooledOperation {
+    loop::Descriptor* descriptor;
+
+    bool cancel() override
+    {
+      return loop::epoll::withdraw(descriptor, this);
+    }
+
+    void finish() override
+    {
+      abort();
+      release();
+    }
+  };
+
+  // Reads and writes hand their result to `deliver`, which passes it to a
+  // callback or a future (see WithCallback and WithFuture below).
+  struct ReadOperation : CancellableOperation {
+    void* data;
+    size_t size;
+    SSIZE_T result;
+
+    virtual void deliver(SSIZE_T result) = 0;
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        result = CANCELLED;
+        return true;
+      }
+      result = ::read(fd, data, size);
+      return !(result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+
+    void complete() override
+    {
+      delist();
+      deliver(result);
+    }
+
+    void abort() override
+    {
+      delist();
+      deliver(cancelled ? CANCELLED : -1);
+    }
+  };
+
+  // Takes its buffer from the pool only once the socket is readable, and
+  // gives it straight back if there turns out to be nothing to read, so a
+  // read that waits holds no buffer.
+  struct BufferReadOperation : CancellableOperation {
+    BufferPool* pool;
+    Slice slice;
+    SSIZE_T result;
+    SliceCallback callback;
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        result = CANCELLED;
+        return true;
+      }
+
+      slice = pool->acquire();
+      result = ::read(fd, slice.data(), slice.size());
+      if (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        slice = Slice();
+        return false;
+      }
+      return true;
+    }
+
+    void complete() override
+    {
+      delist();
+
+      // The callback gets the only reference to the buffer.
+      Slice data = result > 0 ? slice.slice(0, static_cast<size_t>(result)) : Slice();
+      slice = Slice();
+      callback(result, std::move(data));
+    }
+
+    void abort() override
+    {
+      delist();
+      callback(cancelled ? CANCELLED : -1, Slice());
+    }
+  };
+
+  // Writes complete once the whole buffer has been handed to the kernel,
+  // which is what WSASend and WriteFile do for overlapped handles.
+  struct WriteOperation : CancellableOperation {
+    const char* data;
+    size_t size;
+    size_t written = 0;
+    bool socket;
+    SSIZE_T result;
+
+    // Keeps the data of a slice write alive.
+    Slice slice;
+
+    virtual void deliver(SSIZE_T result) = 0;
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        result = CANCELLED;
+        return true;
+      }
+
+      while (written < size) {
+        SSIZE_T bytes = socket
+          ? ::send(fd, data + written, size - written, MSG_NOSIGNAL)
+          : ::write(fd, data + written, size - written);
+
+        if (bytes == -1) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+          }
+          result = -1;
+          return true;
+        }
+        written += static_cast<size_t>(bytes);
+      }
+
+      result = static_cast<SSIZE_T>(written);
+      return true;
+    }
+
+    void complete() override
+    {
+      delist();
+      deliver(result);
+    }
+
+    void abort() override
+    {
+      delist();
+      deliver(cancelled ? CANCELLED : -1);
+    }
+  };
+
+  // Copies the buffers of a scatter/gather operation into `vectors`, and
+  // returns their total size.
+  static size_t vectorize(iovec* vectors, const IoBuffer* buffers, size_t count)
+  {
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+      vectors[i].iov_base = buffers[i].data;
+      vectors[i].iov_len = buffers[i].size;
+      size += buffers[i].size;
+    }
+    return size;
+  }
+
+  // Scatter/gather reads and writes keep a copy of the buffers, which a
+  // write moves past whatever each partial send took.
+  struct VectorReadOperation : ReadOperation {
+    iovec vectors[MAX_IO_BUFFERS];
+    int count;
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        result = CANCELLED;
+        return true;
+      }
+      result = ::readv(fd, vectors, count);
+      return !(result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+  };
+
+  struct VectorWriteOperation : WriteOperation {
+    iovec vectors[MAX_IO_BUFFERS];
+    int first = 0;
+    int count;
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        result = CANCELLED;
+        return true;
+      }
+
+      while (written < size) {
+        SSIZE_T bytes;
+        if (socket) {
+          msghdr message = {};
+          message.msg_iov = vectors + first;
+          message.msg_iovlen = count - first;
+          bytes = ::sendmsg(fd, &message, MSG_NOSIGNAL);
+        } else {
+          bytes = ::writev(fd, vectors + first, count - first);
+        }
+
+        if (bytes == -1) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+          }
+          result = -1;
+          return true;
+        }
+        written += static_cast<size_t>(bytes);
+        advance(static_cast<size_t>(bytes));
+      }
+
+      result = static_cast<SSIZE_T>(written);
+      return true;
+    }
+
+    void advance(size_t bytes)
+    {
+      while (first < count && bytes >= vectors[first].iov_len) {
+        bytes -= vectors[first].iov_len;
+        first++;
+      }
+      if (bytes > 0) {
+        vectors[first].iov_base = static_cast<char*>(vectors[first].iov_base) + bytes;
+        vectors[first].iov_len -= bytes;
+      }
+    }
+  };
+
+  template <typename Base>
+  struct WithCallback : Base {
+    Callback callback;
+
+    void deliver(SSIZE_T result) override
+    {
+      if (result == CANCELLED && this->timed_out) {
+        result = TIMED_OUT;
+      }
+      callback(result);
+    }
+  };
+
+  // The state of the future is part of the operation, so that a read or
+  // write that returns a future is still one allocation from the pool.
+  template <typename Base>
+  struct WithFuture : Base {
+    internal::EmbeddedState<SSIZE_T, WithFuture> state{this};
+
+    void deliver(SSIZE_T result) override
+    {
+      if (result == CANCELLED && this->timed_out) {
+        result = TIMED_OUT;
+      }
+      state.set(std::move(result));
+    }
+
+    void release() override
+    {
+      state.release();
+    }
+  };
+
+  struct SendfileOperation : CancellableOperation {
+    int file;
+    off_t offset;
+    size_t size;
+    size_t sent = 0;
+    SSIZE_T result;
+    internal::EmbeddedState<SSIZE_T, SendfileOperation> state{this};
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        result = CANCELLED;
+        return true;
+      }
+
+      while (sent < size) {
+        SSIZE_T bytes = ::sendfile(fd, file, &offset, size - sent);
+        if (bytes == -1) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+          }
+          result = -1;
+          return true;
+        }
+
+        // End of file before `size` bytes, report what we sent.
+        if (bytes == 0) {
+          break;
+        }
+        sent += static_cast<size_t>(bytes);
+      }
+
+      result = static_cast<SSIZE_T>(sent);
+      return true;
+    }
+
+    void complete() override
+    {
+      delist();
+      state.set(std::move(result));
+    }
+
+    void abort() override
+    {
+      delist();
+      state.set(cancelled ? CANCELLED : -1);
+    }
+
+    void release() override
+    {
+      state.release();
+    }
+  };
+
+  struct AcceptOperation : CancellableOperation {
+    SocketHandle* result = nullptr;
+    internal::EmbeddedState<SocketHandle*, AcceptOperation> state{this};
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        return true;
+      }
+
+      int s = ::accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (s == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return false;
+        }
+        return true;
+      }
+      result = new SocketHandle(s, loop::EventLoop::next());
+      return true;
+    }
+
+    void complete() override
+    {
+      delist();
+      state.set(std::move(result));
+    }
+
+    void abort() override
+    {
+      delist();
+      state.set(nullptr);
+    }
+
+    void release() override
+    {
+      state.release();
+    }
+  };
+
+  // Accepts, then reads from the new socket into a buffer of `pool`. The
+  // read is tried as soon as the accept completes, since a client that
+  // sends its request along with the connection has usually sent it by
+  // then; if it hasn't, the read waits on the socket like any other. The
+  // operation goes once both the loop and the read are done with it.
+  struct AcceptReadOperation : CancellableOperation {
+    BufferPool* pool;
+    AcceptReadCallback callback;
+    CancellationToken token;
+    int socket = -1;
+    std::atomic<int> references{2};
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        return true;
+      }
+
+      socket = ::accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      return !(socket == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+
+    void complete() override
+    {
+      delist();
+      if (socket == -1) {
+        callback(nullptr, cancelled ? CANCELLED : -1, Slice());
+        release();
+        return;
+      }
+
+      SocketHandle* accepted = new SocketHandle(socket, loop::EventLoop::next());
+      accepted->readAsync(
+        *pool,
+        [this, accepted](SSIZE_T result, Slice data) {
+          if (result < 0) {
+            accepted->close();
+            delete accepted;
+            callback(nullptr, result, Slice());
+          } else {
+            callback(accepted, result, std::move(data));
+          }
+          release();
+        },
+        token);
+    }
+
+    void abort() override
+    {
+      delist();
+      callback(nullptr, cancelled ? CANCELLED : -1, Slice());
+      release();
+    }
+
+    void release() override
+    {
+      if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+      }
+    }
+  };
+
+  namespace internal {
+    // Shared by an Acceptor and its pending accepts, each of which holds a
+    // reference. `pending` counts the accepts; it only drops to 0 once the
+    // acceptor has stopped, since an accept starts the next one before it
+    // is done.
+    struct AcceptorState {
+      loop::Descriptor* descriptor;
+      AcceptCallback callback;
+      CancellationToken token = CancellationToken::create();
+      std::atomic<size_t> pending{0};
+      std::atomic<bool> stopped{false};
+      std::atomic<int> references{1};
+
+      void acquire()
+      {
+        references.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release()
+      {
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete this;
+        }
+      }
+    };
+  }
+
+  struct AcceptorOperation;
+
+  static void accepted(AcceptorOperation* op);
+
+  // An accept of an Acceptor. Its result goes to `accepted`, which starts
+  // the next one.
+  struct AcceptorOperation : CancellableOperation {
+    internal::AcceptorState* acceptor;
+    int socket = -1;
+    int error = 0;
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        error = ECANCELED;
+        return true;
+      }
+
+      socket = ::accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (socket == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return false;
+        }
+        error = errno;
+      }
+      return true;
+    }
+
+    void complete() override
+    {
+      delist();
+      accepted(this);
+    }
+
+    void abort() override
+    {
+      delist();
+      accepted(this);
+    }
+  };
+
+  static void stop_acceptor(internal::AcceptorState* acceptor)
+  {
+    acceptor->stopped.store(true, std::memory_order_release);
+    acceptor->token.cancel();
+  }
+
+  // Called when an accept is done. The last one hands nullptr on.
+  static void done(internal::AcceptorState* acceptor)
+  {
+    if (acceptor->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      acceptor->callback(nullptr);
+    }
+    acceptor->release();
+  }
+
+  // Queues one more accept. It is never tried right away: the accept that
+  // starts it may have completed in a burst of ready connections, and
+  // trying it would nest the next completion inside this one.
+  static void post(internal::AcceptorState* acceptor)
+  {
+    AcceptorOperation* op = new AcceptorOperation();
+    op->descriptor = acceptor->descriptor;
+    op->acceptor = acceptor;
+    acceptor->acquire();
+    acceptor->pending.fetch_add(1, std::memory_order_relaxed);
+
+    if (!op->enlist(acceptor->token)) {
+      op->cancelled.store(true, std::memory_order_relaxed);
+      op->finish();
+      return;
+    }
+    loop::epoll::queue(op->descriptor, op, loop::Direction::READ);
+  }
+
+  // A connection reset before it was accepted. Anything else stops the
+  // acceptor rather than fail over and over (EMFILE, a closed listener).
+  static bool transient(int error)
+  {
+    return error == ECONNABORTED || error == EPROTO || error == EINTR;
+  }
+
+  static void accepted(AcceptorOperation* op)
+  {
+    internal::AcceptorState* acceptor = op->acceptor;
+    bool stopped = acceptor->stopped.load(std::memory_order_acquire);
+
+    if (op->socket != -1 && !stopped) {
+      post(acceptor);
+      acceptor->callback(new SocketHandle(op->socket, loop::EventLoop::next()));
+    } else {
+      if (op->socket != -1) {
+        ::close(op->socket);
+      }
+      if (!stopped && transient(op->error)) {
+        post(acceptor);
+      } else {
+        stop_acceptor(acceptor);
+      }
+    }
+
+    done(acceptor);
+  }
+
+  // Like ConnectEx, the result is 0 on success or the error code.
+  struct ConnectOperation : CancellableOperation {
+    sockaddr_storage addr;
+    socklen_t addr_size;
+    bool started = false;
+    DWORD errorCode = 0;
+    internal::EmbeddedState<DWORD, ConnectOperation> state{this};
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        errorCode = CANCELLED_ERROR;
+        return true;
+      }
+
+      if (!started) {
+        started = true;
+        if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), addr_size) == 0) {
+          return true;
+        }
+        if (errno == EINPROGRESS) {
+          return false;
+        }
+        errorCode = errno;
+        return true;
+      }
+
+      // The descriptor became writable, so the connect has finished.
+      int error = 0;
+      socklen_t length = sizeof(error);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0) {
+        error = errno;
+      }
+      errorCode = static_cast<DWORD>(error);
+      return true;
+    }
+
+    void complete() override
+    {
+      delist();
+      state.set(std::move(errorCode));
+    }
+
+    void abort() override
+    {
+      delist();
+      state.set(cancelled ? CANCELLED_ERROR : ~0);
+    }
+
+    void release() override
+    {
+      state.release();
+    }
+  };
+
+  // Connects with TCP Fast Open: a sendto with MSG_FASTOPEN puts the data
+  // in the SYN if the kernel has a cookie for the server, and otherwise
+  // only starts the connect (EINPROGRESS). Sends of the rest follow, at
+  // least one even if nothing is left, since a send waits for the
+  // handshake and fails if the connect does, which makes the operation
+  // complete once the connection is up. Sockets that can't do Fast Open
+  // (EOPNOTSUPP) get a plain connect first.
+  struct FastOpenOperation : ConnectOperation {
+    const char* data;
+    size_t size;
+    size_t sent = 0;
+
+    bool perform(int fd) override
+    {
+      if (cancelled.load(std::memory_order_acquire)) {
+        errorCode = CANCELLED_ERROR;
+        return true;
+      }
+
+      if (!started) {
+        started = true;
+        SSIZE_T bytes = ::sendto(
+          fd,
+          data,
+          size,
+          MSG_FASTOPEN | MSG_NOSIGNAL,
+          reinterpret_cast<sockaddr*>(&addr),
+          addr_size);
+
+        if (bytes >= 0) {
+          sent = static_cast<size_t>(bytes);
+        } else if (errno == EOPNOTSUPP) {
+          if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), addr_size) != 0 &&
+              errno != EINPROGRESS) {
+            errorCode = errno;
+            return true;
+          }
+        } else if (errno != EINPROGRESS) {
+          errorCode = errno;
+          return true;
+        }
+      }
+
+      do {
+        SSIZE_T bytes = ::send(fd, data + sent, size - sent, MSG_NOSIGNAL);
+        if (bytes == -1) {
+          if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return false;
+          }
+          errorCode = errno;
+          return true;
+        }
+        sent += static_cast<size_t>(bytes);
+      } while (sent < size);
+      return true;
+    }
+  };
+
+  // Enlists `op` with `token` and queues it on its descriptor. If the
+  // token is cancelled already the operation is aborted right away.
+  static void submit(
+    CancellableOperation* op,
+    const CancellationToken& token,
+    loop::Direction direction)
+  {
+    if (!op->enlist(token)) {
+      op->cancelled.store(true, std::memory_order_relaxed);
+      op->finish();
+      return;
+    }
+    loop::epoll::submit(op->descriptor, op, direction);
+  }
+
+  static void read(
+    ReadOperation* op,
+    loop::Descriptor* descriptor,
+    void* data,
+    size_t size,
+    const CancellationToken& token)
+  {
+    op->descriptor = descriptor;
+    op->data = data;
+    op->size = size;
+    submit(op, token, loop::Direction::READ);
+  }
+
+  static void write(
+    WriteOperation* op,
+    loop::Descriptor* descriptor,
+    const void* data,
+    size_t size,
+    bool socket,
+    const CancellationToken& token)
+  {
+    op->descriptor = descriptor;
+    op->data = static_cast<const char*>(data);
+    op->size = size;
+    op->socket = socket;
+    submit(op, token, loop::Direction::WRITE);
+  }
+
+  static void scatter(
+    VectorReadOperation* op,
+    loop::Descriptor* descriptor,
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token)
+  {
+    op->descriptor = descriptor;
+    op->size = vectorize(op->vectors, buffers, count);
+    op->count = static_cast<int>(count);
+    submit(op, token, loop::Direction::READ);
+  }
+
+  static void gather(
+    VectorWriteOperation* op,
+    loop::Descriptor* descriptor,
+    const IoBuffer* buffers,
+    size_t count,
+    bool socket,
+    const CancellationToken& token)
+  {
+    op->descriptor = descriptor;
+    op->size = vectorize(op->vectors, buffers, count);
+    op->count = static_cast<int>(count);
+    op->socket = socket;
+    submit(op, token, loop::Direction::WRITE);
+  }
+
+
+  template <typename T>
+  static Future<T> ready(T value)
+  {
+    Promise<T> promise;
+    Future<T> future = promise.get_future();
+    promise.set_value(value);
+    return future;
+  }
+
+
+  FileHandle::FileHandle(HANDLE h) : m_handle(h) {}
+
+  Future<SSIZE_T> FileHandle::readAsync(
+    void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    // Regular files are always "ready" as far as epoll is concerned, so
+    // like the Windows implementation this is a blocking call, and there
+    // is nothing to cancel once it started.
+    if (token.cancelled()) {
+      return ready<SSIZE_T>(CANCELLED);
+    }
+    return ready<SSIZE_T>(::read(m_handle, data, size));
+  }
+
+  Future<SSIZE_T> FileHandle::writeAsync(
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (token.cancelled()) {
+      return ready<SSIZE_T>(CANCELLED);
+    }
+    return ready<SSIZE_T>(::write(m_handle, data, size));
+  }
+
+  void FileHandle::close() const
+  {
+    ::close(m_handle);
+  }
+
+
+  SocketHandle::SocketHandle(SOCKET s)
+    : SocketHandle(s, loop::EventLoop::current()) {}
+
+  SocketHandle::SocketHandle(SOCKET s, size_t loop) : m_socket(s)
+  {
+    m_descriptor = loop::epoll::attach(m_socket, loop);
+  }
+
+  Future<SSIZE_T> SocketHandle::readAsync(
+    void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<ReadOperation>* op = new WithFuture<ReadOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    read(op, m_descriptor, data, size, token);
+    return future;
+  }
+
+  void SocketHandle::readAsync(
+    void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<ReadOperation>* op = new WithCallback<ReadOperation>();
+    op->callback = std::move(callback);
+    read(op, m_descriptor, data, size, token);
+  }
+
+  Future<SSIZE_T> SocketHandle::writeAsync(
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<WriteOperation>* op = new WithFuture<WriteOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    write(op, m_descriptor, data, size, true, token);
+    return future;
+  }
+
+  void SocketHandle::writeAsync(
+    const void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<WriteOperation>* op = new WithCallback<WriteOperation>();
+    op->callback = std::move(callback);
+    write(op, m_descriptor, data, size, true, token);
+  }
+
+  void SocketHandle::readAsync(
+    BufferPool& pool,
+    SliceCallback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1, Slice());
+      return;
+    }
+
+    BufferReadOperation* op = new BufferReadOperation();
+    op->descriptor = m_descriptor;
+    op->pool = &pool;
+    op->callback = std::move(callback);
+
+    submit(op, token, loop::Direction::READ);
+  }
+
+  void SocketHandle::writeAsync(
+    Slice slice,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<WriteOperation>* op = new WithCallback<WriteOperation>();
+    op->callback = std::move(callback);
+    op->slice = std::move(slice);
+    write(op, m_descriptor, op->slice.data(), op->slice.size(), true, token);
+  }
+
+  Future<SSIZE_T> SocketHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<VectorReadOperation>* op = new WithFuture<VectorReadOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    scatter(op, m_descriptor, buffers, count, token);
+    return future;
+  }
+
+  void SocketHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<VectorReadOperation>* op = new WithCallback<VectorReadOperation>();
+    op->callback = std::move(callback);
+    scatter(op, m_descriptor, buffers, count, token);
+  }
+
+  Future<SSIZE_T> SocketHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<VectorWriteOperation>* op = new WithFuture<VectorWriteOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    gather(op, m_descriptor, buffers, count, true, token);
+    return future;
+  }
+
+  void SocketHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<VectorWriteOperation>* op = new WithCallback<VectorWriteOperation>();
+    op->callback = std::move(callback);
+    gather(op, m_descriptor, buffers, count, true, token);
+  }
+
+  Future<SSIZE_T> SocketHandle::sendfile(
+    io::Handle* fd,
+    off_t offset,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || offset < 0) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    SendfileOperation* op = new SendfileOperation();
+    op->descriptor = m_descriptor;
+    op->file = fd->get();
+    op->offset = offset;
+    op->size = size;
+    Future<SSIZE_T> future = op->state.get_future();
+
+    submit(op, token, loop::Direction::WRITE);
+    return future;
+  }
+
+  Future<SocketHandle*> SocketHandle::accept(const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      return ready<SocketHandle*>(nullptr);
+    }
+
+    AcceptOperation* op = new AcceptOperation();
+    op->descriptor = m_descriptor;
+    Future<SocketHandle*> future = op->state.get_future();
+
+    submit(op, token, loop::Direction::READ);
+    return future;
+  }
+
+  void SocketHandle::accept(
+    BufferPool& pool,
+    AcceptReadCallback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(nullptr, -1, Slice());
+      return;
+    }
+
+    AcceptReadOperation* op = new AcceptReadOperation();
+    op->descriptor = m_descriptor;
+    op->pool = &pool;
+    op->callback = std::move(callback);
+    op->token = token;
+
+    submit(op, token, loop::Direction::READ);
+  }
+
+  Future<DWORD> SocketHandle::connect(
+    const sockaddr* addr,
+    size_t addr_size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr ||
+        m_socket == INVALID_SOCKET ||
+        addr_size > sizeof(sockaddr_storage)) {
+      return ready<DWORD>(~0);
+    }
+
+    ConnectOperation* op = new ConnectOperation();
+    op->descriptor = m_descriptor;
+    memcpy(&op->addr, addr, addr_size);
+    op->addr_size = static_cast<socklen_t>(addr_size);
+    Future<DWORD> future = op->state.get_future();
+
+    // Unlike ConnectEx there is no need to bind first.
+    submit(op, token, loop::Direction::WRITE);
+    return future;
+  }
+
+  Future<DWORD> SocketHandle::connect(
+    const sockaddr* addr,
+    size_t addr_size,
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr ||
+        m_socket == INVALID_SOCKET ||
+        addr_size > sizeof(sockaddr_storage)) {
+      return ready<DWORD>(~0);
+    }
+
+    FastOpenOperation* op = new FastOpenOperation();
+    op->descriptor = m_descriptor;
+    memcpy(&op->addr, addr, addr_size);
+    op->addr_size = static_cast<socklen_t>(addr_size);
+    op->data = static_cast<const char*>(data);
+    op->size = size;
+    Future<DWORD> future = op->state.get_future();
+
+    submit(op, token, loop::Direction::WRITE);
+    return future;
+  }
+
+  int SocketHandle::listen(int connections) const
+  {
+    if (::listen(m_socket, connections) != 0) {
+      return errno;
+    }
+    return 0;
+  }
+
+  void SocketHandle::close() const
+  {
+    if (m_descriptor != nullptr) {
+      loop::epoll::detach(m_descriptor);
+    }
+    ::close(m_socket);
+  }
+
+
+  Acceptor::Acceptor(const SocketHandle& listener, size_t depth, AcceptCallback callback)
+    : m_state(new internal::AcceptorState())
+  {
+    m_state->descriptor = listener.m_descriptor;
+    m_state->callback = std::move(callback);
+
+    // Counts as an accept until all of them are started, so that the
+    // callback can't get nullptr in between.
+    m_state->acquire();
+    m_state->pending.store(1, std::memory_order_relaxed);
+
+    if (m_state->descriptor == nullptr || depth == 0) {
+      stop_acceptor(m_state);
+    }
+    for (size_t i = 0; i < depth && !m_state->stopped.load(std::memory_order_acquire); i++) {
+      post(m_state);
+    }
+    done(m_state);
+  }
+
+  Acceptor::~Acceptor()
+  {
+    stop_acceptor(m_state);
+    m_state->release();
+  }
+
+  void Acceptor::stop()
+  {
+    stop_acceptor(m_state);
+  }
+
+  void Acceptor::recycle(SocketHandle* socket)
+  {
+    socket->close();
+    delete socket;
+  }
+
+
+  PipeHandle::PipeHandle(HANDLE h)
+    : PipeHandle(h, loop::EventLoop::current()) {}
+
+  PipeHandle::PipeHandle(HANDLE h, size_t loop) : m_handle(h)
+  {
+    m_descriptor = loop::epoll::attach(m_handle, loop);
+  }
+
+  Future<SSIZE_T> PipeHandle::readAsync(
+    void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<ReadOperation>* op = new WithFuture<ReadOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    read(op, m_descriptor, data, size, token);
+    return future;
+  }
+
+  void PipeHandle::readAsync(
+    void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<ReadOperation>* op = new WithCallback<ReadOperation>();
+    op->callback = std::move(callback);
+    read(op, m_descriptor, data, size, token);
+  }
+
+  Future<SSIZE_T> PipeHandle::writeAsync(
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<WriteOperation>* op = new WithFuture<WriteOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    write(op, m_descriptor, data, size, false, token);
+    return future;
+  }
+
+  void PipeHandle::writeAsync(
+    const void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<WriteOperation>* op = new WithCallback<WriteOperation>();
+    op->callback = std::move(callback);
+    write(op, m_descriptor, data, size, false, token);
+  }
+
+  Future<SSIZE_T> PipeHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<VectorReadOperation>* op = new WithFuture<VectorReadOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    scatter(op, m_descriptor, buffers, count, token);
+    return future;
+  }
+
+  void PipeHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<VectorReadOperation>* op = new WithCallback<VectorReadOperation>();
+    op->callback = std::move(callback);
+    scatter(op, m_descriptor, buffers, count, token);
+  }
+
+  Future<SSIZE_T> PipeHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<VectorWriteOperation>* op = new WithFuture<VectorWriteOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    gather(op, m_descriptor, buffers, count, false, token);
+    return future;
+  }
+
+  void PipeHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<VectorWriteOperation>* op = new WithCallback<VectorWriteOperation>();
+    op->callback = std::move(callback);
+    gather(op, m_descriptor, buffers, count, false, token);
+  }
+
+  void PipeHandle::close() const
+  {
+    if (m_descriptor != nullptr) {
+      loop::epoll::detach(m_descriptor);
+    }
+    ::close(m_handle);
+  }
+
+
+  template <typename T, typename H>
+  static Handle* make(internal::HandleStorage* storage, H h)
+  {
+    if (storage == nullptr) {
+      return new T(h);
+    }
+    return new (storage) T(h);
+  }
+
+  Handle* createAsyncHandle(io::Handle* fd)
+  {
+    return createAsyncHandle(fd, nullptr);
+  }
+
+  Handle* createAsyncHandle(io::Handle* fd, internal::HandleStorage* storage)
+  {
+    int dup = fd->dup();
+    if (dup == -1) {
+      return nullptr;
+    }
+
+    struct stat s;
+    if (fstat(dup, &s) != 0) {
+      ::close(dup);
+      return nullptr;
+    }
+
+    if (S_ISSOCK(s.st_mode)) {
+      return make<SocketHandle>(storage, dup);
+    } else if (S_ISFIFO(s.st_mode) || S_ISCHR(s.st_mode)) {
+      return make<PipeHandle>(storage, dup);
+    }
+    return make<FileHandle>(storage, dup);
+  }
+
+  Future<SSIZE_T> readAsync(
+    Handle* fd,
+    void* data,
+    size_t size,
+    const CancellationToken& token)
+  {
+    return fd->readAsync(data, size, token);
+  }
+
+  Future<SSIZE_T> writeAsync(
+    Handle* fd,
+    const void* data,
+    size_t size,
+    const CancellationToken& token)
+  {
+    return fd->writeAsync(data, size, token);
+  }
+
+  void close(Handle* fd)
+  {
+    fd->close();
+  }
+}
+#endif // __linux__ && !USE_IO_URING
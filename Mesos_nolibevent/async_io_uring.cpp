@@ -0,0 +1,1357 @@
+#include "stdafx.h"
+#include "io.hpp"
+#include "async_io.hpp"
+#include "eventloop.hpp"
+#include "eventloop_uring.hpp"
+#include "pool.hpp"
+
+#if defined(__linux__) && defined(USE_IO_URING)
+namespace async {
+  // Each operation maps onto one submission entry, the same way each one
+  // maps onto one WSARecv/WSASend/AcceptEx/ConnectEx/TransmitFile call in
+  // the Windows implementation. The structs play the role of the
+  // WSAOverlapped_* structs: they carry the callback or the state of the
+  // future, and are passed back to us in `user_data` when the operation
+  // completes.
+
+  static io_uring_sqe prepare(
+    uint8_t opcode,
+    int fd,
+    const void* addr,
+    unsigned len,
+    uint64_t off,
+    loop::Completion* completion)
+  {
+    io_uring_sqe sqe = {};
+    sqe.opcode = opcode;
+    sqe.fd = fd;
+    sqe.addr = reinterpret_cast<uint64_t>(addr);
+    sqe.len = len;
+    sqe.off = off;
+    sqe.user_data = reinterpret_cast<uint64_t>(completion);
+    return sqe;
+  }
+
+  // A token cancels an operation with an IORING_OP_ASYNC_CANCEL for its
+  // entry, which then completes with an error and finds `cancelled` set.
+  // Operations that take more than one entry only submit the next one if
+  // the token hasn't been cancelled since.
+  struct Operation :
+    loop::Completion,
+    internal::Cancellable,
+    internal::PooledOperation {
+    size_t loop;
+
+    bool cancel() override
+    {
+      loop::uring::cancel(loop, this);
+      return false;
+    }
+
+    // Called once the operation has completed. An operation that holds
+    // the state of its future stays around until the future lets go of it
+    // as well.
+    virtual void release()
+    {
+      delete this;
+    }
+
+    SSIZE_T failure() const
+    {
+      return cancelled ? CANCELLED : -1;
+    }
+  };
+
+  // Reads and writes hand their result to `deliver`, which passes it to a
+  // callback or a future (see WithCallback and WithFuture below).
+  struct ReadOperation : Operation {
+    virtual void deliver(SSIZE_T result) = 0;
+
+    void complete(int result) override
+    {
+      delist();
+      deliver(result < 0 ? failure() : result);
+      release();
+    }
+  };
+
+  // Reads into a buffer of a pool, which is held from the start. When the
+  // pool's memory is registered with the ring the read uses it as a fixed
+  // buffer.
+  struct BufferReadOperation : Operation {
+    Slice slice;
+    SliceCallback callback;
+
+    void complete(int result) override
+    {
+      delist();
+
+      // The callback gets the only reference to the buffer.
+      Slice data = result > 0 ? slice.slice(0, static_cast<size_t>(result)) : Slice();
+      slice = Slice();
+      callback(result < 0 ? failure() : result, std::move(data));
+      release();
+    }
+  };
+
+  // Writes complete once the whole buffer has been handed to the kernel,
+  // which is what WSASend and WriteFile do for overlapped handles. Short
+  // writes are resubmitted for the remainder.
+  struct WriteOperation : Operation {
+    int fd;
+    const char* data;
+    size_t size;
+    size_t written = 0;
+    bool socket;
+
+    // Keeps the data of a slice write alive. Writes from a registered
+    // buffer use it as a fixed buffer.
+    Slice slice;
+
+    virtual void deliver(SSIZE_T result) = 0;
+
+    void start()
+    {
+      io_uring_sqe sqe;
+      if (slice.region() >= 0) {
+        sqe = prepare(
+          IORING_OP_WRITE_FIXED,
+          fd,
+          data + written,
+          static_cast<unsigned>(size - written),
+          static_cast<uint64_t>(-1),
+          this);
+        sqe.buf_index = static_cast<uint16_t>(slice.region());
+      } else {
+        sqe = prepare(
+          socket ? IORING_OP_SEND : IORING_OP_WRITE,
+          fd,
+          data + written,
+          static_cast<unsigned>(size - written),
+          socket ? 0 : static_cast<uint64_t>(-1),
+          this);
+
+        if (socket) {
+          sqe.msg_flags = MSG_NOSIGNAL;
+        }
+      }
+
+      loop::uring::submit(loop, &sqe, 1);
+    }
+
+    void complete(int result) override
+    {
+      SSIZE_T status;
+      if (result < 0) {
+        status = failure();
+      } else {
+        written += static_cast<size_t>(result);
+        if (result > 0 && written < size) {
+          if (resume([this]() { start(); })) {
+            return;
+          }
+          status = CANCELLED;
+        } else {
+          status = static_cast<SSIZE_T>(written);
+        }
+      }
+
+      delist();
+      deliver(status);
+      release();
+    }
+  };
+
+  // Copies the buffers of a scatter/gather operation into `vectors`, and
+  // returns their total size.
+  static size_t vectorize(iovec* vectors, const IoBuffer* buffers, size_t count)
+  {
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+      vectors[i].iov_base = buffers[i].data;
+      vectors[i].iov_len = buffers[i].size;
+      size += buffers[i].size;
+    }
+    return size;
+  }
+
+  // Scatter/gather reads and writes keep a copy of the buffers, and the
+  // message that points at them for sockets, for as long as the kernel
+  // may look at them.
+  struct VectorReadOperation : ReadOperation {
+    iovec vectors[MAX_IO_BUFFERS];
+    msghdr message;
+  };
+
+  // Like WriteOperation, with a short write resubmitted for the buffers,
+  // or the part of one, that are left.
+  struct VectorWriteOperation : Operation {
+    int fd;
+    iovec vectors[MAX_IO_BUFFERS];
+    int first = 0;
+    int count;
+    msghdr message;
+    size_t size;
+    size_t written = 0;
+    bool socket;
+
+    virtual void deliver(SSIZE_T result) = 0;
+
+    void start()
+    {
+      io_uring_sqe sqe;
+      if (socket) {
+        message = {};
+        message.msg_iov = vectors + first;
+        message.msg_iovlen = count - first;
+        sqe = prepare(IORING_OP_SENDMSG, fd, &message, 1, 0, this);
+        sqe.msg_flags = MSG_NOSIGNAL;
+      } else {
+        sqe = prepare(
+          IORING_OP_WRITEV,
+          fd,
+          vectors + first,
+          static_cast<unsigned>(count - first),
+          static_cast<uint64_t>(-1),
+          this);
+      }
+
+      loop::uring::submit(loop, &sqe, 1);
+    }
+
+    void advance(size_t bytes)
+    {
+      while (first < count && bytes >= vectors[first].iov_len) {
+        bytes -= vectors[first].iov_len;
+        first++;
+      }
+      if (bytes > 0) {
+        vectors[first].iov_base = static_cast<char*>(vectors[first].iov_base) + bytes;
+        vectors[first].iov_len -= bytes;
+      }
+    }
+
+    void complete(int result) override
+    {
+      SSIZE_T status;
+      if (result < 0) {
+        status = failure();
+      } else {
+        written += static_cast<size_t>(result);
+        advance(static_cast<size_t>(result));
+        if (result > 0 && written < size) {
+          if (resume([this]() { start(); })) {
+            return;
+          }
+          status = CANCELLED;
+        } else {
+          status = static_cast<SSIZE_T>(written);
+        }
+      }
+
+      delist();
+      deliver(status);
+      release();
+    }
+  };
+
+  template <typename Base>
+  struct WithCallback : Base {
+    Callback callback;
+
+    void deliver(SSIZE_T result) override
+    {
+      if (result == CANCELLED && this->timed_out) {
+        result = TIMED_OUT;
+      }
+      callback(result);
+    }
+  };
+
+  // The state of the future is part of the operation, so that a read or
+  // write that returns a future is still one allocation from the pool.
+  template <typename Base>
+  struct WithFuture : Base {
+    internal::EmbeddedState<SSIZE_T, WithFuture> state{this};
+
+    void deliver(SSIZE_T result) override
+    {
+      if (result == CANCELLED && this->timed_out) {
+        result = TIMED_OUT;
+      }
+      state.set(std::move(result));
+    }
+
+    void release() override
+    {
+      state.release();
+    }
+  };
+
+  // There is no sendfile opcode, so the file is spliced into a pipe and
+  // the pipe into the socket, one pipe buffer at a time.
+  struct SendfileOperation : Operation {
+    int socket;
+    int file;
+    off_t offset;
+    size_t size;
+    size_t sent = 0;
+    int pipe[2];
+    size_t buffered = 0;
+    internal::EmbeddedState<SSIZE_T, SendfileOperation> state{this};
+
+    static constexpr size_t CHUNK = 64 * 1024;
+
+    void splice(int in, uint64_t in_offset, int out, size_t length)
+    {
+      io_uring_sqe sqe = prepare(
+        IORING_OP_SPLICE,
+        out,
+        nullptr,
+        static_cast<unsigned>(length),
+        static_cast<uint64_t>(-1),
+        this);
+      sqe.splice_fd_in = in;
+      sqe.splice_off_in = in_offset;
+      sqe.splice_flags = SPLICE_F_MOVE;
+
+      loop::uring::submit(loop, &sqe, 1);
+    }
+
+    void start()
+    {
+      if (sent == size) {
+        done(static_cast<SSIZE_T>(sent));
+        return;
+      }
+      splice(file, static_cast<uint64_t>(offset), pipe[1], std::min(size - sent, CHUNK));
+    }
+
+    void done(SSIZE_T result)
+    {
+      delist();
+      ::close(pipe[0]);
+      ::close(pipe[1]);
+      state.set(std::move(result));
+      release();
+    }
+
+    void release() override
+    {
+      state.release();
+    }
+
+    void complete(int result) override
+    {
+      if (result < 0) {
+        done(failure());
+        return;
+      }
+
+      if (buffered == 0) {
+        // File -> pipe finished. Zero means we hit the end of the file.
+        if (result == 0) {
+          done(static_cast<SSIZE_T>(sent));
+          return;
+        }
+        offset += result;
+        buffered = static_cast<size_t>(result);
+      } else {
+        // Pipe -> socket finished.
+        if (result == 0) {
+          done(-1);
+          return;
+        }
+        buffered -= static_cast<size_t>(result);
+        sent += static_cast<size_t>(result);
+        if (buffered == 0) {
+          if (!resume([this]() { start(); })) {
+            done(CANCELLED);
+          }
+          return;
+        }
+      }
+
+      if (!resume([this]() { splice(pipe[0], static_cast<uint64_t>(-1), socket, buffered); })) {
+        done(CANCELLED);
+      }
+    }
+  };
+
+  struct AcceptOperation : Operation {
+    internal::EmbeddedState<SocketHandle*, AcceptOperation> state{this};
+
+    void complete(int result) override
+    {
+      delist();
+      state.set(result < 0 ? nullptr : new SocketHandle(result, loop::EventLoop::next()));
+      release();
+    }
+
+    void release() override
+    {
+      state.release();
+    }
+  };
+
+  // Accepts, then reads from the new socket into a buffer of `pool`. The
+  // read is a second entry, on the socket's own loop, which the kernel
+  // tries right away, so a request sent along with the connection needs
+  // no wait for the socket to become readable. The operation goes once
+  // the read is done with it.
+  struct AcceptReadOperation : Operation {
+    BufferPool* pool;
+    AcceptReadCallback callback;
+    CancellationToken token;
+
+    void complete(int result) override
+    {
+      delist();
+      if (result < 0) {
+        callback(nullptr, failure(), Slice());
+        release();
+        return;
+      }
+
+      SocketHandle* accepted = new SocketHandle(result, loop::EventLoop::next());
+      accepted->readAsync(
+        *pool,
+        [this, accepted](SSIZE_T result, Slice data) {
+          if (result < 0) {
+            accepted->close();
+            delete accepted;
+            callback(nullptr, result, Slice());
+          } else {
+            callback(accepted, result, std::move(data));
+          }
+          release();
+        },
+        token);
+    }
+  };
+
+  namespace internal {
+    // Shared by an Acceptor and its pending accepts, each of which holds a
+    // reference. `pending` counts the accepts; it only drops to 0 once the
+    // acceptor has stopped, since an accept starts the next one before it
+    // is done. The state holds a reference to the listener's descriptor,
+    // which outlives the listener if it is closed first.
+    struct AcceptorState {
+      loop::Descriptor* descriptor = nullptr;
+      AcceptCallback callback;
+      CancellationToken token = CancellationToken::create();
+      std::atomic<size_t> pending{0};
+      std::atomic<bool> stopped{false};
+      std::atomic<int> references{1};
+
+      void acquire()
+      {
+        references.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release()
+      {
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete this;
+        }
+      }
+
+      ~AcceptorState()
+      {
+        if (descriptor != nullptr) {
+          loop::uring::release(descriptor);
+        }
+      }
+    };
+  }
+
+  struct AcceptorOperation;
+
+  static void accepted(AcceptorOperation* op, int result);
+
+  // An accept of an Acceptor. Its result goes to `accepted`, which starts
+  // the next one.
+  struct AcceptorOperation : Operation {
+    internal::AcceptorState* acceptor;
+
+    void complete(int result) override
+    {
+      delist();
+      accepted(this, result);
+      release();
+    }
+  };
+
+  // Like ConnectEx, the result is 0 on success or the error code.
+  struct ConnectOperation : Operation {
+    sockaddr_storage addr;
+    internal::EmbeddedState<DWORD, ConnectOperation> state{this};
+
+    void complete(int result) override
+    {
+      delist();
+      if (result < 0 && cancelled) {
+        result = -CANCELLED_ERROR;
+      }
+      state.set(static_cast<DWORD>(-result));
+      release();
+    }
+
+    void release() override
+    {
+      state.release();
+    }
+  };
+
+  // Connects with TCP Fast Open: a sendmsg with MSG_FASTOPEN puts the data
+  // in the SYN if the kernel has a cookie for the server, and otherwise
+  // only starts the connect (-EINPROGRESS). Sends of the rest follow, at
+  // least one even if nothing is left, since a send waits for the
+  // handshake and fails if the connect does, which makes the operation
+  // complete once the connection is up. Sockets that can't do Fast Open
+  // (-EOPNOTSUPP) get an IORING_OP_CONNECT first.
+  struct FastOpenOperation : Operation {
+    enum class Stage { OPEN, CONNECT, SEND };
+
+    int fd;
+    sockaddr_storage addr;
+    socklen_t addr_size;
+    msghdr message;
+    iovec vector;
+    const char* data;
+    size_t size;
+    size_t sent = 0;
+    Stage stage = Stage::OPEN;
+    internal::EmbeddedState<DWORD, FastOpenOperation> state{this};
+
+    void start()
+    {
+      io_uring_sqe sqe;
+      if (stage == Stage::OPEN) {
+        vector.iov_base = const_cast<char*>(data);
+        vector.iov_len = size;
+        message = {};
+        message.msg_name = &addr;
+        message.msg_namelen = addr_size;
+        message.msg_iov = &vector;
+        message.msg_iovlen = 1;
+        sqe = prepare(IORING_OP_SENDMSG, fd, &message, 1, 0, this);
+        sqe.msg_flags = MSG_FASTOPEN | MSG_NOSIGNAL;
+      } else if (stage == Stage::CONNECT) {
+        sqe = prepare(IORING_OP_CONNECT, fd, &addr, 0, addr_size, this);
+      } else {
+        sqe = prepare(
+          IORING_OP_SEND,
+          fd,
+          data + sent,
+          static_cast<unsigned>(size - sent),
+          0,
+          this);
+        sqe.msg_flags = MSG_NOSIGNAL;
+      }
+      loop::uring::submit(loop, &sqe, 1);
+    }
+
+    void complete(int result) override
+    {
+      if (stage == Stage::OPEN && result == -EOPNOTSUPP) {
+        next(Stage::CONNECT);
+        return;
+      }
+
+      if (result < 0 && !(stage == Stage::OPEN && result == -EINPROGRESS)) {
+        finish(cancelled ? CANCELLED_ERROR : static_cast<DWORD>(-result));
+        return;
+      }
+
+      if (stage == Stage::OPEN || stage == Stage::SEND) {
+        sent += static_cast<size_t>(std::max(result, 0));
+      }
+      if (stage != Stage::SEND || (result > 0 && sent < size)) {
+        next(Stage::SEND);
+        return;
+      }
+      finish(0);
+    }
+
+    void next(Stage stage)
+    {
+      this->stage = stage;
+      if (!resume([this]() { start(); })) {
+        finish(CANCELLED_ERROR);
+      }
+    }
+
+    void finish(DWORD error)
+    {
+      delist();
+      state.set(std::move(error));
+      release();
+    }
+
+    void release() override
+    {
+      state.release();
+    }
+  };
+
+  // Enlists `op` with `token` and runs `submit`, which hands it to the
+  // ring. If the token is cancelled already the operation completes right
+  // away, as cancelled.
+  template <typename F>
+  static void start(Operation* op, const CancellationToken& token, F submit)
+  {
+    if (!op->enlist(token, [&]() { submit(); return true; })) {
+      op->cancelled.store(true, std::memory_order_relaxed);
+      op->complete(-ECANCELED);
+    }
+  }
+
+
+  static void stop_acceptor(internal::AcceptorState* acceptor)
+  {
+    acceptor->stopped.store(true, std::memory_order_release);
+    acceptor->token.cancel();
+  }
+
+  // Called when an accept is done. The last one hands nullptr on.
+  static void done(internal::AcceptorState* acceptor)
+  {
+    if (acceptor->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      acceptor->callback(nullptr);
+    }
+    acceptor->release();
+  }
+
+  static void post(internal::AcceptorState* acceptor)
+  {
+    AcceptorOperation* op = new AcceptorOperation();
+    op->loop = acceptor->descriptor->loop;
+    op->acceptor = acceptor;
+    acceptor->acquire();
+    acceptor->pending.fetch_add(1, std::memory_order_relaxed);
+
+    io_uring_sqe sqe = prepare(IORING_OP_ACCEPT, acceptor->descriptor->fd, nullptr, 0, 0, op);
+    sqe.accept_flags = SOCK_CLOEXEC;
+
+    // Once the listener is closed its fd may already belong to something
+    // else, so the accept fails rather than be submitted.
+    bool submitted = true;
+    start(op, acceptor->token, [&]() { submitted = loop::uring::submit(acceptor->descriptor, &sqe, 1); });
+    if (!submitted) {
+      op->complete(-EBADF);
+    }
+  }
+
+  // A connection reset before it was accepted. Anything else stops the
+  // acceptor rather than fail over and over (EMFILE, a closed listener).
+  static bool transient(int error)
+  {
+    return error == ECONNABORTED || error == EPROTO || error == EINTR;
+  }
+
+  static void accepted(AcceptorOperation* op, int result)
+  {
+    internal::AcceptorState* acceptor = op->acceptor;
+    bool stopped = acceptor->stopped.load(std::memory_order_acquire);
+
+    if (result >= 0 && !stopped) {
+      post(acceptor);
+      acceptor->callback(new SocketHandle(result, loop::EventLoop::next()));
+    } else {
+      if (result >= 0) {
+        ::close(result);
+      }
+      if (!stopped && !op->cancelled && transient(-result)) {
+        post(acceptor);
+      } else {
+        stop_acceptor(acceptor);
+      }
+    }
+
+    done(acceptor);
+  }
+
+
+  template <typename T>
+  static Future<T> ready(T value)
+  {
+    Promise<T> promise;
+    Future<T> future = promise.get_future();
+    promise.set_value(value);
+    return future;
+  }
+
+  static void read(
+    ReadOperation* op,
+    loop::Descriptor* descriptor,
+    void* data,
+    size_t size,
+    bool socket,
+    const CancellationToken& token)
+  {
+    op->loop = descriptor->loop;
+
+    // Pipes have no position, -1 means "the current one".
+    io_uring_sqe sqe = prepare(
+      socket ? IORING_OP_RECV : IORING_OP_READ,
+      descriptor->fd,
+      data,
+      static_cast<unsigned>(size),
+      socket ? 0 : static_cast<uint64_t>(-1),
+      op);
+    start(op, token, [&]() { loop::uring::submit(op->loop, &sqe, 1); });
+  }
+
+  static void write(
+    WriteOperation* op,
+    loop::Descriptor* descriptor,
+    const void* data,
+    size_t size,
+    bool socket,
+    const CancellationToken& token)
+  {
+    op->loop = descriptor->loop;
+    op->fd = descriptor->fd;
+    op->data = static_cast<const char*>(data);
+    op->size = size;
+    op->socket = socket;
+    start(op, token, [op]() { op->start(); });
+  }
+
+  static void scatter(
+    VectorReadOperation* op,
+    loop::Descriptor* descriptor,
+    const IoBuffer* buffers,
+    size_t count,
+    bool socket,
+    const CancellationToken& token)
+  {
+    op->loop = descriptor->loop;
+    vectorize(op->vectors, buffers, count);
+
+    io_uring_sqe sqe;
+    if (socket) {
+      op->message = {};
+      op->message.msg_iov = op->vectors;
+      op->message.msg_iovlen = count;
+      sqe = prepare(IORING_OP_RECVMSG, descriptor->fd, &op->message, 1, 0, op);
+    } else {
+      sqe = prepare(
+        IORING_OP_READV,
+        descriptor->fd,
+        op->vectors,
+        static_cast<unsigned>(count),
+        static_cast<uint64_t>(-1),
+        op);
+    }
+    start(op, token, [&]() { loop::uring::submit(op->loop, &sqe, 1); });
+  }
+
+  static void gather(
+    VectorWriteOperation* op,
+    loop::Descriptor* descriptor,
+    const IoBuffer* buffers,
+    size_t count,
+    bool socket,
+    const CancellationToken& token)
+  {
+    op->loop = descriptor->loop;
+    op->fd = descriptor->fd;
+    op->size = vectorize(op->vectors, buffers, count);
+    op->count = static_cast<int>(count);
+    op->socket = socket;
+    start(op, token, [op]() { op->start(); });
+  }
+
+
+  FileHandle::FileHandle(HANDLE h) : m_handle(h) {}
+
+  Future<SSIZE_T> FileHandle::readAsync(
+    void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    // Works like a regular handle, as on Windows, so there is nothing to
+    // cancel once it started.
+    if (token.cancelled()) {
+      return ready<SSIZE_T>(CANCELLED);
+    }
+    return ready<SSIZE_T>(::read(m_handle, data, size));
+  }
+
+  Future<SSIZE_T> FileHandle::writeAsync(
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (token.cancelled()) {
+      return ready<SSIZE_T>(CANCELLED);
+    }
+    return ready<SSIZE_T>(::write(m_handle, data, size));
+  }
+
+  void FileHandle::close() const
+  {
+    ::close(m_handle);
+  }
+
+
+  SocketHandle::SocketHandle(SOCKET s) : SocketHandle(s, loop::EventLoop::current())
+  {
+  }
+
+  SocketHandle::SocketHandle(SOCKET s, size_t loop) : m_socket(s)
+  {
+    m_descriptor = loop::uring::attach(m_socket, loop);
+  }
+
+  Future<SSIZE_T> SocketHandle::readAsync(
+    void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<ReadOperation>* op = new WithFuture<ReadOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    read(op, m_descriptor, data, size, true, token);
+    return future;
+  }
+
+  void SocketHandle::readAsync(
+    void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<ReadOperation>* op = new WithCallback<ReadOperation>();
+    op->callback = std::move(callback);
+    read(op, m_descriptor, data, size, true, token);
+  }
+
+  Future<SSIZE_T> SocketHandle::writeAsync(
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<WriteOperation>* op = new WithFuture<WriteOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    write(op, m_descriptor, data, size, true, token);
+    return future;
+  }
+
+  void SocketHandle::writeAsync(
+    const void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<WriteOperation>* op = new WithCallback<WriteOperation>();
+    op->callback = std::move(callback);
+    write(op, m_descriptor, data, size, true, token);
+  }
+
+  void SocketHandle::readAsync(
+    BufferPool& pool,
+    SliceCallback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1, Slice());
+      return;
+    }
+
+    BufferReadOperation* op = new BufferReadOperation();
+    op->loop = m_descriptor->loop;
+    op->slice = pool.acquire();
+    op->callback = std::move(callback);
+
+    io_uring_sqe sqe;
+    if (op->slice.region() >= 0) {
+      sqe = prepare(
+        IORING_OP_READ_FIXED,
+        m_socket,
+        op->slice.data(),
+        static_cast<unsigned>(op->slice.size()),
+        static_cast<uint64_t>(-1),
+        op);
+      sqe.buf_index = static_cast<uint16_t>(op->slice.region());
+    } else {
+      sqe = prepare(
+        IORING_OP_RECV,
+        m_socket,
+        op->slice.data(),
+        static_cast<unsigned>(op->slice.size()),
+        0,
+        op);
+    }
+    start(op, token, [&]() { loop::uring::submit(op->loop, &sqe, 1); });
+  }
+
+  void SocketHandle::writeAsync(
+    Slice slice,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<WriteOperation>* op = new WithCallback<WriteOperation>();
+    op->callback = std::move(callback);
+    op->slice = std::move(slice);
+    write(op, m_descriptor, op->slice.data(), op->slice.size(), true, token);
+  }
+
+  Future<SSIZE_T> SocketHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<VectorReadOperation>* op = new WithFuture<VectorReadOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    scatter(op, m_descriptor, buffers, count, true, token);
+    return future;
+  }
+
+  void SocketHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<VectorReadOperation>* op = new WithCallback<VectorReadOperation>();
+    op->callback = std::move(callback);
+    scatter(op, m_descriptor, buffers, count, true, token);
+  }
+
+  Future<SSIZE_T> SocketHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<VectorWriteOperation>* op = new WithFuture<VectorWriteOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    gather(op, m_descriptor, buffers, count, true, token);
+    return future;
+  }
+
+  void SocketHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<VectorWriteOperation>* op = new WithCallback<VectorWriteOperation>();
+    op->callback = std::move(callback);
+    gather(op, m_descriptor, buffers, count, true, token);
+  }
+
+  Future<SSIZE_T> SocketHandle::sendfile(
+    io::Handle* fd,
+    off_t offset,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET || offset < 0) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    SendfileOperation* op = new SendfileOperation();
+    if (::pipe2(op->pipe, O_CLOEXEC) != 0) {
+      delete op;
+      return ready<SSIZE_T>(-1);
+    }
+
+    op->loop = m_descriptor->loop;
+    op->socket = m_socket;
+    op->file = fd->get();
+    op->offset = offset;
+    op->size = size;
+    Future<SSIZE_T> future = op->state.get_future();
+
+    start(op, token, [op]() { op->start(); });
+    return future;
+  }
+
+  Future<SocketHandle*> SocketHandle::accept(const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      return ready<SocketHandle*>(nullptr);
+    }
+
+    AcceptOperation* op = new AcceptOperation();
+    op->loop = m_descriptor->loop;
+    Future<SocketHandle*> future = op->state.get_future();
+
+    io_uring_sqe sqe = prepare(IORING_OP_ACCEPT, m_socket, nullptr, 0, 0, op);
+    sqe.accept_flags = SOCK_CLOEXEC;
+    start(op, token, [&]() { loop::uring::submit(op->loop, &sqe, 1); });
+    return future;
+  }
+
+  void SocketHandle::accept(
+    BufferPool& pool,
+    AcceptReadCallback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || m_socket == INVALID_SOCKET) {
+      callback(nullptr, -1, Slice());
+      return;
+    }
+
+    AcceptReadOperation* op = new AcceptReadOperation();
+    op->loop = m_descriptor->loop;
+    op->pool = &pool;
+    op->callback = std::move(callback);
+    op->token = token;
+
+    io_uring_sqe sqe = prepare(IORING_OP_ACCEPT, m_socket, nullptr, 0, 0, op);
+    sqe.accept_flags = SOCK_CLOEXEC;
+    start(op, token, [&]() { loop::uring::submit(op->loop, &sqe, 1); });
+  }
+
+  Future<DWORD> SocketHandle::connect(
+    const sockaddr* addr,
+    size_t addr_size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr ||
+        m_socket == INVALID_SOCKET ||
+        addr_size > sizeof(sockaddr_storage)) {
+      return ready<DWORD>(~0);
+    }
+
+    ConnectOperation* op = new ConnectOperation();
+    op->loop = m_descriptor->loop;
+    memcpy(&op->addr, addr, addr_size);
+    Future<DWORD> future = op->state.get_future();
+
+    // The address length goes in `off` for IORING_OP_CONNECT.
+    io_uring_sqe sqe = prepare(
+      IORING_OP_CONNECT, m_socket, &op->addr, 0, addr_size, op);
+    start(op, token, [&]() { loop::uring::submit(op->loop, &sqe, 1); });
+    return future;
+  }
+
+  Future<DWORD> SocketHandle::connect(
+    const sockaddr* addr,
+    size_t addr_size,
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr ||
+        m_socket == INVALID_SOCKET ||
+        addr_size > sizeof(sockaddr_storage)) {
+      return ready<DWORD>(~0);
+    }
+
+    FastOpenOperation* op = new FastOpenOperation();
+    op->loop = m_descriptor->loop;
+    op->fd = m_socket;
+    memcpy(&op->addr, addr, addr_size);
+    op->addr_size = static_cast<socklen_t>(addr_size);
+    op->data = static_cast<const char*>(data);
+    op->size = size;
+    Future<DWORD> future = op->state.get_future();
+
+    start(op, token, [op]() { op->start(); });
+    return future;
+  }
+
+  int SocketHandle::listen(int connections) const
+  {
+    if (::listen(m_socket, connections) != 0) {
+      return errno;
+    }
+    return 0;
+  }
+
+  void SocketHandle::close() const
+  {
+    if (m_descriptor != nullptr) {
+      loop::uring::detach(m_descriptor);
+    }
+    ::close(m_socket);
+  }
+
+
+  Acceptor::Acceptor(const SocketHandle& listener, size_t depth, AcceptCallback callback)
+    : m_state(new internal::AcceptorState())
+  {
+    m_state->descriptor = listener.m_descriptor;
+    m_state->callback = std::move(callback);
+    if (m_state->descriptor != nullptr) {
+      loop::uring::acquire(m_state->descriptor);
+    }
+
+    // Counts as an accept until all of them are started, so that the
+    // callback can't get nullptr in between.
+    m_state->acquire();
+    m_state->pending.store(1, std::memory_order_relaxed);
+
+    if (m_state->descriptor == nullptr || depth == 0) {
+      stop_acceptor(m_state);
+    }
+    for (size_t i = 0; i < depth && !m_state->stopped.load(std::memory_order_acquire); i++) {
+      post(m_state);
+    }
+    done(m_state);
+  }
+
+  Acceptor::~Acceptor()
+  {
+    stop_acceptor(m_state);
+    m_state->release();
+  }
+
+  void Acceptor::stop()
+  {
+    stop_acceptor(m_state);
+  }
+
+  void Acceptor::recycle(SocketHandle* socket)
+  {
+    socket->close();
+    delete socket;
+  }
+
+
+  PipeHandle::PipeHandle(HANDLE h) : PipeHandle(h, loop::EventLoop::current())
+  {
+  }
+
+  PipeHandle::PipeHandle(HANDLE h, size_t loop) : m_handle(h)
+  {
+    m_descriptor = loop::uring::attach(m_handle, loop);
+  }
+
+  Future<SSIZE_T> PipeHandle::readAsync(
+    void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<ReadOperation>* op = new WithFuture<ReadOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    read(op, m_descriptor, data, size, false, token);
+    return future;
+  }
+
+  void PipeHandle::readAsync(
+    void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<ReadOperation>* op = new WithCallback<ReadOperation>();
+    op->callback = std::move(callback);
+    read(op, m_descriptor, data, size, false, token);
+  }
+
+  Future<SSIZE_T> PipeHandle::writeAsync(
+    const void* data,
+    size_t size,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<WriteOperation>* op = new WithFuture<WriteOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    write(op, m_descriptor, data, size, false, token);
+    return future;
+  }
+
+  void PipeHandle::writeAsync(
+    const void* data,
+    size_t size,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<WriteOperation>* op = new WithCallback<WriteOperation>();
+    op->callback = std::move(callback);
+    write(op, m_descriptor, data, size, false, token);
+  }
+
+  Future<SSIZE_T> PipeHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<VectorReadOperation>* op = new WithFuture<VectorReadOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    scatter(op, m_descriptor, buffers, count, false, token);
+    return future;
+  }
+
+  void PipeHandle::readvAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<VectorReadOperation>* op = new WithCallback<VectorReadOperation>();
+    op->callback = std::move(callback);
+    scatter(op, m_descriptor, buffers, count, false, token);
+  }
+
+  Future<SSIZE_T> PipeHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      return ready<SSIZE_T>(-1);
+    }
+
+    WithFuture<VectorWriteOperation>* op = new WithFuture<VectorWriteOperation>();
+    Future<SSIZE_T> future = op->state.get_future();
+    gather(op, m_descriptor, buffers, count, false, token);
+    return future;
+  }
+
+  void PipeHandle::writevAsync(
+    const IoBuffer* buffers,
+    size_t count,
+    Callback callback,
+    const CancellationToken& token) const
+  {
+    if (m_descriptor == nullptr || count == 0 || count > MAX_IO_BUFFERS) {
+      callback(-1);
+      return;
+    }
+
+    WithCallback<VectorWriteOperation>* op = new WithCallback<VectorWriteOperation>();
+    op->callback = std::move(callback);
+    gather(op, m_descriptor, buffers, count, false, token);
+  }
+
+  void PipeHandle::close() const
+  {
+    if (m_descriptor != nullptr) {
+      loop::uring::detach(m_descriptor);
+    }
+    ::close(m_handle);
+  }
+
+
+  template <typename T, typename H>
+  static Handle* make(internal::HandleStorage* storage, H h)
+  {
+    if (storage == nullptr) {
+      return new T(h);
+    }
+    return new (storage) T(h);
+  }
+
+  Handle* createAsyncHandle(io::Handle* fd)
+  {
+    return createAsyncHandle(fd, nullptr);
+  }
+
+  Handle* createAsyncHandle(io::Handle* fd, internal::HandleStorage* storage)
+  {
+    int dup = fd->dup();
+    if (dup == -1) {
+      return nullptr;
+    }
+
+    struct stat s;
+    if (fstat(dup, &s) != 0) {
+      ::close(dup);
+      return nullptr;
+    }
+
+    if (S_ISSOCK(s.st_mode)) {
+      return make<SocketHandle>(storage, dup);
+    } else if (S_ISFIFO(s.st_mode) || S_ISCHR(s.st_mode)) {
+      return make<PipeHandle>(storage, dup);
+    }
+    return make<FileHandle>(storage, dup);
+  }
+
+  Future<SSIZE_T> readAsync(
+    Handle* fd,
+    void* data,
+    size_t size,
+    const CancellationToken& token)
+  {
+    return fd->readAsync(data, size, token);
+  }
+
+  Future<SSIZE_T> writeAsync(
+    Handle* fd,
+    const void* data,
+    size_t size,
+    const CancellationToken& token)
+  {
+    return fd->writeAsync(data, size, token);
+  }
+
+  void close(Handle* fd)
+  {
+    fd->close();
+  }
+}
+#endif // __linux__ && USE_IO_URING
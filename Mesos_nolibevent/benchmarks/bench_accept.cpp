@@ -0,0 +1,176 @@
+// Accept rate under a storm of 100k short-lived loopback connections,
+// made by 4 client threads with blocking connects, each closed with a
+// reset right away so that no TIME_WAIT piles up. The server accepts them
+// one at a time, starting the next accept from the completion of the last
+// one, and then with an Acceptor that keeps 64 accepts pending. Either way
+// it closes every connection as soon as it has it.
+//
+// Reports the connections per second, and the latency of the connects,
+// whose tail shows the SYNs that had to be retried because the backlog
+// was full.
+//
+// Build (Linux, see Makefile):
+//   make bench_accept
+//   make URING=1 bench_accept
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace {
+  const int CONNECTIONS = 100000;
+  const int CLIENTS = 4;
+  const int BACKLOG = 1024;
+  const size_t DEPTH = 64;
+
+  struct Server {
+    std::atomic<int> accepted{0};
+    async::Promise<int> stopped;
+  };
+
+  // One accept at a time, like a server that loops over `accept`.
+  struct Serial {
+    async::SocketHandle* listener;
+    async::CancellationToken token;
+    Server* server;
+
+    void start()
+    {
+      listener->accept(token).then([this](async::SocketHandle* socket) {
+        if (socket == nullptr) {
+          server->stopped.set_value(0);
+          return;
+        }
+        server->accepted.fetch_add(1, std::memory_order_relaxed);
+        socket->close();
+        delete socket;
+        start();
+      });
+    }
+  };
+
+  // Makes `count` connections and returns how many went through, with the
+  // time each connect took.
+  int connect(const sockaddr_in& address, int count, std::vector<uint64_t>& latencies)
+  {
+    int connected = 0;
+    for (int i = 0; i < count; i++) {
+      int s = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      linger reset = { 1, 0 };
+      setsockopt(s, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+
+      benchmark::Stopwatch stopwatch;
+      if (::connect(s, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0) {
+        connected++;
+      }
+      latencies.push_back(stopwatch.elapsed());
+      ::close(s);
+    }
+    return connected;
+  }
+
+  // Runs the clients against a server that is already accepting, and
+  // waits for the server to have accepted every connection that went
+  // through.
+  void storm(const char* name, const sockaddr_in& address, Server& server)
+  {
+    std::vector<std::vector<uint64_t>> latencies(CLIENTS);
+    std::atomic<int> connected(0);
+
+    benchmark::Stopwatch stopwatch;
+    std::vector<std::thread> clients;
+    for (int i = 0; i < CLIENTS; i++) {
+      clients.emplace_back([&, i]() {
+        connected.fetch_add(connect(address, CONNECTIONS / CLIENTS, latencies[i]));
+      });
+    }
+    for (std::thread& client : clients) {
+      client.join();
+    }
+    while (server.accepted.load() < connected.load()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    uint64_t elapsed = stopwatch.elapsed();
+
+    std::vector<uint64_t> all;
+    for (std::vector<uint64_t>& client : latencies) {
+      all.insert(all.end(), client.begin(), client.end());
+    }
+
+    benchmark::report(name, static_cast<uint64_t>(connected.load()), elapsed);
+    benchmark::report_latency("  connect", all);
+    printf("%-40s %12d\n", "  failed connects", CONNECTIONS - connected.load());
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  int s = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t size = sizeof(address);
+  if (bind(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      getsockname(s, reinterpret_cast<sockaddr*>(&address), &size) != 0) {
+    printf("bind failed: %d\n", errno);
+    return 1;
+  }
+
+  async::SocketHandle listener(s, 0);
+  if (listener.listen(BACKLOG) != 0) {
+    printf("listen failed: %d\n", errno);
+    return 1;
+  }
+
+  {
+    Server server;
+    async::Future<int> stopped = server.stopped.get_future();
+    Serial serial;
+    serial.listener = &listener;
+    serial.token = async::CancellationToken::create();
+    serial.server = &server;
+    serial.start();
+
+    storm("accept, one at a time", address, server);
+    serial.token.cancel();
+    stopped.get();
+  }
+
+  {
+    Server server;
+    async::Future<int> stopped = server.stopped.get_future();
+    async::Acceptor acceptor(listener, DEPTH, [&server](async::SocketHandle* socket) {
+      if (socket == nullptr) {
+        server.stopped.set_value(0);
+        return;
+      }
+      server.accepted.fetch_add(1, std::memory_order_relaxed);
+      socket->close();
+      delete socket;
+    });
+
+    storm("accept, Acceptor with 64 pending", address, server);
+    acceptor.stop();
+    stopped.get();
+  }
+
+  listener.close();
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_accept only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
@@ -0,0 +1,210 @@
+// Short-lived RPC connections: each of 50k loopback connections, made by 4
+// client threads, sends a 64 byte request right after connecting, waits
+// for the server to echo it and closes. The server keeps 16 accepts
+// pending, and gets the request either with an accept and then a read
+// into a pool buffer, or with one accept that does both (see
+// `SocketHandle::accept(BufferPool&)`).
+//
+// Reports the connections per second, and the latency from the start of
+// the connect to the response.
+//
+// Build (Linux, see Makefile):
+//   make bench_accept_read
+//   make URING=1 bench_accept_read
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace {
+  const int CONNECTIONS = 50000;
+  const int CLIENTS = 4;
+  const int BACKLOG = 1024;
+  const int DEPTH = 16;
+  const size_t REQUEST = 64;
+
+  struct Server {
+    async::SocketHandle* listener;
+    async::BufferPool* pool;
+    bool combined;
+    async::CancellationToken token = async::CancellationToken::create();
+    std::atomic<int> pending{DEPTH};
+    async::Promise<int> stopped;
+
+    // Starts an accept, in place of one that completed.
+    void post()
+    {
+      if (combined) {
+        listener->accept(
+          *pool,
+          [this](async::SocketHandle* socket, SSIZE_T result, async::Slice data) {
+            if (socket == nullptr) {
+              done();
+              return;
+            }
+            post();
+            respond(socket, result, std::move(data));
+          },
+          token);
+        return;
+      }
+
+      listener->accept(token).then([this](async::SocketHandle* socket) {
+        if (socket == nullptr) {
+          done();
+          return;
+        }
+        post();
+        socket->readAsync(
+          *pool,
+          [this, socket](SSIZE_T result, async::Slice data) {
+            respond(socket, result, std::move(data));
+          },
+          token);
+      });
+    }
+
+    void respond(async::SocketHandle* socket, SSIZE_T result, async::Slice data)
+    {
+      if (result <= 0) {
+        socket->close();
+        delete socket;
+        return;
+      }
+      socket->writeAsync(std::move(data), [socket](SSIZE_T) {
+        socket->close();
+        delete socket;
+      });
+    }
+
+    // The accepts only fail once the token is cancelled.
+    void done()
+    {
+      if (pending.fetch_sub(1) == 1) {
+        stopped.set_value(0);
+      }
+    }
+  };
+
+  // Makes `count` connections and returns how many got their response,
+  // with the time each took.
+  int connect(const sockaddr_in& address, int count, std::vector<uint64_t>& latencies)
+  {
+    char request[REQUEST] = { 'x' };
+    char response[REQUEST];
+    int served = 0;
+    for (int i = 0; i < count; i++) {
+      int s = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      linger reset = { 1, 0 };
+      setsockopt(s, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+
+      benchmark::Stopwatch stopwatch;
+      if (::connect(s, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0 &&
+          ::send(s, request, sizeof(request), MSG_NOSIGNAL) == sizeof(request)) {
+        size_t received = 0;
+        while (received < sizeof(response)) {
+          SSIZE_T bytes = ::recv(s, response + received, sizeof(response) - received, 0);
+          if (bytes <= 0) {
+            break;
+          }
+          received += static_cast<size_t>(bytes);
+        }
+        if (received == sizeof(response)) {
+          served++;
+          latencies.push_back(stopwatch.elapsed());
+        }
+      }
+      ::close(s);
+    }
+    return served;
+  }
+
+  void run(const char* name, async::SocketHandle& listener, const sockaddr_in& address, bool combined)
+  {
+    async::BufferPool pool(4096, 64);
+    Server server;
+    server.listener = &listener;
+    server.pool = &pool;
+    server.combined = combined;
+    async::Future<int> stopped = server.stopped.get_future();
+    for (int i = 0; i < DEPTH; i++) {
+      server.post();
+    }
+
+    std::vector<std::vector<uint64_t>> latencies(CLIENTS);
+    std::atomic<int> served(0);
+
+    benchmark::Stopwatch stopwatch;
+    std::vector<std::thread> clients;
+    for (int i = 0; i < CLIENTS; i++) {
+      clients.emplace_back([&, i]() {
+        served.fetch_add(connect(address, CONNECTIONS / CLIENTS, latencies[i]));
+      });
+    }
+    for (std::thread& client : clients) {
+      client.join();
+    }
+    uint64_t elapsed = stopwatch.elapsed();
+
+    server.token.cancel();
+    stopped.get();
+
+    // The last responses may still be closing their sockets, and hold
+    // their buffers until then.
+    while (pool.used() != 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::vector<uint64_t> all;
+    for (std::vector<uint64_t>& client : latencies) {
+      all.insert(all.end(), client.begin(), client.end());
+    }
+
+    benchmark::report(name, static_cast<uint64_t>(served.load()), elapsed);
+    benchmark::report_latency("  connect to response", all);
+    printf("%-40s %12d\n", "  failed connections", CONNECTIONS - served.load());
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  int s = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t size = sizeof(address);
+  if (bind(s, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      getsockname(s, reinterpret_cast<sockaddr*>(&address), &size) != 0) {
+    printf("bind failed: %d\n", errno);
+    return 1;
+  }
+
+  async::SocketHandle listener(s, 0);
+  if (listener.listen(BACKLOG) != 0) {
+    printf("listen failed: %d\n", errno);
+    return 1;
+  }
+
+  run("accept, then read", listener, address, false);
+  run("accept with the first read", listener, address, true);
+
+  listener.close();
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_accept_read only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
@@ -0,0 +1,108 @@
+// Counts the heap allocations made per timer and per posted function, by
+// replacing the global operator new. The closures capture four pointers,
+// which is more than std::function keeps inline but well within what
+// loop::Function does, so neither scheduling a timer nor posting should
+// allocate at all once the loop is warmed up. Exits with 1 if one does.
+//
+// Build (Linux, see Makefile):
+//   make bench_alloc
+
+#define BENCHMARK_COUNT_ALLOCATIONS
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+
+namespace {
+  const int TIMERS = 100000;
+
+  std::atomic<int> ran(0);
+
+  // Runs `work` twice, so that whatever it needs to grow the first time
+  // around is already there, and reports the allocations of the second run.
+  template <typename F>
+  double per_operation(const char* name, int count, F work)
+  {
+    work();
+
+    uint64_t before = benchmark::allocations.load();
+    work();
+    double result = static_cast<double>(benchmark::allocations.load() - before) / count;
+
+    printf("%-40s %12.2f allocations/op\n", name, result);
+    return result;
+  }
+
+  void wait_for(int count)
+  {
+    while (ran.load() < count) {
+      std::this_thread::yield();
+    }
+    ran.store(0);
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  int a = 0;
+  int b = 0;
+  int c = 0;
+  int d = 0;
+
+  per_operation("std::function, 4 pointers", TIMERS, [&]() {
+    for (int i = 0; i < TIMERS; i++) {
+      std::function<void()> function([&a, &b, &c, &d]() { ran += a + b + c + d; });
+    }
+  });
+
+  per_operation("loop::Function, 4 pointers", TIMERS, [&]() {
+    for (int i = 0; i < TIMERS; i++) {
+      loop::Function<void()> function([&a, &b, &c, &d]() { ran += a + b + c + d; });
+    }
+  });
+
+  std::vector<loop::Timer> timers(TIMERS);
+  double cancelled = per_operation("delay + cancel", TIMERS, [&]() {
+    for (int i = 0; i < TIMERS; i++) {
+      timers[i] = loop::EventLoop::delay(std::chrono::seconds(10), [&a, &b, &c, &d]() {
+        ran += a + b + c + d + 1;
+      });
+    }
+    for (const loop::Timer& timer : timers) {
+      timer.cancel();
+    }
+  });
+
+  // Counts the loop thread too, which expires the timers.
+  double expired = per_operation("delay + expire", TIMERS, [&]() {
+    for (int i = 0; i < TIMERS; i++) {
+      loop::EventLoop::delay(std::chrono::microseconds(100), [&a, &b, &c, &d]() {
+        ran += a + b + c + d + 1;
+      });
+    }
+    wait_for(TIMERS);
+  });
+
+  // The node that carries the function through the queue comes from the
+  // operation pool.
+  double posted = per_operation("post", TIMERS, [&]() {
+    for (int i = 0; i < TIMERS; i++) {
+      loop::EventLoop::post([&a, &b, &c, &d]() { ran += a + b + c + d + 1; });
+    }
+    wait_for(TIMERS);
+  });
+
+  loop::EventLoop::stop();
+  eventloop.join();
+
+  if (cancelled != 0 || expired != 0) {
+    printf("scheduling a timer allocated!\n");
+    return 1;
+  }
+  if (posted != 0) {
+    printf("posting a function allocated!\n");
+    return 1;
+  }
+  return 0;
+}
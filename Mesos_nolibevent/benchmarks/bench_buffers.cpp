@@ -0,0 +1,204 @@
+// Reads on 50k connections (Unix socket pairs), first into a 64 KiB buffer
+// of each connection's own, the way test_socket does it, then into the
+// buffers of a BufferPool. Every connection keeps a read pending; each
+// round writes one message to every connection and waits for all of the
+// reads, which hand their data on and start the next read.
+//
+// Reports the throughput, the memory of all the buffers, and how many
+// pool buffers are held by reads that are waiting for data between rounds
+// (none on epoll, one per connection where reads hold their buffer from
+// the start). If the descriptor limit doesn't allow 50k connections it
+// runs as many as it can.
+//
+// Build (Linux, see Makefile):
+//   make bench_buffers
+//   make URING=1 bench_buffers
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef __linux__
+#include <sys/resource.h>
+
+namespace {
+  const size_t CONNECTIONS = 50000;
+  const int ROUNDS = 20;
+  const size_t MESSAGE = 512;
+  const size_t OWN_BUFFER = 64 * 1024;
+  const size_t POOL_BUFFER = 16 * 1024;
+  const size_t POOL_GROWTH = 1024;
+
+  struct Connection;
+
+  struct State {
+    async::BufferPool* pool = nullptr;
+    std::atomic<size_t> pending{0};
+    async::Promise<int> done;
+    uint64_t checksum = 0;
+  };
+
+  struct Connection {
+    async::SocketHandle* reader;
+    int writer;
+    State* state;
+    int remaining;
+    std::vector<char> buffer;
+
+    void consume(const char* data, SSIZE_T size)
+    {
+      if (size > 0) {
+        state->checksum += static_cast<unsigned char>(data[size - 1]);
+      }
+    }
+
+    void completed()
+    {
+      if (--remaining > 0) {
+        start();
+      }
+      if (state->pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        state->done.set_value(0);
+      }
+    }
+
+    void start()
+    {
+      if (state->pool == nullptr) {
+        reader->readAsync(buffer.data(), buffer.size(), [this](SSIZE_T result) {
+          consume(buffer.data(), result);
+          completed();
+        });
+      } else {
+        // The slice is handed on as is, and its buffer goes back to the
+        // pool once the consumer lets go of it.
+        reader->readAsync(*state->pool, [this](SSIZE_T result, async::Slice slice) {
+          consume(slice.data(), result);
+
+          // Done with the data, the buffer can go back before the round
+          // ends.
+          slice = async::Slice();
+          completed();
+        });
+      }
+    }
+  };
+
+  // Raises the descriptor limit as far as it goes, and returns how many
+  // connections fit.
+  size_t connections()
+  {
+    rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return std::min<size_t>(CONNECTIONS, (limit.rlim_cur - 64) / 2);
+  }
+
+  void run(const char* name, std::vector<Connection>& all, async::BufferPool* pool)
+  {
+    State state;
+    state.pool = pool;
+
+    char message[MESSAGE];
+    memset(message, 'x', sizeof(message));
+
+    for (Connection& connection : all) {
+      connection.state = &state;
+      connection.remaining = ROUNDS;
+      if (pool == nullptr) {
+        connection.buffer.assign(OWN_BUFFER, 0);
+      }
+    }
+
+    loop::EventLoop::post([&all]() {
+      for (Connection& connection : all) {
+        connection.start();
+      }
+    });
+
+    size_t held = 0;
+    benchmark::Stopwatch stopwatch;
+    for (int round = 0; round < ROUNDS; round++) {
+      state.done = async::Promise<int>();
+      async::Future<int> done = state.done.get_future();
+      state.pending.store(all.size());
+
+      if (round == ROUNDS / 2 && pool != nullptr) {
+        // Every read of the round is pending, none has any data yet.
+        held = pool->used();
+      }
+
+      for (Connection& connection : all) {
+        if (::write(connection.writer, message, sizeof(message)) != sizeof(message)) {
+          throw std::string("write failed");
+        }
+      }
+      done.get();
+    }
+    uint64_t elapsed = stopwatch.elapsed();
+
+    uint64_t reads = static_cast<uint64_t>(ROUNDS) * all.size();
+    size_t memory = pool != nullptr ? pool->footprint() : all.size() * OWN_BUFFER;
+
+    benchmark::report(name, reads, elapsed);
+    printf("%-40s %12.1f MB/s\n",
+      name,
+      static_cast<double>(reads * MESSAGE) / (static_cast<double>(elapsed) / 1e9) / 1e6);
+    printf("%-40s %12.1f MB, %.1f KB per connection\n",
+      "  buffer memory",
+      static_cast<double>(memory) / 1e6,
+      static_cast<double>(memory) / 1e3 / static_cast<double>(all.size()));
+    if (pool != nullptr) {
+      printf("%-40s %12zu of %zu\n", "  buffers held by waiting reads", held, all.size());
+    }
+
+    for (Connection& connection : all) {
+      std::vector<char>().swap(connection.buffer);
+    }
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  std::vector<Connection> all(connections());
+  printf("%-40s %12zu\n", "connections", all.size());
+  for (Connection& connection : all) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+      printf("socketpair failed: %d\n", errno);
+      return 1;
+    }
+    fcntl(sockets[0], F_SETFL, O_NONBLOCK);
+    connection.reader = new async::SocketHandle(sockets[0], 0);
+    connection.writer = sockets[1];
+  }
+
+  run("read, own 64 KiB buffers", all, nullptr);
+
+  {
+    async::BufferPool pool(POOL_BUFFER, POOL_GROWTH);
+    run("read, pooled 16 KiB buffers", all, &pool);
+  }
+
+  for (Connection& connection : all) {
+    connection.reader->close();
+    ::close(connection.writer);
+    delete connection.reader;
+  }
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_buffers only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
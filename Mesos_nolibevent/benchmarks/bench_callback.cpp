@@ -0,0 +1,126 @@
+// Compares the callback-style reads and writes with the future-returning
+// ones: operations per second and heap allocations per operation, over a
+// Unix socket pair (SocketHandle) and a pipe (PipeHandle). Every round
+// writes a small message into one end and reads it from the other, and the
+// next round is started from the read's completion, so no thread ever
+// blocks and both styles do exactly the same I/O.
+//
+// Build (Linux, see Makefile):
+//   make bench_callback
+//   make URING=1 bench_callback
+
+#define BENCHMARK_COUNT_ALLOCATIONS
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef __linux__
+namespace {
+  const int ROUNDS = 200000;
+  const size_t MESSAGE = 64;
+
+  // The read is always issued before the write, so it is still pending
+  // when the data arrives and completes from the loop rather than inside
+  // the write. That keeps the stack flat however many rounds there are.
+  template <typename H>
+  struct Rounds {
+    H* writer;
+    H* reader;
+    char out[MESSAGE];
+    char in[MESSAGE];
+    int remaining;
+    async::Promise<int> done;
+
+    void callbacks()
+    {
+      reader->readAsync(in, MESSAGE, [this](SSIZE_T) {
+        if (--remaining > 0) {
+          callbacks();
+        } else {
+          done.set_value(0);
+        }
+      });
+      writer->writeAsync(out, MESSAGE, [](SSIZE_T) {});
+    }
+
+    void futures()
+    {
+      reader->readAsync(in, MESSAGE).then([this](SSIZE_T) {
+        if (--remaining > 0) {
+          futures();
+        } else {
+          done.set_value(0);
+        }
+      });
+      writer->writeAsync(out, MESSAGE).then([](SSIZE_T) {});
+    }
+  };
+
+  // Runs `ROUNDS` rounds twice, so that the loop is warmed up, and reports
+  // the second run.
+  template <typename H>
+  void measure(const char* name, H* writer, H* reader, void (Rounds<H>::*start)())
+  {
+    for (int run = 0; run < 2; run++) {
+      Rounds<H> rounds;
+      rounds.writer = writer;
+      rounds.reader = reader;
+      rounds.remaining = ROUNDS;
+      memset(rounds.out, 'x', sizeof(rounds.out));
+      async::Future<int> done = rounds.done.get_future();
+
+      uint64_t before = benchmark::allocations.load();
+      benchmark::Stopwatch stopwatch;
+      loop::EventLoop::post([&rounds, start]() { (rounds.*start)(); });
+      done.get();
+      uint64_t elapsed = stopwatch.elapsed();
+
+      uint64_t allocated = benchmark::allocations.load() - before;
+
+      if (run == 1) {
+        benchmark::report(name, 2 * ROUNDS, elapsed);
+        printf("%-40s %12.2f allocations/op\n",
+          name,
+          static_cast<double>(allocated) / (2.0 * ROUNDS));
+      }
+    }
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  int sockets[2];
+  socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets);
+  async::SocketHandle writer(sockets[0], 0);
+  async::SocketHandle reader(sockets[1], 0);
+
+  measure("socket, future", &writer, &reader, &Rounds<async::SocketHandle>::futures);
+  measure("socket, callback", &writer, &reader, &Rounds<async::SocketHandle>::callbacks);
+
+  int pipes[2];
+  pipe2(pipes, O_CLOEXEC);
+  async::PipeHandle pipe_writer(pipes[1], 0);
+  async::PipeHandle pipe_reader(pipes[0], 0);
+
+  measure("pipe, future", &pipe_writer, &pipe_reader, &Rounds<async::PipeHandle>::futures);
+  measure("pipe, callback", &pipe_writer, &pipe_reader, &Rounds<async::PipeHandle>::callbacks);
+
+  writer.close();
+  reader.close();
+  pipe_writer.close();
+  pipe_reader.close();
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_callback only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
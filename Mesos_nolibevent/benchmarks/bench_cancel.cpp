@@ -0,0 +1,132 @@
+// Cancels 100k reads that are in flight, each one started with its own
+// token, half of them on Unix socket pairs (SocketHandle) and half on pipes
+// (PipeHandle), none of which ever gets any data. Checks that every read
+// completes with CANCELLED and that every operation is freed afterwards, by
+// counting the live heap blocks with a replaced global operator new, and
+// reports how fast the reads are cancelled. Exits with 1 if a read reports
+// anything else or a block is left over. Built with NO_OPERATION_POOL, so
+// that the operations come from the heap and are counted too (see
+// pool.hpp).
+//
+// Build (Linux, see Makefile):
+//   make bench_cancel
+//   make URING=1 bench_cancel
+
+#define BENCHMARK_COUNT_ALLOCATIONS
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef __linux__
+namespace {
+  const int READS = 100000;
+
+  // Each descriptor gets this many reads queued on it, which keeps well
+  // under the default limit of open files.
+  const int READS_PER_HANDLE = 400;
+
+  char buffer[64];
+
+  std::atomic<int> completed(0);
+  std::atomic<int> failures(0);
+  async::Promise<int> done;
+
+  void read(async::Handle* handle, const async::CancellationToken& token)
+  {
+    handle->readAsync(buffer, sizeof(buffer), token).then([](SSIZE_T result) {
+      if (result != async::CANCELLED) {
+        failures.fetch_add(1, std::memory_order_relaxed);
+      }
+      if (completed.fetch_add(1, std::memory_order_acq_rel) + 1 == READS) {
+        done.set_value(0);
+      }
+    });
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  // Readers and the other ends, which stay open so that the reads don't
+  // complete with end of file.
+  std::vector<async::Handle*> readers;
+  std::vector<int> others;
+
+  for (int i = 0; i < READS / READS_PER_HANDLE; i++) {
+    if (i % 2 == 0) {
+      int sockets[2];
+      socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, sockets);
+      readers.push_back(new async::SocketHandle(sockets[0], 0));
+      others.push_back(sockets[1]);
+    } else {
+      int pipes[2];
+      pipe2(pipes, O_CLOEXEC | O_NONBLOCK);
+      readers.push_back(new async::PipeHandle(pipes[0], 0));
+      others.push_back(pipes[1]);
+    }
+  }
+
+  std::vector<async::CancellationToken> tokens(READS);
+  async::Future<int> finished = done.get_future();
+
+  // Give the loop a moment to get going, so that its own allocations don't
+  // count against the reads.
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  int64_t baseline = benchmark::live.load();
+
+  for (int i = 0; i < READS; i++) {
+    tokens[i] = async::CancellationToken::create();
+    read(readers[i / READS_PER_HANDLE], tokens[i]);
+  }
+
+  // Let every read reach the kernel before cancelling.
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  int64_t inflight = benchmark::live.load() - baseline;
+
+  benchmark::Stopwatch stopwatch;
+  for (int i = 0; i < READS; i++) {
+    tokens[i].cancel();
+  }
+  finished.get();
+  uint64_t elapsed = stopwatch.elapsed();
+
+  for (int i = 0; i < READS; i++) {
+    tokens[i] = async::CancellationToken();
+  }
+
+  // The last operations are freed on the loop thread right after their
+  // callbacks ran.
+  int64_t leaked = benchmark::live.load() - baseline;
+  for (int i = 0; i < 100 && leaked > 0; i++) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    leaked = benchmark::live.load() - baseline;
+  }
+
+  benchmark::report("cancel in-flight read", READS, elapsed);
+  printf("%-40s %12lld\n", "blocks live while in flight", static_cast<long long>(inflight));
+  printf("%-40s %12d\n", "reads not cancelled", failures.load());
+  printf("%-40s %12lld\n", "blocks leaked", static_cast<long long>(leaked));
+
+  for (size_t i = 0; i < readers.size(); i++) {
+    readers[i]->close();
+    ::close(others[i]);
+    if (i % 2 == 0) {
+      delete static_cast<async::SocketHandle*>(readers[i]);
+    } else {
+      delete static_cast<async::PipeHandle*>(readers[i]);
+    }
+  }
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return failures.load() == 0 && leaked == 0 ? 0 : 1;
+}
+#else
+int main()
+{
+  printf("bench_cancel only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
@@ -0,0 +1,76 @@
+// Measures the cost of reading the time: the wall clock behind
+// EventLoop::time(), the monotonic clock with and without the time stamp
+// counter fast path, and the cached time EventLoop::now() returns inside
+// a loop callback.
+//
+// Build (Linux, see Makefile):
+//   make bench_clock
+
+#include "benchmark.hpp"
+#include "../clock.hpp"
+#include "../eventloop.hpp"
+
+namespace {
+  const int CALLS = 10000000;
+
+  // Keeps the compiler from dropping the calls.
+  volatile uint64_t sink;
+
+  template <typename F>
+  void measure(const char* name, F read)
+  {
+    uint64_t sum = 0;
+    benchmark::Stopwatch stopwatch;
+    for (int i = 0; i < CALLS; i++) {
+      sum += static_cast<uint64_t>(read());
+    }
+    benchmark::report(name, CALLS, stopwatch.elapsed());
+    sink = sum;
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+
+  measure("EventLoop::time()", []() { return loop::EventLoop::time(); });
+  measure("std::chrono::steady_clock::now()", []() {
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+  });
+  measure("clock::monotonic(), OS clock", []() {
+    return loop::clock::monotonic();
+  });
+
+  benchmark::Stopwatch calibration;
+  if (loop::clock::enable_tsc()) {
+    printf("%-40s %12.1f ms\n",
+      "TSC calibration took",
+      static_cast<double>(calibration.elapsed()) / 1e6);
+
+    measure("clock::monotonic(), TSC", []() {
+      return loop::clock::monotonic();
+    });
+
+    // How far the calibrated TSC strays from the OS clock over a second.
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t tsc_start = loop::clock::monotonic();
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    int64_t os = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+    int64_t tsc = static_cast<int64_t>(loop::clock::monotonic() - tsc_start);
+    printf("%-40s %12lld ns\n",
+      "TSC drift over 1s",
+      static_cast<long long>(tsc - os));
+  } else {
+    printf("no invariant TSC, skipping the fast path\n");
+  }
+
+  // What a callback sees: the loop read the clock once when it woke up.
+  loop::clock::update();
+  measure("EventLoop::now(), in a loop callback", []() {
+    return loop::EventLoop::now();
+  });
+  loop::clock::clear();
+
+  return 0;
+}
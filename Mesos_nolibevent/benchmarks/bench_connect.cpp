@@ -0,0 +1,184 @@
+// Time to the first response on a new connection: 10k loopback
+// connections, one after the other, each of which sends a 64 byte request
+// and waits for the server's 64 byte response. The request is either
+// written once the connect completes, or handed to the connect (see
+// `SocketHandle::connect(addr, addr_size, data, size)`).
+//
+// The data only goes out in the SYN if net.ipv4.tcp_fastopen has the
+// server bit (2) set as well as the client bit (1), which the benchmark
+// prints; otherwise the connect sends it right after the handshake.
+//
+// Build (Linux, see Makefile):
+//   make bench_connect
+//   make URING=1 bench_connect
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+namespace {
+  const int CONNECTIONS = 10000;
+  const size_t MESSAGE = 64;
+
+  // Answers every request with a response of the same size, one
+  // connection at a time, until `stopped` is set.
+  void serve(int listener, const std::atomic<bool>& stopped)
+  {
+    char message[MESSAGE];
+    while (!stopped.load()) {
+      int s = ::accept(listener, NULL, NULL);
+      if (s == -1) {
+        continue;
+      }
+
+      size_t received = 0;
+      while (received < sizeof(message)) {
+        SSIZE_T bytes = ::recv(s, message + received, sizeof(message) - received, 0);
+        if (bytes <= 0) {
+          break;
+        }
+        received += static_cast<size_t>(bytes);
+      }
+      if (received == sizeof(message)) {
+        ::send(s, message, sizeof(message), MSG_NOSIGNAL);
+      }
+      ::close(s);
+    }
+  }
+
+  // Makes one connection and returns the time to its response, or 0 if
+  // it failed.
+  uint64_t exchange(const sockaddr_in& address, bool together)
+  {
+    int s = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    linger reset = { 1, 0 };
+    setsockopt(s, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    async::SocketHandle socket(s, 0);
+
+    static const char request[MESSAGE] = { 'x' };
+    char response[MESSAGE];
+    async::Promise<bool> done;
+    async::Future<bool> finished = done.get_future();
+
+    auto read = [&]() {
+      socket.readAsync(response, sizeof(response), [&](SSIZE_T result) {
+        done.set_value(result > 0);
+      });
+    };
+
+    const sockaddr* addr = reinterpret_cast<const sockaddr*>(&address);
+    benchmark::Stopwatch stopwatch;
+    if (together) {
+      socket.connect(addr, sizeof(address), request, sizeof(request)).then([&](DWORD error) {
+        if (error != 0) {
+          done.set_value(false);
+          return;
+        }
+        read();
+      });
+    } else {
+      socket.connect(addr, sizeof(address)).then([&](DWORD error) {
+        if (error != 0) {
+          done.set_value(false);
+          return;
+        }
+        socket.writeAsync(request, sizeof(request), [&](SSIZE_T result) {
+          if (result < 0) {
+            done.set_value(false);
+            return;
+          }
+          read();
+        });
+      });
+    }
+
+    bool succeeded = finished.get();
+    uint64_t elapsed = stopwatch.elapsed();
+    socket.close();
+    return succeeded ? elapsed : 0;
+  }
+
+  void run(const char* name, const sockaddr_in& address, bool together)
+  {
+    std::vector<uint64_t> latencies;
+    int failed = 0;
+    benchmark::Stopwatch stopwatch;
+    for (int i = 0; i < CONNECTIONS; i++) {
+      uint64_t latency = exchange(address, together);
+      if (latency == 0) {
+        failed++;
+      } else {
+        latencies.push_back(latency);
+      }
+    }
+    uint64_t elapsed = stopwatch.elapsed();
+
+    benchmark::report(name, static_cast<uint64_t>(latencies.size()), elapsed);
+    benchmark::report_latency("  connect to response", latencies);
+    printf("%-40s %12d\n", "  failed connections", failed);
+  }
+
+  int fastopen()
+  {
+    int value = 0;
+    FILE* file = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+    if (file != nullptr) {
+      if (fscanf(file, "%d", &value) != 1) {
+        value = 0;
+      }
+      fclose(file);
+    }
+    return value;
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t size = sizeof(address);
+  int queue = 128;
+  if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      getsockname(listener, reinterpret_cast<sockaddr*>(&address), &size) != 0 ||
+      setsockopt(listener, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) != 0 ||
+      ::listen(listener, 128) != 0) {
+    printf("listen failed: %d\n", errno);
+    return 1;
+  }
+
+  std::atomic<bool> stopped(false);
+  std::thread server(serve, listener, std::cref(stopped));
+
+  printf("net.ipv4.tcp_fastopen = %d\n", fastopen());
+  run("connect, then write", address, false);
+  run("connect with the request", address, true);
+
+  // Wakes the server up so that it sees `stopped`.
+  stopped.store(true);
+  int s = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  ::connect(s, reinterpret_cast<sockaddr*>(&address), sizeof(address));
+  ::close(s);
+  server.join();
+  ::close(listener);
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_connect only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
@@ -0,0 +1,183 @@
+// Many small writes to one socket: 4 threads write 1M 64 byte messages in
+// all over loopback TCP, each with up to 64 of its writes outstanding,
+// while a thread on the other end drains the connection. The messages go
+// out either with a write each, or through a WriteQueue, which sends the
+// writes made while a send is in flight together once it completes.
+//
+// Reports messages per second and, on epoll, send system calls per
+// message, counted by wrapping `send` and `sendmsg` the way bench_echo
+// counts allocations. With io_uring the sends are submission entries and
+// aren't counted.
+//
+// Build (Linux, see Makefile):
+//   make bench_cork
+//   make URING=1 bench_cork
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/syscall.h>
+
+namespace {
+  std::atomic<uint64_t> sends(0);
+}
+
+#ifndef USE_IO_URING
+extern "C" ssize_t send(int fd, const void* data, size_t size, int flags)
+{
+  sends.fetch_add(1, std::memory_order_relaxed);
+  return syscall(SYS_sendto, fd, data, size, flags, nullptr, 0);
+}
+
+extern "C" ssize_t sendmsg(int fd, const msghdr* message, int flags)
+{
+  sends.fetch_add(1, std::memory_order_relaxed);
+  return syscall(SYS_sendmsg, fd, message, flags);
+}
+#endif
+
+namespace {
+  const uint64_t MESSAGES = 1000000;
+  const int WRITERS = 4;
+  const int WINDOW = 64;
+  const size_t MESSAGE = 64;
+
+  const char message[MESSAGE] = { 'x' };
+
+  // Reads and drops everything until the connection is closed.
+  void drain(int s)
+  {
+    std::vector<char> buffer(1 << 20);
+    while (::recv(s, buffer.data(), buffer.size(), 0) > 0) {
+    }
+    ::close(s);
+  }
+
+  // Returns a connected pair of loopback TCP sockets, the first of which
+  // is handed to the loop.
+  bool connected(int& client, int& server)
+  {
+    int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(address);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        getsockname(listener, reinterpret_cast<sockaddr*>(&address), &size) != 0 ||
+        ::listen(listener, 1) != 0) {
+      ::close(listener);
+      return false;
+    }
+
+    client = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (::connect(client, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+      ::close(client);
+      ::close(listener);
+      return false;
+    }
+    server = ::accept(listener, NULL, NULL);
+    ::close(listener);
+
+    // Small messages go out right away instead of waiting on Nagle.
+    int on = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return server != -1;
+  }
+
+  // Writes its share of the messages with `write`, keeping up to WINDOW of
+  // them outstanding.
+  template <typename F>
+  void produce(F write, std::atomic<uint64_t>& written, std::atomic<uint64_t>& failed)
+  {
+    std::atomic<int> outstanding(0);
+    for (uint64_t i = 0; i < MESSAGES / WRITERS; i++) {
+      while (outstanding.load(std::memory_order_acquire) >= WINDOW) {
+        std::this_thread::yield();
+      }
+      outstanding.fetch_add(1, std::memory_order_relaxed);
+      write([&](SSIZE_T result) {
+        if (result != static_cast<SSIZE_T>(MESSAGE)) {
+          failed.fetch_add(1, std::memory_order_relaxed);
+        }
+        written.fetch_add(1, std::memory_order_relaxed);
+        outstanding.fetch_sub(1, std::memory_order_release);
+      });
+    }
+    while (outstanding.load(std::memory_order_acquire) != 0) {
+      std::this_thread::yield();
+    }
+  }
+
+  void run(const char* name, bool queued)
+  {
+    int client;
+    int server;
+    if (!connected(client, server)) {
+      printf("%s: connect failed: %d\n", name, errno);
+      return;
+    }
+    std::thread drainer(drain, server);
+
+    async::SocketHandle socket(client, 0);
+    async::WriteQueue queue(socket);
+    std::atomic<uint64_t> written(0);
+    std::atomic<uint64_t> failed(0);
+
+    uint64_t before = sends.load();
+    benchmark::Stopwatch stopwatch;
+    std::vector<std::thread> writers;
+    for (int i = 0; i < WRITERS; i++) {
+      writers.emplace_back([&]() {
+        produce([&](async::Callback callback) {
+          if (queued) {
+            queue.writeAsync(message, sizeof(message), std::move(callback));
+          } else {
+            socket.writeAsync(message, sizeof(message), std::move(callback));
+          }
+        }, written, failed);
+      });
+    }
+    for (std::thread& writer : writers) {
+      writer.join();
+    }
+    uint64_t elapsed = stopwatch.elapsed();
+    uint64_t calls = sends.load() - before;
+
+    socket.close();
+    drainer.join();
+
+    benchmark::report(name, written.load(), elapsed);
+#ifndef USE_IO_URING
+    printf("%-40s %12.3f\n", "  send calls per message",
+      static_cast<double>(calls) / static_cast<double>(written.load()));
+#else
+    (void)calls;
+#endif
+    printf("%-40s %12llu\n", "  failed writes", static_cast<unsigned long long>(failed.load()));
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  run("a write per message", false);
+  run("WriteQueue", true);
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_cork only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
@@ -0,0 +1,183 @@
+// Deadlines on socket reads. First 50k reads that never get any data are
+// started with a deadline 200ms out, on Unix socket pairs: every one must
+// complete with TIMED_OUT, and the process must not have opened a single
+// file descriptor for them (a timerfd per deadline would show up in
+// /proc/self/fd). Reports how late the reads timed out. Then compares round
+// trips whose reads carry a deadline that never passes with round trips
+// whose reads don't, which is the cost of arming and disarming a deadline.
+// Exits with 1 if a read reports anything but TIMED_OUT, or a descriptor
+// shows up.
+//
+// Build (Linux, see Makefile):
+//   make bench_deadline
+//   make URING=1 bench_deadline
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef __linux__
+#include <dirent.h>
+
+namespace {
+  const int READS = 50000;
+  const int READS_PER_SOCKET = 200;
+  const int ROUNDS = 200000;
+  const size_t MESSAGE = 64;
+
+  size_t descriptors()
+  {
+    size_t count = 0;
+    DIR* dir = opendir("/proc/self/fd");
+    while (readdir(dir) != nullptr) {
+      count++;
+    }
+    closedir(dir);
+    return count;
+  }
+
+  // Starts the reads, waits for all of them, and returns the number that
+  // reported anything but TIMED_OUT.
+  int timeouts(const std::vector<async::SocketHandle*>& readers)
+  {
+    static char buffer[64];
+
+    std::vector<uint64_t> lateness(READS);
+    std::atomic<int> completed(0);
+    std::atomic<int> failures(0);
+    async::Promise<int> done;
+    async::Future<int> finished = done.get_future();
+
+    size_t before = descriptors();
+    async::Deadline deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(200);
+
+    for (int i = 0; i < READS; i++) {
+      readers[i / READS_PER_SOCKET]->readAsync(
+        buffer,
+        sizeof(buffer),
+        [&, i](SSIZE_T result) {
+          lateness[i] = static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - deadline).count());
+          if (result != async::TIMED_OUT) {
+            failures.fetch_add(1, std::memory_order_relaxed);
+          }
+          if (completed.fetch_add(1, std::memory_order_acq_rel) + 1 == READS) {
+            done.set_value(0);
+          }
+        },
+        deadline);
+    }
+
+    size_t pending = descriptors();
+    finished.get();
+
+    benchmark::report_latency("read timed out, late by", lateness);
+    printf("%-40s %12d\n", "reads not timed out", failures.load());
+    printf("%-40s %12lld\n",
+      "descriptors opened for deadlines",
+      static_cast<long long>(pending) - static_cast<long long>(before));
+
+    return failures.load() + (pending == before ? 0 : 1);
+  }
+
+  // Like bench_callback: the next round starts from the read's completion.
+  struct Rounds {
+    async::SocketHandle* writer;
+    async::SocketHandle* reader;
+    bool deadline;
+    char out[MESSAGE];
+    char in[MESSAGE];
+    int remaining;
+    async::Promise<int> done;
+
+    void start()
+    {
+      auto next = [this](SSIZE_T) {
+        if (--remaining > 0) {
+          start();
+        } else {
+          done.set_value(0);
+        }
+      };
+
+      if (deadline) {
+        reader->readAsync(
+          in,
+          MESSAGE,
+          std::move(next),
+          std::chrono::steady_clock::now() + std::chrono::seconds(10));
+      } else {
+        reader->readAsync(in, MESSAGE, std::move(next));
+      }
+      writer->writeAsync(out, MESSAGE, [](SSIZE_T) {});
+    }
+  };
+
+  void measure(const char* name, async::SocketHandle* writer, async::SocketHandle* reader, bool deadline)
+  {
+    for (int run = 0; run < 2; run++) {
+      Rounds rounds;
+      rounds.writer = writer;
+      rounds.reader = reader;
+      rounds.deadline = deadline;
+      rounds.remaining = ROUNDS;
+      memset(rounds.out, 'x', sizeof(rounds.out));
+      async::Future<int> done = rounds.done.get_future();
+
+      benchmark::Stopwatch stopwatch;
+      loop::EventLoop::post([&rounds]() { rounds.start(); });
+      done.get();
+
+      if (run == 1) {
+        benchmark::report(name, ROUNDS, stopwatch.elapsed());
+      }
+    }
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  std::vector<async::SocketHandle*> readers;
+  std::vector<int> writers;
+  for (int i = 0; i < READS / READS_PER_SOCKET; i++) {
+    int sockets[2];
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, sockets);
+    readers.push_back(new async::SocketHandle(sockets[0], 0));
+    writers.push_back(sockets[1]);
+  }
+
+  int failures = timeouts(readers);
+
+  for (size_t i = 0; i < readers.size(); i++) {
+    readers[i]->close();
+    ::close(writers[i]);
+    delete readers[i];
+  }
+
+  int sockets[2];
+  socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, sockets);
+  async::SocketHandle writer(sockets[0], 0);
+  async::SocketHandle reader(sockets[1], 0);
+
+  measure("round trip", &writer, &reader, false);
+  measure("round trip, read with deadline", &writer, &reader, true);
+
+  writer.close();
+  reader.close();
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return failures == 0 ? 0 : 1;
+}
+#else
+int main()
+{
+  printf("bench_deadline only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
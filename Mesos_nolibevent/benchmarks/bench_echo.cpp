@@ -0,0 +1,165 @@
+// An echo server and its clients written as coroutines on the loops:
+// `CONNECTIONS` clients each send `ROUNDS` small messages over loopback TCP
+// and wait for every one to come back. Every connection has a coroutine on
+// either end, and the only threads are the loops themselves plus the main
+// thread, which just waits for the clients' results. Reports round trips
+// per second and heap allocations per I/O operation. The coroutine frames
+// come from the per-loop frame cache, so after the first wave of
+// connections they do not show up in the count; what is left is the
+// operation itself and the state of its future.
+//
+//   ./bench_echo [loops]
+//
+// Build (Linux, see Makefile):
+//   make bench_echo
+//   make URING=1 bench_echo
+
+#define BENCHMARK_COUNT_ALLOCATIONS
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+#include "../coroutine.hpp"
+
+#ifdef __linux__
+namespace {
+  const int CONNECTIONS = 1000;
+  const int ROUNDS = 200;
+  const size_t MESSAGE = 64;
+
+  int tcp_socket()
+  {
+    return socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  }
+
+  // Echoes everything back until the client hangs up.
+  async::Detached serve(async::SocketHandle* connection)
+  {
+    char buffer[MESSAGE];
+    for (;;) {
+      SSIZE_T bytes = co_await connection->readAsync(buffer, sizeof(buffer));
+      if (bytes <= 0) {
+        break;
+      }
+      if (co_await connection->writeAsync(buffer, bytes) != bytes) {
+        break;
+      }
+    }
+    connection->close();
+    delete connection;
+  }
+
+  // Hands every connection to a coroutine of its own, until the listener
+  // is closed.
+  async::Detached accept_all(async::SocketHandle* listener)
+  {
+    while (async::SocketHandle* connection = co_await listener->accept()) {
+      serve(connection);
+    }
+  }
+
+  // Returns the number of round trips that came back intact.
+  async::Future<int> client(sockaddr_in addr)
+  {
+    async::SocketHandle socket(tcp_socket(), loop::EventLoop::next());
+    DWORD error = co_await socket.connect(
+      reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    if (error != 0) {
+      socket.close();
+      co_return 0;
+    }
+
+    char message[MESSAGE];
+    char reply[MESSAGE];
+    memset(message, 'x', sizeof(message));
+
+    int rounds = 0;
+    for (; rounds < ROUNDS; rounds++) {
+      SSIZE_T written = co_await socket.writeAsync(message, sizeof(message));
+      if (written != static_cast<SSIZE_T>(MESSAGE)) {
+        break;
+      }
+
+      size_t received = 0;
+      while (received < MESSAGE) {
+        SSIZE_T bytes =
+          co_await socket.readAsync(reply + received, MESSAGE - received);
+        if (bytes <= 0) {
+          break;
+        }
+        received += static_cast<size_t>(bytes);
+      }
+      if (received < MESSAGE) {
+        break;
+      }
+    }
+
+    socket.close();
+    co_return rounds;
+  }
+
+  // Starts all the clients at once and waits for them to finish. Returns
+  // the number of round trips made.
+  int wave(const sockaddr_in& addr)
+  {
+    std::vector<async::Future<int>> clients;
+    clients.reserve(CONNECTIONS);
+    for (int i = 0; i < CONNECTIONS; i++) {
+      clients.push_back(client(addr));
+    }
+
+    int rounds = 0;
+    for (async::Future<int>& future : clients) {
+      rounds += future.get();
+    }
+    return rounds;
+  }
+}
+
+int main(int argc, char** argv)
+{
+  size_t loops = argc > 1 ? static_cast<size_t>(atoi(argv[1])) : 1;
+
+  loop::EventLoop::initialize(loop::EventLoop::Mode::RUN_TO_COMPLETION, loops);
+  std::thread eventloop(&loop::EventLoop::run);
+
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int listen_socket = tcp_socket();
+  bind(listen_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+  socklen_t length = sizeof(addr);
+  getsockname(listen_socket, reinterpret_cast<sockaddr*>(&addr), &length);
+
+  async::SocketHandle listener(listen_socket, 0);
+  listener.listen(SOMAXCONN);
+  accept_all(&listener);
+
+  // The first wave fills the frame caches.
+  wave(addr);
+
+  uint64_t before = benchmark::allocations.load();
+  benchmark::Stopwatch stopwatch;
+  int rounds = wave(addr);
+  uint64_t elapsed = stopwatch.elapsed();
+  uint64_t allocated = benchmark::allocations.load() - before;
+
+  listener.close();
+
+  // Every round trip is four operations: a write and a read on either end.
+  std::string name = std::to_string(loops) + " loops, round trips";
+  benchmark::report(name.c_str(), rounds, elapsed);
+  printf("%-40s %12.2f allocations/op\n",
+    "echo, per I/O operation",
+    static_cast<double>(allocated) / (4.0 * rounds));
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return rounds == CONNECTIONS * ROUNDS ? 0 : 1;
+}
+#else
+int main()
+{
+  printf("bench_echo only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
@@ -0,0 +1,123 @@
+// Measures what a promise/future pair costs per operation, for
+// std::promise/std::future and for async::Promise/async::Future: creating
+// the pair, setting the value and taking it, on one thread and between two
+// threads, and with a continuation attached before the value is set, which
+// is how the loop hands a result on without anyone blocking. Also what
+// when_all and when_any add per future they combine.
+//
+// Build (Linux, see Makefile):
+//   make bench_future
+
+#include "benchmark.hpp"
+#include "../future.hpp"
+
+namespace {
+  const int OPERATIONS = 1000000;
+  const int ROUNDS = 100000;
+  const int FAN_OUT = 64;
+
+  // Keeps the compiler from dropping the work.
+  volatile long sink;
+
+  template <template <typename> class P>
+  void same_thread(const char* name)
+  {
+    long sum = 0;
+    benchmark::Stopwatch stopwatch;
+    for (int i = 0; i < OPERATIONS; i++) {
+      P<long> promise;
+      auto future = promise.get_future();
+      promise.set_value(i);
+      sum += future.get();
+    }
+    benchmark::report(name, OPERATIONS, stopwatch.elapsed());
+    sink = sum;
+  }
+
+  // Two threads take turns: each sets the value the other one is blocked
+  // on. Every round is two handoffs.
+  template <template <typename> class P>
+  void ping_pong(const char* name)
+  {
+    std::vector<P<long>> pings(ROUNDS);
+    std::vector<P<long>> pongs(ROUNDS);
+
+    std::thread other([&pings, &pongs]() {
+      for (int i = 0; i < ROUNDS; i++) {
+        long value = pings[i].get_future().get();
+        pongs[i].set_value(value + 1);
+      }
+    });
+
+    benchmark::Stopwatch stopwatch;
+    for (int i = 0; i < ROUNDS; i++) {
+      auto future = pongs[i].get_future();
+      pings[i].set_value(i);
+      sink = future.get();
+    }
+    uint64_t elapsed = stopwatch.elapsed();
+    other.join();
+
+    benchmark::report(name, 2 * ROUNDS, elapsed);
+  }
+
+  void continuation(const char* name)
+  {
+    long sum = 0;
+    benchmark::Stopwatch stopwatch;
+    for (int i = 0; i < OPERATIONS; i++) {
+      async::Promise<long> promise;
+      promise.get_future().then([&sum](long value) { sum += value; });
+      promise.set_value(i);
+    }
+    benchmark::report(name, OPERATIONS, stopwatch.elapsed());
+    sink = sum;
+  }
+
+  // Combines `FAN_OUT` futures, sets their values in order and takes the
+  // combined result. Reports the cost per future, combinator included.
+  template <typename F>
+  void fan_in(const char* name, F combine)
+  {
+    long sum = 0;
+    benchmark::Stopwatch stopwatch;
+    for (int i = 0; i < OPERATIONS / FAN_OUT; i++) {
+      std::vector<async::Promise<long>> promises(FAN_OUT);
+      std::vector<async::Future<long>> futures;
+      futures.reserve(FAN_OUT);
+      for (async::Promise<long>& promise : promises) {
+        futures.push_back(promise.get_future());
+      }
+
+      auto combined = combine(std::move(futures));
+      for (int j = 0; j < FAN_OUT; j++) {
+        promises[j].set_value(j);
+      }
+      sum += combined.get().size();
+    }
+    benchmark::report(name, OPERATIONS / FAN_OUT * FAN_OUT, stopwatch.elapsed());
+    sink = sum;
+  }
+}
+
+int main()
+{
+  same_thread<std::promise>("std::future, set + get");
+  same_thread<async::Promise>("async::Future, set + get");
+
+  continuation("async::Future, then + set");
+
+  fan_in("async::when_all, 64 futures", [](std::vector<async::Future<long>> futures) {
+    return async::when_all(std::move(futures));
+  });
+  fan_in("async::when_any, 64 futures", [](std::vector<async::Future<long>> futures) {
+    return async::when_any(std::move(futures)).then(
+      [](async::WhenAnyResult<std::vector<async::Future<long>>> result) {
+        return std::move(result.futures);
+      });
+  });
+
+  ping_pong<std::promise>("std::future, cross-thread handoff");
+  ping_pong<async::Promise>("async::Future, cross-thread handoff");
+  return 0;
+}
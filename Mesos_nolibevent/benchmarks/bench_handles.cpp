@@ -0,0 +1,231 @@
+// Compares handles owned through a HandleTable (see handles.hpp) with
+// handles new'd and deleted by hand, the way createAsyncHandle and accept
+// hand them out.
+//
+//   churn         1M handles opened and closed, 1024 open at a time: first
+//                 handles of an invalid descriptor, which measures the
+//                 bookkeeping (plus the two system calls that fail on it),
+//                 then Unix sockets bound to the event loop
+//   lookup        1M lookups of random open ids on the loop thread, where
+//                 completions run, and 1M of ids that were closed, every
+//                 one of which must fail
+//   scan          a pass over 100k open handles, with `for_each`, which
+//                 takes a reference to each one, and with `scan`, which
+//                 doesn't
+//
+// Exits with 1 if a closed id still finds a handle.
+//
+// Build (Linux, see Makefile):
+//   make bench_handles
+//   make URING=1 bench_handles
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+#include "../handles.hpp"
+
+#include <random>
+#include <typeinfo>
+
+#ifdef __linux__
+namespace {
+  const int HANDLES = 1000000;
+  const size_t LIVE = 1024;
+  const int LOOKUPS = 1000000;
+  const size_t SCANNED = 100000;
+
+  // Keeps the compiler from dropping the work.
+  volatile uintptr_t sink;
+
+  int invalid()
+  {
+    return INVALID_HANDLE_VALUE;
+  }
+
+  int unix_socket()
+  {
+    return ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  }
+
+  template <typename T>
+  void churn_heap(const char* name, int (*descriptor)())
+  {
+    std::vector<async::Handle*> live(LIVE, nullptr);
+
+    benchmark::Stopwatch stopwatch;
+    for (int i = 0; i < HANDLES; i++) {
+      async::Handle*& handle = live[i % LIVE];
+      if (handle != nullptr) {
+        handle->close();
+        delete handle;
+      }
+      handle = new T(descriptor(), 0);
+    }
+    uint64_t elapsed = stopwatch.elapsed();
+
+    for (async::Handle* handle : live) {
+      handle->close();
+      delete handle;
+    }
+    benchmark::report(name, HANDLES, elapsed);
+  }
+
+  template <typename T>
+  void churn_table(const char* name, int (*descriptor)())
+  {
+    async::HandleTable table;
+    std::vector<async::HandleId> live(LIVE, async::INVALID_HANDLE_ID);
+
+    benchmark::Stopwatch stopwatch;
+    for (int i = 0; i < HANDLES; i++) {
+      async::HandleId& id = live[i % LIVE];
+      if (id != async::INVALID_HANDLE_ID) {
+        table.close(id);
+      }
+      id = table.emplace<T>(descriptor(), 0);
+    }
+    uint64_t elapsed = stopwatch.elapsed();
+
+    for (async::HandleId id : live) {
+      table.close(id);
+    }
+    benchmark::report(name, HANDLES, elapsed);
+  }
+
+  // Runs `f` on the loop thread and waits for it.
+  template <typename F>
+  void on_loop(F f)
+  {
+    async::Promise<int> done;
+    async::Future<int> finished = done.get_future();
+    loop::EventLoop::post([&f, &done]() {
+      f();
+      done.set_value(0);
+    });
+    finished.get();
+  }
+
+  // Returns the number of closed ids that found a handle.
+  int lookups()
+  {
+    async::HandleTable table;
+    std::vector<async::HandleId> open;
+    std::vector<async::HandleId> closed;
+    for (size_t i = 0; i < 2 * LIVE; i++) {
+      async::HandleId id = table.emplace<async::SocketHandle>(INVALID_SOCKET, 0);
+      (i % 2 == 0 ? open : closed).push_back(id);
+    }
+
+    // The closed slots get new handles, with the same indexes.
+    for (async::HandleId id : closed) {
+      table.close(id);
+    }
+    for (size_t i = 0; i < closed.size(); i++) {
+      table.emplace<async::SocketHandle>(INVALID_SOCKET, 0);
+    }
+
+    std::mt19937 random(42);
+    std::vector<uint32_t> order(LOOKUPS);
+    for (uint32_t& index : order) {
+      index = random() % LIVE;
+    }
+
+    int found = 0;
+    on_loop([&]() {
+      benchmark::Stopwatch stopwatch;
+      for (uint32_t index : order) {
+        async::HandleTable::Ref ref = table.lookup(open[index]);
+        sink = reinterpret_cast<uintptr_t>(ref.get());
+      }
+      benchmark::report("lookup, open id", LOOKUPS, stopwatch.elapsed());
+
+      stopwatch.reset();
+      for (uint32_t index : order) {
+        if (table.lookup(closed[index])) {
+          found++;
+        }
+      }
+      benchmark::report("lookup, closed id", LOOKUPS, stopwatch.elapsed());
+    });
+    printf("%-40s %12d\n", "closed ids that found a handle", found);
+    return found;
+  }
+
+  void scans()
+  {
+    // Other allocations come between the heap handles, as they would in
+    // a process that has been running for a while.
+    std::vector<async::Handle*> heap;
+    std::vector<std::unique_ptr<char[]>> other;
+    async::HandleTable table;
+    for (size_t i = 0; i < SCANNED; i++) {
+      heap.push_back(new async::SocketHandle(INVALID_SOCKET, 0));
+      other.emplace_back(new char[64 + i % 192]);
+      table.emplace<async::SocketHandle>(INVALID_SOCKET, 0);
+    }
+
+    for (int run = 0; run < 2; run++) {
+      uintptr_t sum = 0;
+      benchmark::Stopwatch stopwatch;
+      for (async::Handle* handle : heap) {
+        sum += reinterpret_cast<uintptr_t>(&typeid(*handle));
+      }
+      uint64_t elapsed = stopwatch.elapsed();
+      sink = sum;
+      if (run == 1) {
+        benchmark::report("scan, heap handles", SCANNED, elapsed);
+      }
+
+      sum = 0;
+      stopwatch.reset();
+      table.for_each([&sum](async::HandleId, async::Handle& handle) {
+        sum += reinterpret_cast<uintptr_t>(&typeid(handle));
+      });
+      elapsed = stopwatch.elapsed();
+      sink = sum;
+      if (run == 1) {
+        benchmark::report("scan, table, for_each", SCANNED, elapsed);
+      }
+
+      sum = 0;
+      stopwatch.reset();
+      table.scan([&sum](async::HandleId, async::Handle& handle) {
+        sum += reinterpret_cast<uintptr_t>(&typeid(handle));
+      });
+      elapsed = stopwatch.elapsed();
+      sink = sum;
+      if (run == 1) {
+        benchmark::report("scan, table, scan", SCANNED, elapsed);
+      }
+    }
+
+    for (async::Handle* handle : heap) {
+      delete handle;
+    }
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  churn_heap<async::PipeHandle>("churn, heap, no descriptor", &invalid);
+  churn_table<async::PipeHandle>("churn, table, no descriptor", &invalid);
+  churn_heap<async::SocketHandle>("churn, heap, Unix socket", &unix_socket);
+  churn_table<async::SocketHandle>("churn, table, Unix socket", &unix_socket);
+
+  int found = lookups();
+  scans();
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return found == 0 ? 0 : 1;
+}
+#else
+int main()
+{
+  printf("bench_handles only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
@@ -0,0 +1,120 @@
+// Compares the two modes of the Windows event loop with a socket ping-pong
+// over loopback TCP: THREAD_POOL, where completions run on the default
+// thread pool, and RUN_TO_COMPLETION, where the thread in EventLoop::run
+// dequeues them in batches from its own completion port.
+//
+// The mode can only be picked once per process, so run it once per mode:
+//   bench_modes pool
+//   bench_modes rtc
+//
+// Build (Windows, from a developer prompt):
+//   cl /std:c++17 /O2 /EHsc /I.. bench_modes.cpp ..\clock.cpp ..\future.cpp ^
+//     ..\cancellation.cpp ..\pool.cpp ..\buffers.cpp ..\task_queue.cpp ^
+//     ..\timer_wheel.cpp ..\eventloop.cpp ..\async_io.cpp
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef _WIN32
+#pragma comment(lib, "Ws2_32.lib")
+#pragma comment(lib, "Mswsock.lib")
+
+namespace {
+  const int ROUNDS = 100000;
+  const size_t MESSAGE = 64;
+  const u_short PORT = 27016;
+
+  SOCKET overlapped_socket()
+  {
+    return WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0, WSA_FLAG_OVERLAPPED);
+  }
+
+  // Echoes every message back to the client.
+  void serve(async::SocketHandle* server)
+  {
+    char buf[MESSAGE];
+    for (int i = 0; i < ROUNDS; i++) {
+      server->readAsync(buf, MESSAGE).get();
+      server->writeAsync(buf, MESSAGE).get();
+    }
+  }
+}
+
+int main(int argc, char** argv)
+{
+  const char* name = argc > 1 ? argv[1] : "pool";
+  loop::EventLoop::Mode mode = strcmp(name, "rtc") == 0
+    ? loop::EventLoop::Mode::RUN_TO_COMPLETION
+    : loop::EventLoop::Mode::THREAD_POOL;
+
+  WSADATA wsa;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+    return 1;
+  }
+
+  loop::EventLoop::initialize(mode);
+  std::thread eventloop(&loop::EventLoop::run);
+
+  sockaddr_in addr = { 0 };
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  SOCKET listen_socket = overlapped_socket();
+  bind(listen_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+
+  async::SocketHandle listener(listen_socket);
+  listener.listen(SOMAXCONN);
+  async::Future<async::SocketHandle*> accepted = listener.accept();
+
+  async::SocketHandle client(overlapped_socket());
+  if (client.connect(reinterpret_cast<sockaddr*>(&addr), sizeof(addr)).get() != 0) {
+    printf("connect failed\n");
+    return 1;
+  }
+
+  async::SocketHandle* server = accepted.get();
+  if (server == nullptr) {
+    printf("accept failed\n");
+    return 1;
+  }
+
+  std::thread echo(serve, server);
+
+  std::vector<uint64_t> samples;
+  samples.reserve(ROUNDS);
+
+  char buf[MESSAGE] = { 0 };
+  benchmark::Stopwatch total;
+  for (int i = 0; i < ROUNDS; i++) {
+    benchmark::Stopwatch rtt;
+    client.writeAsync(buf, MESSAGE).get();
+    client.readAsync(buf, MESSAGE).get();
+    samples.push_back(rtt.elapsed());
+  }
+  uint64_t elapsed = total.elapsed();
+  echo.join();
+
+  std::string label = std::string(name) + " ping-pong";
+  benchmark::report(label.c_str(), ROUNDS, elapsed);
+  benchmark::report_latency(label.c_str(), samples);
+
+  client.close();
+  server->close();
+  listener.close();
+  delete server;
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  WSACleanup();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_modes only runs on Windows, the reactor backends always run\n"
+         "to completion (see bench_reactor)\n");
+  return 0;
+}
+#endif // _WIN32
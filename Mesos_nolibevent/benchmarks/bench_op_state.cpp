@@ -0,0 +1,204 @@
+// What a read that returns a future costs, now that the state of the
+// future is kept in the operation context. Runs 1M round trips over a Unix
+// socket pair, each started from the completion of the last one on the
+// loop thread, for three kinds of read:
+//
+//   callback            the callback API, for reference
+//   promise + callback  the way the future-returning reads used to work:
+//                       a promise whose state is allocated on its own,
+//                       captured by the callback of the read
+//   future              the future-returning read
+//
+// Counts the calls to the global operator new per read (operation contexts
+// come from the operation pool, so only the promise's state should show
+// up), and the instructions and cache misses of the loop thread per round
+// trip, from perf_event_open, in user space only. The counters print n/a
+// where the hardware counters can't be opened (in most VMs and containers).
+//
+// Build (Linux, see Makefile):
+//   make bench_op_state
+//   make URING=1 bench_op_state
+
+#define BENCHMARK_COUNT_ALLOCATIONS
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+namespace {
+  const int ROUNDS = 1000000;
+  const int WARMUP = 10000;
+  const size_t MESSAGE = 64;
+
+  enum class Kind {
+    CALLBACK,
+    PROMISE,
+    FUTURE
+  };
+
+  // A hardware counter of the thread that opens it, or -1 if it can't be
+  // opened.
+  int open_counter(uint64_t config)
+  {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+  }
+
+  struct Counters {
+    int instructions = -1;
+    int misses = -1;
+
+    void start()
+    {
+      for (int fd : { instructions, misses }) {
+        if (fd >= 0) {
+          ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+          ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+      }
+    }
+
+    void stop()
+    {
+      for (int fd : { instructions, misses }) {
+        if (fd >= 0) {
+          ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+      }
+    }
+
+    void print(const char* name, int fd, int count) const
+    {
+      uint64_t value = 0;
+      if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+        printf("%-40s %12s\n", name, "n/a");
+      } else {
+        printf("%-40s %12.1f per round trip\n", name, static_cast<double>(value) / count);
+      }
+    }
+  };
+
+  struct Rounds {
+    Kind kind;
+    async::SocketHandle* writer;
+    async::SocketHandle* reader;
+    char out[MESSAGE];
+    char in[MESSAGE];
+    int remaining;
+    async::Promise<int> done;
+
+    void next()
+    {
+      if (--remaining > 0) {
+        start();
+      } else {
+        done.set_value(0);
+      }
+    }
+
+    void start()
+    {
+      if (kind == Kind::CALLBACK) {
+        reader->readAsync(in, MESSAGE, [this](SSIZE_T) { next(); });
+      } else if (kind == Kind::PROMISE) {
+        async::Promise<SSIZE_T> promise;
+        async::Future<SSIZE_T> future = promise.get_future();
+        reader->readAsync(in, MESSAGE, [promise = std::move(promise)](SSIZE_T result) mutable {
+          promise.set_value(result);
+        });
+        future.then([this](SSIZE_T) { next(); });
+      } else {
+        reader->readAsync(in, MESSAGE).then([this](SSIZE_T) { next(); });
+      }
+      writer->writeAsync(out, MESSAGE, [](SSIZE_T) {});
+    }
+  };
+
+  void run(
+    const char* name,
+    Kind kind,
+    async::SocketHandle* writer,
+    async::SocketHandle* reader,
+    Counters& counters)
+  {
+    for (int count : { WARMUP, ROUNDS }) {
+      Rounds rounds;
+      rounds.kind = kind;
+      rounds.writer = writer;
+      rounds.reader = reader;
+      rounds.remaining = count;
+      memset(rounds.out, 'x', sizeof(rounds.out));
+      async::Future<int> done = rounds.done.get_future();
+
+      uint64_t before = benchmark::allocations.load();
+      benchmark::Stopwatch stopwatch;
+      loop::EventLoop::post([&rounds, &counters]() {
+        counters.start();
+        rounds.start();
+      });
+      done.get();
+      uint64_t elapsed = stopwatch.elapsed();
+      counters.stop();
+
+      uint64_t allocated = benchmark::allocations.load() - before;
+
+      if (count == ROUNDS) {
+        benchmark::report(name, count, elapsed);
+        printf("%-40s %12.4f per read\n", "  heap allocations", static_cast<double>(allocated) / count);
+        counters.print("  instructions", counters.instructions, count);
+        counters.print("  cache misses", counters.misses, count);
+      }
+    }
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  // The counters have to be opened on the loop thread to count it.
+  Counters counters;
+  async::Promise<int> opened;
+  async::Future<int> ready = opened.get_future();
+  loop::EventLoop::post([&counters, &opened]() {
+    counters.instructions = open_counter(PERF_COUNT_HW_INSTRUCTIONS);
+    counters.misses = open_counter(PERF_COUNT_HW_CACHE_MISSES);
+    opened.set_value(0);
+  });
+  ready.get();
+
+  int sockets[2];
+  socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0, sockets);
+  async::SocketHandle writer(sockets[0], 0);
+  async::SocketHandle reader(sockets[1], 0);
+
+  run("round trip, callback", Kind::CALLBACK, &writer, &reader, counters);
+  run("round trip, promise + callback", Kind::PROMISE, &writer, &reader, counters);
+  run("round trip, future", Kind::FUTURE, &writer, &reader, counters);
+
+  writer.close();
+  reader.close();
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_op_state only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
@@ -0,0 +1,211 @@
+// Compares the operation pool (see pool.hpp) with the global heap. The
+// first two cases each make 10M allocations of a typical operation size:
+//
+//   same thread   allocate and free on one thread, 64 blocks live at a time
+//   cross thread  allocate on one thread, free on another, the way an
+//                 operation started by the application is freed by the
+//                 loop that completes it
+//
+// The last case runs 10M reads and writes over a Unix socket pair with
+// the callback API. Every operation context now comes from the pool, so
+// it counts the calls that still reach the global operator new, which
+// should be none once the pool is warm.
+//
+// Build (Linux, see Makefile):
+//   make bench_pool
+//   make URING=1 bench_pool
+
+#define BENCHMARK_COUNT_ALLOCATIONS
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+#include "../pool.hpp"
+
+#include <cstdlib>
+
+#ifdef __linux__
+namespace {
+  const int OPERATIONS = 10000000;
+  const size_t SIZE = 192;
+  const int LIVE = 64;
+
+  struct Heap {
+    static void* allocate() { return malloc(SIZE); }
+    static void deallocate(void* block) { free(block); }
+  };
+
+  struct Pool {
+    static void* allocate() { return async::internal::allocate_operation(SIZE); }
+    static void deallocate(void* block) { async::internal::deallocate_operation(block, SIZE); }
+  };
+
+  template <typename A>
+  void same_thread(const char* name)
+  {
+    void* blocks[LIVE] = {};
+
+    benchmark::Stopwatch stopwatch;
+    for (int i = 0; i < OPERATIONS; i++) {
+      void*& block = blocks[i % LIVE];
+      if (block != nullptr) {
+        A::deallocate(block);
+      }
+      block = A::allocate();
+      *static_cast<char*>(block) = 1;
+    }
+    uint64_t elapsed = stopwatch.elapsed();
+
+    for (int i = 0; i < LIVE; i++) {
+      A::deallocate(blocks[i]);
+    }
+    benchmark::report(name, OPERATIONS, elapsed);
+  }
+
+  // Hands blocks from one thread to the other in batches, so that the
+  // handoff costs little next to the allocations even on a single core.
+  struct Handoff {
+    static const size_t BATCH = 4096;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<void*> batch;
+    bool full = false;
+
+    void put(std::vector<void*>& blocks)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [this]() { return !full; });
+      batch.swap(blocks);
+      full = true;
+      changed.notify_one();
+    }
+
+    void take(std::vector<void*>& blocks)
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [this]() { return full; });
+      batch.swap(blocks);
+      full = false;
+      changed.notify_one();
+    }
+  };
+
+  template <typename A>
+  void cross_thread(const char* name)
+  {
+    const int batches = OPERATIONS / static_cast<int>(Handoff::BATCH);
+    Handoff handoff;
+
+    benchmark::Stopwatch stopwatch;
+    std::thread consumer([&handoff, batches]() {
+      std::vector<void*> blocks;
+      for (int i = 0; i < batches; i++) {
+        handoff.take(blocks);
+        for (void* block : blocks) {
+          A::deallocate(block);
+        }
+        blocks.clear();
+      }
+    });
+
+    std::vector<void*> blocks;
+    for (int i = 0; i < batches; i++) {
+      for (size_t j = 0; j < Handoff::BATCH; j++) {
+        void* block = A::allocate();
+        *static_cast<char*>(block) = 1;
+        blocks.push_back(block);
+      }
+      handoff.put(blocks);
+    }
+    consumer.join();
+
+    benchmark::report(name, static_cast<uint64_t>(batches) * Handoff::BATCH, stopwatch.elapsed());
+  }
+
+  // Like bench_callback, the next round starts from the read's completion.
+  struct Rounds {
+    async::SocketHandle* writer;
+    async::SocketHandle* reader;
+    char out[64];
+    char in[64];
+    int remaining;
+    async::Promise<int> done;
+
+    void start()
+    {
+      reader->readAsync(in, sizeof(in), [this](SSIZE_T) {
+        if (--remaining > 0) {
+          start();
+        } else {
+          done.set_value(0);
+        }
+      });
+      writer->writeAsync(out, sizeof(out), [](SSIZE_T) {});
+    }
+  };
+
+  void round_trips(
+    const char* name,
+    async::SocketHandle* writer,
+    async::SocketHandle* reader,
+    int count,
+    bool report)
+  {
+    Rounds rounds;
+    rounds.writer = writer;
+    rounds.reader = reader;
+    rounds.remaining = count;
+    memset(rounds.out, 'x', sizeof(rounds.out));
+    async::Future<int> done = rounds.done.get_future();
+
+    uint64_t before = benchmark::allocations.load();
+    benchmark::Stopwatch stopwatch;
+    loop::EventLoop::post([&rounds]() { rounds.start(); });
+    done.get();
+    uint64_t elapsed = stopwatch.elapsed();
+
+    uint64_t allocated = benchmark::allocations.load() - before;
+
+    if (!report) {
+      return;
+    }
+    benchmark::report(name, 2 * static_cast<uint64_t>(count), elapsed);
+    printf("%-40s %12.4f allocations/op\n",
+      name,
+      static_cast<double>(allocated) / (2.0 * count));
+  }
+}
+
+int main()
+{
+  same_thread<Heap>("same thread, heap");
+  same_thread<Pool>("same thread, pool");
+  cross_thread<Heap>("cross thread, heap");
+  cross_thread<Pool>("cross thread, pool");
+
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  int sockets[2];
+  socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets);
+  async::SocketHandle writer(sockets[0], 0);
+  async::SocketHandle reader(sockets[1], 0);
+
+  // Warms the pools of the loop thread up first.
+  round_trips("read + write", &writer, &reader, 10000, false);
+  round_trips("read + write", &writer, &reader, OPERATIONS / 2, true);
+
+  writer.close();
+  reader.close();
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_pool only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
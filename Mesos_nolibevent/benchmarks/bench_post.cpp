@@ -0,0 +1,85 @@
+// Compares EventLoop::post with EventLoop::delay(0), the way to run a
+// function on the loop before post existed: the throughput of posting from
+// other threads, and the latency from posting to running on an idle loop.
+//
+// Build (Linux, see Makefile):
+//   make bench_post
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+
+namespace {
+  const int FUNCTIONS = 1000000;
+  const int SAMPLES = 20000;
+  const int THREADS = 4;
+
+  std::atomic<int> ran(0);
+
+  // `THREADS` threads hand `FUNCTIONS` functions to the loop between them,
+  // and the clock stops once the loop ran all of them.
+  template <typename F>
+  void throughput(const char* name, F submit)
+  {
+    ran.store(0);
+
+    benchmark::Stopwatch stopwatch;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREADS; i++) {
+      threads.emplace_back([&submit]() {
+        for (int j = 0; j < FUNCTIONS / THREADS; j++) {
+          submit([]() { ran.fetch_add(1, std::memory_order_relaxed); });
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    while (ran.load() < FUNCTIONS) {
+      std::this_thread::yield();
+    }
+
+    benchmark::report(name, FUNCTIONS, stopwatch.elapsed());
+  }
+
+  // Hands one function at a time to the idle loop and measures how long it
+  // takes until the function runs.
+  template <typename F>
+  void latency(const char* name, F submit)
+  {
+    std::vector<uint64_t> samples;
+    samples.reserve(SAMPLES);
+
+    for (int i = 0; i < SAMPLES; i++) {
+      std::atomic<bool> done(false);
+      benchmark::Stopwatch stopwatch;
+      submit([&done]() { done.store(true, std::memory_order_release); });
+      while (!done.load(std::memory_order_acquire)) {}
+      samples.push_back(stopwatch.elapsed());
+    }
+
+    benchmark::report_latency(name, samples);
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  auto post = [](const std::function<void()>& function) {
+    loop::EventLoop::post(function);
+  };
+  auto delay = [](const std::function<void()>& function) {
+    loop::EventLoop::delay(std::chrono::nanoseconds::zero(), function);
+  };
+
+  throughput("post, 4 threads", post);
+  throughput("delay(0), 4 threads", delay);
+
+  latency("post, wakeup", post);
+  latency("delay(0), wakeup", delay);
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
@@ -0,0 +1,224 @@
+// Compares the Linux event loop (epoll, or io_uring when built with
+// USE_IO_URING) against the thread-pool dispatch model used by the Windows
+// implementation, where every completion is picked up by some pool thread
+// before the promise is fulfilled.
+//
+// The Windows thread pool is not available on Linux, so the thread-pool
+// side is modelled with a small pool of std::threads: each operation is
+// queued to the pool, performed there with a blocking call, and its result
+// handed back through a std::promise. That is the same number of thread
+// hops a completion takes through CreateThreadpoolIo.
+//
+// Build (Linux, see Makefile):
+//   make bench_reactor
+//   make URING=1 bench_reactor
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#include <deque>
+
+#ifdef __linux__
+namespace {
+#ifdef USE_IO_URING
+  const char* BACKEND = "io_uring";
+#else
+  const char* BACKEND = "epoll";
+#endif
+
+  const int ROUNDS = 100000;
+  const size_t MESSAGE = 64;
+  const size_t BULK = 64 * 1024;
+  const size_t BULK_TOTAL = 1024 * 1024 * 1024;
+
+  // Thread pool that performs blocking I/O and completes a promise, in the
+  // same way socketCallback does from a thread pool thread.
+  class ThreadPool {
+  public:
+    ThreadPool(size_t threads)
+    {
+      for (size_t i = 0; i < threads; i++) {
+        m_threads.emplace_back([this]() { work(); });
+      }
+    }
+
+    ~ThreadPool()
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_exit = true;
+      }
+      m_cv.notify_all();
+      for (std::thread& thread : m_threads) {
+        thread.join();
+      }
+    }
+
+    std::future<SSIZE_T> read(int fd, void* data, size_t size)
+    {
+      return submit([fd, data, size]() {
+        return ::read(fd, data, size);
+      });
+    }
+
+    std::future<SSIZE_T> write(int fd, const void* data, size_t size)
+    {
+      return submit([fd, data, size]() {
+        return ::write(fd, data, size);
+      });
+    }
+
+  private:
+    std::future<SSIZE_T> submit(std::function<SSIZE_T()> io)
+    {
+      std::shared_ptr<std::promise<SSIZE_T>> promise =
+        std::make_shared<std::promise<SSIZE_T>>();
+      std::future<SSIZE_T> future = promise->get_future();
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back([io, promise]() { promise->set_value(io()); });
+      }
+      m_cv.notify_one();
+      return future;
+    }
+
+    void work()
+    {
+      for (;;) {
+        std::function<void()> task;
+        {
+          std::unique_lock<std::mutex> lock(m_mutex);
+          m_cv.wait(lock, [this]() { return m_exit || !m_queue.empty(); });
+          if (m_queue.empty()) {
+            return;
+          }
+          task = std::move(m_queue.front());
+          m_queue.pop_front();
+        }
+        task();
+      }
+    }
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void()>> m_queue;
+    bool m_exit = false;
+  };
+
+  // Runs `ROUNDS` request/response exchanges between two threads. `read`
+  // and `write` take the side (0 = client, 1 = server) and return futures.
+  template <typename Read, typename Write>
+  void ping_pong(const char* name, Read read, Write write)
+  {
+    std::thread server([&]() {
+      char buf[MESSAGE];
+      for (int i = 0; i < ROUNDS; i++) {
+        read(1, buf, MESSAGE).get();
+        write(1, buf, MESSAGE).get();
+      }
+    });
+
+    std::vector<uint64_t> samples;
+    samples.reserve(ROUNDS);
+
+    char buf[MESSAGE] = { 0 };
+    benchmark::Stopwatch total;
+    for (int i = 0; i < ROUNDS; i++) {
+      benchmark::Stopwatch rtt;
+      write(0, buf, MESSAGE).get();
+      read(0, buf, MESSAGE).get();
+      samples.push_back(rtt.elapsed());
+    }
+    uint64_t elapsed = total.elapsed();
+    server.join();
+
+    benchmark::report(name, ROUNDS, elapsed);
+    benchmark::report_latency(name, samples);
+  }
+
+  // Streams `BULK_TOTAL` bytes from one side to the other.
+  template <typename Read, typename Write>
+  void bulk(const char* name, Read read, Write write)
+  {
+    std::thread reader([&]() {
+      std::unique_ptr<char[]> buf(new char[BULK]);
+      size_t received = 0;
+      while (received < BULK_TOTAL) {
+        SSIZE_T bytes = read(1, buf.get(), BULK).get();
+        if (bytes <= 0) {
+          break;
+        }
+        received += static_cast<size_t>(bytes);
+      }
+    });
+
+    std::unique_ptr<char[]> buf(new char[BULK]());
+    benchmark::Stopwatch stopwatch;
+    for (size_t sent = 0; sent < BULK_TOTAL; sent += BULK) {
+      write(0, buf.get(), BULK).get();
+    }
+    reader.join();
+    uint64_t elapsed = stopwatch.elapsed();
+
+    printf("%-40s %12.1f MB/s\n",
+      name,
+      (static_cast<double>(BULK_TOTAL) / (1024 * 1024)) / (elapsed / 1e9));
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  {
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds);
+    async::SocketHandle sockets[2] = { fds[0], fds[1] };
+
+    auto read = [&sockets](int side, void* data, size_t size) {
+      return sockets[side].readAsync(data, size);
+    };
+    auto write = [&sockets](int side, const void* data, size_t size) {
+      return sockets[side].writeAsync(data, size);
+    };
+
+    ping_pong((std::string(BACKEND) + " ping-pong").c_str(), read, write);
+    bulk((std::string(BACKEND) + " bulk").c_str(), read, write);
+
+    sockets[0].close();
+    sockets[1].close();
+  }
+
+  {
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds);
+    ThreadPool pool(std::max(4u, std::thread::hardware_concurrency()));
+
+    auto read = [&](int side, void* data, size_t size) {
+      return pool.read(fds[side], data, size);
+    };
+    auto write = [&](int side, const void* data, size_t size) {
+      return pool.write(fds[side], data, size);
+    };
+
+    ping_pong("thread-pool ping-pong", read, write);
+    bulk("thread-pool bulk", read, write);
+
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_reactor only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
@@ -0,0 +1,168 @@
+// Measures how the Linux event loop scales with the number of loops, each
+// run by its own thread pinned to its own core: new connections per second
+// over loopback TCP, and bytes per second echoed over a fixed set of
+// loopback TCP connections spread over the loops.
+//
+// The loops can only be set up once per process, so run it once per loop
+// count, up to the number of cores:
+//   for n in 1 2 4 8; do ./bench_scaling $n; done
+//
+// The driving threads (two per loop) block on the futures, so they share
+// the cores with the loops. The numbers are for comparing loop counts with
+// each other, not for comparing against other servers.
+//
+// Build (Linux, see Makefile):
+//   make bench_scaling
+//   make URING=1 bench_scaling
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#ifdef __linux__
+namespace {
+  const int CONNECTIONS = 20000;
+  const size_t MESSAGE = 16 * 1024;
+  const size_t ECHO_TOTAL = 256 * 1024 * 1024;
+
+  sockaddr_in loopback()
+  {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+  }
+
+  int tcp_socket()
+  {
+    return socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  }
+
+  // Runs `count` iterations of `work`, split over `threads` threads.
+  template <typename F>
+  uint64_t spread(size_t threads, int count, F work)
+  {
+    std::atomic<int> remaining(count);
+    std::vector<std::thread> workers;
+
+    benchmark::Stopwatch stopwatch;
+    for (size_t i = 0; i < threads; i++) {
+      workers.emplace_back([&remaining, &work, i]() {
+        while (remaining.fetch_sub(1) > 0) {
+          work(i);
+        }
+      });
+    }
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+    return stopwatch.elapsed();
+  }
+
+  // Connects and accepts through the loops and closes both ends right
+  // away. Accepted sockets are spread over the loops in round robin order.
+  void connections(size_t threads)
+  {
+    sockaddr_in addr = loopback();
+    int listen_socket = tcp_socket();
+    int one = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    bind(listen_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    socklen_t length = sizeof(addr);
+    getsockname(listen_socket, reinterpret_cast<sockaddr*>(&addr), &length);
+
+    async::SocketHandle listener(listen_socket);
+    listener.listen(SOMAXCONN);
+
+    uint64_t elapsed = spread(threads, CONNECTIONS, [&](size_t) {
+      async::Future<async::SocketHandle*> accepted = listener.accept();
+
+      async::SocketHandle client(tcp_socket(), loop::EventLoop::next());
+      client.connect(reinterpret_cast<sockaddr*>(&addr), sizeof(addr)).get();
+
+      async::SocketHandle* server = accepted.get();
+      client.close();
+      if (server != nullptr) {
+        server->close();
+        delete server;
+      }
+    });
+
+    listener.close();
+
+    std::string name = std::to_string(loop::EventLoop::loops()) + " loops, connections";
+    benchmark::report(name.c_str(), CONNECTIONS, elapsed);
+  }
+
+  // One connection per thread, echoing `MESSAGE` bytes at a time. Both
+  // ends of a connection are bound to the same loop, and the connections
+  // are spread evenly over the loops.
+  void echo(size_t threads)
+  {
+    sockaddr_in addr = loopback();
+    int listen_socket = tcp_socket();
+    bind(listen_socket, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+    socklen_t length = sizeof(addr);
+    getsockname(listen_socket, reinterpret_cast<sockaddr*>(&addr), &length);
+    ::listen(listen_socket, SOMAXCONN);
+
+    std::vector<std::unique_ptr<async::SocketHandle>> clients;
+    std::vector<std::unique_ptr<async::SocketHandle>> servers;
+    for (size_t i = 0; i < threads; i++) {
+      int client = tcp_socket();
+      ::connect(client, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+      int server = ::accept4(listen_socket, nullptr, nullptr, SOCK_CLOEXEC);
+
+      size_t index = i % loop::EventLoop::loops();
+      clients.emplace_back(new async::SocketHandle(client, index));
+      servers.emplace_back(new async::SocketHandle(server, index));
+    }
+    ::close(listen_socket);
+
+    int rounds = static_cast<int>(ECHO_TOTAL / MESSAGE);
+    uint64_t elapsed = spread(threads, rounds, [&](size_t i) {
+      thread_local std::unique_ptr<char[]> buf(new char[MESSAGE]());
+      clients[i]->writeAsync(buf.get(), MESSAGE).get();
+      for (size_t received = 0; received < MESSAGE;) {
+        SSIZE_T bytes = servers[i]->readAsync(buf.get(), MESSAGE - received).get();
+        if (bytes <= 0) {
+          return;
+        }
+        received += static_cast<size_t>(bytes);
+      }
+    });
+
+    for (size_t i = 0; i < threads; i++) {
+      clients[i]->close();
+      servers[i]->close();
+    }
+
+    printf("%-40s %12.1f MB/s\n",
+      (std::to_string(loop::EventLoop::loops()) + " loops, bytes").c_str(),
+      (static_cast<double>(rounds) * MESSAGE / (1024 * 1024)) / (elapsed / 1e9));
+  }
+}
+
+int main(int argc, char** argv)
+{
+  size_t loops = argc > 1
+    ? static_cast<size_t>(atoi(argv[1]))
+    : std::max(1u, std::thread::hardware_concurrency());
+
+  loop::EventLoop::initialize(loop::EventLoop::Mode::RUN_TO_COMPLETION, loops);
+  std::thread eventloop(&loop::EventLoop::run);
+
+  connections(2 * loops);
+  echo(2 * loops);
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_scaling only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
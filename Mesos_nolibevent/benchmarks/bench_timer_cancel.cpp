@@ -0,0 +1,109 @@
+// Measures timer churn: arming a timer through EventLoop::delay and
+// cancelling it right away, which is what a timeout that guards an
+// operation does when the operation completes in time. The goal is at
+// least one million arm + cancel pairs per second on one thread. It first
+// checks that a default Timer can't cancel or move a timer it doesn't own.
+//
+// Build (Linux, see Makefile):
+//   make bench_timer_cancel
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+
+namespace {
+  const int OPERATIONS = 1000000;
+  const int THREADS = 4;
+
+  std::atomic<int> fired(0);
+
+  // Every timer is cancelled long before it is due.
+  void churn(int count)
+  {
+    for (int i = 0; i < count; i++) {
+      loop::Timer timer = loop::EventLoop::delay(10, []() { fired++; });
+      timer.cancel();
+    }
+  }
+
+  // Arms the timers first and then moves every one of them out by a second.
+  void reschedule(int count)
+  {
+    std::vector<loop::Timer> timers;
+    timers.reserve(count);
+    for (int i = 0; i < count; i++) {
+      timers.push_back(loop::EventLoop::delay(10, []() { fired++; }));
+    }
+
+    benchmark::Stopwatch stopwatch;
+    std::chrono::steady_clock::time_point later =
+      std::chrono::steady_clock::now() + std::chrono::seconds(11);
+    for (const loop::Timer& timer : timers) {
+      timer.reschedule(later);
+    }
+    benchmark::report("reschedule", count, stopwatch.elapsed());
+
+    for (const loop::Timer& timer : timers) {
+      timer.cancel();
+    }
+  }
+
+  // A default Timer refers to no timer, not even the first one scheduled,
+  // which has the first node of the first loop's wheel.
+  bool unowned()
+  {
+    std::atomic<bool> ran(false);
+    loop::EventLoop::delay(std::chrono::milliseconds(50), [&ran]() { ran = true; });
+
+    loop::Timer none;
+    bool ok = !none.cancel() &&
+      !none.reschedule(std::chrono::steady_clock::now() + std::chrono::seconds(10));
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    return ok && ran.load();
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread thread(&loop::EventLoop::run);
+
+  bool owned = unowned();
+  if (!owned) {
+    printf("a default Timer cancelled or moved a timer it doesn't own!\n");
+  }
+
+  // With no other timer, every arm moves the OS timer in and every cancel
+  // moves it back out.
+  benchmark::Stopwatch stopwatch;
+  churn(OPERATIONS);
+  benchmark::report("arm + cancel, only timer", OPERATIONS, stopwatch.elapsed());
+
+  // The usual case: some earlier timer keeps the OS timer where it is, so
+  // arming and cancelling only touch the wheel.
+  loop::Timer earliest = loop::EventLoop::delay(5, []() { fired++; });
+  stopwatch.reset();
+  churn(OPERATIONS);
+  benchmark::report("arm + cancel, earlier timer", OPERATIONS, stopwatch.elapsed());
+
+  std::vector<std::thread> threads;
+  stopwatch.reset();
+  for (int i = 0; i < THREADS; i++) {
+    threads.emplace_back(churn, OPERATIONS / THREADS);
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  benchmark::report("arm + cancel, 4 threads", OPERATIONS, stopwatch.elapsed());
+
+  reschedule(OPERATIONS);
+  earliest.cancel();
+
+  if (fired.load() != 0) {
+    printf("%d cancelled timers fired!\n", fired.load());
+  }
+
+  loop::EventLoop::stop();
+  thread.join();
+  return owned && fired.load() == 0 ? 0 : 1;
+}
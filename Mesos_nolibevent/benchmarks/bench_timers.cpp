@@ -0,0 +1,157 @@
+// Measures the cost of scheduling and expiring one million timers, both on
+// the timing wheel by itself (against a binary heap, the usual alternative)
+// and through EventLoop::delay, and how much slack cuts down on wakeups.
+//
+// Build (Linux, see Makefile):
+//   make bench_timers
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../timer_wheel.hpp"
+
+#include <queue>
+#include <random>
+
+namespace {
+  const int TIMERS = 1000000;
+
+  // Deadlines are spread over a minute, at nanosecond granularity.
+  const uint64_t SPREAD = 60ULL * 1000 * 1000 * 1000;
+
+  // The wheel is advanced in steps of this size, like a loop waking up
+  // once per millisecond would.
+  const uint64_t STEP = 1000 * 1000;
+
+  std::vector<uint64_t> deadlines()
+  {
+    std::mt19937_64 random(42);
+    std::vector<uint64_t> result(TIMERS);
+    for (uint64_t& deadline : result) {
+      deadline = random() % SPREAD;
+    }
+    return result;
+  }
+
+  // Returns false if the wheel didn't fire every timer exactly once.
+  bool wheel(const std::vector<uint64_t>& deadlines)
+  {
+    loop::TimerWheel wheel(0, 1000 * 1000);
+    uint64_t fired = 0;
+
+    benchmark::Stopwatch stopwatch;
+    for (uint64_t deadline : deadlines) {
+      wheel.schedule(deadline, 0, [&fired]() { fired++; });
+    }
+    benchmark::report("wheel insert", TIMERS, stopwatch.elapsed());
+
+    std::vector<loop::TimerWheel::Function> expired;
+    stopwatch.reset();
+    for (uint64_t now = 0; wheel.size() > 0; now += STEP) {
+      expired.clear();
+      wheel.advance(now, expired);
+      for (loop::TimerWheel::Function& function : expired) {
+        function();
+      }
+    }
+    benchmark::report("wheel expire", TIMERS, stopwatch.elapsed());
+
+    if (fired != TIMERS) {
+      printf("wheel fired %llu timers!\n", static_cast<unsigned long long>(fired));
+      return false;
+    }
+    return true;
+  }
+
+  // Counts the wakeups a loop needs to run 100k timers due over a second,
+  // that is how many times it advances the wheel to `next()`, with and
+  // without letting the timers run a little late.
+  void coalescing(uint64_t slack)
+  {
+    const int COUNT = 100000;
+    const uint64_t SECOND = 1000 * 1000 * 1000;
+
+    std::mt19937_64 random(42);
+    loop::TimerWheel wheel(0, 1000);
+    for (int i = 0; i < COUNT; i++) {
+      wheel.schedule(random() % SECOND, slack, []() {});
+    }
+
+    uint64_t wakeups = 0;
+    std::vector<loop::TimerWheel::Function> expired;
+    while (wheel.size() > 0) {
+      expired.clear();
+      wheel.advance(wheel.next(), expired);
+      wakeups++;
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "wakeups, %llu us slack",
+      static_cast<unsigned long long>(slack / 1000));
+    printf("%-40s %12llu\n", name, static_cast<unsigned long long>(wakeups));
+  }
+
+  void heap(const std::vector<uint64_t>& deadlines)
+  {
+    typedef std::pair<uint64_t, std::function<void()>> Timer;
+    auto later = [](const Timer& a, const Timer& b) { return a.first > b.first; };
+    std::priority_queue<Timer, std::vector<Timer>, decltype(later)> heap(later);
+    uint64_t fired = 0;
+
+    benchmark::Stopwatch stopwatch;
+    for (uint64_t deadline : deadlines) {
+      heap.push(Timer(deadline, [&fired]() { fired++; }));
+    }
+    benchmark::report("heap insert", TIMERS, stopwatch.elapsed());
+
+    stopwatch.reset();
+    for (uint64_t now = 0; !heap.empty(); now += STEP) {
+      while (!heap.empty() && heap.top().first <= now) {
+        heap.top().second();
+        heap.pop();
+      }
+    }
+    benchmark::report("heap expire", TIMERS, stopwatch.elapsed());
+  }
+
+  void eventloop()
+  {
+    std::atomic<int> fired(0);
+    std::promise<void> done;
+
+    benchmark::Stopwatch stopwatch;
+    for (int i = 0; i < TIMERS; i++) {
+      loop::EventLoop::delay(1, [&fired, &done]() {
+        if (++fired == TIMERS) {
+          done.set_value();
+        }
+      });
+    }
+    benchmark::report("EventLoop::delay insert", TIMERS, stopwatch.elapsed());
+
+    // All the timers are due at about the same time, so this is dominated
+    // by the cost of expiring them.
+    done.get_future().wait();
+    printf("%-40s %12.1f ms\n",
+      "EventLoop::delay all fired after",
+      static_cast<double>(stopwatch.elapsed()) / 1e6);
+  }
+}
+
+int main()
+{
+  std::vector<uint64_t> random = deadlines();
+  bool fired = wheel(random);
+  heap(random);
+
+  coalescing(0);
+  coalescing(100 * 1000);
+  coalescing(1000 * 1000);
+  coalescing(10 * 1000 * 1000);
+
+  loop::EventLoop::initialize();
+  std::thread thread(&loop::EventLoop::run);
+  eventloop();
+  loop::EventLoop::stop();
+  thread.join();
+  return fired ? 0 : 1;
+}
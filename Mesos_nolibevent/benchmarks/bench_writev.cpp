@@ -0,0 +1,146 @@
+// Framed messages over loopback TCP: a 16 byte header followed by a payload
+// of 64 bytes, 4 KB or 64 KB, written one message at a time while a thread
+// on the other end drains the connection. Each message goes out either as
+// two writes, copied into one buffer and written once, or written once from
+// both buffers (see `SocketHandle::writevAsync`). Reports messages per
+// second for each payload size, over 100k messages.
+//
+// Build (Linux, see Makefile):
+//   make bench_writev
+//   make URING=1 bench_writev
+
+#include "benchmark.hpp"
+#include "../eventloop.hpp"
+#include "../async_io.hpp"
+
+#include <cstring>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+namespace {
+  const size_t HEADER = 16;
+  const size_t PAYLOADS[] = { 64, 4096, 65536 };
+  const uint64_t MESSAGES = 100000;
+
+  enum class Mode {
+    TWO_WRITES,
+    COPY,
+    GATHER
+  };
+
+  // Reads and drops everything until the connection is closed.
+  void drain(int s)
+  {
+    std::vector<char> buffer(1 << 20);
+    while (::recv(s, buffer.data(), buffer.size(), 0) > 0) {
+    }
+    ::close(s);
+  }
+
+  // Returns a connected pair of loopback TCP sockets, the first of which
+  // is handed to the loop.
+  bool connected(int& client, int& server)
+  {
+    int listener = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(address);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        getsockname(listener, reinterpret_cast<sockaddr*>(&address), &size) != 0 ||
+        ::listen(listener, 1) != 0) {
+      ::close(listener);
+      return false;
+    }
+
+    client = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (::connect(client, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+      ::close(client);
+      ::close(listener);
+      return false;
+    }
+    server = ::accept(listener, NULL, NULL);
+    ::close(listener);
+
+    // Small messages go out right away instead of waiting on Nagle.
+    int on = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return server != -1;
+  }
+
+  bool send(async::SocketHandle& socket, Mode mode, char* header, char* payload, size_t size, std::vector<char>& frame)
+  {
+    switch (mode) {
+    case Mode::TWO_WRITES:
+      return socket.writeAsync(header, HEADER).get() == HEADER &&
+        socket.writeAsync(payload, size).get() == static_cast<SSIZE_T>(size);
+    case Mode::COPY:
+      memcpy(frame.data(), header, HEADER);
+      memcpy(frame.data() + HEADER, payload, size);
+      return socket.writeAsync(frame.data(), HEADER + size).get() == static_cast<SSIZE_T>(HEADER + size);
+    case Mode::GATHER: {
+      async::IoBuffer buffers[] = { { header, HEADER }, { payload, size } };
+      return socket.writevAsync(buffers, 2).get() == static_cast<SSIZE_T>(HEADER + size);
+    }
+    }
+    return false;
+  }
+
+  void run(const char* name, Mode mode, size_t size)
+  {
+    int client;
+    int server;
+    if (!connected(client, server)) {
+      printf("%s: connect failed: %d\n", name, errno);
+      return;
+    }
+    std::thread drainer(drain, server);
+
+    async::SocketHandle socket(client, 0);
+    std::vector<char> header(HEADER, 'h');
+    std::vector<char> payload(size, 'p');
+    std::vector<char> frame(HEADER + size);
+
+    uint64_t sent = 0;
+    benchmark::Stopwatch stopwatch;
+    for (; sent < MESSAGES; sent++) {
+      if (!send(socket, mode, header.data(), payload.data(), size, frame)) {
+        break;
+      }
+    }
+    uint64_t elapsed = stopwatch.elapsed();
+
+    socket.close();
+    drainer.join();
+
+    char label[64];
+    snprintf(label, sizeof(label), "%s, %zu B", name, size);
+    benchmark::report(label, sent, elapsed);
+  }
+}
+
+int main()
+{
+  loop::EventLoop::initialize();
+  std::thread eventloop(&loop::EventLoop::run);
+
+  for (size_t size : PAYLOADS) {
+    run("header, then payload", Mode::TWO_WRITES, size);
+    run("copy, then write", Mode::COPY, size);
+    run("gather write", Mode::GATHER, size);
+  }
+
+  loop::EventLoop::stop();
+  eventloop.join();
+  return 0;
+}
+#else
+int main()
+{
+  printf("bench_writev only runs on Linux\n");
+  return 0;
+}
+#endif // __linux__
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "../stdafx.h"
+
+#include <chrono>
+
+// Small helpers shared by the benchmarks. Every benchmark is a standalone
+// program that prints one line per measurement.
+
+namespace benchmark {
+  class Stopwatch {
+  public:
+    Stopwatch() : m_start(std::chrono::steady_clock::now()) {}
+
+    void reset()
+    {
+      m_start = std::chrono::steady_clock::now();
+    }
+
+    // Elapsed time in nanoseconds.
+    uint64_t elapsed() const
+    {
+      return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - m_start).count());
+    }
+
+  private:
+    std::chrono::steady_clock::time_point m_start;
+  };
+
+  // Prints the rate of `count` operations over `nanoseconds` and the cost
+  // of a single operation.
+  inline void report(const char* name, uint64_t count, uint64_t nanoseconds)
+  {
+    double seconds = static_cast<double>(nanoseconds) / 1e9;
+    printf("%-40s %12.0f ops/s %10.1f ns/op\n",
+      name,
+      static_cast<double>(count) / seconds,
+      static_cast<double>(nanoseconds) / static_cast<double>(count));
+  }
+
+  // Prints the median and tail of a set of latency samples, in microseconds.
+  inline void report_latency(const char* name, std::vector<uint64_t>& samples)
+  {
+    if (samples.empty()) {
+      return;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    auto percentile = [&samples](double p) {
+      size_t index = static_cast<size_t>(p * (samples.size() - 1));
+      return static_cast<double>(samples[index]) / 1e3;
+    };
+
+    printf("%-40s p50 %8.1f us  p99 %8.1f us  p99.9 %8.1f us\n",
+      name,
+      percentile(0.5),
+      percentile(0.99),
+      percentile(0.999));
+  }
+}
+
+#ifdef BENCHMARK_COUNT_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+
+// A benchmark that defines BENCHMARK_COUNT_ALLOCATIONS before including
+// this file replaces the global operator new and delete with ones that
+// count the heap blocks it allocates, and those that are still live. The
+// definitions are in the header because a benchmark is a single source
+// file. They are kept out of line, because once GCC inlines them next to
+// a new-expression -Wmismatched-new-delete mistakes their free() for a
+// mismatched one.
+
+namespace benchmark {
+  std::atomic<uint64_t> allocations(0);
+  std::atomic<int64_t> live(0);
+}
+
+__attribute__((noinline)) void* operator new(size_t size)
+{
+  if (void* p = malloc(size == 0 ? 1 : size)) {
+    benchmark::allocations.fetch_add(1, std::memory_order_relaxed);
+    benchmark::live.fetch_add(1, std::memory_order_relaxed);
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+  if (p != nullptr) {
+    benchmark::live.fetch_sub(1, std::memory_order_relaxed);
+    free(p);
+  }
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+  operator delete(p);
+}
+#endif
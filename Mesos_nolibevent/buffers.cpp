@@ -0,0 +1,156 @@
+#include "stdafx.h"
+#include "buffers.hpp"
+
+#if defined(__linux__) && defined(USE_IO_URING)
+#include "eventloop_uring.hpp"
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace async {
+  namespace internal {
+    void Buffer::release()
+    {
+      if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        pool->release(this);
+      }
+    }
+  }
+
+  static size_t page_size()
+  {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+  }
+
+  static char* map(size_t size)
+  {
+#ifdef _WIN32
+    void* memory = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (memory == NULL) {
+      throw "Could not allocate buffers: " + std::to_string(GetLastError());
+    }
+#else
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      throw "Could not allocate buffers: " + std::to_string(errno);
+    }
+#endif
+    return static_cast<char*>(memory);
+  }
+
+  static void unmap(char* memory, size_t size)
+  {
+#ifdef _WIN32
+    VirtualFree(memory, 0, MEM_RELEASE);
+#else
+    munmap(memory, size);
+#endif
+  }
+
+
+  Slice Slice::slice(size_t offset, size_t size) const
+  {
+    offset = std::min(offset, m_size);
+    size = std::min(size, m_size - offset);
+    if (m_buffer != nullptr) {
+      m_buffer->acquire();
+    }
+    return Slice(m_buffer, m_data + offset, size);
+  }
+
+
+  BufferPool::BufferPool(size_t size, size_t count)
+    : m_count(std::max<size_t>(count, 1)), m_free(nullptr), m_used(0)
+  {
+    size_t page = page_size();
+    m_size = (std::max<size_t>(size, 1) + page - 1) / page * page;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    grow();
+  }
+
+  BufferPool::~BufferPool()
+  {
+    for (Region& region : m_regions) {
+#if defined(__linux__) && defined(USE_IO_URING)
+      loop::uring::unregister_buffer(region.index);
+#endif
+      unmap(region.memory, region.size);
+      delete[] region.buffers;
+    }
+  }
+
+  void BufferPool::grow()
+  {
+    Region region;
+    region.size = m_size * m_count;
+    region.memory = map(region.size);
+    region.index = -1;
+#if defined(__linux__) && defined(USE_IO_URING)
+    region.index = loop::uring::register_buffer(region.memory, region.size);
+#endif
+
+    region.buffers = new internal::Buffer[m_count];
+    for (size_t i = m_count; i > 0; i--) {
+      internal::Buffer& buffer = region.buffers[i - 1];
+      buffer.pool = this;
+      buffer.data = region.memory + (i - 1) * m_size;
+      buffer.region = region.index;
+      buffer.next = m_free;
+      m_free = &buffer;
+    }
+
+    m_regions.push_back(region);
+  }
+
+  Slice BufferPool::acquire()
+  {
+    internal::Buffer* buffer;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_free == nullptr) {
+        grow();
+      }
+      buffer = m_free;
+      m_free = buffer->next;
+      m_used++;
+    }
+
+    buffer->references.store(1, std::memory_order_relaxed);
+    return Slice(buffer, buffer->data, m_size);
+  }
+
+  void BufferPool::release(internal::Buffer* buffer)
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    buffer->next = m_free;
+    m_free = buffer;
+    m_used--;
+  }
+
+  size_t BufferPool::buffers() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_regions.size() * m_count;
+  }
+
+  size_t BufferPool::used() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_used;
+  }
+
+  size_t BufferPool::footprint() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_regions.size() * m_count * m_size;
+  }
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include "stdafx.h"
+
+namespace async {
+  class BufferPool;
+
+  namespace internal {
+    // A buffer of a BufferPool. It goes back to the pool when the last
+    // slice of it is gone.
+    struct Buffer {
+      BufferPool* pool;
+      char* data;
+      int region;
+      std::atomic<int> references{0};
+      Buffer* next = nullptr;
+
+      void acquire()
+      {
+        references.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release();
+    };
+  }
+
+  // A view of part of a pool buffer. Copies, and the slices cut from a
+  // slice, share the buffer rather than copy it, so a read's data can be
+  // handed on (to a parser, to a write on another socket) as is.
+  class Slice {
+  public:
+    Slice() : m_buffer(nullptr), m_data(nullptr), m_size(0) {}
+
+    Slice(const Slice& that)
+      : m_buffer(that.m_buffer), m_data(that.m_data), m_size(that.m_size)
+    {
+      if (m_buffer != nullptr) {
+        m_buffer->acquire();
+      }
+    }
+
+    Slice(Slice&& that) noexcept
+      : m_buffer(that.m_buffer), m_data(that.m_data), m_size(that.m_size)
+    {
+      that.m_buffer = nullptr;
+      that.m_data = nullptr;
+      that.m_size = 0;
+    }
+
+    Slice& operator=(Slice that) noexcept
+    {
+      std::swap(m_buffer, that.m_buffer);
+      std::swap(m_data, that.m_data);
+      std::swap(m_size, that.m_size);
+      return *this;
+    }
+
+    ~Slice()
+    {
+      if (m_buffer != nullptr) {
+        m_buffer->release();
+      }
+    }
+
+    char* data() const
+    {
+      return m_data;
+    }
+
+    size_t size() const
+    {
+      return m_size;
+    }
+
+    bool empty() const
+    {
+      return m_size == 0;
+    }
+
+    // The `size` bytes from `offset` on, or as many of them as the slice
+    // has, sharing its buffer.
+    Slice slice(size_t offset, size_t size) const;
+
+    // The index the buffer's memory is registered under with the io_uring
+    // event loop (see `loop::uring::register_buffer`), or -1.
+    int region() const
+    {
+      return m_buffer != nullptr ? m_buffer->region : -1;
+    }
+
+  private:
+    friend class BufferPool;
+
+    Slice(internal::Buffer* buffer, char* data, size_t size)
+      : m_buffer(buffer), m_data(data), m_size(size) {}
+
+    internal::Buffer* m_buffer;
+    char* m_data;
+    size_t m_size;
+  };
+
+  // Fixed size buffers owned by the library, for reads that don't need a
+  // buffer of the caller's (see `SocketHandle::readAsync(BufferPool&)`).
+  //
+  // The buffers are page aligned and allocated `count` at a time, in one
+  // region of memory straight from the OS, which the io_uring event loop
+  // registers with its rings, so the kernel doesn't have to pin and map
+  // the pages of every read and write again. The pool only ever grows.
+  //
+  // On epoll a read takes its buffer once the socket is readable, so idle
+  // connections hold none; elsewhere a read holds its buffer from the
+  // moment it is started.
+  //
+  // Create pools after `EventLoop::initialize`, so that there are rings to
+  // register them with. Every slice must be gone before the pool is.
+  class BufferPool {
+  public:
+    // Buffers of `size` bytes, rounded up to whole pages.
+    BufferPool(size_t size, size_t count);
+
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // A slice over all of a free buffer. Can be called from any thread.
+    Slice acquire();
+
+    // The size of each buffer.
+    size_t size() const
+    {
+      return m_size;
+    }
+
+    // The number of buffers, free or not.
+    size_t buffers() const;
+
+    // The number of buffers that are handed out.
+    size_t used() const;
+
+    // The memory of all the buffers, in bytes.
+    size_t footprint() const;
+
+  private:
+    friend struct internal::Buffer;
+
+    struct Region {
+      char* memory;
+      size_t size;
+      int index;
+      internal::Buffer* buffers;
+    };
+
+    // Adds a region of `m_count` buffers. Must be called with `m_mutex`
+    // locked.
+    void grow();
+
+    void release(internal::Buffer* buffer);
+
+    size_t m_size;
+    size_t m_count;
+
+    mutable std::mutex m_mutex;
+    internal::Buffer* m_free;
+    size_t m_used;
+    std::vector<Region> m_regions;
+  };
+}
@@ -0,0 +1,184 @@
+#include "stdafx.h"
+#include "cancellation.hpp"
+
+namespace async {
+  namespace internal {
+    bool Cancellable::enlist(const CancellationToken& token)
+    {
+      TokenState* state = token.m_state;
+      if (state == nullptr) {
+        return true;
+      }
+
+      std::lock_guard<std::mutex> lock(state->mutex);
+      return link(state);
+    }
+
+
+    void Cancellable::delist()
+    {
+      TokenState* state = m_token;
+      if (state == nullptr) {
+        return;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        unlink();
+      }
+      m_token = nullptr;
+      state->delisted();
+    }
+
+
+    // Must be called with the token locked.
+    bool Cancellable::link(TokenState* state)
+    {
+      if (state->cancelled) {
+        timed_out = state->deadline && state->expired;
+        return false;
+      }
+
+      state->acquire();
+      m_token = state;
+      m_previous = nullptr;
+      m_next = state->head;
+      if (state->head != nullptr) {
+        state->head->m_previous = this;
+      }
+      state->head = this;
+      m_linked = true;
+      return true;
+    }
+
+
+    // Must be called with the token locked. The operation keeps its
+    // reference to the token until it delists.
+    void Cancellable::unlink()
+    {
+      if (!m_linked) {
+        return;
+      }
+
+      if (m_previous != nullptr) {
+        m_previous->m_next = m_next;
+      } else {
+        m_token->head = m_next;
+      }
+      if (m_next != nullptr) {
+        m_next->m_previous = m_previous;
+      }
+      m_previous = nullptr;
+      m_next = nullptr;
+      m_linked = false;
+    }
+
+
+    void TokenState::cancel(bool expire)
+    {
+      // The operations that were taken back before they ran, chained
+      // through `m_next` now that they are off the token's list.
+      Cancellable* withdrawn = nullptr;
+      bool disarm;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (cancelled) {
+          return;
+        }
+        cancelled = true;
+        expired = expire;
+        disarm = armed && !expire;
+
+        while (Cancellable* operation = head) {
+          operation->unlink();
+          operation->timed_out = deadline && expire;
+          operation->cancelled.store(true, std::memory_order_release);
+          if (operation->cancel()) {
+            operation->m_next = withdrawn;
+            withdrawn = operation;
+          }
+        }
+      }
+
+      // Completing an operation may start another one with this token, so
+      // this has to happen without the lock.
+      while (Cancellable* operation = withdrawn) {
+        withdrawn = operation->m_next;
+        operation->finish();
+      }
+
+      // Destroys the timer's copy of the token, but never the last one:
+      // whoever cancels holds a copy too.
+      if (disarm) {
+        timer.cancel();
+      }
+    }
+  }
+
+
+  CancellationToken CancellationToken::create()
+  {
+    CancellationToken token;
+    token.m_state = new internal::TokenState();
+    return token;
+  }
+
+
+  CancellationToken CancellationToken::create(Deadline deadline)
+  {
+    CancellationToken token = create();
+    loop::Timer timer = loop::EventLoop::delay(deadline, [token]() {
+      token.m_state->cancel(true);
+    });
+
+    // The timer may have fired already, which leaves it for `cancel` to
+    // find stale and do nothing with.
+    std::lock_guard<std::mutex> lock(token.m_state->mutex);
+    token.m_state->armed = true;
+    token.m_state->timer = timer;
+    return token;
+  }
+
+
+  void CancellationToken::cancel() const
+  {
+    if (m_state != nullptr) {
+      m_state->cancel(false);
+    }
+  }
+
+
+  bool CancellationToken::cancelled() const
+  {
+    if (m_state == nullptr) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    return m_state->cancelled;
+  }
+
+
+  namespace internal {
+    CancellationToken operation_deadline(Deadline deadline)
+    {
+      // Nothing is enlisted with the token yet, so this is in time even if
+      // the deadline has passed already.
+      CancellationToken token = CancellationToken::create(deadline);
+      std::lock_guard<std::mutex> lock(token.m_state->mutex);
+      token.m_state->deadline = true;
+      return token;
+    }
+  }
+
+
+  bool CancellationToken::expired() const
+  {
+    if (m_state == nullptr) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    return m_state->expired;
+  }
+}
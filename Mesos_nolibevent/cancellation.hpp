@@ -0,0 +1,232 @@
+#pragma once
+
+#include "stdafx.h"
+#include "eventloop.hpp"
+
+namespace async {
+  // When an operation is due, on the same clock as `EventLoop::delay`.
+  typedef std::chrono::steady_clock::time_point Deadline;
+
+  class CancellationToken;
+
+  namespace internal {
+    struct TokenState;
+
+    // The part of an operation that a CancellationToken can reach. Every
+    // operation enlists with its token before it is handed to the OS and
+    // delists once it completes, before it reports its result and is
+    // freed, so the token never sees an operation that is gone.
+    struct Cancellable {
+      virtual ~Cancellable() {}
+
+      // Asks the backend to cancel the operation: CancelIoEx on Windows,
+      // an IORING_OP_ASYNC_CANCEL on io_uring, taking it off the queue of
+      // its descriptor on epoll. Runs with the token locked, so it must
+      // not run any callbacks. Returns true if the operation was taken back
+      // before it ever ran, in which case `finish` is called next, without
+      // the lock, to complete it. Otherwise the operation completes on its
+      // own, usually with an error, and finds `cancelled` set.
+      virtual bool cancel() = 0;
+
+      virtual void finish() {}
+
+      // Returns false, and enlists nothing, if the token is cancelled
+      // already. Operations that can complete while they are being started
+      // (epoll) use this one and check `cancelled` before they perform.
+      bool enlist(const CancellationToken& token);
+
+      // Enlists and runs `start`, which hands the operation to the OS, with
+      // the token locked, so that a cancel can't slip in between the two
+      // and miss the operation. Returns false without running `start` if
+      // the token is cancelled already. If `start` returns false because
+      // the operation failed right away, the operation is delisted again.
+      template <typename F>
+      bool enlist(const CancellationToken& token, F start);
+
+      // Runs `start` again, with the token locked, for an enlisted operation
+      // that takes more than one request (a short write on io_uring).
+      // Returns false without running it if the token was cancelled since.
+      template <typename F>
+      bool resume(F start);
+
+      void delist();
+
+      std::atomic<bool> cancelled{false};
+
+      // Set along with `cancelled` when the deadline of a token made for
+      // this operation alone cancelled it (see `operation_deadline`), so
+      // that it completes with TIMED_OUT rather than CANCELLED.
+      bool timed_out = false;
+
+    private:
+      friend struct TokenState;
+
+      bool link(TokenState* state);
+
+      void unlink();
+
+      TokenState* m_token = nullptr;
+      Cancellable* m_previous = nullptr;
+      Cancellable* m_next = nullptr;
+      bool m_linked = false;
+    };
+
+    // A token's state, shared by its copies and the operations enlisted
+    // with it.
+    struct TokenState {
+      // `expire` is set if the token's deadline passed.
+      void cancel(bool expire);
+
+      void acquire()
+      {
+        references.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release()
+      {
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete this;
+        }
+      }
+
+      // Gives up the reference of an operation that is done with the
+      // token. A token that is the deadline of that one operation is
+      // cancelled first, which disarms its timer.
+      void delisted()
+      {
+        if (deadline) {
+          cancel(false);
+        }
+        release();
+      }
+
+      std::mutex mutex;
+      bool cancelled = false;
+      bool expired = false;
+
+      // Made by `operation_deadline`.
+      bool deadline = false;
+
+      Cancellable* head = nullptr;
+      std::atomic<int> references{1};
+
+      // The timer that cancels a token with a deadline.
+      bool armed = false;
+      loop::Timer timer;
+    };
+
+    // A token that cancels itself at `deadline`, for the one operation
+    // that the Deadline overloads of the handles start with it. Unlike a
+    // token from `CancellationToken::create(Deadline)`, the operation
+    // reports the deadline as TIMED_OUT, and disarms the timer when it
+    // delists, so neither takes a closure around its callback or future.
+    CancellationToken operation_deadline(Deadline deadline);
+  }
+
+  // Cancels operations after they were started. Pass the token to any
+  // operation of an async::Handle, then call `cancel` to cancel every
+  // operation that was started with it and has not completed yet, and any
+  // that is started with it later. A cancelled read, write or sendfile
+  // completes with CANCELLED, a connect with CANCELLED_ERROR, and an
+  // accept with nullptr (check `cancelled` to tell it from a failure). An
+  // operation that completed anyway before the cancel got to it keeps its
+  // result.
+  //
+  // A token can also cancel itself at a deadline. Its timer is one of the
+  // event loop's (see `EventLoop::delay`), so any number of pending
+  // deadlines share the loop's single OS timer.
+  //
+  // Copies of a token share its state. A default constructed token is
+  // never cancelled and costs nothing.
+  class CancellationToken {
+  public:
+    CancellationToken() : m_state(nullptr) {}
+
+    // A new token that can be cancelled.
+    static CancellationToken create();
+
+    // A new token that cancels itself at `deadline`, unless it is
+    // cancelled before. Cancelling it disarms the timer, which is how an
+    // operation that completed in time gets rid of its deadline.
+    static CancellationToken create(Deadline deadline);
+
+    CancellationToken(const CancellationToken& that) : m_state(that.m_state)
+    {
+      if (m_state != nullptr) {
+        m_state->acquire();
+      }
+    }
+
+    CancellationToken(CancellationToken&& that) noexcept : m_state(that.m_state)
+    {
+      that.m_state = nullptr;
+    }
+
+    CancellationToken& operator=(CancellationToken that) noexcept
+    {
+      std::swap(m_state, that.m_state);
+      return *this;
+    }
+
+    ~CancellationToken()
+    {
+      if (m_state != nullptr) {
+        m_state->release();
+      }
+    }
+
+    void cancel() const;
+
+    bool cancelled() const;
+
+    // True if the token cancelled itself because its deadline passed.
+    bool expired() const;
+
+  private:
+    friend struct internal::Cancellable;
+    friend CancellationToken internal::operation_deadline(Deadline deadline);
+
+    internal::TokenState* m_state;
+  };
+
+  namespace internal {
+    template <typename F>
+    bool Cancellable::enlist(const CancellationToken& token, F start)
+    {
+      TokenState* state = token.m_state;
+      if (state == nullptr) {
+        start();
+        return true;
+      }
+
+      std::unique_lock<std::mutex> lock(state->mutex);
+      if (!link(state)) {
+        return false;
+      }
+      if (!start()) {
+        unlink();
+        lock.unlock();
+        m_token = nullptr;
+        state->delisted();
+      }
+      return true;
+    }
+
+    template <typename F>
+    bool Cancellable::resume(F start)
+    {
+      TokenState* state = m_token;
+      if (state == nullptr) {
+        start();
+        return true;
+      }
+
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (cancelled.load(std::memory_order_relaxed)) {
+        return false;
+      }
+      start();
+      return true;
+    }
+  }
+}
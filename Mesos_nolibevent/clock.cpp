@@ -0,0 +1,188 @@
+#include "stdafx.h"
+#include "clock.hpp"
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define HAVE_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#ifndef _WIN32
+#include <time.h>
+#endif
+
+namespace loop {
+  namespace clock {
+
+    // 0 outside of an iteration of the loop.
+    thread_local uint64_t iteration = 0;
+
+#ifdef _WIN32
+    static uint64_t os_frequency()
+    {
+      LARGE_INTEGER frequency;
+      QueryPerformanceFrequency(&frequency);
+      return static_cast<uint64_t>(frequency.QuadPart);
+    }
+
+    static uint64_t os_monotonic()
+    {
+      static const uint64_t frequency = os_frequency();
+
+      LARGE_INTEGER counter;
+      QueryPerformanceCounter(&counter);
+
+      // Split the conversion so that it cannot overflow.
+      uint64_t ticks = static_cast<uint64_t>(counter.QuadPart);
+      uint64_t seconds = ticks / frequency;
+      uint64_t remainder = ticks % frequency;
+      return seconds * 1000000000 + remainder * 1000000000 / frequency;
+    }
+#else
+    static uint64_t os_monotonic()
+    {
+      timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+#endif
+
+#ifdef HAVE_TSC
+    // Time stamp counter readings are turned into nanoseconds as
+    // `base + (tsc - tsc_base) * scale / 2^32`, relative to one reading of
+    // both clocks taken at calibration time.
+    struct Calibration {
+      uint64_t base;
+      uint64_t tsc_base;
+      uint64_t scale;
+    };
+
+    Calibration calibration;
+    std::atomic<bool> tsc(false);
+
+    // How long the time stamp counter is compared against the OS clock.
+    const uint64_t CALIBRATION_TIME = 20 * 1000 * 1000;
+
+    static bool invariant_tsc()
+    {
+      unsigned int registers[4] = { 0 };
+#ifdef _MSC_VER
+      __cpuid(reinterpret_cast<int*>(registers), 0x80000000);
+      if (registers[0] < 0x80000007) {
+        return false;
+      }
+      __cpuid(reinterpret_cast<int*>(registers), 0x80000007);
+#else
+      if (__get_cpuid(0x80000007, &registers[0], &registers[1],
+                      &registers[2], &registers[3]) == 0) {
+        return false;
+      }
+#endif
+      // EDX bit 8: the TSC runs at a constant rate in every power state.
+      return (registers[3] & (1 << 8)) != 0;
+    }
+
+    // (a * b) >> 32, without overflowing in between.
+    static uint64_t multiply_shift(uint64_t a, uint64_t b)
+    {
+#ifdef _MSC_VER
+      uint64_t high;
+      uint64_t low = _umul128(a, b, &high);
+      return __shiftright128(low, high, 32);
+#else
+      return static_cast<uint64_t>(
+        (static_cast<unsigned __int128>(a) * b) >> 32);
+#endif
+    }
+
+    // Reads both clocks as close together as we can: the TSC is read on
+    // both sides of the OS clock, and the tightest of a few tries is kept.
+    static void sample(uint64_t* time, uint64_t* counter)
+    {
+      uint64_t best = UINT64_MAX;
+      for (int i = 0; i < 5; i++) {
+        uint64_t before = __rdtsc();
+        uint64_t now = os_monotonic();
+        uint64_t after = __rdtsc();
+        if (after - before < best) {
+          best = after - before;
+          *time = now;
+          *counter = before + (after - before) / 2;
+        }
+      }
+    }
+#endif // HAVE_TSC
+
+
+    uint64_t monotonic()
+    {
+#ifdef HAVE_TSC
+      if (tsc.load(std::memory_order_acquire)) {
+        return calibration.base +
+          multiply_shift(__rdtsc() - calibration.tsc_base, calibration.scale);
+      }
+#endif
+      return os_monotonic();
+    }
+
+
+    bool enable_tsc()
+    {
+#ifdef HAVE_TSC
+      if (tsc.load()) {
+        return true;
+      }
+
+      if (!invariant_tsc()) {
+        return false;
+      }
+
+      uint64_t start;
+      uint64_t start_counter;
+      sample(&start, &start_counter);
+
+      uint64_t end;
+      uint64_t end_counter;
+      do {
+        sample(&end, &end_counter);
+      } while (end - start < CALIBRATION_TIME);
+
+      if (end_counter <= start_counter) {
+        return false;
+      }
+
+      // Continue from the OS clock's current reading, so time never goes
+      // backwards across the switch.
+      calibration.scale = ((end - start) << 32) / (end_counter - start_counter);
+      calibration.base = end;
+      calibration.tsc_base = end_counter;
+      tsc.store(true, std::memory_order_release);
+      return true;
+#else
+      return false;
+#endif
+    }
+
+
+    uint64_t now()
+    {
+      return iteration != 0 ? iteration : monotonic();
+    }
+
+
+    uint64_t update()
+    {
+      iteration = monotonic();
+      return iteration;
+    }
+
+
+    void clear()
+    {
+      iteration = 0;
+    }
+  }
+}
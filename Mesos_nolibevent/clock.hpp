@@ -0,0 +1,36 @@
+#pragma once
+
+#include "stdafx.h"
+
+namespace loop {
+  namespace clock {
+    // Monotonic time in nanoseconds, counted from an unspecified point
+    // (usually boot). This is the clock all the timers of the event loop
+    // run on. By default it is QueryPerformanceCounter on Windows and
+    // CLOCK_MONOTONIC elsewhere.
+    uint64_t monotonic();
+
+    // Switches `monotonic` over to reading the CPU's time stamp counter
+    // directly, scaled to nanoseconds by calibrating it against the OS
+    // clock. That skips the call into the OS (or the vDSO) on every read.
+    // It only works on x86 processors with an invariant TSC, which ticks
+    // at a constant rate and is synchronized across cores; returns false,
+    // and leaves the clock alone, everywhere else.
+    //
+    // This takes a few milliseconds, and should be called once at startup,
+    // before the event loop is initialized.
+    bool enable_tsc();
+
+    // The time at which the event loop started its current iteration, if
+    // the calling thread is running one. The backends set it each time the
+    // loop wakes up, so that the callbacks run by one wakeup can share a
+    // single clock read. Reads the clock on any other thread.
+    uint64_t now();
+
+    // Sets (and returns) the time of the calling thread's iteration.
+    uint64_t update();
+
+    // Ends the calling thread's iteration; `now` reads the clock again.
+    void clear();
+  }
+}
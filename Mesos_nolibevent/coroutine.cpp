@@ -0,0 +1,81 @@
+#include "stdafx.h"
+#include "coroutine.hpp"
+
+namespace async {
+  namespace internal {
+    // Frames are rounded up to a power of two, from 64 bytes to 16 KB.
+    // Larger ones go straight to the heap.
+    static const size_t SMALLEST = 64;
+    static const size_t CLASSES = 9;
+
+    // How many free frames of each size a thread keeps. A coroutine can
+    // start on one thread and finish on another, so without a limit a
+    // thread that only ever frees frames would keep collecting them.
+    static const size_t CACHED = 256;
+
+    struct FreeFrame {
+      FreeFrame* next;
+    };
+
+    struct FrameCache {
+      FreeFrame* frames[CLASSES] = {};
+      size_t counts[CLASSES] = {};
+
+      ~FrameCache()
+      {
+        for (size_t i = 0; i < CLASSES; i++) {
+          while (FreeFrame* frame = frames[i]) {
+            frames[i] = frame->next;
+            ::operator delete(frame);
+          }
+        }
+      }
+    };
+
+    static thread_local FrameCache cache;
+
+    // The index of the smallest class that fits `size`, or CLASSES if
+    // none does.
+    static size_t size_class(size_t size)
+    {
+      size_t index = 0;
+      for (size_t bytes = SMALLEST; bytes < size; bytes <<= 1) {
+        if (++index == CLASSES) {
+          break;
+        }
+      }
+      return index;
+    }
+
+
+    void* allocate_frame(size_t size)
+    {
+      size_t index = size_class(size);
+      if (index == CLASSES) {
+        return ::operator new(size);
+      }
+
+      if (FreeFrame* frame = cache.frames[index]) {
+        cache.frames[index] = frame->next;
+        cache.counts[index]--;
+        return frame;
+      }
+      return ::operator new(SMALLEST << index);
+    }
+
+
+    void deallocate_frame(void* frame, size_t size)
+    {
+      size_t index = size_class(size);
+      if (index == CLASSES || cache.counts[index] == CACHED) {
+        ::operator delete(frame);
+        return;
+      }
+
+      FreeFrame* free = static_cast<FreeFrame*>(frame);
+      free->next = cache.frames[index];
+      cache.frames[index] = free;
+      cache.counts[index]++;
+    }
+  }
+}
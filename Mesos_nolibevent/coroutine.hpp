@@ -0,0 +1,168 @@
+#pragma once
+
+#include "stdafx.h"
+#include "future.hpp"
+
+#include <coroutine>
+#include <exception>
+
+// Lets C++20 coroutines `co_await` the operations of the async handles:
+//
+//   async::Detached echo(async::SocketHandle* socket)
+//   {
+//     char buffer[1024];
+//     SSIZE_T bytes;
+//     while ((bytes = co_await socket->readAsync(buffer, sizeof(buffer))) > 0) {
+//       co_await socket->writeAsync(buffer, bytes);
+//     }
+//     socket->close();
+//   }
+//
+// A coroutine that waits on an operation is resumed by the completion
+// itself, on the loop thread the handle is bound to, so no thread is ever
+// blocked on its behalf. This header needs C++20; the rest of the library
+// still builds as C++17.
+
+namespace async {
+  namespace internal {
+    // Coroutine frames are recycled through a free list per thread, sorted
+    // by size. Every loop runs on its own thread, so a loop that keeps
+    // starting the same coroutines (one per accepted connection, say)
+    // reuses the frames of those that finished on it instead of going to
+    // the heap.
+    void* allocate_frame(size_t size);
+
+    void deallocate_frame(void* frame, size_t size);
+
+    // Base of the promise types, so that their frames come from the
+    // allocator above.
+    struct FramePromise {
+      static void* operator new(size_t size)
+      {
+        return allocate_frame(size);
+      }
+
+      static void operator delete(void* frame, size_t size)
+      {
+        deallocate_frame(frame, size);
+      }
+    };
+
+    // What `co_await future` does. If the value is already there, the
+    // coroutine goes on without suspending. Otherwise it suspends once,
+    // and the continuation that receives the value resumes it right where
+    // the value is set: in the completion callback of the operation. The
+    // continuation is two pointers, so it is kept inside the future's
+    // state and waiting allocates nothing.
+    //
+    // The value can also come in between `await_ready` and `then`, or
+    // while `then` runs. Whichever of `await_suspend` and the continuation
+    // gets to `m_done` second learns that the other one is done: the
+    // continuation resumes the coroutine, and `await_suspend` lets it go
+    // on without suspending, so a run of operations that complete right
+    // away doesn't nest a `resume` on the stack for each of them.
+    template <typename T>
+    class Awaiter {
+    public:
+      explicit Awaiter(Future<T>&& future) : m_future(std::move(future)) {}
+
+      bool await_ready() const
+      {
+        return m_future.ready();
+      }
+
+      bool await_suspend(std::coroutine_handle<> coroutine)
+      {
+        m_future.then([this, coroutine](T value) {
+          m_value.emplace(std::move(value));
+          if (m_done.exchange(true, std::memory_order_acq_rel)) {
+            coroutine.resume();
+          }
+        });
+
+        // Once the continuation has seen this, the coroutine may be resumed
+        // and its frame, which holds the awaiter, freed.
+        return !m_done.exchange(true, std::memory_order_acq_rel);
+      }
+
+      T await_resume()
+      {
+        if (m_value) {
+          return std::move(*m_value);
+        }
+        return m_future.get();
+      }
+
+    private:
+      Future<T> m_future;
+      std::optional<T> m_value;
+      std::atomic<bool> m_done{false};
+    };
+
+    // The promise of a coroutine that returns a Future: the coroutine
+    // starts right away, and its `co_return` sets the future's value.
+    template <typename T>
+    struct FuturePromise : FramePromise {
+      Future<T> get_return_object()
+      {
+        return promise.get_future();
+      }
+
+      std::suspend_never initial_suspend() noexcept { return {}; }
+
+      std::suspend_never final_suspend() noexcept { return {}; }
+
+      void return_value(T value)
+      {
+        promise.set_value(std::move(value));
+      }
+
+      // A Future has no way to carry an exception.
+      void unhandled_exception()
+      {
+        std::terminate();
+      }
+
+      Promise<T> promise;
+    };
+  }
+
+  template <typename T>
+  internal::Awaiter<T> operator co_await(Future<T>&& future)
+  {
+    return internal::Awaiter<T>(std::move(future));
+  }
+
+  // Awaiting a future consumes it, so it has to be moved in explicitly:
+  // `co_await std::move(future)`.
+  template <typename T>
+  internal::Awaiter<T> operator co_await(Future<T>& future) = delete;
+
+  // The return type of a coroutine nobody waits for, like the one that
+  // serves a connection. It starts right away and frees its frame when it
+  // finishes. It must not throw.
+  struct Detached {
+    struct promise_type : internal::FramePromise {
+      Detached get_return_object() { return Detached(); }
+
+      std::suspend_never initial_suspend() noexcept { return {}; }
+
+      std::suspend_never final_suspend() noexcept { return {}; }
+
+      void return_void() {}
+
+      void unhandled_exception()
+      {
+        std::terminate();
+      }
+    };
+  };
+}
+
+// Any function returning an async::Future can be a coroutine, which makes
+// coroutines and futures interchangeable: a coroutine can `co_await` another
+// one, and code that is not a coroutine can `get` or `then` its result.
+template <typename T, typename... Args>
+struct std::coroutine_traits<async::Future<T>, Args...> {
+  typedef async::internal::FuturePromise<T> promise_type;
+};
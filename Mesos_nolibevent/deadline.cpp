@@ -0,0 +1,107 @@
+#include "stdafx.h"
+#include "async_io.hpp"
+
+namespace async {
+  // The deadlines are the same on every backend: the operation is started
+  // with a token that cancels itself at the deadline, and its completion
+  // cancels the token again, which disarms the timer before it fires.
+  //
+  // A read or write is started with a token made for it alone, which the
+  // operation itself reports as TIMED_OUT and disarms (see
+  // `internal::operation_deadline`), so it still takes a single operation
+  // and its future or callback as they are. The others wrap their result.
+
+  // Reports a connect that the deadline cancelled as TIMED_OUT_ERROR.
+  static auto expire(CancellationToken token)
+  {
+    return [token = std::move(token)](DWORD result) {
+      if (result == CANCELLED_ERROR && token.expired()) {
+        result = TIMED_OUT_ERROR;
+      }
+      token.cancel();
+      return result;
+    };
+  }
+
+
+  Future<SSIZE_T> SocketHandle::readAsync(
+    void* data,
+    size_t size,
+    Deadline deadline) const
+  {
+    return readAsync(data, size, internal::operation_deadline(deadline));
+  }
+
+  Future<SSIZE_T> SocketHandle::writeAsync(
+    const void* data,
+    size_t size,
+    Deadline deadline) const
+  {
+    return writeAsync(data, size, internal::operation_deadline(deadline));
+  }
+
+  void SocketHandle::readAsync(
+    void* data,
+    size_t size,
+    Callback callback,
+    Deadline deadline) const
+  {
+    readAsync(data, size, std::move(callback), internal::operation_deadline(deadline));
+  }
+
+  void SocketHandle::writeAsync(
+    const void* data,
+    size_t size,
+    Callback callback,
+    Deadline deadline) const
+  {
+    writeAsync(data, size, std::move(callback), internal::operation_deadline(deadline));
+  }
+
+  Future<SocketHandle*> SocketHandle::accept(Deadline deadline) const
+  {
+    CancellationToken token = CancellationToken::create(deadline);
+    return accept(token).then([token](SocketHandle* result) {
+      token.cancel();
+      return result;
+    });
+  }
+
+  void SocketHandle::accept(
+    BufferPool& pool,
+    AcceptReadCallback callback,
+    Deadline deadline) const
+  {
+    CancellationToken token = CancellationToken::create(deadline);
+    accept(
+      pool,
+      [token, callback = std::move(callback)](SocketHandle* socket, SSIZE_T result, Slice data) mutable {
+        if (result == CANCELLED && token.expired()) {
+          result = TIMED_OUT;
+        }
+        token.cancel();
+        callback(socket, result, std::move(data));
+      },
+      token);
+  }
+
+  Future<DWORD> SocketHandle::connect(
+    const sockaddr* addr,
+    size_t addr_size,
+    Deadline deadline) const
+  {
+    CancellationToken token = CancellationToken::create(deadline);
+    return connect(addr, addr_size, token).then(expire(token));
+  }
+
+  Future<DWORD> SocketHandle::connect(
+    const sockaddr* addr,
+    size_t addr_size,
+    const void* data,
+    size_t size,
+    Deadline deadline) const
+  {
+    CancellationToken token = CancellationToken::create(deadline);
+    return connect(addr, addr_size, data, size, token).then(expire(token));
+  }
+}
@@ -1,6 +1,11 @@
 #include "stdafx.h"
 #include "eventloop.hpp"
+#include "clock.hpp"
+#include "eventloop_iocp.hpp"
+#include "task_queue.hpp"
+#include "timer_wheel.hpp"
 
+#ifdef _WIN32
 namespace loop {
   
   // The `environment` variable stores the thread pool environment, which we
@@ -15,13 +20,134 @@ namespace loop {
 
   std::once_flag flag;
 
+  EventLoop::Mode mode = EventLoop::Mode::THREAD_POOL;
+
+  // One loop. The THREAD_POOL mode only ever has one.
+  struct Port {
+    // RUN_TO_COMPLETION mode: the completion port every handle bound to
+    // the loop is associated with, and which its thread dequeues from. A
+    // completion with a key of 0 is only there to wake the thread up.
+    HANDLE port = NULL;
+
+    // All the timers of the loop live in one timing wheel. In the
+    // THREAD_POOL mode it is driven by a single thread pool timer armed
+    // for the wheel's next deadline. `armed` is that deadline, so we only
+    // call SetThreadpoolTimer when it actually moves. In the
+    // RUN_TO_COMPLETION mode there is no thread pool timer: the loop's
+    // thread bounds its wait for completions by `armed` instead.
+    std::mutex timers_mutex;
+    TimerWheel* timers = nullptr;
+    uint64_t armed = TimerWheel::NEVER;
+
+    // RUN_TO_COMPLETION mode: where the loop's thread collects the timers
+    // that expired, kept around so that running timers doesn't allocate.
+    std::vector<TimerWheel::Function> expired;
+
+    // RUN_TO_COMPLETION mode: functions posted to the loop. `notified` is
+    // set once the loop has been woken up for them, so that only the first
+    // post after the loop picked them up posts a completion.
+    TaskQueue tasks;
+    std::atomic<bool> notified{false};
+  };
+
+  std::vector<Port*> ports;
+
+  // The index of the loop the calling thread runs, if any. In the
+  // THREAD_POOL mode that is the one loop while a pool thread runs one of
+  // its callbacks.
+  thread_local size_t current_port = SIZE_MAX;
+
+  std::atomic<size_t> round_robin(0);
+
   std::condition_variable exit_cv;
   std::mutex exit_mutex;
   bool exit = false;
 
+  // THREAD_POOL mode.
+  PTP_TIMER wheel_timer;
+
+  // Resolution of the timers, in nanoseconds.
+  const uint64_t TIMER_RESOLUTION = 1000;
+
+  // How many posted functions one iteration of the loop runs at most.
+  const size_t TASK_BATCH = 1024;
+
+  static void wake(Port* loop)
+  {
+    PostQueuedCompletionStatus(loop->port, 0, 0, NULL);
+  }
+
+  // RUN_TO_COMPLETION mode: drops a reference to the descriptor.
+  static void release(Descriptor* descriptor)
+  {
+    if (--descriptor->references == 0) {
+      delete descriptor;
+    }
+  }
+
+  // Must be called with the loop's `timers_mutex` held.
+  static void arm_timer(Port* loop, uint64_t deadline)
+  {
+    if (mode == EventLoop::Mode::RUN_TO_COMPLETION) {
+      // Only an earlier deadline needs the loop to wait again. The loop's
+      // thread recomputes its wait before it waits anyway.
+      if (deadline < loop->armed) {
+        loop->armed = deadline;
+        if (current_port == SIZE_MAX || ports[current_port] != loop) {
+          wake(loop);
+        }
+      }
+      return;
+    }
+
+    if (deadline == loop->armed) {
+      return;
+    }
+    loop->armed = deadline;
+
+    if (deadline == TimerWheel::NEVER) {
+      SetThreadpoolTimer(wheel_timer, NULL, 0, 0);
+      return;
+    }
+
+    // Negative values are relative, in 100ns units. 0 is run immediately.
+    uint64_t now = clock::monotonic();
+    uint64_t due = deadline > now ? (deadline - now + 99) / 100 : 0;
+
+    ULARGE_INTEGER time;
+    time.QuadPart = (ULONGLONG)(-(LONGLONG)due);
+
+    FILETIME filetime;
+    filetime.dwHighDateTime = time.HighPart;
+    filetime.dwLowDateTime = time.LowPart;
+
+    SetThreadpoolTimer(wheel_timer, &filetime, 0, 0);
+  }
+
+  void CALLBACK timer_callback(
+    PTP_CALLBACK_INSTANCE instance,
+    PVOID context,
+    PTP_TIMER timer);
+
   void EventLoop::initialize()
   {
-    std::call_once(flag, []() {
+    initialize(Mode::THREAD_POOL);
+  }
+
+  void EventLoop::initialize(Mode m)
+  {
+    initialize(m, 1);
+  }
+
+  void EventLoop::initialize(Mode m, size_t loops)
+  {
+    if (m == Mode::THREAD_POOL && loops > 1) {
+      throw std::string("The THREAD_POOL mode only supports one loop");
+    }
+
+    std::call_once(flag, [m, loops]() {
+      mode = m;
+
       InitializeThreadpoolEnvironment(&environment);
 
       cleanup_group = CreateThreadpoolCleanupGroup();
@@ -31,47 +157,241 @@ namespace loop {
       }
 
       SetThreadpoolCallbackCleanupGroup(&environment, cleanup_group, NULL);
+
+      for (size_t i = 0; i < std::max<size_t>(loops, 1); i++) {
+        Port* loop = new Port();
+        loop->timers = new TimerWheel(clock::monotonic(), TIMER_RESOLUTION);
+
+        if (mode == Mode::RUN_TO_COMPLETION) {
+          loop->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+          if (loop->port == NULL) {
+            DWORD error = GetLastError();
+            throw "Could not create completion port: " + std::to_string(error);
+          }
+        }
+
+        ports.push_back(loop);
+      }
+
+      if (mode == Mode::RUN_TO_COMPLETION) {
+        return;
+      }
+
+      wheel_timer = CreateThreadpoolTimer(timer_callback, NULL, &environment);
+      if (wheel_timer == NULL) {
+        DWORD error = GetLastError();
+        throw "failed to create timer event: " + std::to_string(error);
+      }
     });
   }
 
+  size_t EventLoop::loops()
+  {
+    return ports.size();
+  }
+
+  size_t EventLoop::current()
+  {
+    if (current_port != SIZE_MAX) {
+      return current_port;
+    }
+    return next();
+  }
+
+  size_t EventLoop::next()
+  {
+    return round_robin.fetch_add(1, std::memory_order_relaxed) % ports.size();
+  }
+
+  // THREAD_POOL mode, which only has the one loop.
   void CALLBACK timer_callback(
     PTP_CALLBACK_INSTANCE instance,
     PVOID context,
     PTP_TIMER timer)
   {
-    auto f = reinterpret_cast<std::function<void()>*>(context);
-    (*f)();
-    delete f;
-    CloseThreadpoolTimer(timer);
+    Port* loop = ports[0];
+
+    // The timers run by one callback count as one iteration of the loop.
+    uint64_t now = clock::update();
+    current_port = 0;
+
+    std::vector<TimerWheel::Function> expired;
+    {
+      std::lock_guard<std::mutex> lock(loop->timers_mutex);
+      loop->armed = TimerWheel::NEVER;
+      loop->timers->advance(now, expired);
+      arm_timer(loop, loop->timers->next());
+    }
+
+    for (TimerWheel::Function& function : expired) {
+      function();
+    }
+
+    current_port = SIZE_MAX;
+    clock::clear();
+  }
+
+
+  // Nanoseconds in `duration`, with anything negative counting as none.
+  static uint64_t nanoseconds(std::chrono::nanoseconds duration)
+  {
+    return duration.count() > 0 ? static_cast<uint64_t>(duration.count()) : 0;
   }
-  
 
-  void EventLoop::delay(
+  // Converts a deadline on the standard library's steady clock to ours.
+  static uint64_t deadline_of(std::chrono::steady_clock::time_point deadline)
+  {
+    return clock::monotonic() + nanoseconds(deadline - std::chrono::steady_clock::now());
+  }
+
+
+  Timer EventLoop::delay(
     const int duration,
-    const std::function<void()>& function)
+    Function<void()> function)
   {
-    std::function<void()>* fptr = new std::function<void()>();
-    *fptr = function;
+    return delay(std::chrono::seconds(duration), std::move(function));
+  }
 
-    PTP_TIMER  timer =
-      CreateThreadpoolTimer(timer_callback, (PVOID) fptr, &environment);
 
-    if (timer == NULL) {
-      DWORD error = GetLastError();
-      throw "failed to create timer event: " + std::to_string(error) ; 
+  Timer EventLoop::delay(
+    std::chrono::nanoseconds duration,
+    Function<void()> function,
+    std::chrono::nanoseconds slack)
+  {
+    uint64_t deadline = clock::monotonic() + nanoseconds(duration);
+
+    size_t index = current();
+    Port* loop = ports[index];
+
+    std::lock_guard<std::mutex> lock(loop->timers_mutex);
+    TimerWheel::Id id = loop->timers->schedule(
+      deadline,
+      nanoseconds(slack),
+      std::move(function));
+
+    // The thread pool timer only needs to move for a new earliest timer.
+    uint64_t next = loop->timers->next();
+    if (next < loop->armed) {
+      arm_timer(loop, next);
     }
 
-    // If you give a positive value, then the timer call interprets it as absolute time.
-    // A negative value is interpretted as relative time.
-    // 0 is run immediately.
-    ULARGE_INTEGER time;
-    time.QuadPart = (ULONGLONG)(-duration * 10 * 1000 * 1000);
+    return Timer(index, id);
+  }
 
-    FILETIME filetime;
-    filetime.dwHighDateTime = time.HighPart;
-    filetime.dwLowDateTime = time.LowPart;
 
-    SetThreadpoolTimer(timer, &filetime, 0, 0);
+  Timer EventLoop::delay(
+    std::chrono::steady_clock::time_point deadline,
+    Function<void()> function,
+    std::chrono::nanoseconds slack)
+  {
+    return delay(deadline - std::chrono::steady_clock::now(), std::move(function), slack);
+  }
+
+
+  // THREAD_POOL mode.
+  void CALLBACK task_callback(PTP_CALLBACK_INSTANCE instance, PVOID context)
+  {
+    Task* task = static_cast<Task*>(context);
+
+    clock::update();
+    current_port = 0;
+    task->function();
+    current_port = SIZE_MAX;
+    clock::clear();
+
+    delete task;
+  }
+
+
+  void EventLoop::post(Function<void()> function)
+  {
+    Task* task = new Task();
+    task->function = std::move(function);
+
+    if (mode == Mode::THREAD_POOL) {
+      if (!TrySubmitThreadpoolCallback(task_callback, task, &environment)) {
+        DWORD error = GetLastError();
+        delete task;
+        throw "Could not submit callback: " + std::to_string(error);
+      }
+      return;
+    }
+
+    size_t index = current();
+    Port* loop = ports[index];
+    loop->tasks.push(task);
+
+    // The loop thread looks at its queue before it waits again anyway.
+    if (current_port != index &&
+        !loop->notified.exchange(true, std::memory_order_acq_rel)) {
+      wake(loop);
+    }
+  }
+
+
+  void EventLoop::dispatch(Function<void()> function)
+  {
+    if (current_port != SIZE_MAX) {
+      function();
+      return;
+    }
+    post(std::move(function));
+  }
+
+
+  bool Timer::cancel() const
+  {
+    if (m_id == 0) {
+      return false;
+    }
+
+    Port* loop = ports[m_loop];
+
+    TimerWheel::Function function;
+    {
+      std::lock_guard<std::mutex> lock(loop->timers_mutex);
+      function = loop->timers->cancel(m_id);
+      if (!function) {
+        return false;
+      }
+
+      // Push the thread pool timer back if this was the earliest timer, so
+      // that no thread gets woken up for nothing.
+      uint64_t next = loop->timers->next();
+      if (next > loop->armed) {
+        arm_timer(loop, next);
+      }
+    }
+
+    // The function is destroyed here, outside of the lock.
+    return true;
+  }
+
+
+  bool Timer::reschedule(std::chrono::steady_clock::time_point deadline) const
+  {
+    if (m_id == 0) {
+      return false;
+    }
+
+    Port* loop = ports[m_loop];
+
+    std::lock_guard<std::mutex> lock(loop->timers_mutex);
+    if (!loop->timers->reschedule(m_id, deadline_of(deadline))) {
+      return false;
+    }
+
+    uint64_t next = loop->timers->next();
+    if (next != loop->armed) {
+      arm_timer(loop, next);
+    }
+    return true;
+  }
+
+
+  uint64_t EventLoop::now()
+  {
+    return clock::now();
   }
 
 
@@ -100,8 +420,145 @@ namespace loop {
   }
 
 
+  // Runs every timer whose deadline has passed. RUN_TO_COMPLETION mode.
+  static void expire_timers(Port* loop, uint64_t now)
+  {
+    std::vector<TimerWheel::Function>& expired = loop->expired;
+    {
+      std::lock_guard<std::mutex> lock(loop->timers_mutex);
+      loop->timers->advance(now, expired);
+    }
+
+    for (TimerWheel::Function& function : expired) {
+      function();
+    }
+    expired.clear();
+  }
+
+
+  static void complete(const OVERLAPPED_ENTRY& entry)
+  {
+    Descriptor* descriptor =
+      reinterpret_cast<Descriptor*>(entry.lpCompletionKey);
+    if (descriptor == nullptr) {
+      return;
+    }
+
+    // The entry only has the NTSTATUS, let Windows translate it into the
+    // error code a thread pool callback would have been given.
+    DWORD bytes = entry.dwNumberOfBytesTransferred;
+    ULONG result = NO_ERROR;
+    if (!GetOverlappedResult(descriptor->handle, entry.lpOverlapped, &bytes, FALSE)) {
+      result = GetLastError();
+    }
+
+    descriptor->callback(NULL, NULL, entry.lpOverlapped, result, bytes, NULL);
+    release(descriptor);
+  }
+
+
+  static bool stopped()
+  {
+    std::lock_guard<std::mutex> lock(exit_mutex);
+    return exit;
+  }
+
+
+  static void run_to_completion(Port* loop)
+  {
+    OVERLAPPED_ENTRY entries[128];
+    while (!stopped()) {
+      uint64_t deadline;
+      {
+        std::lock_guard<std::mutex> lock(loop->timers_mutex);
+        deadline = loop->timers->next();
+        loop->armed = deadline;
+      }
+
+      // The wait is in milliseconds, rounded up so no timer runs early.
+      // Functions left over from the last iteration mean we only poll.
+      DWORD timeout = INFINITE;
+      if (!loop->tasks.empty()) {
+        timeout = 0;
+      } else if (deadline != TimerWheel::NEVER) {
+        uint64_t now = clock::monotonic();
+        uint64_t milliseconds = deadline > now
+          ? (deadline - now + 999999) / 1000000
+          : 0;
+        timeout = static_cast<DWORD>(std::min<uint64_t>(milliseconds, INFINITE - 1));
+      }
+
+      ULONG count = 0;
+      if (!GetQueuedCompletionStatusEx(loop->port, entries, 128, &count, timeout, FALSE)) {
+        DWORD error = GetLastError();
+        if (error != WAIT_TIMEOUT) {
+          throw "GetQueuedCompletionStatusEx failed: " + std::to_string(error);
+        }
+        count = 0;
+      }
+
+      uint64_t now = clock::update();
+      for (ULONG i = 0; i < count; i++) {
+        complete(entries[i]);
+      }
+
+      // Whoever posts from now on has to wake us up again. Anything posted
+      // without a wakeup is seen by `run` or by the `empty` check above.
+      loop->notified.exchange(false, std::memory_order_acq_rel);
+      loop->tasks.run(TASK_BATCH);
+
+      expire_timers(loop, now);
+      clock::clear();
+    }
+  }
+
+
+  // Runs loop `index` on the calling thread, pinned to a core of its own
+  // when there is more than one loop.
+  static void run_pinned(size_t index)
+  {
+    if (ports.size() > 1) {
+      DWORD processors = std::max<DWORD>(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS), 1);
+      SetThreadAffinityMask(GetCurrentThread(), DWORD_PTR(1) << (index % processors));
+    }
+
+    current_port = index;
+    run_to_completion(ports[index]);
+    current_port = SIZE_MAX;
+  }
+
+
   void EventLoop::run()
   {
+    if (mode == Mode::RUN_TO_COMPLETION) {
+      // The calling thread runs the first loop, and a thread of its own
+      // runs each of the others.
+      std::vector<std::thread> threads;
+      for (size_t i = 1; i < ports.size(); i++) {
+        threads.emplace_back([i]() { run_pinned(i); });
+      }
+
+      run_pinned(0);
+
+      for (std::thread& thread : threads) {
+        thread.join();
+      }
+
+      // A loop can see `exit` before `stop` is done waking the others.
+      std::lock_guard<std::mutex> lock(exit_mutex);
+
+      CloseThreadpoolCleanupGroupMembers(cleanup_group, FALSE, NULL);
+      CloseThreadpoolCleanupGroup(cleanup_group);
+      DestroyThreadpoolEnvironment(&environment);
+
+      for (Port* loop : ports) {
+        CloseHandle(loop->port);
+        delete loop->timers;
+        delete loop;
+      }
+      return;
+    }
+
     // We don't actually need to run anything here since the thread pool is already running.
     // All we do is wait on a condition variable, so that this thread can clean up.
     std::unique_lock<std::mutex> lock(exit_mutex);
@@ -110,6 +567,9 @@ namespace loop {
     CloseThreadpoolCleanupGroupMembers(cleanup_group, FALSE, NULL);
     CloseThreadpoolCleanupGroup(cleanup_group);
     DestroyThreadpoolEnvironment(&environment);
+
+    delete ports[0]->timers;
+    delete ports[0];
   }
 
 
@@ -118,5 +578,95 @@ namespace loop {
     std::lock_guard<std::mutex> lock(exit_mutex);
     exit = true;
     exit_cv.notify_one();
+
+    if (mode == Mode::RUN_TO_COMPLETION) {
+      for (Port* loop : ports) {
+        wake(loop);
+      }
+    }
+  }
+
+
+  namespace iocp {
+    // THREAD_POOL mode.
+    static void CALLBACK io_callback(
+      PTP_CALLBACK_INSTANCE instance,
+      PVOID context,
+      PVOID overlapped,
+      ULONG result,
+      ULONG_PTR transferred,
+      PTP_IO io)
+    {
+      PTP_WIN32_IO_CALLBACK callback = reinterpret_cast<PTP_WIN32_IO_CALLBACK>(context);
+      current_port = 0;
+      callback(instance, NULL, overlapped, result, transferred, io);
+      current_port = SIZE_MAX;
+    }
+
+
+    Descriptor* attach(HANDLE handle, PTP_WIN32_IO_CALLBACK callback, size_t loop)
+    {
+      Descriptor* descriptor = new Descriptor();
+      descriptor->handle = handle;
+      descriptor->callback = callback;
+      descriptor->io = NULL;
+      descriptor->references = 1;
+
+      if (mode == EventLoop::Mode::RUN_TO_COMPLETION) {
+        ULONG_PTR key = reinterpret_cast<ULONG_PTR>(descriptor);
+        HANDLE port = ports[loop % ports.size()]->port;
+        if (CreateIoCompletionPort(handle, port, key, 0) == NULL) {
+          delete descriptor;
+          return nullptr;
+        }
+        return descriptor;
+      }
+
+      // The callback rides along as the context rather than the
+      // descriptor, which completions can outlive in this mode.
+      descriptor->io = CreateThreadpoolIo(
+        handle,
+        io_callback,
+        reinterpret_cast<PVOID>(callback),
+        &environment);
+      if (descriptor->io == NULL) {
+        delete descriptor;
+        return nullptr;
+      }
+      return descriptor;
+    }
+
+
+    void start(Descriptor* descriptor)
+    {
+      if (mode == EventLoop::Mode::RUN_TO_COMPLETION) {
+        descriptor->references++;
+        return;
+      }
+      StartThreadpoolIo(descriptor->io);
+    }
+
+
+    void cancel(Descriptor* descriptor)
+    {
+      if (mode == EventLoop::Mode::RUN_TO_COMPLETION) {
+        release(descriptor);
+        return;
+      }
+      CancelThreadpoolIo(descriptor->io);
+    }
+
+
+    void detach(Descriptor* descriptor)
+    {
+      if (mode == EventLoop::Mode::RUN_TO_COMPLETION) {
+        // Completions of the operations still in flight free it.
+        release(descriptor);
+        return;
+      }
+      CloseThreadpoolIo(descriptor->io);
+      delete descriptor;
+    }
   }
-}
\ No newline at end of file
+}
+#endif // _WIN32
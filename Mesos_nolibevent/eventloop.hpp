@@ -1,9 +1,39 @@
 #pragma once
 
 #include "stdafx.h"
+#include "function.hpp"
 
 namespace loop {
+#ifdef _WIN32
   extern TP_CALLBACK_ENVIRON environment;
+#endif
+
+  // A timer scheduled with `EventLoop::delay`. This is just an id, so it
+  // is cheap to copy and keep around, and it stays safe to use after the
+  // timer ran: `cancel` and `reschedule` then do nothing and return false.
+  // So do those of a default-constructed Timer, which refers to no timer.
+  class Timer
+  {
+  public:
+    Timer() : m_loop(0), m_id(0) {}
+
+    // Cancels the timer. Its function is destroyed right away rather than
+    // when the timer would have fired. Returns false if the timer already
+    // ran or was cancelled before.
+    bool cancel() const;
+
+    // Moves the timer so that it fires at `deadline` instead. Returns
+    // false if the timer already ran or was cancelled.
+    bool reschedule(std::chrono::steady_clock::time_point deadline) const;
+
+  private:
+    friend class EventLoop;
+
+    Timer(size_t loop, uint64_t id) : m_loop(loop), m_id(id) {}
+
+    size_t m_loop;
+    uint64_t m_id;
+  };
 
   // The interface that must be implemented by an event management
   // system. This is a class to cleanly isolate the interface and so
@@ -11,20 +41,94 @@ namespace loop {
   class EventLoop
   {
   public:
+    // How the loop runs callbacks (I/O completions and timers).
+    enum class Mode {
+      // On the threads of the default thread pool, in parallel. `run` only
+      // waits for `stop`. This is the default on Windows.
+      THREAD_POOL,
+
+      // On the thread that calls `run`, one after the other: `run` waits
+      // for a batch of I/O completions, runs them, then runs the functions
+      // posted to the loop and then the timers that have expired, and
+      // repeats. Callbacks never race each other, so state that only they
+      // touch needs no locks. The epoll and io_uring backends always work
+      // like this.
+      RUN_TO_COMPLETION
+    };
+
     // Initializes the event loop.
     static void initialize();
 
+    static void initialize(Mode mode);
+
+    // Initializes `loops` independent event loops, to be run by as many
+    // threads, each pinned to its own core. Every handle is bound to one
+    // loop for its whole life, so its completions always run on the same
+    // thread. Handles created on a loop thread are bound to that loop, and
+    // handles created on any other thread (or accepted) are spread over
+    // the loops in round robin order. Timers work the same way.
+    //
+    // On Windows this needs the RUN_TO_COMPLETION mode, the THREAD_POOL
+    // mode only has one loop.
+    static void initialize(Mode mode, size_t loops);
+
+    // The number of loops.
+    static size_t loops();
+
+    // The loop run by the calling thread or, on any other thread, the
+    // next loop in round robin order.
+    static size_t current();
+
+    // The next loop in round robin order.
+    static size_t next();
+
     // Invoke the specified function in the event loop after the
-    // specified duration.
-    // TODO(bmahler): Update this to use rvalue references.
-    static void delay(
+    // specified duration. The function is moved into the loop; it is not
+    // copied, and it does not allocate if it is small (see `Function`).
+    static Timer delay(
       const int duration,
-      const std::function<void()>& function);
+      Function<void()> function);
+
+    // Timers have microsecond resolution. A timer may run up to `slack`
+    // late, which lets the loop run timers that are due at about the same
+    // time together, in one wakeup, rather than one after the other.
+    static Timer delay(
+      std::chrono::nanoseconds duration,
+      Function<void()> function,
+      std::chrono::nanoseconds slack = std::chrono::nanoseconds::zero());
+
+    // Invoke the specified function in the event loop at `deadline`.
+    static Timer delay(
+      std::chrono::steady_clock::time_point deadline,
+      Function<void()> function,
+      std::chrono::nanoseconds slack = std::chrono::nanoseconds::zero());
+
+    // Runs `function` on the loop soon, after the I/O completions of its
+    // next iteration. This is much cheaper than a `delay` of 0: it does
+    // not touch the timers, and posting to a loop that already has
+    // functions pending does not wake it up again. Functions posted from
+    // one thread run in the order they were posted.
+    //
+    // On a loop thread the function goes to that loop, on any other thread
+    // to the next loop in round robin order. In the THREAD_POOL mode it is
+    // submitted to the thread pool.
+    static void post(Function<void()> function);
+
+    // Runs `function` right away if called from a loop thread, and posts
+    // it otherwise. In the THREAD_POOL mode a loop thread is a pool thread
+    // running a callback of the loop.
+    static void dispatch(Function<void()> function);
 
     // Returns the current time w.r.t. the event loop.
     static double time();
 
-    // Runs the event loop.
+    // Returns monotonic time in nanoseconds (see `clock::monotonic`). In a
+    // callback run by the loop this is the time the loop woke up to run
+    // it, which saves reading the clock again for every timestamp.
+    static uint64_t now();
+
+    // Runs the event loop. With several loops the calling thread runs the
+    // first one, and `run` starts a thread for each of the others.
     static void run();
 
     // Asynchronously tells the event loop to stop and then returns.
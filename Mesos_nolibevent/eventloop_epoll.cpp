@@ -0,0 +1,696 @@
+#include "stdafx.h"
+#include "eventloop.hpp"
+#include "eventloop_epoll.hpp"
+#include "clock.hpp"
+#include "task_queue.hpp"
+#include "timer_wheel.hpp"
+
+#if defined(__linux__) && !defined(USE_IO_URING)
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+namespace loop {
+
+  // Unlike the Windows implementation, which lets the default thread pool
+  // run the callbacks, this is a classic single threaded reactor: `run`
+  // waits in epoll_wait and performs the I/O on the calling thread. All
+  // the timers share one timerfd, armed for the earliest deadline, and
+  // an eventfd is used to wake the loop up from other threads.
+  //
+  // There can be several independent reactors, each run by its own thread
+  // pinned to its own core.
+  struct Reactor {
+    int epoll_fd = -1;
+    int timer_fd = -1;
+    int wake_fd = -1;
+
+    // All the timers live in one timing wheel; the timerfd is armed for the
+    // wheel's next deadline, which we remember in `armed` so that we only
+    // call timerfd_settime when it actually moves.
+    std::mutex timers_mutex;
+    TimerWheel* timers = nullptr;
+    uint64_t armed = TimerWheel::NEVER;
+
+    // Where the loop's thread collects the timers that expired, kept
+    // around so that running timers doesn't allocate.
+    std::vector<TimerWheel::Function> expired;
+
+    // Descriptors detached while the loop may still hold an event for them.
+    std::mutex retired_mutex;
+    std::vector<Descriptor*> retired;
+
+    // Functions posted to the loop. `notified` is set once the loop has
+    // been woken up for them, so that only the first post after the loop
+    // picked them up writes to the eventfd.
+    TaskQueue tasks;
+    std::atomic<bool> notified{false};
+  };
+
+  // The epoll_data of the timerfd and the eventfd point at these, so
+  // they can be told apart from the descriptors.
+  char timer_tag;
+  char wake_tag;
+
+  std::once_flag flag;
+  std::atomic<bool> exit(false);
+  std::mutex stop_mutex;
+
+  std::vector<Reactor*> reactors;
+
+  // The index of the reactor the calling thread runs, if any.
+  thread_local size_t current_reactor = SIZE_MAX;
+
+  std::atomic<size_t> round_robin(0);
+
+  // Resolution of the timers, in nanoseconds.
+  const uint64_t TIMER_RESOLUTION = 1000;
+
+  // How many posted functions one iteration of the loop runs at most.
+  const size_t TASK_BATCH = 1024;
+
+  // Must be called with `timers_mutex` held.
+  static void arm_timer(Reactor* reactor, uint64_t deadline)
+  {
+    if (deadline == reactor->armed) {
+      return;
+    }
+    reactor->armed = deadline;
+
+    // The timerfd is armed relative to now: our clock may be the time
+    // stamp counter rather than CLOCK_MONOTONIC.
+    itimerspec spec = {};
+    if (deadline != TimerWheel::NEVER) {
+      uint64_t now = clock::monotonic();
+
+      // A zero `it_value` disarms the timer, so make sure a timer that is
+      // already due still fires.
+      uint64_t timeout = deadline > now ? deadline - now : 1;
+      spec.it_value.tv_sec = timeout / 1000000000;
+      spec.it_value.tv_nsec = timeout % 1000000000;
+    }
+
+    if (timerfd_settime(reactor->timer_fd, 0, &spec, NULL) != 0) {
+      throw "failed to arm timer: " + std::to_string(errno);
+    }
+  }
+
+  static void wake(Reactor* reactor)
+  {
+    uint64_t one = 1;
+    ssize_t result = ::write(reactor->wake_fd, &one, sizeof(one));
+    (void) result;
+  }
+
+  static Reactor* create()
+  {
+    Reactor* reactor = new Reactor();
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd == -1) {
+      throw "Could not create epoll instance: " + std::to_string(errno);
+    }
+
+    reactor->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (reactor->timer_fd == -1) {
+      throw "Could not create timerfd: " + std::to_string(errno);
+    }
+
+    reactor->timers = new TimerWheel(clock::monotonic(), TIMER_RESOLUTION);
+
+    reactor->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reactor->wake_fd == -1) {
+      throw "Could not create eventfd: " + std::to_string(errno);
+    }
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = &timer_tag;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->timer_fd, &event) != 0) {
+      throw "Could not watch timerfd: " + std::to_string(errno);
+    }
+
+    event.data.ptr = &wake_tag;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->wake_fd, &event) != 0) {
+      throw "Could not watch eventfd: " + std::to_string(errno);
+    }
+
+    return reactor;
+  }
+
+  void EventLoop::initialize()
+  {
+    initialize(Mode::RUN_TO_COMPLETION, 1);
+  }
+
+
+  // The reactor always runs to completion, there is nothing to choose.
+  void EventLoop::initialize(Mode mode)
+  {
+    initialize(mode, 1);
+  }
+
+
+  void EventLoop::initialize(Mode mode, size_t loops)
+  {
+    // This backend always runs to completion.
+    (void) mode;
+
+    std::call_once(flag, [loops]() {
+      // Writes to a pipe or socket whose peer went away should fail the
+      // operation rather than kill the process.
+      signal(SIGPIPE, SIG_IGN);
+
+      for (size_t i = 0; i < std::max<size_t>(loops, 1); i++) {
+        reactors.push_back(create());
+      }
+    });
+  }
+
+
+  size_t EventLoop::loops()
+  {
+    return reactors.size();
+  }
+
+
+  size_t EventLoop::current()
+  {
+    if (current_reactor != SIZE_MAX) {
+      return current_reactor;
+    }
+    return next();
+  }
+
+
+  size_t EventLoop::next()
+  {
+    return round_robin.fetch_add(1, std::memory_order_relaxed) % reactors.size();
+  }
+
+
+  // Nanoseconds in `duration`, with anything negative counting as none.
+  static uint64_t nanoseconds(std::chrono::nanoseconds duration)
+  {
+    return duration.count() > 0 ? static_cast<uint64_t>(duration.count()) : 0;
+  }
+
+  // Converts a deadline on the standard library's steady clock to ours.
+  static uint64_t deadline_of(std::chrono::steady_clock::time_point deadline)
+  {
+    return clock::monotonic() + nanoseconds(deadline - std::chrono::steady_clock::now());
+  }
+
+
+  Timer EventLoop::delay(
+    const int duration,
+    Function<void()> function)
+  {
+    return delay(std::chrono::seconds(duration), std::move(function));
+  }
+
+
+  Timer EventLoop::delay(
+    std::chrono::nanoseconds duration,
+    Function<void()> function,
+    std::chrono::nanoseconds slack)
+  {
+    uint64_t deadline = clock::monotonic() + nanoseconds(duration);
+
+    size_t index = current();
+    Reactor* reactor = reactors[index];
+
+    std::lock_guard<std::mutex> lock(reactor->timers_mutex);
+    TimerWheel::Id id = reactor->timers->schedule(
+      deadline,
+      nanoseconds(slack),
+      std::move(function));
+
+    // The timerfd only needs to move for a new earliest timer.
+    uint64_t next = reactor->timers->next();
+    if (next < reactor->armed) {
+      arm_timer(reactor, next);
+    }
+
+    return Timer(index, id);
+  }
+
+
+  Timer EventLoop::delay(
+    std::chrono::steady_clock::time_point deadline,
+    Function<void()> function,
+    std::chrono::nanoseconds slack)
+  {
+    return delay(deadline - std::chrono::steady_clock::now(), std::move(function), slack);
+  }
+
+
+  // Queues `function` on the loop. `local` is set on the loop's own
+  // thread, which looks at its queue before it waits again anyway.
+  static void enqueue(Reactor* reactor, bool local, Function<void()> function)
+  {
+    Task* task = new Task();
+    task->function = std::move(function);
+    reactor->tasks.push(task);
+
+    if (!local && !reactor->notified.exchange(true, std::memory_order_acq_rel)) {
+      wake(reactor);
+    }
+  }
+
+
+  void EventLoop::post(Function<void()> function)
+  {
+    size_t index = current();
+    enqueue(reactors[index], current_reactor == index, std::move(function));
+  }
+
+
+  void EventLoop::dispatch(Function<void()> function)
+  {
+    if (current_reactor != SIZE_MAX) {
+      function();
+      return;
+    }
+    post(std::move(function));
+  }
+
+
+  bool Timer::cancel() const
+  {
+    if (m_id == 0) {
+      return false;
+    }
+
+    Reactor* reactor = reactors[m_loop];
+
+    TimerWheel::Function function;
+    {
+      std::lock_guard<std::mutex> lock(reactor->timers_mutex);
+      function = reactor->timers->cancel(m_id);
+      if (!function) {
+        return false;
+      }
+
+      // Push the timerfd back if this was the earliest timer, so that the
+      // loop doesn't wake up for nothing.
+      uint64_t next = reactor->timers->next();
+      if (next > reactor->armed) {
+        arm_timer(reactor, next);
+      }
+    }
+
+    // The function is destroyed here, outside of the lock.
+    return true;
+  }
+
+
+  bool Timer::reschedule(std::chrono::steady_clock::time_point deadline) const
+  {
+    if (m_id == 0) {
+      return false;
+    }
+
+    Reactor* reactor = reactors[m_loop];
+
+    std::lock_guard<std::mutex> lock(reactor->timers_mutex);
+    if (!reactor->timers->reschedule(m_id, deadline_of(deadline))) {
+      return false;
+    }
+
+    uint64_t next = reactor->timers->next();
+    if (next != reactor->armed) {
+      arm_timer(reactor, next);
+    }
+    return true;
+  }
+
+
+  double EventLoop::time()
+  {
+    timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+      throw "unvalid system time: " + std::to_string(errno);
+    }
+
+    return static_cast<double>(ts.tv_sec) +
+      static_cast<double>(ts.tv_nsec) / 1000000000;
+  }
+
+
+  uint64_t EventLoop::now()
+  {
+    return clock::now();
+  }
+
+
+  // Runs every timer whose deadline has passed.
+  static void expire_timers(Reactor* reactor)
+  {
+    uint64_t expirations;
+    ssize_t result = ::read(reactor->timer_fd, &expirations, sizeof(expirations));
+    (void) result;
+
+    std::vector<TimerWheel::Function>& expired = reactor->expired;
+    {
+      std::lock_guard<std::mutex> lock(reactor->timers_mutex);
+      reactor->armed = TimerWheel::NEVER;
+      reactor->timers->advance(clock::now(), expired);
+      arm_timer(reactor, reactor->timers->next());
+    }
+
+    for (TimerWheel::Function& function : expired) {
+      function();
+    }
+    expired.clear();
+  }
+
+
+  static void arm(Descriptor* descriptor)
+  {
+    epoll_event event = {};
+    event.events = EPOLLONESHOT;
+    if (!descriptor->readers.empty()) {
+      event.events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (!descriptor->writers.empty()) {
+      event.events |= EPOLLOUT;
+    }
+    event.data.ptr = descriptor;
+
+    epoll_ctl(descriptor->reactor->epoll_fd, EPOLL_CTL_MOD, descriptor->fd, &event);
+  }
+
+
+  // Performs queued operations until one of them would block.
+  static void drain(OperationQueue& queue, int fd, OperationQueue& done)
+  {
+    while (!queue.empty()) {
+      if (!queue.head->perform(fd)) {
+        break;
+      }
+      done.push(queue.pop());
+    }
+  }
+
+
+  // Walks the queue instead of popping it: the operations must keep
+  // pointing at `done`, which `withdraw` reads under the descriptor's lock
+  // that is no longer held here.
+  static void complete(OperationQueue& done)
+  {
+    Operation* op = done.head;
+    while (op != nullptr) {
+      Operation* next = op->next;
+      op->complete();
+      op->release();
+      op = next;
+    }
+  }
+
+
+  static void dispatch(Descriptor* descriptor, uint32_t events)
+  {
+    OperationQueue done;
+    {
+      std::lock_guard<std::mutex> lock(descriptor->mutex);
+      if (descriptor->closed) {
+        return;
+      }
+
+      // Errors and hang ups are reported to whoever is waiting, the
+      // operations themselves will pick up the error.
+      if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+        drain(descriptor->readers, descriptor->fd, done);
+      }
+      if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        drain(descriptor->writers, descriptor->fd, done);
+      }
+
+      // The descriptor is registered with EPOLLONESHOT, so it stays
+      // disabled until someone is waiting on it again.
+      if (!descriptor->readers.empty() || !descriptor->writers.empty()) {
+        arm(descriptor);
+      }
+    }
+    complete(done);
+  }
+
+
+  static void reap(Reactor* reactor)
+  {
+    std::vector<Descriptor*> descriptors;
+    {
+      std::lock_guard<std::mutex> lock(reactor->retired_mutex);
+      descriptors.swap(reactor->retired);
+    }
+    for (Descriptor* descriptor : descriptors) {
+      delete descriptor;
+    }
+  }
+
+
+  static void run_reactor(Reactor* reactor)
+  {
+    epoll_event events[128];
+
+    while (!exit.load()) {
+      // Functions left over from the last iteration mean we only poll.
+      int timeout = reactor->tasks.empty() ? -1 : 0;
+      int count = epoll_wait(reactor->epoll_fd, events, 128, timeout);
+      if (count == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw "epoll_wait failed: " + std::to_string(errno);
+      }
+
+      clock::update();
+
+      bool expired = false;
+      for (int i = 0; i < count; i++) {
+        void* ptr = events[i].data.ptr;
+        if (ptr == &timer_tag) {
+          expired = true;
+        } else if (ptr == &wake_tag) {
+          uint64_t value;
+          ssize_t result = ::read(reactor->wake_fd, &value, sizeof(value));
+          (void) result;
+        } else {
+          dispatch(static_cast<Descriptor*>(ptr), events[i].events);
+        }
+      }
+
+      // Whoever posts from now on has to wake us up again. This pairs with
+      // the exchange in `post`, so every function posted by someone who
+      // did not wake us up is visible to the `run` below, or at the latest
+      // to the `empty` check before the next wait.
+      reactor->notified.exchange(false, std::memory_order_acq_rel);
+      reactor->tasks.run(TASK_BATCH);
+
+      if (expired) {
+        expire_timers(reactor);
+      }
+
+      // Every descriptor retired before this point was unregistered
+      // before the epoll_wait above returned, so nothing references it.
+      reap(reactor);
+      clock::clear();
+    }
+
+    reap(reactor);
+  }
+
+
+  static void destroy(Reactor* reactor)
+  {
+    delete reactor->timers;
+    ::close(reactor->timer_fd);
+    ::close(reactor->wake_fd);
+    ::close(reactor->epoll_fd);
+    delete reactor;
+  }
+
+
+  // Runs reactor `index` on the calling thread, pinned to a core of its
+  // own when there is more than one reactor.
+  static void run_pinned(size_t index)
+  {
+    if (reactors.size() > 1) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(index % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    current_reactor = index;
+    run_reactor(reactors[index]);
+    current_reactor = SIZE_MAX;
+  }
+
+
+  void EventLoop::run()
+  {
+    // The calling thread runs the first reactor, and a thread of its own
+    // runs each of the others.
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < reactors.size(); i++) {
+      threads.emplace_back([i]() { run_pinned(i); });
+    }
+
+    run_pinned(0);
+
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+
+    // A reactor can see `exit` before `stop` is done waking the others.
+    std::lock_guard<std::mutex> lock(stop_mutex);
+    for (Reactor* reactor : reactors) {
+      destroy(reactor);
+    }
+  }
+
+
+  void EventLoop::stop()
+  {
+    std::lock_guard<std::mutex> lock(stop_mutex);
+    exit.store(true);
+    for (Reactor* reactor : reactors) {
+      wake(reactor);
+    }
+  }
+
+
+  namespace epoll {
+    Descriptor* attach(int fd, size_t loop)
+    {
+      int flags = fcntl(fd, F_GETFL);
+      if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return nullptr;
+      }
+
+      Descriptor* descriptor = new Descriptor();
+      descriptor->fd = fd;
+      descriptor->reactor = reactors[loop % reactors.size()];
+
+      // Registered with no events: the descriptor is only armed while an
+      // operation is queued on it.
+      epoll_event event = {};
+      event.events = EPOLLONESHOT;
+      event.data.ptr = descriptor;
+      if (epoll_ctl(descriptor->reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        delete descriptor;
+        return nullptr;
+      }
+
+      return descriptor;
+    }
+
+
+    void submit(Descriptor* descriptor, Operation* op, Direction direction)
+    {
+      bool performed = false;
+      {
+        std::lock_guard<std::mutex> lock(descriptor->mutex);
+        OperationQueue& queue = direction == Direction::READ
+          ? descriptor->readers
+          : descriptor->writers;
+
+        if (!descriptor->closed) {
+          // Only try right away if we would not overtake anyone.
+          if (!queue.empty() || !op->perform(descriptor->fd)) {
+            queue.push(op);
+            arm(descriptor);
+            return;
+          }
+          performed = true;
+        }
+      }
+
+      if (performed) {
+        op->complete();
+      } else {
+        op->abort();
+      }
+      op->release();
+    }
+
+
+    void queue(Descriptor* descriptor, Operation* op, Direction direction)
+    {
+      {
+        std::lock_guard<std::mutex> lock(descriptor->mutex);
+        if (!descriptor->closed) {
+          OperationQueue& waiting = direction == Direction::READ
+            ? descriptor->readers
+            : descriptor->writers;
+          waiting.push(op);
+          arm(descriptor);
+          return;
+        }
+      }
+
+      op->abort();
+      op->release();
+    }
+
+
+    bool withdraw(Descriptor* descriptor, Operation* op)
+    {
+      std::lock_guard<std::mutex> lock(descriptor->mutex);
+      if (op->queue != &descriptor->readers && op->queue != &descriptor->writers) {
+        return false;
+      }
+
+      op->queue->remove(op);
+      if (!descriptor->closed) {
+        arm(descriptor);
+      }
+      return true;
+    }
+
+
+    void dispatch(Descriptor* descriptor, Function<void()> function)
+    {
+      Reactor* reactor = descriptor->reactor;
+      if (current_reactor != SIZE_MAX && reactors[current_reactor] == reactor) {
+        function();
+        return;
+      }
+      enqueue(reactor, false, std::move(function));
+    }
+
+
+    void detach(Descriptor* descriptor)
+    {
+      OperationQueue aborted;
+      {
+        std::lock_guard<std::mutex> lock(descriptor->mutex);
+        descriptor->closed = true;
+        epoll_ctl(descriptor->reactor->epoll_fd, EPOLL_CTL_DEL, descriptor->fd, NULL);
+
+        while (!descriptor->readers.empty()) {
+          aborted.push(descriptor->readers.pop());
+        }
+        while (!descriptor->writers.empty()) {
+          aborted.push(descriptor->writers.pop());
+        }
+      }
+
+      Operation* op = aborted.head;
+      while (op != nullptr) {
+        Operation* next = op->next;
+        op->abort();
+        op->release();
+        op = next;
+      }
+
+      Reactor* reactor = descriptor->reactor;
+      std::lock_guard<std::mutex> lock(reactor->retired_mutex);
+      reactor->retired.push_back(descriptor);
+    }
+  }
+}
+#endif // __linux__ && !USE_IO_URING
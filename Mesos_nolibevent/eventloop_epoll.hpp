@@ -0,0 +1,145 @@
+#pragma once
+
+#include "stdafx.h"
+#include "function.hpp"
+
+// Internal interface between the epoll event loop and the async handles.
+// Nothing outside of eventloop_epoll.cpp, async_io_epoll.cpp and
+// write_queue.cpp should need to include this.
+
+namespace loop {
+  struct OperationQueue;
+
+  // An I/O request parked on a descriptor. The epoll backend is a reactor,
+  // so instead of handing a buffer to the kernel (like WSARecv does) we keep
+  // the request here and retry it every time the descriptor becomes ready.
+  struct Operation {
+    virtual ~Operation() {}
+
+    // Makes progress on the operation. Returns false if the descriptor
+    // would block, in which case the operation stays queued. Returns true
+    // once the operation has finished, successfully or not.
+    virtual bool perform(int fd) = 0;
+
+    // Delivers the result. Called without any locks held, after which the
+    // operation is released.
+    virtual void complete() = 0;
+
+    // Fails the operation without performing it, e.g. because the handle
+    // was closed while the operation was still queued. The operation is
+    // released after this too.
+    virtual void abort() = 0;
+
+    // Called once the loop is done with the operation. An operation that
+    // holds the state of its future stays around until the future lets go
+    // of it as well.
+    virtual void release()
+    {
+      delete this;
+    }
+
+    Operation* next = nullptr;
+    Operation* previous = nullptr;
+
+    // The queue the operation is in, if any.
+    OperationQueue* queue = nullptr;
+  };
+
+  // Intrusive FIFO of operations waiting on the same readiness event.
+  // Operations can also leave from the middle, when they are cancelled.
+  struct OperationQueue {
+    Operation* head = nullptr;
+    Operation* tail = nullptr;
+
+    bool empty() const { return head == nullptr; }
+
+    void push(Operation* op)
+    {
+      op->next = nullptr;
+      op->previous = tail;
+      op->queue = this;
+      if (tail == nullptr) {
+        head = op;
+      } else {
+        tail->next = op;
+      }
+      tail = op;
+    }
+
+    Operation* pop()
+    {
+      Operation* op = head;
+      if (op != nullptr) {
+        remove(op);
+      }
+      return op;
+    }
+
+    void remove(Operation* op)
+    {
+      if (op->previous != nullptr) {
+        op->previous->next = op->next;
+      } else {
+        head = op->next;
+      }
+      if (op->next != nullptr) {
+        op->next->previous = op->previous;
+      } else {
+        tail = op->previous;
+      }
+      op->next = nullptr;
+      op->previous = nullptr;
+      op->queue = nullptr;
+    }
+  };
+
+  struct Reactor;
+
+  // The loop's view of a non-blocking file descriptor. The readers and
+  // writers are served in FIFO order, so operations submitted from the
+  // same thread complete in the order they were issued.
+  struct Descriptor {
+    int fd;
+    Reactor* reactor;
+    std::mutex mutex;
+    OperationQueue readers;
+    OperationQueue writers;
+    bool closed = false;
+  };
+
+  enum class Direction {
+    READ,
+    WRITE
+  };
+
+  namespace epoll {
+    // Puts `fd` in non-blocking mode and registers it with loop `loop`,
+    // which performs all of its I/O from then on. Returns nullptr if the
+    // descriptor cannot be watched by epoll.
+    Descriptor* attach(int fd, size_t loop);
+
+    // Tries `op` right away if nothing is queued ahead of it, otherwise
+    // queues it until the descriptor is ready in the given direction.
+    void submit(Descriptor* descriptor, Operation* op, Direction direction);
+
+    // Queues `op` without trying it first, for an operation submitted from
+    // the completion of another one on the same descriptor, which would
+    // otherwise nest a completion per ready event (see Acceptor).
+    void queue(Descriptor* descriptor, Operation* op, Direction direction);
+
+    // Takes `op` off the descriptor if it is still queued there, and
+    // returns whether it was. The caller then owns the operation, which
+    // will not be performed, completed or aborted by the loop.
+    bool withdraw(Descriptor* descriptor, Operation* op);
+
+    // Like `EventLoop::dispatch`, for the loop the descriptor is bound to:
+    // runs `function` right away on that loop's thread, and posts it to
+    // that loop from any other thread.
+    void dispatch(Descriptor* descriptor, Function<void()> function);
+
+    // Unregisters the descriptor and aborts every queued operation. The
+    // descriptor itself is freed by the loop thread once no event that
+    // still references it can be in flight. The caller closes the fd.
+    void detach(Descriptor* descriptor);
+  }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "stdafx.h"
+
+// Internal interface between the Windows event loop and the async handles.
+// Nothing outside of eventloop.cpp and async_io.cpp should need to include
+// this.
+
+#ifdef _WIN32
+namespace loop {
+  // The loop's view of an overlapped handle. Completions for the handle are
+  // delivered to `callback`: on a thread pool thread in the THREAD_POOL
+  // mode, or on the thread in `EventLoop::run` in the RUN_TO_COMPLETION
+  // mode, where the `instance` and `io` arguments are NULL.
+  struct Descriptor {
+    HANDLE handle;
+    PTP_WIN32_IO_CALLBACK callback;
+
+    // THREAD_POOL mode.
+    PTP_IO io;
+
+    // RUN_TO_COMPLETION mode. The handle holds one reference and every
+    // operation in flight another, since completions of operations that
+    // were in flight when the handle was closed still name the descriptor.
+    std::atomic<long> references;
+  };
+
+  namespace iocp {
+    // Binds the handle to loop `loop`, whose thread then runs all of its
+    // completions in the RUN_TO_COMPLETION mode. Returns nullptr if the
+    // handle could not be associated with the loop.
+    Descriptor* attach(HANDLE handle, PTP_WIN32_IO_CALLBACK callback, size_t loop);
+
+    // Must be called before every overlapped call on the handle, like
+    // StartThreadpoolIo.
+    void start(Descriptor* descriptor);
+
+    // Must be called when an overlapped call failed right away, so that no
+    // completion will be delivered for it, like CancelThreadpoolIo.
+    void cancel(Descriptor* descriptor);
+
+    // Releases the descriptor. The caller closes the handle.
+    void detach(Descriptor* descriptor);
+  }
+}
+#endif // _WIN32
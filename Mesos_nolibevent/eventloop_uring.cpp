@@ -0,0 +1,820 @@
+#include "stdafx.h"
+#include "eventloop.hpp"
+#include "eventloop_uring.hpp"
+#include "clock.hpp"
+#include "task_queue.hpp"
+#include "timer_wheel.hpp"
+
+#if defined(__linux__) && defined(USE_IO_URING)
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+namespace loop {
+
+  // This implementation keeps the proactor model of the Windows one: every
+  // operation hands its buffer to the kernel and is told when it is done.
+  // The difference is that the completions are reaped in batches by `run`
+  // on the calling thread instead of being spread over a thread pool.
+  //
+  // We talk to the ring directly rather than through liburing, so the
+  // structures below are the ones described in io_uring_setup(2).
+  //
+  // There can be several independent rings, each reaped by its own thread
+  // pinned to its own core.
+  const unsigned ENTRIES = 4096;
+
+  struct Ring {
+    int fd = -1;
+
+    // Submission queue. Guarded by `sq_mutex`, since operations can be
+    // started from any thread.
+    std::mutex sq_mutex;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_entries;
+    unsigned* sq_array;
+    io_uring_sqe* sqes;
+
+    // Completion queue, only ever touched by the loop thread.
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // All the timers live in one timing wheel. There is no timer request
+    // in the ring: `run` bounds its wait for completions by the wheel's
+    // next deadline instead, and remembers that deadline in `armed` so
+    // that other threads know when they have to wake it up.
+    std::mutex timers_mutex;
+    TimerWheel* timers = nullptr;
+    uint64_t armed = TimerWheel::NEVER;
+
+    // Where the loop's thread collects the timers that expired, kept
+    // around so that running timers doesn't allocate.
+    std::vector<TimerWheel::Function> expired;
+
+    // Functions posted to the loop. `notified` is set once the loop has
+    // been woken up for them, so that only the first post after the loop
+    // picked them up queues a no-op.
+    TaskQueue tasks;
+    std::atomic<bool> notified{false};
+
+    // Whether the ring has a table of fixed buffers (see
+    // `uring::register_buffer`).
+    bool fixed = false;
+  };
+
+  std::once_flag flag;
+  std::atomic<bool> exit(false);
+  std::mutex stop_mutex;
+
+  std::vector<Ring*> rings;
+
+  // The index of the ring the calling thread reaps, if any.
+  thread_local size_t current_ring = SIZE_MAX;
+
+  std::atomic<size_t> round_robin(0);
+
+  // Resolution of the timers, in nanoseconds.
+  const uint64_t TIMER_RESOLUTION = 1000;
+
+  // How many posted functions one iteration of the loop runs at most.
+  const size_t TASK_BATCH = 1024;
+
+  // Size of each ring's table of fixed buffers. Every region of memory
+  // registered with `uring::register_buffer` takes one entry, in every
+  // ring. The entries in use are guarded by `stop_mutex`, which also keeps
+  // the rings from being destroyed under `register_buffer`.
+  const unsigned FIXED_BUFFERS = 1024;
+  std::vector<bool> fixed_buffers(FIXED_BUFFERS);
+
+  static int io_uring_setup(unsigned entries, io_uring_params* params)
+  {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+  }
+
+  static int io_uring_enter(
+    Ring* ring,
+    unsigned to_submit,
+    unsigned min_complete,
+    unsigned flags,
+    const void* arg = NULL,
+    size_t size = 0)
+  {
+    return static_cast<int>(
+      syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, arg, size));
+  }
+
+  static int io_uring_register(Ring* ring, unsigned opcode, const void* arg, unsigned size)
+  {
+    return static_cast<int>(
+      syscall(__NR_io_uring_register, ring->fd, opcode, arg, size));
+  }
+
+  // Points entry `index` of the ring's fixed buffers at `buffer`; an empty
+  // one clears the entry.
+  static bool update_buffer(Ring* ring, unsigned index, const iovec& buffer)
+  {
+    io_uring_rsrc_update2 update = {};
+    update.offset = index;
+    update.data = reinterpret_cast<uint64_t>(&buffer);
+    update.nr = 1;
+    return io_uring_register(ring, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) == 1;
+  }
+
+  // Number of entries queued but not yet consumed by the kernel. Must be
+  // called with `sq_mutex` held.
+  static unsigned unsubmitted(Ring* ring)
+  {
+    return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  }
+
+  // Copies the entries into the submission queue. Must be called with
+  // `sq_mutex` held.
+  static void push(Ring* ring, const io_uring_sqe* entries, unsigned count)
+  {
+    for (unsigned i = 0; i < count; i++) {
+      // The ring is full: hand what we have to the kernel to make room.
+      while (unsubmitted(ring) == *ring->sq_entries) {
+        if (io_uring_enter(ring, *ring->sq_entries, 0, 0) < 0 &&
+            errno != EINTR && errno != EAGAIN) {
+          throw "io_uring_enter failed: " + std::to_string(errno);
+        }
+      }
+
+      unsigned tail = *ring->sq_tail;
+      unsigned index = tail & *ring->sq_mask;
+      ring->sqes[index] = entries[i];
+      ring->sq_array[index] = index;
+
+      // Publish the entry to the kernel.
+      __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  // Must be called with `sq_mutex` held.
+  static void flush(Ring* ring)
+  {
+    unsigned count = unsubmitted(ring);
+    if (count > 0 && io_uring_enter(ring, count, 0, 0) < 0 && errno != EINTR) {
+      throw "io_uring_enter failed: " + std::to_string(errno);
+    }
+  }
+
+  // Queues a no-op so the loop's wait for completions returns. Entries
+  // without `user_data` are skipped when reaping.
+  static void wake(Ring* ring)
+  {
+    io_uring_sqe sqe = {};
+    sqe.opcode = IORING_OP_NOP;
+    sqe.user_data = 0;
+
+    std::lock_guard<std::mutex> lock(ring->sq_mutex);
+    push(ring, &sqe, 1);
+    flush(ring);
+  }
+
+  // `uring::detach` cancels by fd (Linux 5.19). Older kernels reject the
+  // flags with -EINVAL; newer ones find nothing on the ring's own fd.
+  static bool cancels_by_fd(Ring* ring)
+  {
+    io_uring_sqe sqe = {};
+    sqe.opcode = IORING_OP_ASYNC_CANCEL;
+    sqe.fd = ring->fd;
+    sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe.user_data = 0;
+
+    std::lock_guard<std::mutex> lock(ring->sq_mutex);
+    push(ring, &sqe, 1);
+    while (__atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) == *ring->cq_head) {
+      if (io_uring_enter(ring, unsubmitted(ring), 1, IORING_ENTER_GETEVENTS) < 0 &&
+          errno != EINTR) {
+        throw "io_uring_enter failed: " + std::to_string(errno);
+      }
+    }
+
+    unsigned head = *ring->cq_head;
+    int result = ring->cqes[head & *ring->cq_mask].res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return result != -EINVAL;
+  }
+
+  static Ring* create()
+  {
+    Ring* ring = new Ring();
+
+    io_uring_params params = {};
+    ring->fd = io_uring_setup(ENTRIES, &params);
+    if (ring->fd == -1) {
+      throw "Could not create io_uring: " + std::to_string(errno);
+    }
+
+    // We need to pass a timeout to io_uring_enter (Linux 5.11).
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+      throw std::string("io_uring does not support IORING_ENTER_EXT_ARG");
+    }
+
+    ring->timers = new TimerWheel(clock::monotonic(), TIMER_RESOLUTION);
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    // Newer kernels map both rings with a single mmap.
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      ring->sq_ring_size = std::max(ring->sq_ring_size, ring->cq_ring_size);
+      ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(
+      NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+      throw "Could not map submission queue: " + std::to_string(errno);
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      ring->cq_ring = ring->sq_ring;
+    } else {
+      ring->cq_ring = mmap(
+        NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED) {
+        throw "Could not map completion queue: " + std::to_string(errno);
+      }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = static_cast<io_uring_sqe*>(mmap(
+      NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES));
+    if (ring->sqes == MAP_FAILED) {
+      throw "Could not map submission entries: " + std::to_string(errno);
+    }
+
+    char* sq = static_cast<char*>(ring->sq_ring);
+    ring->sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    ring->sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring->sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring->sq_entries = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_entries);
+    ring->sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+    char* cq = static_cast<char*>(ring->cq_ring);
+    ring->cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    if (!cancels_by_fd(ring)) {
+      throw std::string("io_uring does not support IORING_ASYNC_CANCEL_FD");
+    }
+
+    // An empty table, which `uring::register_buffer` fills in as buffer
+    // pools grow. Without one (before Linux 5.19) nothing is registered.
+    io_uring_rsrc_register table = {};
+    table.nr = FIXED_BUFFERS;
+    table.flags = IORING_RSRC_REGISTER_SPARSE;
+    ring->fixed = io_uring_register(ring, IORING_REGISTER_BUFFERS2, &table, sizeof(table)) == 0;
+
+    return ring;
+  }
+
+  void EventLoop::initialize()
+  {
+    initialize(Mode::RUN_TO_COMPLETION, 1);
+  }
+
+
+  // The ring always runs to completion, there is nothing to choose.
+  void EventLoop::initialize(Mode mode)
+  {
+    initialize(mode, 1);
+  }
+
+
+  void EventLoop::initialize(Mode mode, size_t loops)
+  {
+    // This backend always runs to completion.
+    (void) mode;
+
+    std::call_once(flag, [loops]() {
+      signal(SIGPIPE, SIG_IGN);
+
+      for (size_t i = 0; i < std::max<size_t>(loops, 1); i++) {
+        rings.push_back(create());
+      }
+    });
+  }
+
+
+  size_t EventLoop::loops()
+  {
+    return rings.size();
+  }
+
+
+  size_t EventLoop::current()
+  {
+    if (current_ring != SIZE_MAX) {
+      return current_ring;
+    }
+    return next();
+  }
+
+
+  size_t EventLoop::next()
+  {
+    return round_robin.fetch_add(1, std::memory_order_relaxed) % rings.size();
+  }
+
+
+  // Nanoseconds in `duration`, with anything negative counting as none.
+  static uint64_t nanoseconds(std::chrono::nanoseconds duration)
+  {
+    return duration.count() > 0 ? static_cast<uint64_t>(duration.count()) : 0;
+  }
+
+  // Converts a deadline on the standard library's steady clock to ours.
+  static uint64_t deadline_of(std::chrono::steady_clock::time_point deadline)
+  {
+    return clock::monotonic() + nanoseconds(deadline - std::chrono::steady_clock::now());
+  }
+
+
+  // Makes sure the loop waits no longer than the wheel's next deadline,
+  // waking it up if it is already waiting for longer. Must be called with
+  // `timers_mutex` held; returns whether the loop needs waking.
+  static bool earlier(Ring* ring)
+  {
+    uint64_t next = ring->timers->next();
+    if (next < ring->armed) {
+      ring->armed = next;
+      return true;
+    }
+    return false;
+  }
+
+
+  Timer EventLoop::delay(
+    const int duration,
+    Function<void()> function)
+  {
+    return delay(std::chrono::seconds(duration), std::move(function));
+  }
+
+
+  Timer EventLoop::delay(
+    std::chrono::nanoseconds duration,
+    Function<void()> function,
+    std::chrono::nanoseconds slack)
+  {
+    uint64_t deadline = clock::monotonic() + nanoseconds(duration);
+
+    size_t index = current();
+    Ring* ring = rings[index];
+
+    TimerWheel::Id id;
+    bool wakeup;
+    {
+      std::lock_guard<std::mutex> lock(ring->timers_mutex);
+      id = ring->timers->schedule(
+        deadline,
+        nanoseconds(slack),
+        std::move(function));
+      wakeup = earlier(ring);
+    }
+
+    // The loop thread looks at the wheel before it waits again anyway.
+    if (wakeup && current_ring != index) {
+      wake(ring);
+    }
+
+    return Timer(index, id);
+  }
+
+
+  Timer EventLoop::delay(
+    std::chrono::steady_clock::time_point deadline,
+    Function<void()> function,
+    std::chrono::nanoseconds slack)
+  {
+    return delay(deadline - std::chrono::steady_clock::now(), std::move(function), slack);
+  }
+
+
+  void EventLoop::post(Function<void()> function)
+  {
+    size_t index = current();
+    Ring* ring = rings[index];
+
+    Task* task = new Task();
+    task->function = std::move(function);
+    ring->tasks.push(task);
+
+    // The loop thread looks at its queue before it waits again anyway.
+    if (current_ring != index &&
+        !ring->notified.exchange(true, std::memory_order_acq_rel)) {
+      wake(ring);
+    }
+  }
+
+
+  void EventLoop::dispatch(Function<void()> function)
+  {
+    if (current_ring != SIZE_MAX) {
+      function();
+      return;
+    }
+    post(std::move(function));
+  }
+
+
+  bool Timer::cancel() const
+  {
+    // The loop may still be waiting with a timeout for this timer. We
+    // leave it be rather than waking it up just to wait again: it finds
+    // nothing to run when the timeout expires and waits for the next one.
+    if (m_id == 0) {
+      return false;
+    }
+
+    Ring* ring = rings[m_loop];
+
+    TimerWheel::Function function;
+    {
+      std::lock_guard<std::mutex> lock(ring->timers_mutex);
+      function = ring->timers->cancel(m_id);
+    }
+
+    // The function is destroyed here, outside of the lock.
+    return static_cast<bool>(function);
+  }
+
+
+  bool Timer::reschedule(std::chrono::steady_clock::time_point deadline) const
+  {
+    if (m_id == 0) {
+      return false;
+    }
+
+    Ring* ring = rings[m_loop];
+
+    bool wakeup;
+    {
+      std::lock_guard<std::mutex> lock(ring->timers_mutex);
+      if (!ring->timers->reschedule(m_id, deadline_of(deadline))) {
+        return false;
+      }
+      wakeup = earlier(ring);
+    }
+
+    if (wakeup && current_ring != m_loop) {
+      wake(ring);
+    }
+    return true;
+  }
+
+
+  double EventLoop::time()
+  {
+    timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+      throw "unvalid system time: " + std::to_string(errno);
+    }
+
+    return static_cast<double>(ts.tv_sec) +
+      static_cast<double>(ts.tv_nsec) / 1000000000;
+  }
+
+
+  uint64_t EventLoop::now()
+  {
+    return clock::now();
+  }
+
+
+  // Dispatches every completion entry that is ready.
+  static void reap(Ring* ring)
+  {
+    unsigned head = *ring->cq_head;
+    for (;;) {
+      unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+      if (head == tail) {
+        break;
+      }
+
+      for (; head != tail; head++) {
+        const io_uring_cqe& cqe = ring->cqes[head & *ring->cq_mask];
+        Completion* completion = reinterpret_cast<Completion*>(cqe.user_data);
+        int result = cqe.res;
+
+        // Hand the slot back before running the completion, which may
+        // well queue more work.
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (completion != nullptr) {
+          completion->complete(result);
+        }
+      }
+    }
+  }
+
+
+  // Runs every timer whose deadline has passed.
+  static void expire_timers(Ring* ring)
+  {
+    std::vector<TimerWheel::Function>& expired = ring->expired;
+    {
+      std::lock_guard<std::mutex> lock(ring->timers_mutex);
+      ring->timers->advance(clock::now(), expired);
+    }
+
+    for (TimerWheel::Function& function : expired) {
+      function();
+    }
+    expired.clear();
+  }
+
+
+  static void run_ring(Ring* ring)
+  {
+    while (!exit.load()) {
+      unsigned count;
+      {
+        std::lock_guard<std::mutex> lock(ring->sq_mutex);
+        count = unsubmitted(ring);
+      }
+
+      uint64_t deadline;
+      {
+        std::lock_guard<std::mutex> lock(ring->timers_mutex);
+        deadline = ring->timers->next();
+        ring->armed = deadline;
+      }
+
+      // Submits whatever the completions queued last time around and
+      // waits for at least one completion or the next timer, all in one
+      // system call. Functions left over from the last iteration mean we
+      // only submit.
+      int result;
+      if (!ring->tasks.empty()) {
+        result = count > 0 ? io_uring_enter(ring, count, 0, 0) : 0;
+      } else if (deadline == TimerWheel::NEVER) {
+        result = io_uring_enter(ring, count, 1, IORING_ENTER_GETEVENTS);
+      } else {
+        uint64_t now = clock::monotonic();
+        uint64_t timeout = deadline > now ? deadline - now : 0;
+
+        __kernel_timespec ts;
+        ts.tv_sec = timeout / 1000000000;
+        ts.tv_nsec = timeout % 1000000000;
+
+        io_uring_getevents_arg arg = {};
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+
+        result = io_uring_enter(
+          ring,
+          count,
+          1,
+          IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+          &arg,
+          sizeof(arg));
+      }
+
+      if (result < 0 &&
+          errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME) {
+        throw "io_uring_enter failed: " + std::to_string(errno);
+      }
+
+      clock::update();
+      reap(ring);
+
+      // Whoever posts from now on has to wake us up again. Anything posted
+      // without a wakeup is seen by `run` or by the `empty` check above.
+      ring->notified.exchange(false, std::memory_order_acq_rel);
+      ring->tasks.run(TASK_BATCH);
+
+      expire_timers(ring);
+      clock::clear();
+    }
+  }
+
+
+  static void destroy(Ring* ring)
+  {
+    delete ring->timers;
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    ::close(ring->fd);
+    delete ring;
+  }
+
+
+  // Reaps ring `index` on the calling thread, pinned to a core of its own
+  // when there is more than one ring.
+  static void run_pinned(size_t index)
+  {
+    if (rings.size() > 1) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(index % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+
+    current_ring = index;
+    run_ring(rings[index]);
+    current_ring = SIZE_MAX;
+  }
+
+
+  void EventLoop::run()
+  {
+    // The calling thread reaps the first ring, and a thread of its own
+    // reaps each of the others.
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < rings.size(); i++) {
+      threads.emplace_back([i]() { run_pinned(i); });
+    }
+
+    run_pinned(0);
+
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+
+    // A ring can see `exit` before `stop` is done waking the others.
+    std::lock_guard<std::mutex> lock(stop_mutex);
+    for (Ring* ring : rings) {
+      destroy(ring);
+    }
+  }
+
+
+  void EventLoop::stop()
+  {
+    std::lock_guard<std::mutex> lock(stop_mutex);
+    exit.store(true);
+    for (Ring* ring : rings) {
+      wake(ring);
+    }
+  }
+
+
+  namespace uring {
+    Descriptor* attach(int fd, size_t loop)
+    {
+      Descriptor* descriptor = new Descriptor();
+      descriptor->fd = fd;
+      descriptor->loop = loop % rings.size();
+      return descriptor;
+    }
+
+
+    void submit(size_t loop, const io_uring_sqe* sqes, unsigned count)
+    {
+      Ring* ring = rings[loop];
+
+      std::lock_guard<std::mutex> lock(ring->sq_mutex);
+      push(ring, sqes, count);
+
+      if (current_ring != loop) {
+        flush(ring);
+      }
+    }
+
+
+    bool submit(Descriptor* descriptor, const io_uring_sqe* sqes, unsigned count)
+    {
+      Ring* ring = rings[descriptor->loop];
+
+      // `detach` sets `closed` and queues its cancel under the same lock,
+      // so these entries either come before the cancel or not at all.
+      std::lock_guard<std::mutex> lock(ring->sq_mutex);
+      if (descriptor->closed) {
+        return false;
+      }
+      push(ring, sqes, count);
+
+      if (current_ring != descriptor->loop) {
+        flush(ring);
+      }
+      return true;
+    }
+
+
+    void detach(Descriptor* descriptor)
+    {
+      // Closing the fd does not cancel requests in flight, the ring holds
+      // its own reference to the file.
+      io_uring_sqe sqe = {};
+      sqe.opcode = IORING_OP_ASYNC_CANCEL;
+      sqe.fd = descriptor->fd;
+      sqe.cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+      sqe.user_data = 0;
+
+      {
+        // Submitted right away even on the loop thread, the caller is
+        // about to close the fd.
+        Ring* ring = rings[descriptor->loop];
+        std::lock_guard<std::mutex> lock(ring->sq_mutex);
+        descriptor->closed = true;
+        push(ring, &sqe, 1);
+        flush(ring);
+      }
+
+      release(descriptor);
+    }
+
+
+    void acquire(Descriptor* descriptor)
+    {
+      descriptor->references.fetch_add(1, std::memory_order_relaxed);
+    }
+
+
+    void release(Descriptor* descriptor)
+    {
+      if (descriptor->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete descriptor;
+      }
+    }
+
+
+    void cancel(size_t loop, Completion* completion)
+    {
+      io_uring_sqe sqe = {};
+      sqe.opcode = IORING_OP_ASYNC_CANCEL;
+      sqe.fd = -1;
+      sqe.addr = reinterpret_cast<uint64_t>(completion);
+      sqe.user_data = 0;
+
+      // Unlike a detach this can wait for the loop's next io_uring_enter,
+      // so that the timers of many deadlines expiring together cancel
+      // their requests with a single system call.
+      submit(loop, &sqe, 1);
+    }
+
+
+    int register_buffer(void* memory, size_t size)
+    {
+      std::lock_guard<std::mutex> lock(stop_mutex);
+      if (rings.empty() || exit.load()) {
+        return -1;
+      }
+
+      auto slot = std::find(fixed_buffers.begin(), fixed_buffers.end(), false);
+      if (slot == fixed_buffers.end()) {
+        return -1;
+      }
+      unsigned index = static_cast<unsigned>(slot - fixed_buffers.begin());
+
+      iovec buffer = { memory, size };
+      for (size_t i = 0; i < rings.size(); i++) {
+        if (!rings[i]->fixed || !update_buffer(rings[i], index, buffer)) {
+          // Every ring has the buffer or none does.
+          iovec empty = { nullptr, 0 };
+          for (size_t j = 0; j < i; j++) {
+            update_buffer(rings[j], index, empty);
+          }
+          return -1;
+        }
+      }
+
+      *slot = true;
+      return static_cast<int>(index);
+    }
+
+
+    void unregister_buffer(int index)
+    {
+      if (index < 0) {
+        return;
+      }
+
+      std::lock_guard<std::mutex> lock(stop_mutex);
+      fixed_buffers[index] = false;
+
+      // Rings that are done running drop their buffers when they go.
+      if (exit.load()) {
+        return;
+      }
+
+      iovec empty = { nullptr, 0 };
+      for (Ring* ring : rings) {
+        update_buffer(ring, static_cast<unsigned>(index), empty);
+      }
+    }
+  }
+}
+#endif // __linux__ && USE_IO_URING
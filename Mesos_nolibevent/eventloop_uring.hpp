@@ -0,0 +1,78 @@
+#pragma once
+
+#include "stdafx.h"
+
+#include <linux/io_uring.h>
+
+// Internal interface between the io_uring event loop and the async handles.
+// Nothing outside of eventloop_uring.cpp and async_io_uring.cpp should
+// need to include this.
+
+namespace loop {
+  // A request handed to the ring. Like the OVERLAPPED of an IOCP request,
+  // the completion entry carries a pointer back to it (`user_data`).
+  struct Completion {
+    virtual ~Completion() {}
+
+    // Called on the loop thread with the `res` field of the completion
+    // entry: a byte count, 0, or a negated errno. The completion owns
+    // itself from here on, it can resubmit or delete itself.
+    virtual void complete(int result) = 0;
+  };
+
+  // The loop's view of a file descriptor. The ring needs nothing per
+  // descriptor, this only exists so `close` can cancel what is in flight,
+  // and to remember which loop the descriptor is bound to. `closed` is
+  // guarded by the ring's submission lock; the descriptor is freed once
+  // it is detached and every `acquire` has been released.
+  struct Descriptor {
+    int fd;
+    size_t loop;
+    bool closed = false;
+    std::atomic<int> references{1};
+  };
+
+  namespace uring {
+    // Binds `fd` to loop `loop`, whose ring performs all of its I/O.
+    Descriptor* attach(int fd, size_t loop);
+
+    // Queues `count` entries on the ring of loop `loop`. The caller fills
+    // in the entries, including `user_data`. Entries queued from the loop's
+    // own thread are submitted by its next io_uring_enter, together with
+    // the wait for completions; entries queued from any other thread are
+    // submitted right away.
+    void submit(size_t loop, const io_uring_sqe* sqes, unsigned count);
+
+    // Like the above on the descriptor's loop, unless the descriptor has
+    // been detached: then it queues nothing and returns false. Entries it
+    // did queue are cancelled by a later `detach`, which is what something
+    // that submits by itself, like an Acceptor, needs.
+    bool submit(Descriptor* descriptor, const io_uring_sqe* sqes, unsigned count);
+
+    // Cancels every request in flight on the descriptor and releases it.
+    // The cancelled requests complete with -ECANCELED. The caller closes
+    // the fd.
+    void detach(Descriptor* descriptor);
+
+    // Keeps a descriptor from being freed by `detach` until `release`.
+    void acquire(Descriptor* descriptor);
+
+    void release(Descriptor* descriptor);
+
+    // Cancels `completion` if it is still in flight on the ring of loop
+    // `loop`; it then completes with -ECANCELED (or -EINTR). The cancel is
+    // submitted like any other entry (see `submit`).
+    void cancel(size_t loop, Completion* completion);
+
+    // Registers `size` bytes at `memory` as a fixed buffer with every ring,
+    // under the returned index, for IORING_OP_READ_FIXED and WRITE_FIXED
+    // (`buf_index`). Returns -1 if there are no rings yet, or the kernel
+    // won't register it (RLIMIT_MEMLOCK, or older than Linux 5.19); the
+    // memory then works like any other.
+    int register_buffer(void* memory, size_t size);
+
+    // Unregisters what `register_buffer` registered, unless `index` is -1.
+    // Nothing may be in flight on the buffer.
+    void unregister_buffer(int index);
+  }
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include "stdafx.h"
+
+#include <cstddef>
+#include <type_traits>
+
+namespace loop {
+  // A move-only std::function, used for everything the loop runs later:
+  // timers, posted functions and continuations.
+  //
+  // Callables of up to `INLINE` bytes are kept inside the object itself,
+  // so wrapping a lambda that captures a handful of pointers, a string or
+  // a shared_ptr never allocates. Larger callables, and those that could
+  // throw while being moved, go on the heap like they would in a
+  // std::function. Since it never copies, it also takes callables that
+  // can't be copied, like a lambda that owns a std::promise.
+  //
+  // Calling an empty Function is undefined.
+  template <typename Signature>
+  class Function;
+
+  template <typename R, typename... Args>
+  class Function<R(Args...)>
+  {
+  public:
+    static constexpr size_t INLINE = 64;
+
+    Function() noexcept : m_operations(nullptr) {}
+
+    Function(std::nullptr_t) noexcept : m_operations(nullptr) {}
+
+    template <
+      typename F,
+      typename D = typename std::decay<F>::type,
+      typename = typename std::enable_if<
+        !std::is_same<D, Function>::value &&
+        std::is_invocable_r<R, D&, Args...>::value>::type>
+    Function(F&& f) : m_operations(nullptr)
+    {
+      if (empty(f)) {
+        return;
+      }
+
+      if constexpr (fits<D>()) {
+        new (m_storage) D(std::forward<F>(f));
+        m_operations = &Inline<D>::operations;
+      } else {
+        *reinterpret_cast<D**>(m_storage) = new D(std::forward<F>(f));
+        m_operations = &Heap<D>::operations;
+      }
+    }
+
+    Function(Function&& that) noexcept : m_operations(that.m_operations)
+    {
+      if (m_operations != nullptr) {
+        m_operations->move(that.m_storage, m_storage);
+        that.m_operations = nullptr;
+      }
+    }
+
+    Function& operator=(Function&& that) noexcept
+    {
+      if (this != &that) {
+        reset();
+        if (that.m_operations != nullptr) {
+          that.m_operations->move(that.m_storage, m_storage);
+          m_operations = that.m_operations;
+          that.m_operations = nullptr;
+        }
+      }
+      return *this;
+    }
+
+    Function& operator=(std::nullptr_t) noexcept
+    {
+      reset();
+      return *this;
+    }
+
+    Function(const Function&) = delete;
+    Function& operator=(const Function&) = delete;
+
+    ~Function()
+    {
+      reset();
+    }
+
+    R operator()(Args... args) const
+    {
+      return m_operations->invoke(m_storage, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const noexcept
+    {
+      return m_operations != nullptr;
+    }
+
+    // Whether a callable of type `F` is kept inline, without allocating.
+    template <typename F>
+    static constexpr bool fits()
+    {
+      return sizeof(F) <= INLINE &&
+        alignof(F) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible<F>::value;
+    }
+
+  private:
+    struct Operations {
+      R (*invoke)(void* storage, Args&&... args);
+
+      // Move constructs the callable in `from` into `to`, and destroys
+      // what is left in `from`.
+      void (*move)(void* from, void* to);
+
+      void (*destroy)(void* storage);
+    };
+
+    template <typename F>
+    struct Inline {
+      static R invoke(void* storage, Args&&... args)
+      {
+        return (*static_cast<F*>(storage))(std::forward<Args>(args)...);
+      }
+
+      static void move(void* from, void* to)
+      {
+        new (to) F(std::move(*static_cast<F*>(from)));
+        static_cast<F*>(from)->~F();
+      }
+
+      static void destroy(void* storage)
+      {
+        static_cast<F*>(storage)->~F();
+      }
+
+      static constexpr Operations operations = { &invoke, &move, &destroy };
+    };
+
+    template <typename F>
+    struct Heap {
+      static R invoke(void* storage, Args&&... args)
+      {
+        return (**static_cast<F**>(storage))(std::forward<Args>(args)...);
+      }
+
+      static void move(void* from, void* to)
+      {
+        *static_cast<F**>(to) = *static_cast<F**>(from);
+      }
+
+      static void destroy(void* storage)
+      {
+        delete *static_cast<F**>(storage);
+      }
+
+      static constexpr Operations operations = { &invoke, &move, &destroy };
+    };
+
+    // Null function pointers and empty std::functions make an empty
+    // Function, like they would make an empty std::function.
+    template <typename F>
+    static bool empty(const F&) { return false; }
+
+    template <typename F>
+    static bool empty(F* f) { return f == nullptr; }
+
+    template <typename S>
+    static bool empty(const std::function<S>& f) { return !f; }
+
+    void reset() noexcept
+    {
+      if (m_operations != nullptr) {
+        m_operations->destroy(m_storage);
+        m_operations = nullptr;
+      }
+    }
+
+    const Operations* m_operations;
+    alignas(std::max_align_t) mutable unsigned char m_storage[INLINE];
+  };
+}
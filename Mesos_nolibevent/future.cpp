@@ -0,0 +1,36 @@
+#include "stdafx.h"
+#include "future.hpp"
+
+#ifdef _WIN32
+#pragma comment(lib, "Synchronization.lib")
+#else
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+namespace async {
+  namespace internal {
+    // std::atomic<int> is a plain int underneath on both platforms, which
+    // is what the futex and WaitOnAddress work on.
+    static_assert(sizeof(std::atomic<int>) == sizeof(int), "");
+
+    void park(std::atomic<int>* address, int value)
+    {
+#ifdef _WIN32
+      WaitOnAddress(address, &value, sizeof(value), INFINITE);
+#else
+      syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, nullptr, nullptr, 0);
+#endif
+    }
+
+
+    void unpark(std::atomic<int>* address)
+    {
+#ifdef _WIN32
+      WakeByAddressSingle(address);
+#else
+      syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+    }
+  }
+}
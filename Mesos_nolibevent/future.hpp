@@ -0,0 +1,509 @@
+#pragma once
+
+#include "stdafx.h"
+#include "function.hpp"
+
+#include <optional>
+#include <tuple>
+#include <utility>
+
+namespace async {
+  template <typename T>
+  class Future;
+
+  template <typename T>
+  class Promise;
+
+  namespace internal {
+    template <typename T, typename Owner>
+    class EmbeddedState;
+
+    // Blocks while `*address` is `value`, or until `wake`. May return
+    // spuriously. This is a futex on Linux and WaitOnAddress on Windows, so
+    // a future nobody blocks on needs no mutex or condition variable.
+    void park(std::atomic<int>* address, int value);
+
+    // Wakes the thread blocked on `address` in `park`, if any.
+    void unpark(std::atomic<int>* address);
+
+    // The state a Promise and its Future share: one allocation, released by
+    // whichever of the two lets go last (see EmbeddedState for a state that
+    // isn't an allocation of its own).
+    //
+    // `m_status` moves from PENDING to READY when the value is set, or to
+    // CONTINUATION or WAITING first when the future side gets there before
+    // the value does. Both sides only ever take their one step with an
+    // atomic exchange or compare-and-swap, so attaching a continuation and
+    // completing never take a lock, whichever comes first.
+    template <typename T>
+    class State {
+    public:
+      enum Status { PENDING, CONTINUATION, WAITING, READY };
+
+      virtual ~State() {}
+
+      void set(T&& value)
+      {
+        m_value.emplace(std::move(value));
+
+        int status = m_status.exchange(READY, std::memory_order_acq_rel);
+        if (status == CONTINUATION) {
+          // The continuation owns the value from here on.
+          m_continuation(std::move(*m_value));
+          m_continuation = nullptr;
+        } else if (status == WAITING) {
+          unpark(&m_status);
+        }
+      }
+
+      void then(loop::Function<void(T)>&& continuation)
+      {
+        m_continuation = std::move(continuation);
+
+        int expected = PENDING;
+        if (!m_status.compare_exchange_strong(
+              expected, CONTINUATION, std::memory_order_acq_rel)) {
+          // Already there: run it right away, on this thread.
+          m_continuation(std::move(*m_value));
+          m_continuation = nullptr;
+        }
+      }
+
+      void wait()
+      {
+        int expected = PENDING;
+        if (!m_status.compare_exchange_strong(
+              expected, WAITING, std::memory_order_acq_rel) &&
+            expected == READY) {
+          return;
+        }
+
+        while (m_status.load(std::memory_order_acquire) != READY) {
+          park(&m_status, WAITING);
+        }
+      }
+
+      bool ready() const
+      {
+        return m_status.load(std::memory_order_acquire) == READY;
+      }
+
+      T& value()
+      {
+        return *m_value;
+      }
+
+      void acquire()
+      {
+        m_references.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release()
+      {
+        if (m_references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          dispose();
+        }
+      }
+
+    protected:
+      // Frees the state once the last reference is gone.
+      virtual void dispose()
+      {
+        delete this;
+      }
+
+    private:
+      std::atomic<int> m_status{PENDING};
+
+      // The promise, and the future once there is one.
+      std::atomic<int> m_references{1};
+
+      std::optional<T> m_value;
+      loop::Function<void(T)> m_continuation;
+    };
+  }
+
+  // The result of an asynchronous operation. Unlike std::future, a Future
+  // can hand its value to a continuation instead of blocking for it: the
+  // continuation runs on the thread that completes the operation, which for
+  // I/O is the loop thread the handle is bound to. `get` and `wait` still
+  // block like they do for std::future.
+  //
+  // Every Future is used once: either `then` or `get` takes the value.
+  template <typename T>
+  class Future {
+  public:
+    Future() : m_state(nullptr) {}
+
+    Future(Future&& that) noexcept : m_state(that.m_state)
+    {
+      that.m_state = nullptr;
+    }
+
+    Future& operator=(Future&& that) noexcept
+    {
+      if (this != &that) {
+        reset();
+        m_state = that.m_state;
+        that.m_state = nullptr;
+      }
+      return *this;
+    }
+
+    Future(const Future&) = delete;
+    Future& operator=(const Future&) = delete;
+
+    ~Future()
+    {
+      reset();
+    }
+
+    bool valid() const
+    {
+      return m_state != nullptr;
+    }
+
+    // Whether the value is there, so `get` won't block.
+    bool ready() const
+    {
+      return m_state->ready();
+    }
+
+    // Blocks until the value is there.
+    void wait() const
+    {
+      m_state->wait();
+    }
+
+    // Blocks until the value is there and returns it.
+    T get()
+    {
+      m_state->wait();
+      T value = std::move(m_state->value());
+      reset();
+      return value;
+    }
+
+    // Runs `continuation` with the value once it is there. If it already
+    // is, the continuation runs right away on the calling thread; otherwise
+    // it runs on the thread that sets the value. It must not block.
+    //
+    // A continuation that returns nothing ends the chain. One that returns
+    // a value makes `then` return a Future for that value.
+    template <typename F>
+    auto then(F&& continuation)
+    {
+      typedef typename std::invoke_result<F&, T>::type R;
+
+      internal::State<T>* state = m_state;
+      m_state = nullptr;
+
+      if constexpr (std::is_void<R>::value) {
+        state->then(loop::Function<void(T)>(std::forward<F>(continuation)));
+        state->release();
+      } else {
+        Promise<R> promise;
+        Future<R> future = promise.get_future();
+        state->then(
+          [promise = std::move(promise),
+           continuation = std::forward<F>(continuation)](T value) mutable {
+            promise.set_value(continuation(std::move(value)));
+          });
+        state->release();
+        return future;
+      }
+    }
+
+  private:
+    friend class Promise<T>;
+
+    template <typename U, typename Owner>
+    friend class internal::EmbeddedState;
+
+    explicit Future(internal::State<T>* state) : m_state(state) {}
+
+    void reset()
+    {
+      if (m_state != nullptr) {
+        m_state->release();
+        m_state = nullptr;
+      }
+    }
+
+    internal::State<T>* m_state;
+  };
+
+  // The producing side of a Future. The value must be set exactly once,
+  // and `get_future` called at most once.
+  template <typename T>
+  class Promise {
+  public:
+    Promise() : m_state(new internal::State<T>()) {}
+
+    Promise(Promise&& that) noexcept : m_state(that.m_state)
+    {
+      that.m_state = nullptr;
+    }
+
+    Promise& operator=(Promise&& that) noexcept
+    {
+      if (this != &that) {
+        reset();
+        m_state = that.m_state;
+        that.m_state = nullptr;
+      }
+      return *this;
+    }
+
+    Promise(const Promise&) = delete;
+    Promise& operator=(const Promise&) = delete;
+
+    ~Promise()
+    {
+      reset();
+    }
+
+    Future<T> get_future()
+    {
+      m_state->acquire();
+      return Future<T>(m_state);
+    }
+
+    // Hands the value to the future: runs its continuation, wakes up the
+    // thread waiting for it, or keeps it for later.
+    void set_value(T value)
+    {
+      m_state->set(std::move(value));
+    }
+
+  private:
+    void reset()
+    {
+      if (m_state != nullptr) {
+        m_state->release();
+        m_state = nullptr;
+      }
+    }
+
+    internal::State<T>* m_state;
+  };
+
+  namespace internal {
+    // The state of a future that is part of another object, typically the
+    // context of the operation that sets its value, so that the operation
+    // and its future take one allocation instead of two. The owner holds
+    // the reference a Promise would and gives it up with `release` once it
+    // has set the value. Whichever reference goes last deletes the owner,
+    // so an operation can outlive its completion for as long as its future
+    // is around.
+    template <typename T, typename Owner>
+    class EmbeddedState : public State<T> {
+    public:
+      explicit EmbeddedState(Owner* owner) : m_owner(owner) {}
+
+      // Called at most once, like `Promise::get_future`.
+      Future<T> get_future()
+      {
+        this->acquire();
+        return Future<T>(this);
+      }
+
+    protected:
+      void dispose() override
+      {
+        delete m_owner;
+      }
+
+    private:
+      Owner* m_owner;
+    };
+  }
+
+  // What `when_any` hands on: which future finished first, and the futures
+  // themselves, in the order they were given. The one at `index` is ready,
+  // the others can still be used like any other future, so the results of
+  // the operations that lost the race (an accepted socket, say) are not
+  // lost with them.
+  template <typename Sequence>
+  struct WhenAnyResult {
+    size_t index;
+    Sequence futures;
+  };
+
+  namespace internal {
+    // The state of a `when_all`. The continuation of every future stores
+    // its value and counts down, and the one that gets to zero sets the
+    // result, on its own thread, and frees the state.
+    template <typename T>
+    struct AllOf {
+      explicit AllOf(size_t count) : remaining(count), values(count) {}
+
+      void arrive()
+      {
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          std::vector<T> result;
+          result.reserve(values.size());
+          for (std::optional<T>& value : values) {
+            result.push_back(std::move(*value));
+          }
+          promise.set_value(std::move(result));
+          delete this;
+        }
+      }
+
+      std::atomic<size_t> remaining;
+      std::vector<std::optional<T>> values;
+      Promise<std::vector<T>> promise;
+    };
+
+    template <typename... Ts>
+    struct AllOfEach {
+      AllOfEach() : remaining(sizeof...(Ts)) {}
+
+      void arrive()
+      {
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          promise.set_value(std::apply([](std::optional<Ts>&... value) {
+            return std::tuple<Ts...>(std::move(*value)...);
+          }, values));
+          delete this;
+        }
+      }
+
+      std::atomic<size_t> remaining;
+      std::tuple<std::optional<Ts>...> values;
+      Promise<std::tuple<Ts...>> promise;
+    };
+
+    template <typename... Ts, size_t... Is>
+    void attach(AllOfEach<Ts...>* all, std::index_sequence<Is...>, Future<Ts>&... futures)
+    {
+      (futures.then([all](Ts value) {
+        std::get<Is>(all->values).emplace(std::move(value));
+        all->arrive();
+      }), ...);
+    }
+
+    // The state of a `when_any`. Every future's value is passed on to the
+    // future handed out in its place, the first one to get there sets the
+    // result, and the last one frees the state.
+    template <typename Sequence>
+    struct AnyOf {
+      explicit AnyOf(size_t count) : remaining(count), done(false) {}
+
+      void arrive(size_t index)
+      {
+        if (!done.exchange(true, std::memory_order_acq_rel)) {
+          promise.set_value(WhenAnyResult<Sequence>{ index, std::move(futures) });
+        }
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete this;
+        }
+      }
+
+      std::atomic<size_t> remaining;
+      std::atomic<bool> done;
+      Sequence futures;
+      Promise<WhenAnyResult<Sequence>> promise;
+    };
+
+    template <typename Sequence, typename T>
+    void forward(AnyOf<Sequence>* any, size_t index, Future<T>& future, Promise<T>& promise)
+    {
+      future.then([any, index, promise = std::move(promise)](T value) mutable {
+        promise.set_value(std::move(value));
+        any->arrive(index);
+      });
+    }
+
+    template <typename... Ts, size_t... Is>
+    void forward(
+        AnyOf<std::tuple<Future<Ts>...>>* any,
+        std::index_sequence<Is...>,
+        std::tuple<Promise<Ts>...>& promises,
+        Future<Ts>&... futures)
+    {
+      (forward(any, Is, futures, std::get<Is>(promises)), ...);
+    }
+  }
+
+  // A future for the values of all of `futures`, in the same order. It is
+  // set by the continuation of whichever future finishes last, on the
+  // thread that completes it, so no thread waits for the others.
+  template <typename T>
+  Future<std::vector<T>> when_all(std::vector<Future<T>> futures)
+  {
+    if (futures.empty()) {
+      Promise<std::vector<T>> promise;
+      Future<std::vector<T>> result = promise.get_future();
+      promise.set_value(std::vector<T>());
+      return result;
+    }
+
+    internal::AllOf<T>* all = new internal::AllOf<T>(futures.size());
+    Future<std::vector<T>> result = all->promise.get_future();
+
+    for (size_t i = 0; i < futures.size(); i++) {
+      futures[i].then([all, i](T value) {
+        all->values[i].emplace(std::move(value));
+        all->arrive();
+      });
+    }
+    return result;
+  }
+
+  // The same for futures of different types, e.g. a read, an accept and a
+  // connect: a future for the tuple of their values.
+  template <typename... Ts>
+  Future<std::tuple<Ts...>> when_all(Future<Ts>... futures)
+  {
+    internal::AllOfEach<Ts...>* all = new internal::AllOfEach<Ts...>();
+    Future<std::tuple<Ts...>> result = all->promise.get_future();
+
+    internal::attach(all, std::index_sequence_for<Ts...>(), futures...);
+    return result;
+  }
+
+  // A future that is set as soon as the first of `futures` finishes, by
+  // its continuation. `futures` must not be empty.
+  template <typename T>
+  Future<WhenAnyResult<std::vector<Future<T>>>> when_any(
+    std::vector<Future<T>> futures)
+  {
+    typedef internal::AnyOf<std::vector<Future<T>>> AnyOf;
+
+    AnyOf* any = new AnyOf(futures.size());
+    Future<WhenAnyResult<std::vector<Future<T>>>> result = any->promise.get_future();
+
+    // All of the futures to hand out must be there before the first
+    // continuation can run.
+    std::vector<Promise<T>> promises(futures.size());
+    for (Promise<T>& promise : promises) {
+      any->futures.push_back(promise.get_future());
+    }
+
+    for (size_t i = 0; i < futures.size(); i++) {
+      internal::forward(any, i, futures[i], promises[i]);
+    }
+    return result;
+  }
+
+  // The same for futures of different types.
+  template <typename... Ts>
+  Future<WhenAnyResult<std::tuple<Future<Ts>...>>> when_any(Future<Ts>... futures)
+  {
+    typedef internal::AnyOf<std::tuple<Future<Ts>...>> AnyOf;
+
+    AnyOf* any = new AnyOf(sizeof...(Ts));
+    Future<WhenAnyResult<std::tuple<Future<Ts>...>>> result =
+      any->promise.get_future();
+
+    std::tuple<Promise<Ts>...> promises;
+    any->futures = std::apply([](Promise<Ts>&... promise) {
+      return std::tuple<Future<Ts>...>(promise.get_future()...);
+    }, promises);
+
+    internal::forward(any, std::index_sequence_for<Ts...>(), promises, futures...);
+    return result;
+  }
+}
@@ -0,0 +1,179 @@
+#include "stdafx.h"
+#include "handles.hpp"
+
+namespace async {
+  SocketHandle* HandleTable::Ref::socket() const
+  {
+    return dynamic_cast<SocketHandle*>(m_handle);
+  }
+
+
+  HandleTable::HandleTable() : m_count(0), m_open(0), m_free(NONE)
+  {
+    for (std::atomic<Slot*>& chunk : m_chunks) {
+      chunk.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  HandleTable::~HandleTable()
+  {
+    uint32_t count = m_count.load(std::memory_order_acquire);
+    for (uint32_t index = 0; index < count; index++) {
+      Slot& slot = at(index);
+      if ((slot.state.load(std::memory_order_acquire) & CLOSED) == 0) {
+        slot.handle->close();
+      }
+      if (slot.handle != nullptr) {
+        slot.handle->~Handle();
+      }
+    }
+
+    for (std::atomic<Slot*>& chunk : m_chunks) {
+      delete[] chunk.load(std::memory_order_relaxed);
+    }
+  }
+
+  HandleId HandleTable::open(io::Handle* fd)
+  {
+    uint32_t index = allocate();
+    Slot& slot = at(index);
+    Handle* handle = createAsyncHandle(fd, &slot.storage);
+    publish(index, handle);
+    return handle != nullptr ? id(index) : INVALID_HANDLE_ID;
+  }
+
+  bool HandleTable::pin(Slot& slot, uint64_t state)
+  {
+    uint64_t generation = state & GENERATION;
+    while ((state & (GENERATION | CLOSED)) == generation) {
+      if (slot.state.compare_exchange_weak(state, state + 1, std::memory_order_acquire)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  HandleTable::Ref HandleTable::lookup(HandleId id)
+  {
+    uint32_t index = static_cast<uint32_t>(id);
+    if (index >= m_count.load(std::memory_order_acquire)) {
+      return Ref();
+    }
+
+    Slot& slot = at(index);
+    uint64_t state = slot.state.load(std::memory_order_acquire);
+    if ((state & GENERATION) != (id & GENERATION) || !pin(slot, state)) {
+      return Ref();
+    }
+    return Ref(this, index, slot.handle);
+  }
+
+  bool HandleTable::close(HandleId id)
+  {
+    uint32_t index = static_cast<uint32_t>(id);
+    if (index >= m_count.load(std::memory_order_acquire)) {
+      return false;
+    }
+
+    // Only one close gets to set CLOSED, and with it the table's
+    // reference, which keeps the handle alive until it is closed.
+    Slot& slot = at(index);
+    uint64_t state = slot.state.load(std::memory_order_acquire);
+    do {
+      if ((state & (GENERATION | CLOSED)) != (id & GENERATION)) {
+        return false;
+      }
+    } while (!slot.state.compare_exchange_weak(state, state | CLOSED, std::memory_order_acq_rel));
+
+    m_open.fetch_sub(1, std::memory_order_relaxed);
+    slot.handle->close();
+    release(index);
+    return true;
+  }
+
+  Future<HandleId> HandleTable::accept(HandleId listener, const CancellationToken& token)
+  {
+    Ref ref = lookup(listener);
+    SocketHandle* socket = ref.socket();
+    if (socket == nullptr) {
+      Promise<HandleId> promise;
+      Future<HandleId> future = promise.get_future();
+      promise.set_value(INVALID_HANDLE_ID);
+      return future;
+    }
+
+    // The accepted socket comes from the heap; it moves into a slot, and
+    // takes its descriptor along.
+    return socket->accept(token).then([this](SocketHandle* accepted) {
+      if (accepted == nullptr) {
+        return INVALID_HANDLE_ID;
+      }
+      HandleId id = emplace<SocketHandle>(*accepted);
+      delete accepted;
+      return id;
+    });
+  }
+
+  uint32_t HandleTable::allocate()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_free != NONE) {
+      uint32_t index = m_free;
+      m_free = at(index).next;
+      return index;
+    }
+
+    uint32_t index = m_count.load(std::memory_order_relaxed);
+    if (index % CHUNK == 0) {
+      if (index / CHUNK == CHUNKS) {
+        throw std::string("Too many handles");
+      }
+      m_chunks[index / CHUNK].store(new Slot[CHUNK], std::memory_order_release);
+    }
+    m_count.store(index + 1, std::memory_order_release);
+    return index;
+  }
+
+  void HandleTable::publish(uint32_t index, Handle* handle)
+  {
+    Slot& slot = at(index);
+    if (handle == nullptr) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      slot.next = m_free;
+      m_free = index;
+      return;
+    }
+
+    slot.handle = handle;
+    m_open.fetch_add(1, std::memory_order_relaxed);
+    uint64_t generation = slot.state.load(std::memory_order_relaxed) & GENERATION;
+    slot.state.store(generation | 1, std::memory_order_release);
+  }
+
+  void HandleTable::release(uint32_t index)
+  {
+    uint64_t state = at(index).state.fetch_sub(1, std::memory_order_acq_rel);
+    if ((state & REFERENCES) == 1) {
+      destroy(index);
+    }
+  }
+
+  void HandleTable::destroy(uint32_t index)
+  {
+    // With the mutex held, so that a `scan` never sees a handle go away.
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Slot& slot = at(index);
+    slot.handle->~Handle();
+    slot.handle = nullptr;
+
+    // Skips generation 0, so that no id is ever INVALID_HANDLE_ID.
+    uint64_t generation = (slot.state.load(std::memory_order_relaxed) & GENERATION) + (1ull << 32);
+    if (generation == 0) {
+      generation = 1ull << 32;
+    }
+    slot.state.store(generation | CLOSED, std::memory_order_release);
+
+    slot.next = m_free;
+    m_free = index;
+  }
+}
@@ -0,0 +1,229 @@
+#pragma once
+
+#include "stdafx.h"
+#include "async_io.hpp"
+
+namespace async {
+  // Names a handle of a HandleTable: the index of its slot in the low 32
+  // bits, and the generation of the slot in the high 32. A slot's
+  // generation changes every time a handle in it is destroyed, so the id
+  // of a closed handle never names the handle that takes its slot next.
+  typedef uint64_t HandleId;
+
+  // Names no handle, in any table.
+  const HandleId INVALID_HANDLE_ID = 0;
+
+  // Owns async handles for the application, which refers to them by id
+  // instead of by pointer. An id that outlives its handle, say one kept by
+  // a completion that runs after the handle was closed, can't reach freed
+  // or reused memory: looking it up just fails.
+  //
+  // The handles themselves live in the table's slots, which are allocated
+  // 4096 at a time and never move, so a scan over the table (see `scan`)
+  // touches a few contiguous blocks rather than a heap object per handle.
+  // Looking an id up takes no locks; opening and closing take a mutex to
+  // get or return a slot, and destroying a handle takes it too.
+  //
+  // Handles still open when the table goes are closed with it. Every Ref
+  // must be gone by then.
+  class HandleTable {
+  public:
+    // Keeps a handle from being destroyed while it is held. The handle may
+    // still be closed meanwhile, which makes its operations fail; it is
+    // destroyed, and its slot reused, once the last Ref lets go.
+    class Ref {
+    public:
+      Ref() : m_table(nullptr), m_index(0), m_handle(nullptr) {}
+
+      Ref(Ref&& that) noexcept
+        : m_table(that.m_table), m_index(that.m_index), m_handle(that.m_handle)
+      {
+        that.m_table = nullptr;
+        that.m_handle = nullptr;
+      }
+
+      Ref& operator=(Ref that) noexcept
+      {
+        std::swap(m_table, that.m_table);
+        std::swap(m_index, that.m_index);
+        std::swap(m_handle, that.m_handle);
+        return *this;
+      }
+
+      Ref(const Ref&) = delete;
+
+      ~Ref()
+      {
+        if (m_table != nullptr) {
+          m_table->release(m_index);
+        }
+      }
+
+      explicit operator bool() const
+      {
+        return m_handle != nullptr;
+      }
+
+      Handle* get() const
+      {
+        return m_handle;
+      }
+
+      Handle* operator->() const
+      {
+        return m_handle;
+      }
+
+      // The handle if it is a socket, or nullptr.
+      SocketHandle* socket() const;
+
+    private:
+      friend class HandleTable;
+
+      Ref(HandleTable* table, uint32_t index, Handle* handle)
+        : m_table(table), m_index(index), m_handle(handle) {}
+
+      HandleTable* m_table;
+      uint32_t m_index;
+      Handle* m_handle;
+    };
+
+    HandleTable();
+
+    ~HandleTable();
+
+    HandleTable(const HandleTable&) = delete;
+    HandleTable& operator=(const HandleTable&) = delete;
+
+    // Makes an async handle of `fd`, like `createAsyncHandle`. Returns
+    // INVALID_HANDLE_ID if it can't.
+    HandleId open(io::Handle* fd);
+
+    // Makes a handle of type T (FileHandle, SocketHandle or PipeHandle)
+    // from `args`, e.g. a socket and the loop to bind it to.
+    template <typename T, typename... Args>
+    HandleId emplace(Args&&... args)
+    {
+      uint32_t index = allocate();
+      Slot& slot = at(index);
+      publish(index, new (&slot.storage) T(std::forward<Args>(args)...));
+      return id(index);
+    }
+
+    // The handle `id` names, or an empty Ref if it is closed. Can be called
+    // from any thread.
+    Ref lookup(HandleId id);
+
+    // Closes the handle, which fails its pending operations, and makes its
+    // id invalid. It is destroyed once no Ref holds it any longer. Returns
+    // false if `id` was invalid already.
+    bool close(HandleId id);
+
+    // Accepts a connection on listening socket `listener` (see
+    // `SocketHandle::accept`) and adds it to the table. The future gets
+    // INVALID_HANDLE_ID if `listener` is invalid or the accept fails.
+    Future<HandleId> accept(
+      HandleId listener,
+      const CancellationToken& token = CancellationToken());
+
+    // Runs `f(id, handle)` for every open handle, in slot order. Handles
+    // opened or closed meanwhile may or may not be visited. Each handle is
+    // held by a reference while `f` runs, so `f` may do anything with the
+    // table, including closing the handle.
+    template <typename F>
+    void for_each(F f)
+    {
+      uint32_t count = m_count.load(std::memory_order_acquire);
+      for (uint32_t index = 0; index < count; index++) {
+        Slot& slot = at(index);
+        uint64_t state = slot.state.load(std::memory_order_acquire);
+        if ((state & CLOSED) != 0 || !pin(slot, state)) {
+          continue;
+        }
+        f((state & GENERATION) | index, *slot.handle);
+        release(index);
+      }
+    }
+
+    // Like `for_each`, but without taking a reference to each handle: the
+    // scan holds the table's mutex instead, which keeps any handle from
+    // being destroyed meanwhile, and only reads the state of each slot.
+    // Opening and closing wait for it, and `f` must not open or close a
+    // handle of this table or let go of a Ref to one.
+    template <typename F>
+    void scan(F f)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      uint32_t count = m_count.load(std::memory_order_relaxed);
+      for (uint32_t index = 0; index < count; index++) {
+        Slot& slot = at(index);
+        uint64_t state = slot.state.load(std::memory_order_acquire);
+        if ((state & CLOSED) == 0) {
+          f((state & GENERATION) | index, *slot.handle);
+        }
+      }
+    }
+
+    // The number of open handles.
+    size_t size() const
+    {
+      return m_open.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // A slot's state: its generation in the high 32 bits, CLOSED, and the
+    // number of references to the handle in it, one of which is the
+    // table's own until the handle is closed. A free slot is CLOSED and
+    // has no references.
+    static constexpr uint64_t GENERATION = 0xffffffff00000000ull;
+    static constexpr uint64_t CLOSED = 1ull << 31;
+    static constexpr uint64_t REFERENCES = CLOSED - 1;
+
+    // Up to 16M slots.
+    static constexpr uint32_t CHUNK = 4096;
+    static constexpr uint32_t CHUNKS = 4096;
+
+    static constexpr uint32_t NONE = 0xffffffff;
+
+    struct Slot {
+      std::atomic<uint64_t> state{CLOSED | (1ull << 32)};
+      Handle* handle = nullptr;
+      uint32_t next = 0;
+      internal::HandleStorage storage;
+    };
+
+    Slot& at(uint32_t index) const
+    {
+      return m_chunks[index / CHUNK].load(std::memory_order_acquire)[index % CHUNK];
+    }
+
+    HandleId id(uint32_t index) const
+    {
+      return (at(index).state.load(std::memory_order_relaxed) & GENERATION) | index;
+    }
+
+    // Adds a reference if the slot's state is still `state`, or another
+    // one with the same generation that isn't CLOSED.
+    static bool pin(Slot& slot, uint64_t state);
+
+    // Takes a free slot, growing the table if there is none.
+    uint32_t allocate();
+
+    // Opens the slot with `handle` in it, or frees it again if `handle`
+    // is null.
+    void publish(uint32_t index, Handle* handle);
+
+    void release(uint32_t index);
+
+    // Destroys the handle and returns the slot, once the last reference
+    // is gone.
+    void destroy(uint32_t index);
+
+    std::atomic<Slot*> m_chunks[CHUNKS];
+    std::atomic<uint32_t> m_count;
+    std::atomic<size_t> m_open;
+
+    std::mutex m_mutex;
+    uint32_t m_free;
+  };
+}
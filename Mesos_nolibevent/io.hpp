@@ -4,6 +4,7 @@
 
 // Stout-like api with blocking IO.
 
+#ifdef _WIN32
 namespace io {
   class Handle {
   public:
@@ -364,4 +365,112 @@ namespace io {
   {
     s->close();
   }
-}
\ No newline at end of file
+}
+#else
+namespace io {
+  // On POSIX every handle is a file descriptor, so the only thing that
+  // differs between the handle types is how they are created.
+  class Handle {
+  public:
+    Handle(int fd) : m_fd(fd) {}
+
+    SSIZE_T read(void* data, size_t size) const
+    {
+      return ::read(m_fd, data, size);
+    }
+
+    SSIZE_T write(void* data, size_t size) const
+    {
+      return ::write(m_fd, data, size);
+    }
+
+    void close() const
+    {
+      ::close(m_fd);
+    }
+
+    bool isOverlapped() const
+    {
+      return (::fcntl(m_fd, F_GETFL) & O_NONBLOCK) != 0;
+    }
+
+    int get() const
+    {
+      return m_fd;
+    }
+
+    int dup() const
+    {
+      return ::fcntl(m_fd, F_DUPFD_CLOEXEC, 0);
+    }
+
+  protected:
+    int m_fd;
+  };
+
+  class FileHandle : public Handle {
+  public:
+    FileHandle(int fd) : Handle(fd) {}
+  };
+
+  class SocketHandle : public Handle {
+  public:
+    SocketHandle(int s) : Handle(s) {}
+  };
+
+  class PipeHandle : public Handle {
+  public:
+    PipeHandle(int fd) : Handle(fd) {}
+  };
+
+  inline Handle* open(const char* path, int flags, mode_t mode = 0666)
+  {
+    int fd = ::open(path, flags | O_CLOEXEC, mode);
+    if (fd == -1) {
+      return nullptr;
+    }
+    return new FileHandle(fd);
+  }
+
+  inline SSIZE_T read(Handle* fd, void* data, size_t size)
+  {
+    return fd->read(data, size);
+  }
+
+  inline SSIZE_T write(Handle* fd, void* data, size_t size)
+  {
+    return fd->write(data, size);
+  }
+
+  inline void close(Handle* fd)
+  {
+    fd->close();
+  }
+
+  // `flags` is passed to pipe2, e.g. O_NONBLOCK for pipes that will be
+  // handed to the async library.
+  inline std::array<Handle*, 2> pipe(int flags)
+  {
+    int fds[2];
+    if (::pipe2(fds, flags | O_CLOEXEC) != 0) {
+      return { nullptr, nullptr };
+    }
+    return { new PipeHandle(fds[0]), new PipeHandle(fds[1]) };
+  }
+
+  // Sockets
+  inline Handle* socket(int af, int type, int protocol)
+  {
+    int s = ::socket(af, type | SOCK_CLOEXEC, protocol);
+    if (s == -1) {
+      return nullptr;
+    }
+    return new SocketHandle(s);
+  }
+
+  inline void closesocket(Handle* s)
+  {
+    s->close();
+  }
+}
+#endif
@@ -0,0 +1,190 @@
+#include "stdafx.h"
+#include "pool.hpp"
+
+#include <new>
+
+namespace async {
+  namespace internal {
+#ifndef NO_OPERATION_POOL
+    // Blocks are rounded up to a power of two, from 64 bytes to 1 KB.
+    // Larger ones go straight to the heap.
+    static const size_t SMALLEST = 64;
+    static const size_t CLASSES = 5;
+
+    // Slabs are aligned to their size, so that the slab of a block, and
+    // with it the pool the block belongs to, is found by masking the
+    // block's address. The first cache line of a slab is its header.
+    static const size_t SLAB = 64 * 1024;
+    static const size_t HEADER = 64;
+
+    struct FreeBlock {
+      FreeBlock* next;
+    };
+
+    struct Pool {
+      FreeBlock* blocks[CLASSES] = {};
+
+      // Blocks freed by other threads.
+      std::atomic<FreeBlock*> remote[CLASSES] = {};
+
+      // Next pool on the list of abandoned ones.
+      Pool* next = nullptr;
+    };
+
+    struct Slab {
+      Pool* owner;
+    };
+
+    // Pools of threads that exited, waiting for a thread to adopt them.
+    static std::mutex abandoned_mutex;
+    static Pool* abandoned = nullptr;
+
+    // The pool of the calling thread. This is a plain pointer rather than
+    // part of `Owner` below, so that it can still be read while the
+    // thread's destructors run.
+    static thread_local Pool* local = nullptr;
+    static thread_local bool exited = false;
+
+    // Gives the pool up when the thread exits.
+    struct Owner {
+      bool active = false;
+
+      ~Owner()
+      {
+        if (local != nullptr) {
+          std::lock_guard<std::mutex> lock(abandoned_mutex);
+          local->next = abandoned;
+          abandoned = local;
+          local = nullptr;
+        }
+        exited = true;
+      }
+    };
+
+    static thread_local Owner owner;
+
+    // The index of the smallest class that fits `size`, or CLASSES if
+    // none does.
+    static size_t size_class(size_t size)
+    {
+      size_t index = 0;
+      for (size_t bytes = SMALLEST; bytes < size; bytes <<= 1) {
+        if (++index == CLASSES) {
+          break;
+        }
+      }
+      return index;
+    }
+
+    // Adopts an abandoned pool, or makes a new one. Must be called with
+    // `abandoned_mutex` locked.
+    static Pool* adopt()
+    {
+      Pool* pool = abandoned;
+      if (pool != nullptr) {
+        abandoned = pool->next;
+        pool->next = nullptr;
+        return pool;
+      }
+      return new Pool();
+    }
+
+    // Cuts a new slab into blocks of class `index` and returns them as a
+    // list.
+    static FreeBlock* carve(Pool* pool, size_t index)
+    {
+      char* memory = static_cast<char*>(
+        ::operator new(SLAB, std::align_val_t(SLAB)));
+      reinterpret_cast<Slab*>(memory)->owner = pool;
+
+      size_t size = SMALLEST << index;
+      size_t count = (SLAB - HEADER) / size;
+
+      FreeBlock* blocks = nullptr;
+      for (size_t i = count; i > 0; i--) {
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(memory + HEADER + (i - 1) * size);
+        block->next = blocks;
+        blocks = block;
+      }
+      return blocks;
+    }
+
+    static void* take(Pool* pool, size_t index)
+    {
+      FreeBlock* block = pool->blocks[index];
+      if (block == nullptr) {
+        // Only the owner ever takes the remote list, and it takes all of
+        // it, so there is no ABA to worry about.
+        block = pool->remote[index].exchange(nullptr, std::memory_order_acquire);
+        if (block == nullptr) {
+          block = carve(pool, index);
+        }
+      }
+      pool->blocks[index] = block->next;
+      return block;
+    }
+#endif // NO_OPERATION_POOL
+
+    void* allocate_operation(size_t size)
+    {
+#ifdef NO_OPERATION_POOL
+      return ::operator new(size);
+#else
+      size_t index = size_class(size);
+      if (index == CLASSES) {
+        return ::operator new(size);
+      }
+
+      if (local == nullptr) {
+        std::lock_guard<std::mutex> lock(abandoned_mutex);
+        if (exited) {
+          // The thread is on its way out and already gave its pool up, so
+          // borrow one for this block and leave it abandoned.
+          Pool* pool = adopt();
+          void* block = take(pool, index);
+          pool->next = abandoned;
+          abandoned = pool;
+          return block;
+        }
+
+        local = adopt();
+        owner.active = true;
+      }
+
+      return take(local, index);
+#endif // NO_OPERATION_POOL
+    }
+
+    void deallocate_operation(void* operation, size_t size)
+    {
+#ifdef NO_OPERATION_POOL
+      ::operator delete(operation, size);
+#else
+      size_t index = size_class(size);
+      if (index == CLASSES) {
+        ::operator delete(operation);
+        return;
+      }
+
+      Slab* slab = reinterpret_cast<Slab*>(
+        reinterpret_cast<uintptr_t>(operation) & ~static_cast<uintptr_t>(SLAB - 1));
+      Pool* pool = slab->owner;
+      FreeBlock* block = static_cast<FreeBlock*>(operation);
+
+      if (pool == local) {
+        block->next = pool->blocks[index];
+        pool->blocks[index] = block;
+        return;
+      }
+
+      block->next = pool->remote[index].load(std::memory_order_relaxed);
+      while (!pool->remote[index].compare_exchange_weak(
+          block->next,
+          block,
+          std::memory_order_release,
+          std::memory_order_relaxed)) {
+      }
+#endif // NO_OPERATION_POOL
+    }
+  }
+}
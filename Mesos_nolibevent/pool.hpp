@@ -0,0 +1,45 @@
+#pragma once
+
+#include "stdafx.h"
+
+namespace async {
+  namespace internal {
+    // The contexts of the operations (the OVERLAPPED structs on Windows,
+    // the loop::Operation and loop::Completion structs on Linux) come from
+    // a pool rather than the heap. An operation is typically allocated on
+    // the thread that starts it and freed on the loop thread that completes
+    // it, which is the worst case for a general purpose allocator, so the
+    // pool is built around it:
+    //
+    // Every thread allocates from slabs of its own, one free list per size
+    // class, without any locks. A block freed on the thread that owns its
+    // slab goes straight back on that thread's free list. A block freed on
+    // any other thread is pushed onto a lock-free list of the owner's, which
+    // the owner takes over in one exchange once its own list runs dry.
+    //
+    // A thread that exits leaves its slabs, free blocks included, to the
+    // next thread that starts allocating, so threads that come and go (the
+    // Windows thread pool) don't leak slabs.
+    //
+    // Define NO_OPERATION_POOL to take every operation from the heap
+    // instead, so that ASan, or a count of the heap blocks, sees each one.
+    void* allocate_operation(size_t size);
+
+    void deallocate_operation(void* operation, size_t size);
+
+    // Base of the operation structs, so that they come from the pool. The
+    // size passed to `delete` must be right, so a struct that is deleted
+    // through a pointer to a base needs a virtual destructor.
+    struct PooledOperation {
+      static void* operator new(size_t size)
+      {
+        return allocate_operation(size);
+      }
+
+      static void operator delete(void* operation, size_t size)
+      {
+        deallocate_operation(operation, size);
+      }
+    };
+  }
+}
@@ -0,0 +1,94 @@
+#include "stdafx.h"
+#include "task_queue.hpp"
+
+namespace loop {
+
+  TaskQueue::TaskQueue() : m_tail(&m_stub), m_head(&m_stub)
+  {
+    m_stub.next.store(nullptr, std::memory_order_relaxed);
+  }
+
+
+  TaskQueue::~TaskQueue()
+  {
+    while (Task* task = pop()) {
+      delete task;
+    }
+  }
+
+
+  void TaskQueue::push(Task* task)
+  {
+    task->next.store(nullptr, std::memory_order_relaxed);
+
+    // From here on the task is the tail. Until the store below links it to
+    // its predecessor, the consumer cannot reach it.
+    Task* previous = m_tail.exchange(task, std::memory_order_acq_rel);
+    previous->next.store(task, std::memory_order_release);
+  }
+
+
+  Task* TaskQueue::pop()
+  {
+    Task* head = m_head;
+    Task* next = head->next.load(std::memory_order_acquire);
+
+    // Step over the stub.
+    if (head == &m_stub) {
+      if (next == nullptr) {
+        return nullptr;
+      }
+      m_head = next;
+      head = next;
+      next = next->next.load(std::memory_order_acquire);
+    }
+
+    if (next != nullptr) {
+      m_head = next;
+      return head;
+    }
+
+    // `head` looks like the last task, but a push may already have taken
+    // its place at the tail without linking itself yet.
+    if (head != m_tail.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+
+    // It really is the last one. Put the stub behind it, so that taking
+    // it out leaves the queue with something to point at.
+    push(&m_stub);
+
+    next = head->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+      m_head = next;
+      return head;
+    }
+    return nullptr;
+  }
+
+
+  bool TaskQueue::empty() const
+  {
+    // The consumer only ever leaves the stub at the tail when it took the
+    // last task out.
+    return m_tail.load(std::memory_order_acquire) == &m_stub &&
+      m_head == &m_stub;
+  }
+
+
+  size_t TaskQueue::run(size_t limit)
+  {
+    size_t count = 0;
+    while (count < limit) {
+      Task* task = pop();
+      if (task == nullptr) {
+        break;
+      }
+
+      task->function();
+      delete task;
+      count++;
+    }
+    return count;
+  }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "stdafx.h"
+#include "function.hpp"
+#include "pool.hpp"
+
+namespace loop {
+  // A function posted to a loop with `EventLoop::post`. The link to the
+  // next task lives in the task itself, so queueing it allocates nothing,
+  // and the task comes from the operation pool, so neither does posting
+  // a function small enough for `Function` to keep inline.
+  struct Task : async::internal::PooledOperation {
+    std::atomic<Task*> next;
+    Function<void()> function;
+  };
+
+  // The queue of tasks posted to one loop: any number of threads push, and
+  // only the loop's thread pops. This is Dmitry Vyukov's intrusive MPSC
+  // queue. Pushing is a single atomic exchange plus a store and never
+  // waits for anyone, popping takes no atomic read-modify-write at all.
+  //
+  // The price is a short window in which a push has claimed its place at
+  // the tail but not linked itself to its predecessor yet. `pop` then
+  // returns nullptr even though the queue is not empty; `empty` does tell
+  // the truth, so the loop polls again instead of going to sleep.
+  class TaskQueue {
+  public:
+    TaskQueue();
+
+    // Deletes the tasks that never ran.
+    ~TaskQueue();
+
+    // Queues `task`. Any thread.
+    void push(Task* task);
+
+    // Dequeues the oldest task. The caller owns it. Loop thread only.
+    Task* pop();
+
+    // Whether there is no task queued, not even one still being pushed.
+    bool empty() const;
+
+    // Pops and runs up to `limit` tasks, in order, and returns how many
+    // ran. The limit keeps tasks that keep posting more tasks from
+    // starving I/O and timers. Loop thread only.
+    size_t run(size_t limit);
+
+  private:
+    std::atomic<Task*> m_tail;
+    Task* m_head;
+
+    // Always in the queue, so that `m_tail` never has to be reset to
+    // nullptr by the consumer.
+    Task m_stub;
+  };
+}
@@ -0,0 +1,310 @@
+#include "stdafx.h"
+#include "timer_wheel.hpp"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace loop {
+
+  static int highest_bit(uint64_t value)
+  {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<int>(index);
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+  }
+
+  static int lowest_bit(uint64_t value)
+  {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return static_cast<int>(index);
+#else
+    return __builtin_ctzll(value);
+#endif
+  }
+
+  static uint64_t rotate_left(uint64_t value, unsigned shift)
+  {
+    shift &= 63;
+    return shift == 0 ? value : (value << shift) | (value >> (64 - shift));
+  }
+
+  static uint64_t rotate_right(uint64_t value, unsigned shift)
+  {
+    shift &= 63;
+    return shift == 0 ? value : (value >> shift) | (value << (64 - shift));
+  }
+
+
+  TimerWheel::TimerWheel(uint64_t now, uint64_t resolution)
+    : m_resolution(resolution),
+      m_now(now / resolution),
+      m_size(0),
+      m_free(NIL)
+  {
+    std::fill(std::begin(m_heads), std::end(m_heads), NIL);
+    std::fill(std::begin(m_occupied), std::end(m_occupied), 0);
+  }
+
+
+  TimerWheel::Id TimerWheel::schedule(
+    uint64_t deadline,
+    uint64_t slack,
+    Function&& function)
+  {
+    uint32_t index;
+    if (m_free != NIL) {
+      index = m_free;
+      m_free = m_nodes[index].next;
+    } else {
+      index = static_cast<uint32_t>(m_nodes.size());
+      m_nodes.emplace_back();
+      m_nodes[index].generation = 1;
+    }
+
+    Node& node = m_nodes[index];
+    node.expiry = expiry(deadline, slack);
+    node.slack = slack;
+    node.function = std::move(function);
+
+    insert(index);
+    m_size++;
+
+    return (static_cast<Id>(node.generation) << 32) | index;
+  }
+
+
+  TimerWheel::Function TimerWheel::cancel(Id id)
+  {
+    uint32_t index = find(id);
+    if (index == NIL) {
+      return nullptr;
+    }
+
+    unlink(index);
+    Function function = std::move(m_nodes[index].function);
+    release(index);
+    return function;
+  }
+
+
+  bool TimerWheel::reschedule(Id id, uint64_t deadline)
+  {
+    uint32_t index = find(id);
+    if (index == NIL) {
+      return false;
+    }
+
+    unlink(index);
+    m_nodes[index].expiry = expiry(deadline, m_nodes[index].slack);
+    insert(index);
+    return true;
+  }
+
+
+  uint64_t TimerWheel::expiry(uint64_t deadline, uint64_t slack) const
+  {
+    uint64_t earliest = deadline / m_resolution + (deadline % m_resolution != 0);
+    uint64_t latest = deadline > UINT64_MAX - slack
+      ? UINT64_MAX / m_resolution
+      : (deadline + slack) / m_resolution;
+
+    if (latest <= earliest) {
+      return earliest;
+    }
+
+    // The tick in [earliest, latest] with the most trailing zero bits:
+    // keep the bits `latest` shares with `earliest - 1` plus the first one
+    // it has that `earliest - 1` doesn't, and clear everything below.
+    int bit = highest_bit((earliest - 1) ^ latest);
+    return latest & ~((1ULL << bit) - 1);
+  }
+
+
+  uint32_t TimerWheel::find(Id id) const
+  {
+    uint32_t index = static_cast<uint32_t>(id);
+    uint32_t generation = static_cast<uint32_t>(id >> 32);
+
+    if (index >= m_nodes.size() ||
+        m_nodes[index].list == FREE ||
+        m_nodes[index].generation != generation) {
+      return NIL;
+    }
+    return index;
+  }
+
+
+  void TimerWheel::release(uint32_t index)
+  {
+    Node& node = m_nodes[index];
+    node.function = nullptr;
+    node.list = FREE;
+    if (++node.generation == 0) {
+      node.generation = 1;
+    }
+    node.next = m_free;
+    m_free = index;
+    m_size--;
+  }
+
+
+  void TimerWheel::insert(uint32_t index)
+  {
+    uint64_t expiry = m_nodes[index].expiry;
+    if (expiry <= m_now) {
+      link(DUE, index);
+      return;
+    }
+
+    int level = highest_bit(expiry ^ m_now) / BITS;
+    uint32_t slot = static_cast<uint32_t>(expiry >> (level * BITS)) & (SLOTS - 1);
+    link(level * SLOTS + slot, index);
+    m_occupied[level] |= 1ULL << slot;
+  }
+
+
+  void TimerWheel::link(uint32_t list, uint32_t index)
+  {
+    Node& node = m_nodes[index];
+    node.list = list;
+
+    uint32_t head = m_heads[list];
+    if (head == NIL) {
+      m_heads[list] = index;
+      node.prev = index;
+      node.next = index;
+      return;
+    }
+
+    uint32_t tail = m_nodes[head].prev;
+    node.prev = tail;
+    node.next = head;
+    m_nodes[tail].next = index;
+    m_nodes[head].prev = index;
+  }
+
+
+  void TimerWheel::unlink(uint32_t index)
+  {
+    Node& node = m_nodes[index];
+    uint32_t list = node.list;
+
+    if (node.next == index) {
+      m_heads[list] = NIL;
+      if (list != DUE) {
+        m_occupied[list / SLOTS] &= ~(1ULL << (list % SLOTS));
+      }
+      return;
+    }
+
+    m_nodes[node.prev].next = node.next;
+    m_nodes[node.next].prev = node.prev;
+    if (m_heads[list] == index) {
+      m_heads[list] = node.next;
+    }
+  }
+
+
+  void TimerWheel::advance(uint64_t now, std::vector<Function>& expired)
+  {
+    uint64_t target = now / m_resolution;
+
+    // Collect every slot that the clock moves past (or onto) at each level.
+    // Those timers either expire or get cascaded into a lower level.
+    uint32_t slots[LEVELS * SLOTS + 1];
+    size_t count = 0;
+    if (target > m_now) {
+      for (int level = 0; level < LEVELS; level++) {
+        uint64_t from = m_now >> (level * BITS);
+        uint64_t to = target >> (level * BITS);
+
+        // The upper levels only move when this one wraps around.
+        if (from == to) {
+          break;
+        }
+
+        uint64_t pending;
+        if (to - from >= SLOTS) {
+          pending = ~0ULL;
+        } else {
+          uint64_t run = (1ULL << (to - from)) - 1;
+          pending = rotate_left(run, static_cast<unsigned>(from + 1));
+        }
+
+        pending &= m_occupied[level];
+        while (pending != 0) {
+          int slot = lowest_bit(pending);
+          pending &= pending - 1;
+          slots[count++] = level * SLOTS + slot;
+        }
+      }
+
+      m_now = target;
+    }
+
+    slots[count++] = DUE;
+
+    for (size_t i = 0; i < count; i++) {
+      uint32_t list = slots[i];
+      // Detach the whole list first: cascaded timers may be relinked into
+      // another slot, but never into one we are still walking.
+      uint32_t head = m_heads[list];
+      if (head == NIL) {
+        continue;
+      }
+
+      m_heads[list] = NIL;
+      if (list != DUE) {
+        m_occupied[list / SLOTS] &= ~(1ULL << (list % SLOTS));
+      }
+
+      uint32_t index = head;
+      do {
+        Node& node = m_nodes[index];
+        uint32_t next = node.next;
+
+        if (node.expiry <= m_now) {
+          expired.push_back(std::move(node.function));
+          release(index);
+        } else {
+          insert(index);
+        }
+
+        index = next;
+      } while (index != head);
+    }
+  }
+
+
+  uint64_t TimerWheel::next() const
+  {
+    if (m_heads[DUE] != NIL) {
+      return m_now * m_resolution;
+    }
+
+    // A level only holds timers beyond the current slot of the level below
+    // it, so the first occupied level has the earliest slot.
+    for (int level = 0; level < LEVELS; level++) {
+      if (m_occupied[level] == 0) {
+        continue;
+      }
+
+      uint64_t position = m_now >> (level * BITS);
+      uint64_t after = rotate_right(
+        m_occupied[level],
+        static_cast<unsigned>((position + 1) & (SLOTS - 1)));
+      uint64_t slots = static_cast<uint64_t>(lowest_bit(after)) + 1;
+
+      return ((position + slots) << (level * BITS)) * m_resolution;
+    }
+
+    return NEVER;
+  }
+}
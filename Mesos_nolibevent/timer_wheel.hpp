@@ -0,0 +1,122 @@
+#pragma once
+
+#include "stdafx.h"
+#include "function.hpp"
+
+namespace loop {
+  // A hierarchical timing wheel, used by the event loop so that all of its
+  // timers share a single OS timer armed for `next()`.
+  //
+  // Time is counted in ticks of `resolution` nanoseconds. Level 0 has one
+  // slot per tick, and every level above it has slots that are 64 times as
+  // wide, so a timer lands in the level of the highest 6 bit group in which
+  // its expiry differs from the current time. As time advances, the slots
+  // of the upper levels that have been reached are cascaded down until the
+  // timers in them reach level 0 and expire. Inserting is O(1), and every
+  // timer is moved at most once per level before it expires.
+  //
+  // The wheel is not thread safe, the event loop guards it with a mutex.
+  class TimerWheel {
+  public:
+    typedef loop::Function<void()> Function;
+
+    // Identifies a scheduled timer: the index of its node in the low 32
+    // bits and the node's generation in the high 32 bits. The generation
+    // changes whenever the node is freed, so an Id that outlived its timer
+    // never matches the node's next occupant. It is never 0, so no timer
+    // has the Id 0, which a default `Timer` holds.
+    typedef uint64_t Id;
+
+    // Returned by `next` when there is no timer.
+    static constexpr uint64_t NEVER = UINT64_MAX;
+
+    // `now` is the current time, in nanoseconds on the same monotonic clock
+    // as every other time passed to the wheel.
+    TimerWheel(uint64_t now, uint64_t resolution);
+
+    // Schedules `function` to run at `deadline`. Deadlines are rounded up
+    // to the resolution, so a timer never expires early.
+    //
+    // A timer with `slack` may run up to that many nanoseconds late. The
+    // wheel uses it to coalesce timers: the expiry is pushed out to the
+    // roundest tick within the window, so timers due at about the same
+    // time end up in the same slot and are run by a single wakeup.
+    Id schedule(uint64_t deadline, uint64_t slack, Function&& function);
+
+    // Removes the timer and hands back its function, so the caller can
+    // destroy it outside of its lock. Returns an empty function if the
+    // timer already expired or was cancelled.
+    Function cancel(Id id);
+
+    // Moves the timer to `deadline`, keeping its slack. Returns false if
+    // the timer already expired or was cancelled.
+    bool reschedule(Id id, uint64_t deadline);
+
+    // Moves the wheel forward to `now` and appends the functions of every
+    // timer that has expired to `expired`. The caller runs them, ideally
+    // without holding whatever lock guards the wheel.
+    void advance(uint64_t now, std::vector<Function>& expired);
+
+    // Returns when the wheel next needs to be advanced: the deadline of
+    // the earliest timer, or earlier if some upper level slot has to be
+    // cascaded first. Returns NEVER if there is no timer.
+    uint64_t next() const;
+
+    size_t size() const { return m_size; }
+
+  private:
+    static constexpr int BITS = 6;
+    static constexpr int SLOTS = 1 << BITS;
+
+    // Enough levels to cover every bit of a 64 bit tick count.
+    static constexpr int LEVELS = (64 + BITS - 1) / BITS;
+
+    // Index of the list of timers that were already due when scheduled.
+    static constexpr uint32_t DUE = LEVELS * SLOTS;
+
+    // `Node::list` of a node that is on the free list.
+    static constexpr uint32_t FREE = DUE + 1;
+
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    struct Node {
+      uint64_t expiry;
+      uint64_t slack;
+      uint32_t prev;
+      uint32_t next;
+      uint32_t list;
+      uint32_t generation;
+      Function function;
+    };
+
+    // Returns the tick a timer with this deadline and slack expires on.
+    uint64_t expiry(uint64_t deadline, uint64_t slack) const;
+
+    // Returns the index of the node `id` refers to, or NIL.
+    uint32_t find(Id id) const;
+
+    void release(uint32_t index);
+
+    // Puts the node in the slot its expiry belongs to, given `m_now`.
+    void insert(uint32_t index);
+
+    // Appends the node to the (circular) list `list`.
+    void link(uint32_t list, uint32_t index);
+
+    void unlink(uint32_t index);
+
+    uint64_t m_resolution;
+    uint64_t m_now;
+    size_t m_size;
+
+    // Timers live in `m_nodes` and are linked by index, so the wheel never
+    // allocates once `m_nodes` has grown to the peak number of timers.
+    std::vector<Node> m_nodes;
+    uint32_t m_free;
+
+    uint32_t m_heads[LEVELS * SLOTS + 1];
+
+    // One bit per slot of each level, set while the slot has timers.
+    uint64_t m_occupied[LEVELS];
+  };
+}
@@ -0,0 +1,205 @@
+#include "stdafx.h"
+#include "async_io.hpp"
+
+#if defined(__linux__) && !defined(USE_IO_URING)
+#include "eventloop_epoll.hpp"
+#endif
+
+#include <deque>
+
+namespace async {
+  namespace internal {
+    struct QueuedWrite {
+      const void* data;
+      size_t size;
+      Callback callback;
+    };
+
+    // At most one send is in flight at a time. `sending` holds its writes,
+    // and is only touched by whoever started it and its completion, which
+    // hands the next batch on, so only `queued` and the flags need the
+    // lock.
+    struct WriteQueueState {
+      SocketHandle socket;
+      std::mutex mutex;
+      std::deque<QueuedWrite> queued;
+      std::vector<QueuedWrite> sending;
+      bool busy = false;
+
+      // The sends being started. A completion that finds one leaves the
+      // next batch to it (`next`) instead of starting it itself, so a send
+      // that completes right away doesn't recurse.
+      int starting = 0;
+      bool next = false;
+
+      // The result of the send that failed, if one did.
+      SSIZE_T failure = 0;
+
+      std::atomic<int> references{1};
+
+      explicit WriteQueueState(const SocketHandle& socket) : socket(socket)
+      {
+        sending.reserve(MAX_IO_BUFFERS);
+      }
+
+      void acquire()
+      {
+        references.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      void release()
+      {
+        if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+          delete this;
+        }
+      }
+    };
+  }
+
+  using internal::QueuedWrite;
+  using internal::WriteQueueState;
+
+  static void sent(WriteQueueState* state, SSIZE_T result);
+
+  // Sends the writes in `sending`, and then every batch the completions
+  // hand back while it is at it.
+  static void flush(WriteQueueState* state)
+  {
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      state->starting++;
+    }
+
+    while (true) {
+      IoBuffer buffers[MAX_IO_BUFFERS];
+      size_t count = state->sending.size();
+      for (size_t i = 0; i < count; i++) {
+        buffers[i].data = const_cast<void*>(state->sending[i].data);
+        buffers[i].size = state->sending[i].size;
+      }
+
+      state->acquire();
+      state->socket.writevAsync(buffers, count, [state](SSIZE_T result) {
+        sent(state, result);
+        state->release();
+      });
+
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (!state->next) {
+        state->starting--;
+        return;
+      }
+      state->next = false;
+    }
+  }
+
+  // Moves as many queued writes to `sending` as fit in one send, and
+  // returns how many. Must be called with the lock held.
+  static size_t take(WriteQueueState* state)
+  {
+    size_t count = std::min(state->queued.size(), MAX_IO_BUFFERS - state->sending.size());
+    for (size_t i = 0; i < count; i++) {
+      state->sending.push_back(std::move(state->queued.front()));
+      state->queued.pop_front();
+    }
+    return count;
+  }
+
+  static void sent(WriteQueueState* state, SSIZE_T result)
+  {
+    // Every write of the send gets its callback before any write after
+    // it, since nothing else is sent until the queue takes the next batch.
+    for (QueuedWrite& write : state->sending) {
+      Callback callback = std::move(write.callback);
+      callback(result < 0 ? result : static_cast<SSIZE_T>(write.size));
+    }
+    state->sending.clear();
+
+    std::deque<QueuedWrite> failed;
+    bool start = false;
+    {
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (result < 0) {
+        state->failure = result;
+        failed.swap(state->queued);
+      }
+
+      size_t count = take(state);
+      if (count == 0) {
+        state->busy = false;
+      } else if (state->starting > 0) {
+        state->next = true;
+      } else {
+        start = true;
+      }
+    }
+
+    if (start) {
+      flush(state);
+    }
+    for (QueuedWrite& write : failed) {
+      write.callback(result);
+    }
+  }
+
+
+  WriteQueue::WriteQueue(const SocketHandle& socket)
+    : m_state(new WriteQueueState(socket)) {}
+
+  WriteQueue::~WriteQueue()
+  {
+    m_state->release();
+  }
+
+  Future<SSIZE_T> WriteQueue::writeAsync(const void* data, size_t size)
+  {
+    Promise<SSIZE_T> promise;
+    Future<SSIZE_T> future = promise.get_future();
+    writeAsync(data, size, [promise = std::move(promise)](SSIZE_T result) mutable {
+      promise.set_value(result);
+    });
+    return future;
+  }
+
+  void WriteQueue::writeAsync(const void* data, size_t size, Callback callback)
+  {
+    WriteQueueState* state = m_state;
+    {
+      std::unique_lock<std::mutex> lock(state->mutex);
+      if (state->failure < 0) {
+        SSIZE_T failure = state->failure;
+        lock.unlock();
+        callback(failure);
+        return;
+      }
+      if (state->busy) {
+        state->queued.push_back({ data, size, std::move(callback) });
+        return;
+      }
+      state->busy = true;
+    }
+
+    state->sending.push_back({ data, size, std::move(callback) });
+
+#if defined(__linux__) && !defined(USE_IO_URING)
+    // The send would be performed right here, before anything could queue
+    // up behind it; on the loop thread it goes out with what queued by
+    // then instead.
+    loop::Descriptor* descriptor = state->socket.m_descriptor;
+    if (descriptor != nullptr) {
+      state->acquire();
+      loop::epoll::dispatch(descriptor, [state]() {
+        {
+          std::lock_guard<std::mutex> lock(state->mutex);
+          take(state);
+        }
+        flush(state);
+        state->release();
+      });
+      return;
+    }
+#endif
+
+    flush(state);
+  }
+}